@@ -0,0 +1,164 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "../lib/libplctag.h"
+#include "utils.h"
+
+#define REQUIRED_VERSION 2,1,0
+
+/* system tags need no PLC, so this only exercises the API path. */
+#define TAG_PATH "make=system&family=library&name=version"
+
+#define DATA_TIMEOUT 1500
+
+#define MAX_THREADS (100)
+#define MAX_TAGS (10000)
+
+
+
+/*
+ * This test program creates many threads that call tag accessors as fast
+ * as they can on a shared set of tags.  Each accessor call looks up the tag
+ * by ID, so this measures how well the tag lookup scales as threads are added.
+ */
+
+
+/* global to cheat on passing it to threads. */
+volatile int done = 0;
+int32_t tags[MAX_TAGS];
+int num_tags = 0;
+int64_t thread_ops[MAX_THREADS];
+
+
+
+void *test_tag(void *data)
+{
+    int tid = (int)(intptr_t)data;
+    unsigned int seed = (unsigned int)tid;
+    int64_t ops = 0;
+
+    while(!done) {
+        /* spread the threads across the tags. */
+        seed = seed * 1103515245 + 12345;
+
+        if(plc_tag_get_uint8(tags[(seed >> 8) % (unsigned int)num_tags], 0) == UINT8_MAX) {
+            fprintf(stderr,"Test %d, terminating test, get resulted in an error.\n", tid);
+            done = 1;
+        }
+
+        ops++;
+    }
+
+    thread_ops[tid] = ops;
+
+    return NULL;
+}
+
+
+
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[MAX_THREADS];
+    int64_t start_time;
+    int64_t end_time;
+    int64_t seconds = 5;
+    int64_t total_ops = 0;
+    int num_threads = 0;
+
+    /* check the library version. */
+    if(plc_tag_check_lib_version(REQUIRED_VERSION) != PLCTAG_STATUS_OK) {
+        fprintf(stderr, "Required compatible library version %d.%d.%d not available!", REQUIRED_VERSION);
+        exit(1);
+    }
+
+    if(argc==3) {
+        num_threads = atoi(argv[1]);
+        num_tags = atoi(argv[2]);
+    } else {
+        fprintf(stderr,"Usage: stress_tag_lookup <num threads> <num tags>\n");
+        return 0;
+    }
+
+    if(num_threads < 1 || num_threads > MAX_THREADS || num_tags < 1 || num_tags > MAX_TAGS) {
+        fprintf(stderr,"Use 1 to %d threads and 1 to %d tags.\n", MAX_THREADS, MAX_TAGS);
+        return 1;
+    }
+
+    for(int i=0; i < num_tags; i++) {
+        tags[i] = plc_tag_create(TAG_PATH, DATA_TIMEOUT);
+        if(tags[i] < 0) {
+            fprintf(stderr,"Unable to create tag %d! %s\n", i, plc_tag_decode_error(tags[i]));
+            return 1;
+        }
+    }
+
+    /* create the test threads */
+    for(int tid=0; tid < num_threads; tid++) {
+        pthread_create(&threads[tid], NULL, &test_tag, (void *)(intptr_t)tid);
+    }
+
+    start_time = util_time_ms();
+    end_time = start_time + (seconds * 1000);
+
+    while(!done && util_time_ms() < end_time) {
+        util_sleep_ms(100);
+    }
+
+    if(done) {
+        fprintf(stderr,"Test FAILED!\n");
+    }
+
+    done = 1;
+
+    for(int tid=0; tid < num_threads; tid++) {
+        pthread_join(threads[tid], NULL);
+        total_ops += thread_ops[tid];
+    }
+
+    end_time = util_time_ms();
+
+    fprintf(stderr, "%d threads, %d tags: %lld lookups in %dms, %lld lookups/s.\n", num_threads, num_tags, (long long)total_ops, (int)(end_time - start_time), (long long)((total_ops * 1000) / (end_time - start_time)));
+
+    for(int i=0; i < num_tags; i++) {
+        plc_tag_destroy(tags[i]);
+    }
+
+    return 0;
+}
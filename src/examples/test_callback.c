@@ -43,6 +43,9 @@
 #define TAG_PATH "protocol=ab-eip&gateway=127.0.0.1&path=1,0&cpu=LGX&elem_count=10&name=TestBigArray"
 #define DATA_TIMEOUT 5000
 
+/* nothing answers at this address, it is reserved for documentation (RFC 5737). */
+#define TIMEOUT_TAG_PATH "protocol=ab-eip&gateway=192.0.2.1&path=1,0&cpu=LGX&elem_size=4&elem_count=10&name=TestBigArray"
+
 typedef int32_t DINT;
 
 static volatile DINT *TestDINTArray = NULL;
@@ -287,12 +290,19 @@ int main()
         printf("data[%d]=%d\n",i,TestDINTArray[i]);
     }
 
-    /* test a timeout. */
+    /*
+     * test a timeout.  The local PLC can answer a read within a millisecond,
+     * so use a PLC that never answers.
+     */
     printf("Testing timeout behavior.\n");
-    rc = plc_tag_read(tag, 1);
+    rc = plc_tag_create(TIMEOUT_TAG_PATH, 1);
     if(rc != PLCTAG_ERR_TIMEOUT) {
         printf("Expected PLCTAG_ERR_TIMEOOUT, got %s!\n", plc_tag_decode_error(rc));
 
+        if(rc > 0) {
+            plc_tag_destroy(rc);
+        }
+
         /*
          * we do not need to free the array TestDINTArray because the callback will do
          * it when the tag is destroyed.
@@ -36,7 +36,9 @@
 #include <lib/tag.h>
 #include <platform.h>
 #include <util/attr.h>
+#include <util/capture.h>
 #include <util/debug.h>
+#include <util/trace.h>
 #include <ab/ab.h>
 #include <system/system.h>
 #include <lib/init.h>
@@ -58,6 +60,7 @@ struct {
 } tag_type_map[] = {
     /* System tags */
     {NULL, "system", "library", NULL, system_tag_create},
+    {"system", NULL, NULL, NULL, system_tag_create},
     /* Allen-Bradley PLCs */
     {"ab-eip", NULL, NULL, NULL, ab_tag_create},
     {"ab_eip", NULL, NULL, NULL, ab_tag_create}
@@ -138,10 +141,20 @@ tag_create_function find_tag_create_func(attr attributes)
 
 void destroy_modules(void)
 {
+    /* destroyed tags waiting to be tickled must be freed before their protocol goes away. */
+    lib_stop_tickler();
+
     ab_teardown();
 
+    /* the sessions are gone, nothing more will be captured. */
+    capture_stop();
+
     lib_teardown();
 
+    trace_teardown();
+
+    debug_stop_logger();
+
     plc_tag_unregister_logger();
 
     library_initialized = 0;
@@ -170,7 +183,13 @@ int initialize_modules(void)
         srand((unsigned int)time_ms());
 
         pdebug(DEBUG_INFO,"Initialized library modules.");
-        rc = lib_init();
+
+        /* from here on, debug output is written by a background thread. */
+        rc = debug_start_logger();
+
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = lib_init();
+        }
 
         if(rc == PLCTAG_STATUS_OK) {
             rc = ab_init();
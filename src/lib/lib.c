@@ -33,7 +33,9 @@
 
 #define LIBPLCTAGDLL_EXPORTS 1
 
+#include <inttypes.h>
 #include <limits.h>
+#include <stdio.h>
 #include <float.h>
 #include <lib/libplctag.h>
 #include <lib/tag.h>
@@ -41,29 +43,133 @@
 #include <lib/version.h>
 #include <platform.h>
 #include <util/attr.h>
+#include <util/capture.h>
 #include <util/debug.h>
 #include <util/hash.h>
-#include <util/hashtable.h>
+#include <util/histogram.h>
 #include <util/rc.h>
+#include <util/reactor.h>
+#include <util/trace.h>
 #include <util/vector.h>
 #include <ab/ab.h>
 
 
-#define INITIAL_TAG_TABLE_SIZE (201)
+#define TAG_ID_MASK (0x7FFFFFFF)
 
-#define TAG_ID_MASK (0xFFFFFFF)
+/*
+ * Tag IDs are a slot index in the low bits and a slot generation in the
+ * high bits.  The generation changes each time a slot is reused so stale
+ * IDs do not find the new tag.  Slots are allocated in chunks that are
+ * never freed until the library shuts down.  There is room for about a
+ * million live tags.
+ *
+ * Freed slots are reused oldest first and only once enough of them are
+ * free, so a slot comes around again only after TAG_SLOT_MIN_FREE other
+ * tags were destroyed.  A stale ID can only match a new tag after
+ * TAG_SLOT_MIN_FREE * TAG_GENERATION_MAX destroys.
+ */
+#define TAG_INDEX_BITS (20)
+#define TAG_INDEX_MASK ((1 << TAG_INDEX_BITS) - 1)
+#define TAG_GENERATION_MAX (TAG_ID_MASK >> TAG_INDEX_BITS)
+#define TAG_SLOT_MIN_FREE (4096)
+#define TAG_SLOT_CHUNK_BITS (10)
+#define TAG_SLOT_CHUNK_SIZE (1 << TAG_SLOT_CHUNK_BITS)
+#define TAG_SLOT_MAX_CHUNKS (1 << (TAG_INDEX_BITS - TAG_SLOT_CHUNK_BITS))
+
+/* longest wait for a tag's IO before checking on it again. */
+#define TAG_MAX_WAIT_MS (100)
+
+/* longest the tickler sleeps when no tags are ready. */
+#define TICKLER_MAX_WAIT_MS (100)
+
+/* how soon to retry tags whose API mutex was busy. */
+#define TICKLER_RETRY_WAIT_MS (1)
+
+/*
+ * subscribed tags are kept in a timer wheel driven by the tickler.  Each
+ * slot holds the tags due in one tick; tags due on a later turn of the
+ * wheel stay in their slot until then.
+ */
+#define SUBSCRIBE_TICK_MS (10)
+#define SUBSCRIBE_WHEEL_SLOTS (256)
 
-#define MAX_TAG_MAP_ATTEMPTS (50)
+/* unchanged data is skipped this many bytes at a time when looking for changes. */
+#define CHANGE_BLOCK_SIZE (64)
 
 /* these are only internal to the file */
 
-static volatile int32_t next_tag_id = 10; /* MAGIC */
-static volatile hashtable_p tags = NULL;
+/*
+ * a group of tags that is read as one unit.  Members are kept by tag ID so
+ * that a group does not keep destroyed tags alive.
+ */
+struct plc_tag_group_t {
+    int32_t group_id;
+    int32_t *tag_ids;
+    int num_tags;
+    int tag_capacity;
+    void (*callback)(int32_t group_id, int event, int status);
+    cond_p done_wait;
+
+    /* the rest is protected by the group mutex. */
+    int read_pending;   /* members whose read is not done yet. */
+    int status;
+};
+
+typedef struct plc_tag_group_t *plc_tag_group_p;
+
+struct plc_tag_group_hold_t {
+    volatile int held;
+
+    /* threads to wake when the hold is released, protected by the lock. */
+    lock_t lock;
+    vector_p waiters;
+};
+
+struct group_hold_waiter_t {
+    void (*wake)(void *arg);
+    void *arg;
+};
+
+struct tag_slot_t {
+    volatile int tag_id;    /* zero when the slot is empty. */
+    volatile int readers;   /* lookups in progress. */
+    int generation;
+    int next_free;
+    plc_tag_p tag;
+};
+
+static struct tag_slot_t * volatile tag_slots[TAG_SLOT_MAX_CHUNKS] = { NULL };
+static int num_tag_slots = 0;
+static int free_tag_slot = -1;         /* oldest free slot, reused first. */
+static int free_tag_slot_last = -1;    /* newest free slot. */
+static int num_free_tag_slots = 0;
 static mutex_p tag_lookup_mutex = NULL;
 
 static volatile int library_terminating = 0;
 static thread_p tag_tickler_thread = NULL;
 
+/* tags with completed IO, pushed lock-free by the IO threads. */
+static void * volatile ready_tags = NULL;
+static cond_p tag_tickler_wait = NULL;
+
+/* tags whose data this thread has borrowed.  The API mutex is held for each. */
+static THREAD_LOCAL plc_tag_p borrowed_tags = NULL;
+
+/* the subscription timer wheel.  Each tag in it holds a reference. */
+static mutex_p subscribe_mutex = NULL;
+static plc_tag_p subscribe_wheel[SUBSCRIBE_WHEEL_SLOTS] = { NULL };
+static int64_t subscribe_wheel_time = 0; /* start of the next tick to run. */
+static int num_subscribed = 0;
+
+/* tag groups. */
+static mutex_p group_mutex = NULL;
+static vector_p tag_groups = NULL;
+static int32_t next_group_id = 0;
+
+/* library-wide latency histograms, indexed by PLCTAG_LATENCY_*. */
+#define NUM_LATENCY_HISTOGRAMS (4)
+static histogram_t latency_histograms[NUM_LATENCY_HISTOGRAMS];
+
 //static mutex_p global_library_mutex = NULL;
 
 
@@ -71,8 +177,32 @@ static thread_p tag_tickler_thread = NULL;
 /* helper functions. */
 static plc_tag_p lookup_tag(int32_t id);
 static int add_tag_lookup(plc_tag_p tag);
-static int tag_id_inc(int id);
+static plc_tag_p remove_tag_lookup(int32_t id);
+static struct tag_slot_t *get_tag_slot(int32_t id);
+static void tag_wait_event(plc_tag_p tag, int64_t timeout_time);
+static void push_ready_tags(plc_tag_p first, plc_tag_p last);
+static plc_tag_p pop_ready_tags(void);
+static void tickle_tag(plc_tag_p tag);
+static int get_array(int32_t id, int offset, uint8_t *buffer, int elem_size, int count);
+static int set_array(int32_t id, int offset, const uint8_t *buffer, int elem_size, int count);
+static int check_array_bounds(plc_tag_p tag, int offset, int elem_size, int count);
+static void copy_elements(uint8_t *dest, const uint8_t *src, int elem_size, int count, int endian);
 static THREAD_FUNC(tag_tickler_func);
+static int run_subscriptions(void);
+static int start_subscribed_read(plc_tag_p tag);
+static void subscribe_insert_unsafe(plc_tag_p tag);
+static void subscribe_remove_unsafe(plc_tag_p tag);
+static int unsubscribe_tag(plc_tag_p tag);
+static int check_data_changed(plc_tag_p tag);
+static plc_tag_group_p find_group_unsafe(int32_t group_id);
+static plc_tag_group_p lookup_group(int32_t group_id);
+static void group_destroy(void *group_arg);
+static void group_member_done(plc_tag_p tag, int status);
+static void group_read_done(plc_tag_group_p group);
+static plc_tag_group_hold_p group_hold_create(void);
+static void group_hold_release(plc_tag_group_hold_p hold);
+static void group_hold_destroy(void *hold_arg);
+static void record_op_latency(plc_tag_p tag, int which, int status);
 //static int to_tag_index(int id);
 
 
@@ -119,16 +249,44 @@ int lib_init(void)
 
     pdebug(DEBUG_INFO,"Setting up global library data.");
 
-    pdebug(DEBUG_INFO,"Creating tag hashtable.");
-    if((tags = hashtable_create(INITIAL_TAG_TABLE_SIZE)) == NULL) { /* MAGIC */
-        pdebug(DEBUG_ERROR, "Unable to create tag hashtable!");
+    pdebug(DEBUG_INFO,"Creating tag lookup mutex.");
+    rc = mutex_create((mutex_p *)&tag_lookup_mutex);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag lookup mutex!");
+    }
+
+    pdebug(DEBUG_INFO,"Setting up reactor thread pool.");
+    rc = reactor_startup();
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to set up reactor thread pool!");
+        return rc;
+    }
+
+    pdebug(DEBUG_INFO,"Creating subscription mutex.");
+    rc = mutex_create(&subscribe_mutex);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create subscription mutex!");
+        return rc;
+    }
+
+    pdebug(DEBUG_INFO,"Creating tag group mutex.");
+    rc = mutex_create(&group_mutex);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag group mutex!");
+        return rc;
+    }
+
+    tag_groups = vector_create(10, 10);
+    if(!tag_groups) {
+        pdebug(DEBUG_ERROR, "Unable to allocate tag group list!");
         return PLCTAG_ERR_NO_MEM;
     }
 
-    pdebug(DEBUG_INFO,"Creating tag hashtable mutex.");
-    rc = mutex_create((mutex_p *)&tag_lookup_mutex);
+    pdebug(DEBUG_INFO,"Creating tag tickler condition variable.");
+    rc = cond_create(&tag_tickler_wait);
     if (rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_ERROR, "Unable to create tag hashtable mutex!");
+        pdebug(DEBUG_ERROR, "Unable to create tag tickler condition variable!");
+        return rc;
     }
 
     pdebug(DEBUG_INFO,"Creating tag tickler thread.");
@@ -145,31 +303,111 @@ int lib_init(void)
 
 
 
-void lib_teardown(void)
+/*
+ * lib_stop_tickler
+ *
+ * Stop the tickler thread and let go of the tags still in the ready queue.
+ * This must be done while the protocols still exist, a tag the application
+ * already destroyed is only freed when its last reference goes.
+ */
+
+void lib_stop_tickler(void)
 {
-    pdebug(DEBUG_INFO,"Tearing down library.");
+    plc_tag_p tag = NULL;
 
     library_terminating = 1;
 
     if(tag_tickler_thread) {
         pdebug(DEBUG_INFO,"Tearing down tag tickler thread.");
+        cond_signal(tag_tickler_wait);
         thread_join(tag_tickler_thread);
         thread_destroy(&tag_tickler_thread);
         tag_tickler_thread = NULL;
     }
 
+    tag = pop_ready_tags();
+
+    while(tag) {
+        plc_tag_p next = tag->ready_next;
+
+        tag->ready_next = NULL;
+        lock_release(&tag->ready_lock);
+
+        rc_dec(tag);
+
+        tag = next;
+    }
+}
+
+
+
+void lib_teardown(void)
+{
+    pdebug(DEBUG_INFO,"Tearing down library.");
+
+    lib_stop_tickler();
+
+    /* the protocols are already torn down, anything queued since can only be dropped. */
+    ready_tags = NULL;
+
+    /* the same for any tags that were never destroyed but are still subscribed. */
+    for(int i=0; i < SUBSCRIBE_WHEEL_SLOTS; i++) {
+        subscribe_wheel[i] = NULL;
+    }
+
+    num_subscribed = 0;
+
+    if(subscribe_mutex) {
+        pdebug(DEBUG_INFO,"Tearing down subscription mutex.");
+        mutex_destroy(&subscribe_mutex);
+        subscribe_mutex = NULL;
+    }
+
+    if(tag_groups) {
+        pdebug(DEBUG_INFO,"Destroying tag groups that were never destroyed.");
+
+        for(int i=0; i < vector_length(tag_groups); i++) {
+            rc_dec(vector_get(tag_groups, i));
+        }
+
+        vector_destroy(tag_groups);
+        tag_groups = NULL;
+    }
+
+    if(group_mutex) {
+        pdebug(DEBUG_INFO,"Tearing down tag group mutex.");
+        mutex_destroy(&group_mutex);
+        group_mutex = NULL;
+    }
+
+    if(tag_tickler_wait) {
+        pdebug(DEBUG_INFO,"Tearing down tag tickler condition variable.");
+        cond_destroy(&tag_tickler_wait);
+        tag_tickler_wait = NULL;
+    }
+
+    pdebug(DEBUG_INFO,"Tearing down reactor thread pool.");
+    reactor_teardown();
+
     if(tag_lookup_mutex) {
         pdebug(DEBUG_INFO,"Tearing down tag lookup mutex.");
         mutex_destroy(&tag_lookup_mutex);
         tag_lookup_mutex = NULL;
     }
 
-    if(tags) {
-        pdebug(DEBUG_INFO, "Destroying tag hashtable.");
-        hashtable_destroy(tags);
-        tags = NULL;
+    pdebug(DEBUG_INFO, "Destroying tag lookup slots.");
+    for(int i=0; i < TAG_SLOT_MAX_CHUNKS; i++) {
+        if(tag_slots[i]) {
+            mem_free(tag_slots[i]);
+            tag_slots[i] = NULL;
+        }
     }
 
+    num_tag_slots = 0;
+    free_tag_slot = -1;
+    free_tag_slot_last = -1;
+    num_free_tag_slots = 0;
+
     library_terminating = 0;
 
     pdebug(DEBUG_INFO,"Done.");
@@ -178,6 +416,49 @@ void lib_teardown(void)
 
 
 
+/*
+ * plc_tag_mark_ready
+ *
+ * Called by the protocol IO threads when a request for the tag completes.
+ * This wakes any API thread waiting on the tag and queues the tag for the
+ * tickler thread.  The queue is a lock-free stack so that the IO threads
+ * never block here.
+ *
+ * The caller must guarantee that the tag memory is valid for the duration
+ * of the call.  The queue holds its own reference.
+ */
+
+void plc_tag_mark_ready(plc_tag_p tag)
+{
+    if(!tag) {
+        return;
+    }
+
+    if(tag->tag_cond_wait) {
+        cond_signal(tag->tag_cond_wait);
+    }
+
+    if(!tag->vtable || !tag->vtable->tickler) {
+        return;
+    }
+
+    /* already queued? The tickler clears the flag before it ticks the tag. */
+    if(!lock_acquire_try(&tag->ready_lock)) {
+        return;
+    }
+
+    /* the tag could be in the middle of being destroyed. */
+    if(!rc_inc(tag)) {
+        lock_release(&tag->ready_lock);
+        return;
+    }
+
+    push_ready_tags(tag, tag);
+}
+
+
+
+
 THREAD_FUNC(tag_tickler_func)
 {
     (void)arg;
@@ -187,64 +468,54 @@ THREAD_FUNC(tag_tickler_func)
     pdebug(DEBUG_INFO,"Starting.");
 
     while(!library_terminating) {
-        int max_index = 0;
+        plc_tag_p tag = pop_ready_tags();
+        plc_tag_p retry_first = NULL;
+        plc_tag_p retry_last = NULL;
+        int wait_ms = TICKLER_MAX_WAIT_MS;
 
-        critical_block(tag_lookup_mutex) {
-            max_index = hashtable_capacity(tags);
-        }
+        while(tag) {
+            plc_tag_p next = tag->ready_next;
+
+            tag->ready_next = NULL;
 
-        for(int i=0; i < max_index; i++) {
-            plc_tag_p tag = NULL;
+            debug_set_tag_id(tag->tag_id);
 
-            critical_block(tag_lookup_mutex) {
-                /* look up the max index again. it may have changed. */
-                max_index = hashtable_capacity(tags);
+            /* allow the tag to be queued again by the IO threads. */
+            lock_release(&tag->ready_lock);
 
-                if(i < max_index) {
-                    tag = hashtable_get_index(tags, i);
+            /* the protocol starts IO before the generic tag set up is done. */
+            if(tag->api_mutex && mutex_try_lock(tag->api_mutex) == PLCTAG_STATUS_OK) {
+                tickle_tag(tag);
 
-                    if(tag) {
-                        debug_set_tag_id(tag->tag_id);
-                        tag = rc_inc(tag);
-                    }
+                rc_dec(tag);
+            } else if(lock_acquire_try(&tag->ready_lock)) {
+                /* the tag is busy, keep our reference and try again shortly. */
+                if(retry_last) {
+                    retry_last->ready_next = tag;
                 } else {
-                    debug_set_tag_id(0);
-                    tag = NULL;
+                    retry_first = tag;
                 }
-            }
-
-            if(tag && tag->vtable->tickler) {
-                if(mutex_try_lock(tag->api_mutex) == PLCTAG_STATUS_OK) {
-                    tag->vtable->tickler(tag);
 
-                    mutex_unlock(tag->api_mutex);
-
-                    if(tag->read_complete) {
-                        if(tag->callback) {
-                            tag->callback(tag->tag_id, PLCTAG_EVENT_READ_COMPLETED, plc_tag_status(tag->tag_id));
-                        }
-
-                        tag->read_complete = 0;
-                    }
+                retry_last = tag;
+            } else {
+                /* an IO thread queued it again already. */
+                rc_dec(tag);
+            }
 
-                    if(tag->write_complete) {
-                        if(tag->callback) {
-                            tag->callback(tag->tag_id, PLCTAG_EVENT_WRITE_COMPLETED, plc_tag_status(tag->tag_id));
-                        }
+            debug_set_tag_id(0);
 
-                        tag->write_complete = 0;
-                    }
-                }
-            }
+            tag = next;
+        }
 
-            if(tag) {
-                debug_set_tag_id(0);
-                rc_dec(tag);
-            }
+        if(retry_first) {
+            push_ready_tags(retry_first, retry_last);
         }
 
+        /* start the reads of subscribed tags that are due. */
+        wait_ms = run_subscriptions();
+
         if(!library_terminating) {
-            sleep_ms(1);
+            cond_wait(tag_tickler_wait, (retry_first ? TICKLER_RETRY_WAIT_MS : wait_ms));
         }
     }
 
@@ -257,850 +528,2397 @@ THREAD_FUNC(tag_tickler_func)
 
 
 
-/**************************************************************************
- ***************************  API Functions  ******************************
- **************************************************************************/
-
-
 /*
- * plc_tag_decode_error()
+ * tickle_tag
  *
- * This takes an integer error value and turns it into a printable string.
- *
- * FIXME - this should produce better errors than this!
+ * Run the tag's tickler and any completion callbacks.  Must be called with
+ * the tag API mutex held.  The mutex is released on return.
  */
 
+void tickle_tag(plc_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int read_status = PLCTAG_STATUS_OK;
+    int data_changed = 0;
+
+    rc = tag->vtable->tickler(tag);
 
+    if(tag->read_complete) {
+        read_status = tag->vtable->status(tag);
 
-LIB_EXPORT const char *plc_tag_decode_error(int rc)
-{
-    switch(rc) {
-    case PLCTAG_STATUS_PENDING:
-        return "PLCTAG_STATUS_PENDING";
-    case PLCTAG_STATUS_OK:
-        return "PLCTAG_STATUS_OK";
-    case PLCTAG_ERR_ABORT:
-        return "PLCTAG_ERR_ABORT";
-    case PLCTAG_ERR_BAD_CONFIG:
-        return "PLCTAG_ERR_BAD_CONFIG";
-    case PLCTAG_ERR_BAD_CONNECTION:
-        return "PLCTAG_ERR_BAD_CONNECTION";
-    case PLCTAG_ERR_BAD_DATA:
-        return "PLCTAG_ERR_BAD_DATA";
-    case PLCTAG_ERR_BAD_DEVICE:
-        return "PLCTAG_ERR_BAD_DEVICE";
-    case PLCTAG_ERR_BAD_GATEWAY:
-        return "PLCTAG_ERR_BAD_GATEWAY";
-    case PLCTAG_ERR_BAD_PARAM:
-        return "PLCTAG_ERR_BAD_PARAM";
-    case PLCTAG_ERR_BAD_REPLY:
-        return "PLCTAG_ERR_BAD_REPLY";
-    case PLCTAG_ERR_BAD_STATUS:
-        return "PLCTAG_ERR_BAD_STATUS";
-    case PLCTAG_ERR_CLOSE:
-        return "PLCTAG_ERR_CLOSE";
-    case PLCTAG_ERR_CREATE:
-        return "PLCTAG_ERR_CREATE";
-    case PLCTAG_ERR_DUPLICATE:
-        return "PLCTAG_ERR_DUPLICATE";
-    case PLCTAG_ERR_ENCODE:
-        return "PLCTAG_ERR_ENCODE";
-    case PLCTAG_ERR_MUTEX_DESTROY:
-        return "PLCTAG_ERR_MUTEX_DESTROY";
-    case PLCTAG_ERR_MUTEX_INIT:
-        return "PLCTAG_ERR_MUTEX_INIT";
-    case PLCTAG_ERR_MUTEX_LOCK:
-        return "PLCTAG_ERR_MUTEX_LOCK";
-    case PLCTAG_ERR_MUTEX_UNLOCK:
-        return "PLCTAG_ERR_MUTEX_UNLOCK";
-    case PLCTAG_ERR_NOT_ALLOWED:
-        return "PLCTAG_ERR_NOT_ALLOWED";
-    case PLCTAG_ERR_NOT_FOUND:
-        return "PLCTAG_ERR_NOT_FOUND";
-    case PLCTAG_ERR_NOT_IMPLEMENTED:
-        return "PLCTAG_ERR_NOT_IMPLEMENTED";
-    case PLCTAG_ERR_NO_DATA:
-        return "PLCTAG_ERR_NO_DATA";
-    case PLCTAG_ERR_NO_MATCH:
-        return "PLCTAG_ERR_NO_MATCH";
-    case PLCTAG_ERR_NO_MEM:
-        return "PLCTAG_ERR_NO_MEM";
-    case PLCTAG_ERR_NO_RESOURCES:
-        return "PLCTAG_ERR_NO_RESOURCES";
-    case PLCTAG_ERR_NULL_PTR:
-        return "PLCTAG_ERR_NULL_PTR";
-    case PLCTAG_ERR_OPEN:
-        return "PLCTAG_ERR_OPEN";
-    case PLCTAG_ERR_OUT_OF_BOUNDS:
-        return "PLCTAG_ERR_OUT_OF_BOUNDS";
-    case PLCTAG_ERR_READ:
-        return "PLCTAG_ERR_READ";
-    case PLCTAG_ERR_REMOTE_ERR:
-        return "PLCTAG_ERR_REMOTE_ERR";
-    case PLCTAG_ERR_THREAD_CREATE:
-        return "PLCTAG_ERR_THREAD_CREATE";
-    case PLCTAG_ERR_THREAD_JOIN:
-        return "PLCTAG_ERR_THREAD_JOIN";
-    case PLCTAG_ERR_TIMEOUT:
-        return "PLCTAG_ERR_TIMEOUT";
-    case PLCTAG_ERR_TOO_LARGE:
-        return "PLCTAG_ERR_TOO_LARGE";
-    case PLCTAG_ERR_TOO_SMALL:
-        return "PLCTAG_ERR_TOO_SMALL";
-    case PLCTAG_ERR_UNSUPPORTED:
-        return "PLCTAG_ERR_UNSUPPORTED";
-    case PLCTAG_ERR_WINSOCK:
-        return "PLCTAG_ERR_WINSOCK";
-    case PLCTAG_ERR_WRITE:
-        return "PLCTAG_ERR_WRITE";
-    case PLCTAG_ERR_PARTIAL:
-        return "PLCTAG_ERR_PARTIAL";
-    case PLCTAG_ERR_BUSY:
-        return "PLCTAG_ERR_BUSY";
+        record_op_latency(tag, PLCTAG_LATENCY_READ, read_status);
+        trace_point(TRACE_READ_DONE, tag->tag_id, 0, read_status);
 
-    default:
-        return "Unknown error.";
-        break;
+        /* compare the new data while the API mutex still keeps it stable. */
+        if(tag->detect_changes && rc == PLCTAG_STATUS_OK) {
+            data_changed = check_data_changed(tag);
+        }
     }
 
-    return "Unknown error.";
-}
+    if(tag->write_complete) {
+        int write_status = tag->vtable->status(tag);
+
+        record_op_latency(tag, PLCTAG_LATENCY_WRITE, write_status);
+        trace_point(TRACE_WRITE_DONE, tag->tag_id, 0, write_status);
+    }
+
+    mutex_unlock(tag->api_mutex);
 
+    if(tag->read_complete) {
+        if(tag->callback) {
+            tag->callback(tag->tag_id, PLCTAG_EVENT_READ_COMPLETED, plc_tag_status(tag->tag_id));
+        }
+
+        tag->read_complete = 0;
+
+        /* the read may be the last one a group is waiting for. */
+        group_member_done(tag, read_status);
+    }
+
+    if(data_changed && tag->callback) {
+        tag->callback(tag->tag_id, PLCTAG_EVENT_DATA_CHANGED, PLCTAG_STATUS_OK);
+    }
+
+    if(tag->write_complete) {
+        if(tag->callback) {
+            tag->callback(tag->tag_id, PLCTAG_EVENT_WRITE_COMPLETED, plc_tag_status(tag->tag_id));
+        }
 
+        tag->write_complete = 0;
+    }
+}
 
 
 
 /*
- * Set the debug level.
+ * push_ready_tags
  *
- * This function takes values from the defined debug levels.  It sets
- * the debug level to the passed value.  Higher numbers output increasing amounts
- * of information.   Input values not defined will be ignored.
+ * Push a chain of tags, linked by ready_next, onto the ready stack.  Wake
+ * the tickler if the stack was empty.
  */
 
-LIB_EXPORT void plc_tag_set_debug_level(int debug_level)
+void push_ready_tags(plc_tag_p first, plc_tag_p last)
 {
-	if (debug_level >= PLCTAG_DEBUG_NONE && debug_level <= PLCTAG_DEBUG_SPEW) {
-		set_debug_level(debug_level);
-	}
-}
+    void *old_head = NULL;
+
+    do {
+        old_head = ready_tags;
+        last->ready_next = (plc_tag_p)old_head;
+    } while(!atomic_ptr_cas(&ready_tags, old_head, first));
 
+    if(!old_head) {
+        cond_signal(tag_tickler_wait);
+    }
+}
 
 
 
 /*
- * Check that the library supports the required API version.
+ * pop_ready_tags
  *
- * PLCTAG_STATUS_OK is returned if the version matches.  If it does not,
- * PLCTAG_ERR_UNSUPPORTED is returned.
+ * Take everything on the ready stack at once.  This is only called from
+ * the tickler thread so there is no ABA problem.  The stack is reversed so
+ * that tags are handled in the order they completed.
  */
 
-LIB_EXPORT int plc_tag_check_lib_version(int req_major, int req_minor, int req_patch)
+plc_tag_p pop_ready_tags(void)
 {
-    /* encode these with 16-bits per version part. */
-    uint64_t lib_encoded_version = (((uint64_t)version_major) << 32u)
-                                 + (((uint64_t)version_minor) << 16u)
-                                   + (uint64_t)version_patch;
+    plc_tag_p tag = (plc_tag_p)atomic_ptr_exchange(&ready_tags, NULL);
+    plc_tag_p result = NULL;
 
-    uint64_t req_encoded_version = (((uint64_t)req_major) << 32u)
-                                 + (((uint64_t)req_minor) << 16u)
-                                   + (uint64_t)req_patch;
+    while(tag) {
+        plc_tag_p next = tag->ready_next;
 
-    if(version_major == (uint64_t)req_major && lib_encoded_version >= req_encoded_version) {
-        return PLCTAG_STATUS_OK;
-    } else {
-        return PLCTAG_ERR_UNSUPPORTED;
+        tag->ready_next = result;
+        result = tag;
+        tag = next;
     }
-}
-
-
 
+    return result;
+}
 
 
 
 /*
- * plc_tag_create()
+ * run_subscriptions
  *
- * Just pass through to the plc_tag_create_sync() function.
+ * Run the timer wheel up to the current time.  Every subscribed tag that
+ * is due gets a read started and goes back in the wheel at the next
+ * multiple of its RPI.  Only called from the tickler thread.
  *
- * This is where the dispatch occurs to the protocol specific implementation.
+ * Returns how long the tickler may sleep before the next tick.
  */
 
-LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout)
+int run_subscriptions(void)
 {
-    plc_tag_p tag = PLC_TAG_P_NULL;
-    int id = PLCTAG_ERR_OUT_OF_BOUNDS;
-    attr attribs = NULL;
-    int rc = PLCTAG_STATUS_OK;
-    int read_cache_ms = 0;
-    tag_create_function tag_constructor;
-	int debug_level = -1;
-
-    pdebug(DEBUG_INFO,"Starting");
-
-    if((rc = initialize_modules()) != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_ERROR,"Unable to initialize the internal library state!");
-        return rc;
-    }
-
-    if(!attrib_str || str_length(attrib_str) == 0) {
-        pdebug(DEBUG_WARN,"Tag attribute string is null or zero length!");
-        return PLCTAG_ERR_TOO_SMALL;
-    }
+    plc_tag_p due = NULL;
+    int64_t now = time_ms();
+    int wait_ms = TICKLER_MAX_WAIT_MS;
 
-    attribs = attr_create_from_str(attrib_str);
-    if(!attribs) {
-        pdebug(DEBUG_WARN,"Unable to parse attribute string!");
-        return PLCTAG_ERR_BAD_DATA;
-    }
+    critical_block(subscribe_mutex) {
+        if(!num_subscribed) {
+            break;
+        }
 
-    /* set debug level */
-	debug_level = attr_get_int(attribs, "debug", -1);
-	if (debug_level > DEBUG_NONE) {
-		set_debug_level(debug_level);
-	}
+        /* if we fell far behind, one turn of the wheel covers everything. */
+        if(now - subscribe_wheel_time >= (int64_t)SUBSCRIBE_TICK_MS * SUBSCRIBE_WHEEL_SLOTS) {
+            subscribe_wheel_time = now - (now % SUBSCRIBE_TICK_MS) - ((int64_t)SUBSCRIBE_TICK_MS * (SUBSCRIBE_WHEEL_SLOTS - 1));
+        }
 
-    /*
-     * create the tag, this is protocol specific.
-     *
-     * If this routine wants to keep the attributes around, it needs
-     * to clone them.
-     */
-    tag_constructor = find_tag_create_func(attribs);
+        while(subscribe_wheel_time <= now) {
+            plc_tag_p *link = &subscribe_wheel[(subscribe_wheel_time / SUBSCRIBE_TICK_MS) % SUBSCRIBE_WHEEL_SLOTS];
 
-    if(!tag_constructor) {
-        pdebug(DEBUG_WARN,"Tag creation failed, no tag constructor found for tag type!");
-        attr_destroy(attribs);
-        return PLCTAG_ERR_BAD_PARAM;
-    }
+            while(*link) {
+                plc_tag_p tag = *link;
 
-    tag = tag_constructor(attribs);
+                /* leave tags due on a later turn of the wheel. */
+                if(tag->subscribe_due < subscribe_wheel_time + SUBSCRIBE_TICK_MS) {
+                    *link = tag->subscribe_next;
+                    tag->subscribe_in_wheel = 0;
+                    num_subscribed--;
 
-    /*
-     * FIXME - this really should be here???  Maybe not?  But, this is
-     * the only place it can be without making every protocol type do this automatically.
-     */
-    if(!tag) {
-        pdebug(DEBUG_WARN, "Tag creation failed, skipping mutex creation and other generic setup.");
-        attr_destroy(attribs);
-        return PLCTAG_ERR_CREATE;
-    }
+                    /* the wheel's reference moves to the due list. */
+                    tag->subscribe_next = due;
+                    due = tag;
+                } else {
+                    link = &tag->subscribe_next;
+                }
+            }
 
-    rc = mutex_create(&(tag->ext_mutex));
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN,"Unable to create tag external mutex!");
-        rc_dec(tag);
-        return PLCTAG_ERR_CREATE;
-    }
+            subscribe_wheel_time += SUBSCRIBE_TICK_MS;
+        }
 
-    rc = mutex_create(&(tag->api_mutex));
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN,"Unable to create tag API mutex!");
-        rc_dec(tag);
-        return PLCTAG_ERR_CREATE;
+        wait_ms = (int)(subscribe_wheel_time - now);
     }
 
-    /* set up the read cache config. */
-    read_cache_ms = attr_get_int(attribs,"read_cache_ms",0);
-    if(read_cache_ms < 0) {
-        pdebug(DEBUG_WARN, "read_cache_ms value must be positive, using zero.");
-        read_cache_ms = 0;
-    }
+    while(due) {
+        plc_tag_p tag = due;
+        int started = 0;
+        int keep = 0;
 
-    tag->read_cache_expire = (int64_t)0;
-    tag->read_cache_ms = (int64_t)read_cache_ms;
+        due = tag->subscribe_next;
+        tag->subscribe_next = NULL;
 
-    /*
-     * Release memory for attributes
-     *
-     * some code is commented out that would have kept a pointer
-     * to the attributes in the tag and released the memory upon
-     * tag destruction. To prevent a memory leak without maintaining
-     * that pointer, the memory needs to be released here.
-     */
-    attr_destroy(attribs);
+        debug_set_tag_id(tag->tag_id);
 
-    /*
-    * if there is a timeout, then loop until we get
-    * an error or we timeout.
-    */
-    if(timeout) {
-        int64_t timeout_time = timeout + time_ms();
-        int64_t start_time = time_ms();
+        started = start_subscribed_read(tag);
 
-        /* get the tag status. */
-        rc = tag->vtable->status(tag);
+        critical_block(subscribe_mutex) {
+            /* unsubscribed, or subscribed again, while we were starting the read? */
+            if(tag->subscribe_rpi_ms > 0 && !tag->subscribe_in_wheel) {
+                if(started) {
+                    /* next multiple of the RPI, so tags with the same RPI stay together. */
+                    int64_t base = (tag->subscribe_due > now ? tag->subscribe_due : now);
 
-        while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
-            /* give some time to the tickler function. */
-            if(tag->vtable->tickler) {
-                tag->vtable->tickler(tag);
-            }
+                    tag->subscribe_due = ((base / tag->subscribe_rpi_ms) + 1) * tag->subscribe_rpi_ms;
+                } else {
+                    /* the tag was busy, try again on the next tick. */
+                    tag->subscribe_due = now + SUBSCRIBE_TICK_MS;
+                }
 
-            rc = tag->vtable->status(tag);
+                subscribe_insert_unsafe(tag);
 
-            /*
-             * terminate early and do not wait again if the
-             * IO is done.
-             */
-            if(rc != PLCTAG_STATUS_PENDING) {
-                break;
+                keep = 1;
             }
-
-            sleep_ms(1); /* MAGIC */
-        }
-
-        /*
-         * if we dropped out of the while loop but the status is
-         * still pending, then we timed out.
-         *
-         * Abort the operation and set the status to show the timeout.
-         */
-        if(rc == PLCTAG_STATUS_PENDING) {
-            pdebug(DEBUG_WARN,"Timeout waiting for tag to be ready!");
-            tag->vtable->abort(tag);
-            rc = PLCTAG_ERR_TIMEOUT;
         }
 
-        /* check to see if there was an error during tag creation. */
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Error %s while trying to create tag!", plc_tag_decode_error(rc));
+        if(!keep) {
             rc_dec(tag);
-            return rc;
         }
 
-        pdebug(DEBUG_INFO,"tag set up elapsed time %ldms",(time_ms()-start_time));
+        debug_set_tag_id(0);
     }
 
-    /* map the tag to a tag ID */
-    id = add_tag_lookup(tag);
+    return wait_ms;
+}
 
-    /* if the mapping failed, then punt */
-    if(id < 0) {
-        pdebug(DEBUG_ERROR, "Unable to map tag %p to lookup table entry, rc=%s", tag, plc_tag_decode_error(id));
-        rc_dec(tag);
-        return id;
+
+
+/*
+ * start_subscribed_read
+ *
+ * Start the periodic read of a subscribed tag.  Returns zero if the tag's
+ * API mutex was busy and nothing was done.
+ */
+
+int start_subscribed_read(plc_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!tag->api_mutex || mutex_try_lock(tag->api_mutex) != PLCTAG_STATUS_OK) {
+        return 0;
     }
 
-    /* save this for later. */
-    tag->tag_id = id;
+    /* a periodic read has nobody waiting on it. */
+    tag->op_deadline = 0;
+    tag->op_start_us = time_us();
+    trace_point(TRACE_READ_START, tag->tag_id, 0, 0);
 
-    debug_set_tag_id(id);
+    rc = tag->vtable->read(tag);
 
-    pdebug(DEBUG_INFO, "Returning mapped tag ID %d", id);
+    mutex_unlock(tag->api_mutex);
 
-    pdebug(DEBUG_INFO,"Done.");
+    if(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK) {
+        if(tag->callback) {
+            tag->callback(tag->tag_id, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+        }
+    } else if(rc == PLCTAG_ERR_BUSY) {
+        pdebug(DEBUG_DETAIL, "Last read is still running, skipping this period.");
+    } else {
+        pdebug(DEBUG_WARN, "Unable to start periodic read, %s!", plc_tag_decode_error(rc));
+    }
 
-    return id;
+    return 1;
 }
 
 
 
-
 /*
- * plc_tag_shutdown
+ * subscribe_insert_unsafe
  *
- * Some systems may not be able to call atexit() handlers.  In those cases, wrappers should
- * call this function before unloading the library or terminating.   Most OSes will cleanly
- * recover all system resources when a process is terminated and this will not be necessary.
+ * Put the tag in the wheel slot for its due time, or the next tick to run
+ * if that is already past.  Must be called with the subscription mutex held.
  */
 
-LIB_EXPORT void plc_tag_shutdown(void)
+void subscribe_insert_unsafe(plc_tag_p tag)
 {
-    destroy_modules();
+    int64_t when = tag->subscribe_due;
+    int slot = 0;
+
+    if(!num_subscribed && !subscribe_wheel_time) {
+        subscribe_wheel_time = time_ms();
+        subscribe_wheel_time -= subscribe_wheel_time % SUBSCRIBE_TICK_MS;
+    }
+
+    if(when < subscribe_wheel_time) {
+        when = subscribe_wheel_time;
+    }
+
+    slot = (int)((when / SUBSCRIBE_TICK_MS) % SUBSCRIBE_WHEEL_SLOTS);
+
+    tag->subscribe_next = subscribe_wheel[slot];
+    subscribe_wheel[slot] = tag;
+    tag->subscribe_in_wheel = 1;
+
+    num_subscribed++;
 }
 
 
+
 /*
- * plc_tag_register_callback
- *
- * This function registers the passed callback function with the tag.  Only one callback function
- * may be registered on a tag at a time!
- *
- * Once registered, any of the following operations on or in the tag will result in the callback
- * being called:
- *
- *      * starting a tag read operation.
- *      * a tag read operation ending.
- *      * a tag read being aborted.
- *      * starting a tag write operation.
- *      * a tag write operation ending.
- *      * a tag write being aborted.
- *      * a tag being destroyed
- *
- * The callback is called outside of the internal tag mutex so it can call any tag functions safely.   However,
- * the callback is called in the context of the internal tag helper thread and not the client library thread(s).
- * This means that YOU are responsible for making sure that all client application data structures the callback
- * function touches are safe to access by the callback!
- *
- * Do not do any operations in the callback that block for any significant time.   This will cause library
- * performance to be poor or even to start failing!
+ * subscribe_remove_unsafe
  *
- * When the callback is called with the PLCTAG_EVENT_DESTROY_STARTED, do not call any tag functions.  It is
- * not guaranteed that they will work and they will possibly hang or fail.
- *
- * Return values:
- *void (*tag_callback_func)(int32_t tag_id, uint32_t event, int status)
- * If there is already a callback registered, the function will return PLCTAG_ERR_DUPLICATE.   Only one callback
- * function may be registered at a time on each tag.
- *
- * If all is successful, the function will return PLCTAG_STATUS_OK.
+ * Take the tag out of its wheel slot.  Must be called with the subscription
+ * mutex held.
  */
 
-LIB_EXPORT int plc_tag_register_callback(int32_t tag_id, void (*tag_callback_func)(int32_t tag_id, int event, int status))
+void subscribe_remove_unsafe(plc_tag_p tag)
 {
-    int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(tag_id);
+    int64_t when = (tag->subscribe_due < subscribe_wheel_time ? subscribe_wheel_time : tag->subscribe_due);
+    plc_tag_p *link = &subscribe_wheel[(when / SUBSCRIBE_TICK_MS) % SUBSCRIBE_WHEEL_SLOTS];
 
-    pdebug(DEBUG_INFO, "Starting.");
-
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
+    while(*link && *link != tag) {
+        link = &(*link)->subscribe_next;
     }
 
-    critical_block(tag->api_mutex) {
-        if(tag->callback) {
-            rc = PLCTAG_ERR_DUPLICATE;
-        } else {
-            rc = PLCTAG_STATUS_OK;
-            tag->callback = tag_callback_func;
-        }
+    if(*link) {
+        *link = tag->subscribe_next;
+        num_subscribed--;
+    } else {
+        pdebug(DEBUG_WARN, "Tag is not in its subscription slot!");
     }
 
-    rc_dec(tag);
-
-    pdebug(DEBUG_INFO, "Done.");
-
-    return rc;
+    tag->subscribe_next = NULL;
+    tag->subscribe_in_wheel = 0;
 }
 
 
 
-
 /*
- * plc_tag_unregister_callback
+ * unsubscribe_tag
  *
- * This function removes the callback already registered on the tag.
- *
- * Return values:
- *
- * The function returns PLCTAG_STATUS_OK if there was a registered callback and removing it went well.
- * An error of PLCTAG_ERR_NOT_FOUND is returned if there was no registered callback.
+ * End the tag's subscription, if any, and drop the wheel's reference.
  */
 
-LIB_EXPORT int plc_tag_unregister_callback(int32_t tag_id)
+int unsubscribe_tag(plc_tag_p tag)
 {
-    int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(tag_id);
+    int rc = PLCTAG_ERR_NOT_FOUND;
+    int in_wheel = 0;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    critical_block(subscribe_mutex) {
+        if(tag->subscribe_rpi_ms > 0) {
+            rc = PLCTAG_STATUS_OK;
+        }
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
-    }
+        tag->subscribe_rpi_ms = 0;
 
-    critical_block(tag->api_mutex) {
-        if(tag->callback) {
-            rc = PLCTAG_STATUS_OK;
-            tag->callback = NULL;
-        } else {
-            rc = PLCTAG_ERR_NOT_FOUND;
+        if(tag->subscribe_in_wheel) {
+            subscribe_remove_unsafe(tag);
+            in_wheel = 1;
         }
     }
 
-    rc_dec(tag);
-
-    pdebug(DEBUG_INFO, "Done.");
+    /* outside the mutex, this could be the last reference. */
+    if(in_wheel) {
+        rc_dec(tag);
+    }
 
     return rc;
 }
 
 
 
-
 /*
- * plc_tag_register_logger
+ * check_data_changed
  *
- * This function registers the passed callback function with the library.  Only one callback function
- * may be registered with the library at a time!
+ * Compare the tag data with the copy kept from the last read and find the
+ * range of bytes that changed.  Unchanged blocks are skipped with memcmp,
+ * which is vectorized in the C library, from both ends.  Only the changed
+ * range is copied back into the saved data.
  *
- * Once registered, the function will be called with any logging message that is normally printed due 
- * to the current log level setting.
- *
- * WARNING: the callback will usually be called when the internal tag API mutex is held.   You cannot
- * call any tag functions within the callback!
- *
- * Return values:
- *
- * If there is already a callback registered, the function will return PLCTAG_ERR_DUPLICATE.   Only one callback
- * function may be registered at a time on each tag.
- *
- * If all is successful, the function will return PLCTAG_STATUS_OK.
+ * Must be called with the tag API mutex held.  Returns 1 if anything
+ * changed and sets changed_offset and changed_size.
  */
 
-LIB_EXPORT int plc_tag_register_logger(void (*log_callback_func)(int32_t tag_id, int debug_level, const char *message))
+int check_data_changed(plc_tag_p tag)
 {
-    pdebug(DEBUG_DETAIL, "Starting");
-    return debug_register_logger(log_callback_func);
+    int size = tag->size;
+    int first = 0;
+    int last = 0;
+
+    if(!tag->data || size <= 0) {
+        return 0;
+    }
+
+    /* first read, or the size changed.  Everything is new. */
+    if(!tag->prev_data || tag->prev_size != size) {
+        if(tag->prev_data) {
+            mem_free(tag->prev_data);
+        }
+
+        tag->prev_size = 0;
+
+        tag->prev_data = (uint8_t *)mem_alloc(size);
+        if(!tag->prev_data) {
+            pdebug(DEBUG_WARN, "Unable to allocate buffer for change detection!");
+            return 0;
+        }
+
+        mem_copy(tag->prev_data, tag->data, size);
+        tag->prev_size = size;
+
+        tag->changed_offset = 0;
+        tag->changed_size = size;
+
+        return 1;
+    }
+
+    /* find the first changed byte. */
+    while(first + CHANGE_BLOCK_SIZE <= size && mem_cmp(tag->prev_data + first, CHANGE_BLOCK_SIZE, tag->data + first, CHANGE_BLOCK_SIZE) == 0) {
+        first += CHANGE_BLOCK_SIZE;
+    }
+
+    while(first < size && tag->prev_data[first] == tag->data[first]) {
+        first++;
+    }
+
+    if(first == size) {
+        return 0;
+    }
+
+    /* find the end of the changed range. */
+    last = size;
+
+    while(last - CHANGE_BLOCK_SIZE >= first && mem_cmp(tag->prev_data + last - CHANGE_BLOCK_SIZE, CHANGE_BLOCK_SIZE, tag->data + last - CHANGE_BLOCK_SIZE, CHANGE_BLOCK_SIZE) == 0) {
+        last -= CHANGE_BLOCK_SIZE;
+    }
+
+    while(last > first && tag->prev_data[last - 1] == tag->data[last - 1]) {
+        last--;
+    }
+
+    mem_copy(tag->prev_data + first, tag->data + first, last - first);
+
+    tag->changed_offset = first;
+    tag->changed_size = last - first;
+
+    pdebug(DEBUG_DETAIL, "Data changed in %d bytes at offset %d.", tag->changed_size, tag->changed_offset);
+
+    return 1;
 }
 
 
 
 /*
- * plc_tag_unregister_logger
- *
- * This function removes the logger callback already registered for the library.
+ * find_group_unsafe
  *
- * Return values:
- *
- * The function returns PLCTAG_STATUS_OK if there was a registered callback and removing it went well.
- * An error of PLCTAG_ERR_NOT_FOUND is returned if there was no registered callback.
+ * Must be called with the group mutex held.  No reference is taken.
  */
 
-LIB_EXPORT int plc_tag_unregister_logger(void)
+plc_tag_group_p find_group_unsafe(int32_t group_id)
 {
-    pdebug(DEBUG_DETAIL, "Starting");
-    return debug_unregister_logger();
+    for(int i=0; i < vector_length(tag_groups); i++) {
+        plc_tag_group_p group = vector_get(tag_groups, i);
+
+        if(group->group_id == group_id) {
+            return group;
+        }
+    }
+
+    return NULL;
 }
 
 
 
 /*
- * plc_tag_lock
+ * lookup_group
  *
- * Lock the tag against use by other threads.  Because operations on a tag are
- * very much asynchronous, actions like getting and extracting the data from
- * a tag take more than one API call.  If more than one thread is using the same tag,
- * then the internal state of the tag will get broken and you will probably experience
- * a crash.
- *
- * This should be used to initially lock a tag when starting operations with it
- * followed by a call to plc_tag_unlock when you have everything you need from the tag.
+ * Find a group by ID.  The caller gets a reference.
  */
 
-LIB_EXPORT int plc_tag_lock(int32_t id)
+plc_tag_group_p lookup_group(int32_t group_id)
 {
-    int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
+    plc_tag_group_p group = NULL;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    if(!group_mutex) {
+        return NULL;
+    }
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
+    critical_block(group_mutex) {
+        group = rc_inc(find_group_unsafe(group_id));
     }
 
-    critical_block(tag->api_mutex) {
-        rc = mutex_lock(tag->ext_mutex);
+    return group;
+}
+
+
+
+void group_destroy(void *group_arg)
+{
+    plc_tag_group_p group = (plc_tag_group_p)group_arg;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(group->tag_ids) {
+        mem_free(group->tag_ids);
+        group->tag_ids = NULL;
     }
 
-    rc_dec(tag);
+    if(group->done_wait) {
+        cond_destroy(&group->done_wait);
+        group->done_wait = NULL;
+    }
 
     pdebug(DEBUG_INFO, "Done.");
-
-    return rc;
 }
 
 
 
-
 /*
- * plc_tag_unlock
+ * group_hold_create
  *
- * The opposite action of plc_tag_unlock.  This allows other threads to access the
- * tag.
+ * A new hold starts out held.
  */
 
-LIB_EXPORT int plc_tag_unlock(int32_t id)
+plc_tag_group_hold_p group_hold_create(void)
 {
-    int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
-
-    pdebug(DEBUG_INFO, "Starting.");
+    plc_tag_group_hold_p hold = NULL;
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
+    hold = rc_alloc((int)sizeof(struct plc_tag_group_hold_t), group_hold_destroy);
+    if(!hold) {
+        pdebug(DEBUG_ERROR, "Unable to allocate group hold!");
+        return NULL;
     }
 
-    critical_block(tag->api_mutex) {
-        rc = mutex_unlock(tag->ext_mutex);
+    hold->waiters = vector_create(4, 4);
+    if(!hold->waiters) {
+        pdebug(DEBUG_ERROR, "Unable to allocate group hold waiter list!");
+        return rc_dec(hold);
     }
 
-    rc_dec(tag);
-
-    pdebug(DEBUG_INFO, "Done.");
+    hold->lock = LOCK_INIT;
+    hold->held = 1;
 
-    return rc;
+    return hold;
 }
 
 
 
-
 /*
- * plc_tag_abort()
- *
- * This function calls through the vtable in the passed tag to call
- * the protocol-specific implementation.
- *
- * The implementation must do whatever is necessary to abort any
- * ongoing IO.
+ * group_hold_release
  *
- * The status of the operation is returned.
+ * Let the held requests go and wake up everyone waiting for that.
  */
 
-int plc_tag_abort(int32_t id)
+void group_hold_release(plc_tag_group_hold_p hold)
 {
-    int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
+    vector_p waiters = NULL;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    spin_block(&hold->lock) {
+        hold->held = 0;
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
+        waiters = hold->waiters;
+        hold->waiters = NULL;
     }
 
-    critical_block(tag->api_mutex) {
-        /* who knows what state the tag data is in.  */
-        tag->read_cache_expire = (uint64_t)0;
+    for(int i=0; i < vector_length(waiters); i++) {
+        struct group_hold_waiter_t *waiter = vector_get(waiters, i);
 
-        if(!tag->vtable || !tag->vtable->abort) {
-            pdebug(DEBUG_WARN,"Tag does not have a abort function!");
-            rc = PLCTAG_ERR_NOT_IMPLEMENTED;
+        if(waiter->arg) {
+            waiter->wake(waiter->arg);
+            rc_dec(waiter->arg);
         }
 
-        /* this may be synchronous. */
-        rc = tag->vtable->abort(tag);
+        mem_free(waiter);
     }
 
-    if(tag->callback) {
-        tag->callback(id, PLCTAG_EVENT_ABORTED, PLCTAG_STATUS_OK);
-    }
+    vector_destroy(waiters);
+}
 
-    rc_dec(tag);
 
-    pdebug(DEBUG_INFO, "Done.");
 
-    return rc;
-}
+void group_hold_destroy(void *hold_arg)
+{
+    plc_tag_group_hold_p hold = (plc_tag_group_hold_p)hold_arg;
+
+    /* only a hold that was never released still has waiters. */
+    if(hold->waiters) {
+        for(int i=0; i < vector_length(hold->waiters); i++) {
+            struct group_hold_waiter_t *waiter = vector_get(hold->waiters, i);
+
+            rc_dec(waiter->arg);
+            mem_free(waiter);
+        }
 
+        vector_destroy(hold->waiters);
+        hold->waiters = NULL;
+    }
+}
 
 
 
 /*
- * plc_tag_destroy()
+ * plc_tag_group_hold_is_held
  *
- * Remove all implementation specific details about a tag and clear its
- * memory.
+ * Called by the protocol IO threads to keep requests of a group from being
+ * sent while the rest of the group is still being queued.
  */
 
-
-LIB_EXPORT int plc_tag_destroy(int32_t tag_id)
+int plc_tag_group_hold_is_held(plc_tag_group_hold_p hold)
 {
-    plc_tag_p tag = NULL;
+    return (hold && hold->held);
+}
 
-    pdebug(DEBUG_INFO, "Starting.");
 
-    if(tag_id <= 0 || tag_id >= TAG_ID_MASK) {
-        pdebug(DEBUG_WARN, "Called with zero or invalid tag!");
+
+/*
+ * plc_tag_group_hold_add_waiter
+ *
+ * The protocols use this to be woken up when the requests they are holding
+ * can be sent.  Waiting for the same thing twice only wakes once.
+ */
+
+int plc_tag_group_hold_add_waiter(plc_tag_group_hold_p hold, void (*wake)(void *arg), void *arg)
+{
+    int rc = PLCTAG_STATUS_OK;
+    struct group_hold_waiter_t *waiter = NULL;
+
+    if(!hold || !wake || !arg) {
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    critical_block(tag_lookup_mutex) {
-        tag = hashtable_remove(tags, tag_id);
+    /* allocated outside the spin lock, it is usually not needed for long. */
+    waiter = mem_alloc((int)sizeof(struct group_hold_waiter_t));
+    if(!waiter) {
+        pdebug(DEBUG_ERROR, "Unable to allocate hold waiter!");
+        return PLCTAG_ERR_NO_MEM;
     }
 
-    if(!tag) {
-        pdebug(DEBUG_WARN, "Called with non-existent tag!");
-        return PLCTAG_ERR_NOT_FOUND;
-    }
+    waiter->wake = wake;
+    waiter->arg = arg;
 
-    /* abort anything in flight */
-    pdebug(DEBUG_DETAIL, "Aborting any in-flight operations.");
+    spin_block(&hold->lock) {
+        int found = 0;
 
-    critical_block(tag->api_mutex) {
-        if(!tag->vtable || !tag->vtable->abort) {
-            pdebug(DEBUG_WARN,"Tag does not have a abort function!");
+        if(!hold->held) {
+            break;
         }
 
-        /* Force a clean up. */
-        tag->vtable->abort(tag);
-    }
-
-    if(tag->callback) {
-        tag->callback(tag_id, PLCTAG_EVENT_DESTROYED, PLCTAG_STATUS_OK);
-    }
+        for(int i=0; i < vector_length(hold->waiters) && !found; i++) {
+            struct group_hold_waiter_t *other = vector_get(hold->waiters, i);
 
-    /* release the reference outside the mutex. */
-    rc_dec(tag);
+            found = (other->wake == wake && other->arg == arg);
+        }
 
-    pdebug(DEBUG_INFO, "Done.");
+        if(!found) {
+            rc = vector_put(hold->waiters, vector_length(hold->waiters), waiter);
+            if(rc != PLCTAG_STATUS_OK) {
+                break;
+            }
 
-    debug_set_tag_id(0);
+            waiter->arg = rc_inc(arg);
+            waiter = NULL;
+        }
 
-    return PLCTAG_STATUS_OK;
-}
+        rc = PLCTAG_STATUS_PENDING;
+    }
 
+    /* already released, already waiting, or out of memory. */
+    if(waiter) {
+        mem_free(waiter);
+    }
 
+    return rc;
+}
 
 
 
 /*
- * plc_tag_read()
- *
- * This function calls through the vtable in the passed tag to call
- * the protocol-specific implementation.  That starts the read operation.
- * If there is a timeout passed, then this routine waits for either
- * a timeout or an error.
+ * group_member_done
  *
- * The status of the operation is returned.
+ * Count the end of a member's read against its group.  The last member to
+ * finish completes the group read.  Does nothing if the tag is not part of
+ * a group read.
  */
 
-LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
+void group_member_done(plc_tag_p tag, int status)
 {
-    int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
-
-    pdebug(DEBUG_INFO, "Starting.");
-
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
-    }
+    plc_tag_group_p group = NULL;
 
-    if(tag->callback) {
-        tag->callback(id, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+    /* a completion left over from an earlier read while the group's read is still running. */
+    if(!tag->group_id || status == PLCTAG_STATUS_PENDING) {
+        return;
     }
 
-    critical_block(tag->api_mutex) {
-        /* check read cache, if not expired, return existing data. */
-        if(tag->read_cache_expire > time_ms()) {
-            pdebug(DEBUG_INFO, "Returning cached data.");
-            rc = PLCTAG_STATUS_OK;
+    critical_block(group_mutex) {
+        if(!tag->group_read_pending) {
             break;
         }
 
-        /* the protocol implementation does not do the timeout. */
-        rc = tag->vtable->read(tag);
+        tag->group_read_pending = 0;
 
-        /* if error, return now */
-        if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+        group = find_group_unsafe(tag->group_id);
+        if(!group || !group->read_pending) {
+            group = NULL;
             break;
         }
 
-        /* set up the cache time.  This works when read_cache_ms is zero as it is already expired. */
-        tag->read_cache_expire = time_ms() + tag->read_cache_ms;
+        /* the group reports the first error. */
+        if(status != PLCTAG_STATUS_OK && group->status == PLCTAG_STATUS_OK) {
+            group->status = status;
+        }
 
-        /*
-         * if there is a timeout, then loop until we get
-         * an error or we timeout.
-         */
-        if(timeout) {
-            int64_t timeout_time = timeout + time_ms();
-            int64_t start_time = time_ms();
+        group->read_pending--;
 
-            while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
-                /* give some time to the tickler function. */
-                if(tag->vtable->tickler) {
-                    tag->vtable->tickler(tag);
-                }
+        group = (group->read_pending ? NULL : rc_inc(group));
+    }
 
-                rc = tag->vtable->status(tag);
+    if(group) {
+        group_read_done(group);
+        rc_dec(group);
+    }
+}
 
-                /*
-                 * terminate early and do not wait again if the
-                 * IO is done.
-                 */
-                if(rc != PLCTAG_STATUS_PENDING) {
-                    break;
-                }
 
-                sleep_ms(1); /* MAGIC */
-            }
 
-            /*
-             * if we dropped out of the while loop but the status is
-             * still pending, then we timed out.
-             *
-             * Abort the operation and set the status to show the timeout.
-             */
-            if(rc != PLCTAG_STATUS_OK) {
-                /* abort the request. */
-                if(tag->vtable->abort) {
+/*
+ * group_read_done
+ *
+ * Call the group callback and wake any thread waiting for the group.
+ */
+
+void group_read_done(plc_tag_group_p group)
+{
+    int status = PLCTAG_STATUS_OK;
+
+    critical_block(group_mutex) {
+        status = group->status;
+    }
+
+    pdebug(DEBUG_DETAIL, "Group %d read done with status %s.", group->group_id, plc_tag_decode_error(status));
+
+    if(group->callback) {
+        group->callback(group->group_id, PLCTAG_EVENT_READ_COMPLETED, status);
+    }
+
+    cond_signal(group->done_wait);
+}
+
+
+
+/**************************************************************************
+ ***************************  API Functions  ******************************
+ **************************************************************************/
+
+
+/*
+ * plc_tag_decode_error()
+ *
+ * This takes an integer error value and turns it into a printable string.
+ *
+ * FIXME - this should produce better errors than this!
+ */
+
+
+
+LIB_EXPORT const char *plc_tag_decode_error(int rc)
+{
+    switch(rc) {
+    case PLCTAG_STATUS_PENDING:
+        return "PLCTAG_STATUS_PENDING";
+    case PLCTAG_STATUS_OK:
+        return "PLCTAG_STATUS_OK";
+    case PLCTAG_ERR_ABORT:
+        return "PLCTAG_ERR_ABORT";
+    case PLCTAG_ERR_BAD_CONFIG:
+        return "PLCTAG_ERR_BAD_CONFIG";
+    case PLCTAG_ERR_BAD_CONNECTION:
+        return "PLCTAG_ERR_BAD_CONNECTION";
+    case PLCTAG_ERR_BAD_DATA:
+        return "PLCTAG_ERR_BAD_DATA";
+    case PLCTAG_ERR_BAD_DEVICE:
+        return "PLCTAG_ERR_BAD_DEVICE";
+    case PLCTAG_ERR_BAD_GATEWAY:
+        return "PLCTAG_ERR_BAD_GATEWAY";
+    case PLCTAG_ERR_BAD_PARAM:
+        return "PLCTAG_ERR_BAD_PARAM";
+    case PLCTAG_ERR_BAD_REPLY:
+        return "PLCTAG_ERR_BAD_REPLY";
+    case PLCTAG_ERR_BAD_STATUS:
+        return "PLCTAG_ERR_BAD_STATUS";
+    case PLCTAG_ERR_CLOSE:
+        return "PLCTAG_ERR_CLOSE";
+    case PLCTAG_ERR_CREATE:
+        return "PLCTAG_ERR_CREATE";
+    case PLCTAG_ERR_DUPLICATE:
+        return "PLCTAG_ERR_DUPLICATE";
+    case PLCTAG_ERR_ENCODE:
+        return "PLCTAG_ERR_ENCODE";
+    case PLCTAG_ERR_MUTEX_DESTROY:
+        return "PLCTAG_ERR_MUTEX_DESTROY";
+    case PLCTAG_ERR_MUTEX_INIT:
+        return "PLCTAG_ERR_MUTEX_INIT";
+    case PLCTAG_ERR_MUTEX_LOCK:
+        return "PLCTAG_ERR_MUTEX_LOCK";
+    case PLCTAG_ERR_MUTEX_UNLOCK:
+        return "PLCTAG_ERR_MUTEX_UNLOCK";
+    case PLCTAG_ERR_NOT_ALLOWED:
+        return "PLCTAG_ERR_NOT_ALLOWED";
+    case PLCTAG_ERR_NOT_FOUND:
+        return "PLCTAG_ERR_NOT_FOUND";
+    case PLCTAG_ERR_NOT_IMPLEMENTED:
+        return "PLCTAG_ERR_NOT_IMPLEMENTED";
+    case PLCTAG_ERR_NO_DATA:
+        return "PLCTAG_ERR_NO_DATA";
+    case PLCTAG_ERR_NO_MATCH:
+        return "PLCTAG_ERR_NO_MATCH";
+    case PLCTAG_ERR_NO_MEM:
+        return "PLCTAG_ERR_NO_MEM";
+    case PLCTAG_ERR_NO_RESOURCES:
+        return "PLCTAG_ERR_NO_RESOURCES";
+    case PLCTAG_ERR_NULL_PTR:
+        return "PLCTAG_ERR_NULL_PTR";
+    case PLCTAG_ERR_OPEN:
+        return "PLCTAG_ERR_OPEN";
+    case PLCTAG_ERR_OUT_OF_BOUNDS:
+        return "PLCTAG_ERR_OUT_OF_BOUNDS";
+    case PLCTAG_ERR_READ:
+        return "PLCTAG_ERR_READ";
+    case PLCTAG_ERR_REMOTE_ERR:
+        return "PLCTAG_ERR_REMOTE_ERR";
+    case PLCTAG_ERR_THREAD_CREATE:
+        return "PLCTAG_ERR_THREAD_CREATE";
+    case PLCTAG_ERR_THREAD_JOIN:
+        return "PLCTAG_ERR_THREAD_JOIN";
+    case PLCTAG_ERR_TIMEOUT:
+        return "PLCTAG_ERR_TIMEOUT";
+    case PLCTAG_ERR_TOO_LARGE:
+        return "PLCTAG_ERR_TOO_LARGE";
+    case PLCTAG_ERR_TOO_SMALL:
+        return "PLCTAG_ERR_TOO_SMALL";
+    case PLCTAG_ERR_UNSUPPORTED:
+        return "PLCTAG_ERR_UNSUPPORTED";
+    case PLCTAG_ERR_WINSOCK:
+        return "PLCTAG_ERR_WINSOCK";
+    case PLCTAG_ERR_WRITE:
+        return "PLCTAG_ERR_WRITE";
+    case PLCTAG_ERR_PARTIAL:
+        return "PLCTAG_ERR_PARTIAL";
+    case PLCTAG_ERR_BUSY:
+        return "PLCTAG_ERR_BUSY";
+
+    default:
+        return "Unknown error.";
+        break;
+    }
+
+    return "Unknown error.";
+}
+
+
+
+
+
+/*
+ * Set the debug level.
+ *
+ * This function takes values from the defined debug levels.  It sets
+ * the debug level to the passed value.  Higher numbers output increasing amounts
+ * of information.   Input values not defined will be ignored.
+ */
+
+LIB_EXPORT void plc_tag_set_debug_level(int debug_level)
+{
+	if (debug_level >= PLCTAG_DEBUG_NONE && debug_level <= PLCTAG_DEBUG_SPEW) {
+		set_debug_level(debug_level);
+	}
+}
+
+
+
+
+/*
+ * Check that the library supports the required API version.
+ *
+ * PLCTAG_STATUS_OK is returned if the version matches.  If it does not,
+ * PLCTAG_ERR_UNSUPPORTED is returned.
+ */
+
+LIB_EXPORT int plc_tag_check_lib_version(int req_major, int req_minor, int req_patch)
+{
+    /* encode these with 16-bits per version part. */
+    uint64_t lib_encoded_version = (((uint64_t)version_major) << 32u)
+                                 + (((uint64_t)version_minor) << 16u)
+                                   + (uint64_t)version_patch;
+
+    uint64_t req_encoded_version = (((uint64_t)req_major) << 32u)
+                                 + (((uint64_t)req_minor) << 16u)
+                                   + (uint64_t)req_patch;
+
+    if(version_major == (uint64_t)req_major && lib_encoded_version >= req_encoded_version) {
+        return PLCTAG_STATUS_OK;
+    } else {
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+}
+
+
+
+
+
+
+/*
+ * plc_tag_create()
+ *
+ * Just pass through to the plc_tag_create_sync() function.
+ *
+ * This is where the dispatch occurs to the protocol specific implementation.
+ */
+
+LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout)
+{
+    plc_tag_p tag = PLC_TAG_P_NULL;
+    int id = PLCTAG_ERR_OUT_OF_BOUNDS;
+    attr attribs = NULL;
+    int rc = PLCTAG_STATUS_OK;
+    int read_cache_ms = 0;
+    tag_create_function tag_constructor;
+	int debug_level = -1;
+
+    pdebug(DEBUG_INFO,"Starting");
+
+    if((rc = initialize_modules()) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR,"Unable to initialize the internal library state!");
+        return rc;
+    }
+
+    if(!attrib_str || str_length(attrib_str) == 0) {
+        pdebug(DEBUG_WARN,"Tag attribute string is null or zero length!");
+        return PLCTAG_ERR_TOO_SMALL;
+    }
+
+    attribs = attr_create_from_str(attrib_str);
+    if(!attribs) {
+        pdebug(DEBUG_WARN,"Unable to parse attribute string!");
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    /* set debug level */
+	debug_level = attr_get_int(attribs, "debug", -1);
+	if (debug_level > DEBUG_NONE) {
+		set_debug_level(debug_level);
+	}
+
+    /*
+     * create the tag, this is protocol specific.
+     *
+     * If this routine wants to keep the attributes around, it needs
+     * to clone them.
+     */
+    tag_constructor = find_tag_create_func(attribs);
+
+    if(!tag_constructor) {
+        pdebug(DEBUG_WARN,"Tag creation failed, no tag constructor found for tag type!");
+        attr_destroy(attribs);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    tag = tag_constructor(attribs);
+
+    /*
+     * FIXME - this really should be here???  Maybe not?  But, this is
+     * the only place it can be without making every protocol type do this automatically.
+     */
+    if(!tag) {
+        pdebug(DEBUG_WARN, "Tag creation failed, skipping mutex creation and other generic setup.");
+        attr_destroy(attribs);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    rc = mutex_create(&(tag->ext_mutex));
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Unable to create tag external mutex!");
+        rc_dec(tag);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    rc = mutex_create(&(tag->api_mutex));
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Unable to create tag API mutex!");
+        rc_dec(tag);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    rc = cond_create(&(tag->tag_cond_wait));
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Unable to create tag condition variable!");
+        rc_dec(tag);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    /* set up the read cache config. */
+    read_cache_ms = attr_get_int(attribs,"read_cache_ms",0);
+    if(read_cache_ms < 0) {
+        pdebug(DEBUG_WARN, "read_cache_ms value must be positive, using zero.");
+        read_cache_ms = 0;
+    }
+
+    tag->read_cache_expire = (int64_t)0;
+    tag->read_cache_ms = (int64_t)read_cache_ms;
+
+    /* report by exception. */
+    tag->detect_changes = (attr_get_int(attribs, "detect_changes", 0) ? 1 : 0);
+
+    /*
+     * Release memory for attributes
+     *
+     * some code is commented out that would have kept a pointer
+     * to the attributes in the tag and released the memory upon
+     * tag destruction. To prevent a memory leak without maintaining
+     * that pointer, the memory needs to be released here.
+     */
+    attr_destroy(attribs);
+
+    /*
+    * if there is a timeout, then loop until we get
+    * an error or we timeout.
+    */
+    if(timeout) {
+        int64_t timeout_time = timeout + time_ms();
+        int64_t start_time = time_ms();
+
+        /* the tickler thread can see the tag as soon as it has IO in flight. */
+        critical_block(tag->api_mutex) {
+            /* get the tag status. */
+            rc = tag->vtable->status(tag);
+
+            while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
+                /* give some time to the tickler function. */
+                if(tag->vtable->tickler) {
+                    tag->vtable->tickler(tag);
+                }
+
+                rc = tag->vtable->status(tag);
+
+                /*
+                 * terminate early and do not wait again if the
+                 * IO is done.
+                 */
+                if(rc != PLCTAG_STATUS_PENDING) {
+                    break;
+                }
+
+                tag_wait_event(tag, timeout_time);
+            }
+
+            /*
+             * if we dropped out of the while loop but the status is
+             * still pending, then we timed out.
+             *
+             * Abort the operation and set the status to show the timeout.
+             */
+            if(rc == PLCTAG_STATUS_PENDING) {
+                pdebug(DEBUG_WARN,"Timeout waiting for tag to be ready!");
+                tag->vtable->abort(tag);
+                rc = PLCTAG_ERR_TIMEOUT;
+            }
+        }
+
+        /* check to see if there was an error during tag creation. */
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Error %s while trying to create tag!", plc_tag_decode_error(rc));
+            rc_dec(tag);
+            return rc;
+        }
+
+        pdebug(DEBUG_INFO,"tag set up elapsed time %ldms",(time_ms()-start_time));
+    }
+
+    /* map the tag to a tag ID */
+    id = add_tag_lookup(tag);
+
+    /* if the mapping failed, then punt */
+    if(id < 0) {
+        pdebug(DEBUG_ERROR, "Unable to map tag %p to lookup table entry, rc=%s", tag, plc_tag_decode_error(id));
+        rc_dec(tag);
+        return id;
+    }
+
+    /* save this for later. */
+    tag->tag_id = id;
+
+    debug_set_tag_id(id);
+
+    pdebug(DEBUG_INFO, "Returning mapped tag ID %d", id);
+
+    pdebug(DEBUG_INFO,"Done.");
+
+    return id;
+}
+
+
+
+
+/*
+ * plc_tag_shutdown
+ *
+ * Some systems may not be able to call atexit() handlers.  In those cases, wrappers should
+ * call this function before unloading the library or terminating.   Most OSes will cleanly
+ * recover all system resources when a process is terminated and this will not be necessary.
+ */
+
+LIB_EXPORT void plc_tag_shutdown(void)
+{
+    destroy_modules();
+}
+
+
+/*
+ * plc_tag_register_callback
+ *
+ * This function registers the passed callback function with the tag.  Only one callback function
+ * may be registered on a tag at a time!
+ *
+ * Once registered, any of the following operations on or in the tag will result in the callback
+ * being called:
+ *
+ *      * starting a tag read operation.
+ *      * a tag read operation ending.
+ *      * a tag read being aborted.
+ *      * starting a tag write operation.
+ *      * a tag write operation ending.
+ *      * a tag write being aborted.
+ *      * a tag being destroyed
+ *
+ * The callback is called outside of the internal tag mutex so it can call any tag functions safely.   However,
+ * the callback is called in the context of the internal tag helper thread and not the client library thread(s).
+ * This means that YOU are responsible for making sure that all client application data structures the callback
+ * function touches are safe to access by the callback!
+ *
+ * Do not do any operations in the callback that block for any significant time.   This will cause library
+ * performance to be poor or even to start failing!
+ *
+ * When the callback is called with the PLCTAG_EVENT_DESTROY_STARTED, do not call any tag functions.  It is
+ * not guaranteed that they will work and they will possibly hang or fail.
+ *
+ * Return values:
+ *void (*tag_callback_func)(int32_t tag_id, uint32_t event, int status)
+ * If there is already a callback registered, the function will return PLCTAG_ERR_DUPLICATE.   Only one callback
+ * function may be registered at a time on each tag.
+ *
+ * If all is successful, the function will return PLCTAG_STATUS_OK.
+ */
+
+LIB_EXPORT int plc_tag_register_callback(int32_t tag_id, void (*tag_callback_func)(int32_t tag_id, int event, int status))
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(tag_id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        if(tag->callback) {
+            rc = PLCTAG_ERR_DUPLICATE;
+        } else {
+            rc = PLCTAG_STATUS_OK;
+            tag->callback = tag_callback_func;
+        }
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_unregister_callback
+ *
+ * This function removes the callback already registered on the tag.
+ *
+ * Return values:
+ *
+ * The function returns PLCTAG_STATUS_OK if there was a registered callback and removing it went well.
+ * An error of PLCTAG_ERR_NOT_FOUND is returned if there was no registered callback.
+ */
+
+LIB_EXPORT int plc_tag_unregister_callback(int32_t tag_id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(tag_id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        if(tag->callback) {
+            rc = PLCTAG_STATUS_OK;
+            tag->callback = NULL;
+        } else {
+            rc = PLCTAG_ERR_NOT_FOUND;
+        }
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_register_logger
+ *
+ * This function registers the passed callback function with the library.  Only one callback function
+ * may be registered with the library at a time!
+ *
+ * Once registered, the function will be called with any logging message that is normally printed due 
+ * to the current log level setting.
+ *
+ * WARNING: the callback will usually be called when the internal tag API mutex is held.   You cannot
+ * call any tag functions within the callback!
+ *
+ * Return values:
+ *
+ * If there is already a callback registered, the function will return PLCTAG_ERR_DUPLICATE.   Only one callback
+ * function may be registered at a time on each tag.
+ *
+ * If all is successful, the function will return PLCTAG_STATUS_OK.
+ */
+
+LIB_EXPORT int plc_tag_register_logger(void (*log_callback_func)(int32_t tag_id, int debug_level, const char *message))
+{
+    pdebug(DEBUG_DETAIL, "Starting");
+    return debug_register_logger(log_callback_func);
+}
+
+
+
+/*
+ * plc_tag_unregister_logger
+ *
+ * This function removes the logger callback already registered for the library.
+ *
+ * Return values:
+ *
+ * The function returns PLCTAG_STATUS_OK if there was a registered callback and removing it went well.
+ * An error of PLCTAG_ERR_NOT_FOUND is returned if there was no registered callback.
+ */
+
+LIB_EXPORT int plc_tag_unregister_logger(void)
+{
+    pdebug(DEBUG_DETAIL, "Starting");
+    return debug_unregister_logger();
+}
+
+
+
+/*
+ * plc_tag_lock
+ *
+ * Lock the tag against use by other threads.  Because operations on a tag are
+ * very much asynchronous, actions like getting and extracting the data from
+ * a tag take more than one API call.  If more than one thread is using the same tag,
+ * then the internal state of the tag will get broken and you will probably experience
+ * a crash.
+ *
+ * This should be used to initially lock a tag when starting operations with it
+ * followed by a call to plc_tag_unlock when you have everything you need from the tag.
+ */
+
+LIB_EXPORT int plc_tag_lock(int32_t id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        rc = mutex_lock(tag->ext_mutex);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_unlock
+ *
+ * The opposite action of plc_tag_unlock.  This allows other threads to access the
+ * tag.
+ */
+
+LIB_EXPORT int plc_tag_unlock(int32_t id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        rc = mutex_unlock(tag->ext_mutex);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_borrow_data()
+ *
+ * Lock the tag and hand out a pointer to its data buffer.  The lock and the
+ * reference are kept until plc_tag_release_data().  The borrowed tags are
+ * tracked per thread so the release does not need the tag ID to still be
+ * mapped.  A destroy of the tag will block until the data is released.
+ */
+
+LIB_EXPORT int plc_tag_borrow_data(int32_t id, const uint8_t **data, int *size)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!data || !size) {
+        pdebug(DEBUG_WARN, "Null data or size pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    tag = lookup_tag(id);
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    /* the API mutex is not recursive, so borrowing twice would deadlock. */
+    for(plc_tag_p borrowed = borrowed_tags; borrowed; borrowed = borrowed->borrow_next) {
+        if(borrowed == tag) {
+            pdebug(DEBUG_WARN, "Tag data is already borrowed by this thread!");
+            rc_dec(tag);
+            return PLCTAG_ERR_BUSY;
+        }
+    }
+
+    rc = mutex_lock(tag->api_mutex);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to lock tag API mutex!");
+        rc_dec(tag);
+        return rc;
+    }
+
+    if(!tag->data) {
+        pdebug(DEBUG_WARN,"Tag has no data!");
+        mutex_unlock(tag->api_mutex);
+        rc_dec(tag);
+        return PLCTAG_ERR_NO_DATA;
+    }
+
+    *data = tag->data;
+    *size = tag->size;
+
+    /* keep the mutex and our reference. */
+    tag->borrow_next = borrowed_tags;
+    borrowed_tags = tag;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+LIB_EXPORT int plc_tag_release_data(int32_t id)
+{
+    plc_tag_p *walker = &borrowed_tags;
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    while(*walker && (*walker)->tag_id != id) {
+        walker = &((*walker)->borrow_next);
+    }
+
+    tag = *walker;
+    if(!tag) {
+        pdebug(DEBUG_WARN, "Tag data is not borrowed by this thread!");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    *walker = tag->borrow_next;
+    tag->borrow_next = NULL;
+
+    mutex_unlock(tag->api_mutex);
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+/*
+ * plc_tag_abort()
+ *
+ * This function calls through the vtable in the passed tag to call
+ * the protocol-specific implementation.
+ *
+ * The implementation must do whatever is necessary to abort any
+ * ongoing IO.
+ *
+ * The status of the operation is returned.
+ */
+
+int plc_tag_abort(int32_t id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* who knows what state the tag data is in.  */
+        tag->read_cache_expire = (uint64_t)0;
+
+        if(!tag->vtable || !tag->vtable->abort) {
+            pdebug(DEBUG_WARN,"Tag does not have a abort function!");
+            rc = PLCTAG_ERR_NOT_IMPLEMENTED;
+        }
+
+        /* this may be synchronous. */
+        rc = tag->vtable->abort(tag);
+    }
+
+    /* a group read must not wait for this tag any more. */
+    group_member_done(tag, PLCTAG_ERR_ABORT);
+
+    if(tag->callback) {
+        tag->callback(id, PLCTAG_EVENT_ABORTED, PLCTAG_STATUS_OK);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_destroy()
+ *
+ * Remove all implementation specific details about a tag and clear its
+ * memory.
+ */
+
+
+LIB_EXPORT int plc_tag_destroy(int32_t tag_id)
+{
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(tag_id <= 0 || tag_id > TAG_ID_MASK) {
+        pdebug(DEBUG_WARN, "Called with zero or invalid tag!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    tag = remove_tag_lookup(tag_id);
+
+    if(!tag) {
+        pdebug(DEBUG_WARN, "Called with non-existent tag!");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    /* no more periodic reads. */
+    unsubscribe_tag(tag);
+
+    /* abort anything in flight */
+    pdebug(DEBUG_DETAIL, "Aborting any in-flight operations.");
+
+    critical_block(tag->api_mutex) {
+        if(!tag->vtable || !tag->vtable->abort) {
+            pdebug(DEBUG_WARN,"Tag does not have a abort function!");
+        }
+
+        /* Force a clean up. */
+        tag->vtable->abort(tag);
+    }
+
+    group_member_done(tag, PLCTAG_ERR_ABORT);
+
+    if(tag->callback) {
+        tag->callback(tag_id, PLCTAG_EVENT_DESTROYED, PLCTAG_STATUS_OK);
+    }
+
+    /* release the reference outside the mutex. */
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    debug_set_tag_id(0);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+/*
+ * plc_tag_read()
+ *
+ * This function calls through the vtable in the passed tag to call
+ * the protocol-specific implementation.  That starts the read operation.
+ * If there is a timeout passed, then this routine waits for either
+ * a timeout or an error.
+ *
+ * The status of the operation is returned.
+ */
+
+LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int data_changed = 0;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    if(tag->callback) {
+        tag->callback(id, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+    }
+
+    critical_block(tag->api_mutex) {
+        /* check read cache, if not expired, return existing data. */
+        if(tag->read_cache_expire > time_ms()) {
+            pdebug(DEBUG_INFO, "Returning cached data.");
+            rc = PLCTAG_STATUS_OK;
+            break;
+        }
+
+        /* the protocol implementation does not do the timeout, but it can drop requests nobody waits for. */
+        tag->op_deadline = (timeout > 0 ? time_ms() + timeout : 0);
+        tag->op_start_us = time_us();
+        trace_point(TRACE_READ_START, id, 0, timeout);
+
+        rc = tag->vtable->read(tag);
+
+        /* if error, return now */
+        if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        /* set up the cache time.  This works when read_cache_ms is zero as it is already expired. */
+        tag->read_cache_expire = time_ms() + tag->read_cache_ms;
+
+        /*
+         * if there is a timeout, then loop until we get
+         * an error or we timeout.
+         */
+        if(timeout) {
+            int64_t timeout_time = timeout + time_ms();
+            int64_t start_time = time_ms();
+
+            while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
+                /* give some time to the tickler function. */
+                if(tag->vtable->tickler) {
+                    tag->vtable->tickler(tag);
+                }
+
+                rc = tag->vtable->status(tag);
+
+                /*
+                 * terminate early and do not wait again if the
+                 * IO is done.
+                 */
+                if(rc != PLCTAG_STATUS_PENDING) {
+                    break;
+                }
+
+                tag_wait_event(tag, timeout_time);
+            }
+
+            /*
+             * if we dropped out of the while loop but the status is
+             * still pending, then we timed out.
+             *
+             * Abort the operation and set the status to show the timeout.
+             */
+            if(rc != PLCTAG_STATUS_OK) {
+                /* abort the request. */
+                if(tag->vtable->abort) {
+                    tag->vtable->abort(tag);
+                }
+
+                /* translate error if we are still pending. */
+                if(rc == PLCTAG_STATUS_PENDING) {
+                    pdebug(DEBUG_WARN, "Read operation timed out.");
+                    rc = PLCTAG_ERR_TIMEOUT;
+                }
+            }
+
+            /* don't trigger the callback twice. */
+            if(tag->read_complete) {
+                tag->read_complete = 0;
+            }
+
+            record_op_latency(tag, PLCTAG_LATENCY_READ, rc);
+            trace_point(TRACE_READ_DONE, id, 0, rc);
+
+            if(rc == PLCTAG_STATUS_OK && tag->detect_changes) {
+                data_changed = check_data_changed(tag);
+            }
+
+            pdebug(DEBUG_INFO,"elapsed time %ldms",(time_ms()-start_time));
+        }
+    } /* end of api mutex block */
+
+    if(tag->callback) {
+        if(timeout) {
+            tag->callback(id, PLCTAG_EVENT_READ_COMPLETED, rc);
+        }
+
+        if(data_changed) {
+            tag->callback(id, PLCTAG_EVENT_DATA_CHANGED, PLCTAG_STATUS_OK);
+        }
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return rc;
+}
+
+
+
+
+
+
+/*
+ * plc_tag_status
+ *
+ * Return the current status of the tag.  This will be PLCTAG_STATUS_PENDING if there is
+ * an uncompleted IO operation.  It will be PLCTAG_STATUS_OK if everything is fine.  Other
+ * errors will be returned as appropriate.
+ *
+ * This is a function provided by the underlying protocol implementation.
+ */
+
+
+int plc_tag_status(int32_t id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        if(tag && tag->vtable->tickler) {
+            tag->vtable->tickler(tag);
+        }
+
+        rc = tag->vtable->status(tag);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_SPEW, "Done with rc=%s.", plc_tag_decode_error(rc));
+
+    return rc;
+}
+
+
+
+
+
+/*
+ * plc_tag_write()
+ *
+ * This function calls through the vtable in the passed tag to call
+ * the protocol-specific implementation.  That starts the write operation.
+ * If there is a timeout passed, then this routine waits for either
+ * a timeout or an error.
+ *
+ * The status of the operation is returned.
+ */
+
+LIB_EXPORT int plc_tag_write(int32_t id, int timeout)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    if(tag->callback) {
+        tag->callback(id, PLCTAG_EVENT_WRITE_STARTED, PLCTAG_STATUS_OK);
+    }
+
+    critical_block(tag->api_mutex) {
+        /* the protocol implementation does not do the timeout, but it can drop requests nobody waits for. */
+        tag->op_deadline = (timeout > 0 ? time_ms() + timeout : 0);
+        tag->op_start_us = time_us();
+        trace_point(TRACE_WRITE_START, id, 0, timeout);
+
+        rc = tag->vtable->write(tag);
+
+        /* if error, return now */
+        if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN,"Response from write command is not OK!");
+            break;
+        }
+
+        /*
+         * if there is a timeout, then loop until we get
+         * an error or we timeout.
+         */
+        if(timeout) {
+            int64_t start_time = time_ms();
+            int64_t timeout_time = timeout + start_time;
+
+            while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
+                /* give some time to the tickler function. */
+                if(tag->vtable->tickler) {
+                    tag->vtable->tickler(tag);
+                }
+
+                rc = tag->vtable->status(tag);
+
+                /*
+                 * terminate early and do not wait again if the
+                 * IO is done.
+                 */
+                if(rc != PLCTAG_STATUS_PENDING) {
+                    break;
+                }
+
+                tag_wait_event(tag, timeout_time);
+            }
+
+            /*
+             * if we dropped out of the while loop but the status is
+             * still pending, then we timed out.
+             *
+             * Abort the operation and set the status to show the timeout.
+             */
+            if(rc != PLCTAG_STATUS_OK) {
+                /* abort the request. */
+                if(tag->vtable->abort) {
                     tag->vtable->abort(tag);
                 }
 
-                /* translate error if we are still pending. */
-                if(rc == PLCTAG_STATUS_PENDING) {
-                    pdebug(DEBUG_WARN, "Read operation timed out.");
-                    rc = PLCTAG_ERR_TIMEOUT;
+                /* translate error if we are still pending. */
+                if(rc == PLCTAG_STATUS_PENDING) {
+                    pdebug(DEBUG_WARN, "Write operation timed out.");
+                    rc = PLCTAG_ERR_TIMEOUT;
+                }
+            }
+
+            /* don't trigger the callback twice. */
+            if(tag->write_complete) {
+                tag->write_complete = 0;
+            }
+
+            record_op_latency(tag, PLCTAG_LATENCY_WRITE, rc);
+            trace_point(TRACE_WRITE_DONE, id, 0, rc);
+
+            pdebug(DEBUG_INFO,"elapsed time %lldms",(time_ms()-start_time));
+        }
+    } /* end of api mutex block */
+
+    if(tag->callback) {
+        if(timeout) {
+            tag->callback(id, PLCTAG_EVENT_WRITE_COMPLETED, rc);
+        }
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_subscribe
+ *
+ * Read the tag every rpi_ms from the tickler thread.  Subscribing again just
+ * changes the RPI.
+ */
+
+LIB_EXPORT int plc_tag_subscribe(int32_t id, int rpi_ms)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(rpi_ms <= 0) {
+        pdebug(DEBUG_WARN, "RPI must be positive!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    tag = lookup_tag(id);
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    if(!tag->vtable || !tag->vtable->read) {
+        pdebug(DEBUG_WARN, "Tag does not support reading!");
+        rc_dec(tag);
+        return PLCTAG_ERR_NOT_IMPLEMENTED;
+    }
+
+    critical_block(subscribe_mutex) {
+        struct tag_slot_t *slot = get_tag_slot(id);
+        int64_t now = time_ms();
+
+        /* plc_tag_destroy unsubscribes after taking the tag out of the lookup table. */
+        if(!slot || slot->tag_id != id) {
+            pdebug(DEBUG_WARN, "Tag is being destroyed.");
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
+
+        if(tag->subscribe_in_wheel) {
+            subscribe_remove_unsafe(tag);
+        } else {
+            /* the wheel keeps its own reference. */
+            rc_inc(tag);
+        }
+
+        tag->subscribe_rpi_ms = rpi_ms;
+
+        /* line up on a multiple of the RPI so that tags with the same RPI are read together. */
+        tag->subscribe_due = ((now / rpi_ms) + 1) * rpi_ms;
+
+        subscribe_insert_unsafe(tag);
+    }
+
+    /* the tickler may be sleeping longer than the first tick. */
+    if(rc == PLCTAG_STATUS_OK) {
+        cond_signal(tag_tickler_wait);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * plc_tag_unsubscribe
+ *
+ * Stop the periodic reads of the tag.
+ */
+
+LIB_EXPORT int plc_tag_unsubscribe(int32_t id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    rc = unsubscribe_tag(tag);
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_group_create
+ *
+ * Create an empty tag group.  Returns the group ID or an error.
+ */
+
+LIB_EXPORT int32_t plc_tag_group_create(void)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_group_p group = NULL;
+    int32_t group_id = 0;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if((rc = initialize_modules()) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR,"Unable to initialize the internal library state!");
+        return rc;
+    }
+
+    group = (plc_tag_group_p)rc_alloc((int)sizeof(struct plc_tag_group_t), group_destroy);
+    if(!group) {
+        pdebug(DEBUG_ERROR, "Unable to allocate tag group!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    rc = cond_create(&group->done_wait);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag group condition variable!");
+        rc_dec(group);
+        return rc;
+    }
+
+    critical_block(group_mutex) {
+        /* IDs are positive and not reused until the counter wraps. */
+        do {
+            next_group_id = (next_group_id < INT32_MAX ? next_group_id + 1 : 1);
+        } while(find_group_unsafe(next_group_id));
+
+        group->group_id = next_group_id;
+
+        rc = vector_put(tag_groups, vector_length(tag_groups), group);
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to add tag group to the group list!");
+        rc_dec(group);
+        return rc;
+    }
+
+    group_id = group->group_id;
+
+    pdebug(DEBUG_INFO, "Done, created group %d.", group_id);
+
+    return group_id;
+}
+
+
+
+/*
+ * plc_tag_group_destroy
+ *
+ * Remove the group.  The member tags are not touched other than being
+ * taken out of the group.  A read in progress is not aborted.
+ */
+
+LIB_EXPORT int plc_tag_group_destroy(int32_t group_id)
+{
+    plc_tag_group_p group = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!group_mutex) {
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(group_mutex) {
+        for(int i=0; i < vector_length(tag_groups); i++) {
+            plc_tag_group_p entry = vector_get(tag_groups, i);
+
+            if(entry->group_id == group_id) {
+                group = vector_remove(tag_groups, i);
+                break;
+            }
+        }
+
+        /* nobody can complete the read now. */
+        if(group) {
+            group->read_pending = 0;
+        }
+    }
+
+    if(!group) {
+        pdebug(DEBUG_WARN, "Group not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    for(int i=0; i < group->num_tags; i++) {
+        plc_tag_p tag = lookup_tag(group->tag_ids[i]);
+
+        if(tag) {
+            critical_block(group_mutex) {
+                if(tag->group_id == group_id) {
+                    tag->group_id = 0;
+                    tag->group_read_pending = 0;
+                }
+            }
+
+            rc_dec(tag);
+        }
+    }
+
+    /* wake up anyone waiting on a read. */
+    cond_signal(group->done_wait);
+
+    rc_dec(group);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * plc_tag_group_add
+ *
+ * Add a tag to a group.  A tag can only be in one group.
+ */
+
+LIB_EXPORT int plc_tag_group_add(int32_t group_id, int32_t tag_id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_group_p group = NULL;
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    group = lookup_group(group_id);
+    if(!group) {
+        pdebug(DEBUG_WARN, "Group not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    tag = lookup_tag(tag_id);
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        rc_dec(group);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    if(!tag->vtable || !tag->vtable->read) {
+        pdebug(DEBUG_WARN, "Tag does not support reading!");
+        rc_dec(tag);
+        rc_dec(group);
+        return PLCTAG_ERR_NOT_IMPLEMENTED;
+    }
+
+    critical_block(group_mutex) {
+        if(tag->group_id == group_id) {
+            pdebug(DEBUG_DETAIL, "Tag is already in the group.");
+            break;
+        }
+
+        if(tag->group_id) {
+            pdebug(DEBUG_WARN, "Tag is already in group %d!", tag->group_id);
+            rc = PLCTAG_ERR_DUPLICATE;
+            break;
+        }
+
+        if(group->read_pending) {
+            pdebug(DEBUG_WARN, "Group read in progress!");
+            rc = PLCTAG_ERR_BUSY;
+            break;
+        }
+
+        if(group->num_tags >= group->tag_capacity) {
+            int new_capacity = (group->tag_capacity ? group->tag_capacity * 2 : 8);
+            int32_t *new_tag_ids = mem_realloc(group->tag_ids, (int)(sizeof(int32_t) * (size_t)new_capacity));
+
+            if(!new_tag_ids) {
+                pdebug(DEBUG_ERROR, "Unable to grow group member list!");
+                rc = PLCTAG_ERR_NO_MEM;
+                break;
+            }
+
+            group->tag_ids = new_tag_ids;
+            group->tag_capacity = new_capacity;
+        }
+
+        group->tag_ids[group->num_tags++] = tag_id;
+        tag->group_id = group_id;
+    }
+
+    rc_dec(tag);
+    rc_dec(group);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * plc_tag_group_read
+ *
+ * Start the reads of all the tags in the group.  The group is held while
+ * the reads are queued so that the IO threads see all of them at once and
+ * pack them together.  If there is a timeout, wait for all of them.
+ */
+
+LIB_EXPORT int plc_tag_group_read(int32_t group_id, int timeout)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_group_p group = NULL;
+    plc_tag_group_hold_p hold = NULL;
+    int32_t *tag_ids = NULL;
+    int num_tags = 0;
+    int64_t deadline = 0;
+    int done = 0;
+    int timed_out = 0;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    group = lookup_group(group_id);
+    if(!group) {
+        pdebug(DEBUG_WARN, "Group not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    hold = group_hold_create();
+    if(!hold) {
+        rc_dec(group);
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    critical_block(group_mutex) {
+        if(group->read_pending) {
+            pdebug(DEBUG_WARN, "Group read already in progress!");
+            rc = PLCTAG_ERR_BUSY;
+            break;
+        }
+
+        num_tags = group->num_tags;
+
+        if(num_tags) {
+            tag_ids = mem_alloc((int)(sizeof(int32_t) * (size_t)num_tags));
+            if(!tag_ids) {
+                pdebug(DEBUG_ERROR, "Unable to allocate group member list!");
+                rc = PLCTAG_ERR_NO_MEM;
+                break;
+            }
+
+            mem_copy(tag_ids, group->tag_ids, (int)(sizeof(int32_t) * (size_t)num_tags));
+        }
+
+        /* the extra count keeps the read from finishing before every member is started. */
+        group->read_pending = 1;
+        group->status = PLCTAG_STATUS_OK;
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        group_hold_release(hold);
+        rc_dec(hold);
+        rc_dec(group);
+        return rc;
+    }
+
+    cond_clear(group->done_wait);
+
+    if(group->callback) {
+        group->callback(group_id, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+    }
+
+    /* all members share the deadline so that they stay together in the queue. */
+    deadline = (timeout > 0 ? time_ms() + timeout : 0);
+
+    for(int i=0; i < num_tags; i++) {
+        plc_tag_p tag = lookup_tag(tag_ids[i]);
+        int read_rc = PLCTAG_STATUS_OK;
+
+        if(!tag) {
+            pdebug(DEBUG_DETAIL, "Tag %d in the group no longer exists.", tag_ids[i]);
+            continue;
+        }
+
+        if(tag->callback) {
+            tag->callback(tag->tag_id, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+        }
+
+        critical_block(tag->api_mutex) {
+            tag->op_deadline = deadline;
+            tag->op_start_us = time_us();
+            trace_point(TRACE_READ_START, tag->tag_id, 0, timeout);
+
+            /* the requests queued by the read are held until every member's read is queued. */
+            tag->group_hold = hold;
+
+            read_rc = tag->vtable->read(tag);
+
+            tag->group_hold = NULL;
+
+            if(read_rc == PLCTAG_STATUS_PENDING) {
+                /* the tickler cannot see the read finish until the API mutex is released. */
+                critical_block(group_mutex) {
+                    tag->group_read_pending = 1;
+                    group->read_pending++;
+                }
+            }
+
+            if(read_rc == PLCTAG_STATUS_PENDING || read_rc == PLCTAG_STATUS_OK) {
+                tag->read_cache_expire = time_ms() + tag->read_cache_ms;
+            }
+        }
+
+        if(read_rc != PLCTAG_STATUS_PENDING && read_rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to start read of tag %d, %s!", tag->tag_id, plc_tag_decode_error(read_rc));
+
+            critical_block(group_mutex) {
+                if(group->status == PLCTAG_STATUS_OK) {
+                    group->status = read_rc;
                 }
             }
+        }
 
-            /* don't trigger the callback twice. */
-            if(tag->read_complete) {
-                tag->read_complete = 0;
+        rc_dec(tag);
+    }
+
+    /* everything is queued, let the IO threads send it. */
+    group_hold_release(hold);
+    rc_dec(hold);
+
+    critical_block(group_mutex) {
+        group->read_pending--;
+        done = !group->read_pending;
+    }
+
+    if(done) {
+        group_read_done(group);
+    }
+
+    if(timeout) {
+        while(!done && deadline > time_ms()) {
+            cond_wait(group->done_wait, (int)(deadline - time_ms()));
+
+            critical_block(group_mutex) {
+                done = !group->read_pending;
             }
+        }
 
-            pdebug(DEBUG_INFO,"elapsed time %ldms",(time_ms()-start_time));
+        if(!done) {
+            critical_block(group_mutex) {
+                /* the last member may have finished just now. */
+                if(group->read_pending) {
+                    group->read_pending = 0;
+                    group->status = PLCTAG_ERR_TIMEOUT;
+                    timed_out = 1;
+                }
+            }
         }
-    } /* end of api mutex block */
 
-    if(tag->callback) {
-        if(timeout) {
-            tag->callback(id, PLCTAG_EVENT_READ_COMPLETED, rc);
+        if(timed_out) {
+            pdebug(DEBUG_WARN, "Group read timed out.");
+
+            for(int i=0; i < num_tags; i++) {
+                plc_tag_p tag = lookup_tag(tag_ids[i]);
+                int still_pending = 0;
+
+                if(!tag) {
+                    continue;
+                }
+
+                critical_block(group_mutex) {
+                    still_pending = tag->group_read_pending;
+                    tag->group_read_pending = 0;
+                }
+
+                if(still_pending) {
+                    critical_block(tag->api_mutex) {
+                        tag->read_cache_expire = 0;
+                        tag->vtable->abort(tag);
+                    }
+                }
+
+                rc_dec(tag);
+            }
+
+            group_read_done(group);
+        }
+
+        critical_block(group_mutex) {
+            rc = group->status;
+        }
+    } else {
+        critical_block(group_mutex) {
+            rc = (group->read_pending ? PLCTAG_STATUS_PENDING : group->status);
         }
     }
 
-    rc_dec(tag);
+    if(tag_ids) {
+        mem_free(tag_ids);
+    }
 
-    pdebug(DEBUG_INFO, "Done");
+    rc_dec(group);
+
+    pdebug(DEBUG_INFO, "Done.");
 
     return rc;
 }
 
 
 
+/*
+ * plc_tag_group_status
+ *
+ * PLCTAG_STATUS_PENDING while a group read is running, otherwise the result
+ * of the last group read.
+ */
+
+LIB_EXPORT int plc_tag_group_status(int32_t group_id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_group_p group = lookup_group(group_id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!group) {
+        pdebug(DEBUG_WARN, "Group not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(group_mutex) {
+        rc = (group->read_pending ? PLCTAG_STATUS_PENDING : group->status);
+    }
+
+    rc_dec(group);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
 
 
 
 /*
- * plc_tag_status
- *
- * Return the current status of the tag.  This will be PLCTAG_STATUS_PENDING if there is
- * an uncompleted IO operation.  It will be PLCTAG_STATUS_OK if everything is fine.  Other
- * errors will be returned as appropriate.
+ * plc_tag_group_register_callback
  *
- * This is a function provided by the underlying protocol implementation.
+ * Set the callback for group events.  Only one callback may be registered.
+ * Passing NULL removes the callback.
  */
 
-
-int plc_tag_status(int32_t id)
+LIB_EXPORT int plc_tag_group_register_callback(int32_t group_id, void (*group_callback_func)(int32_t group_id, int event, int status))
 {
     int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
+    plc_tag_group_p group = lookup_group(group_id);
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    pdebug(DEBUG_INFO, "Starting.");
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
+    if(!group) {
+        pdebug(DEBUG_WARN, "Group not found.");
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
-        if(tag && tag->vtable->tickler) {
-            tag->vtable->tickler(tag);
+    critical_block(group_mutex) {
+        if(group->callback && group_callback_func) {
+            rc = PLCTAG_ERR_DUPLICATE;
+        } else {
+            group->callback = group_callback_func;
         }
-
-        rc = tag->vtable->status(tag);
     }
 
-    rc_dec(tag);
+    rc_dec(group);
 
-    pdebug(DEBUG_SPEW, "Done with rc=%s.", plc_tag_decode_error(rc));
+    pdebug(DEBUG_INFO, "Done.");
 
     return rc;
 }
@@ -1110,108 +2928,173 @@ int plc_tag_status(int32_t id)
 
 
 /*
- * plc_tag_write()
+ * plc_tag_get_latency
  *
- * This function calls through the vtable in the passed tag to call
- * the protocol-specific implementation.  That starts the write operation.
- * If there is a timeout passed, then this routine waits for either
- * a timeout or an error.
+ * Return the latency in microseconds at the percentile of one of the
+ * histograms.
+ */
+
+LIB_EXPORT int64_t plc_tag_get_latency(int which, double percentile)
+{
+    if(which < 0 || which >= NUM_LATENCY_HISTOGRAMS) {
+        pdebug(DEBUG_WARN, "Unknown latency histogram %d!", which);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    return histogram_percentile(&latency_histograms[which], percentile);
+}
+
+
+
+/*
+ * plc_tag_dump_latency
  *
- * The status of the operation is returned.
+ * Write a line with the count and percentiles of each histogram into the
+ * buffer.  The text is always zero terminated.
  */
 
-LIB_EXPORT int plc_tag_write(int32_t id, int timeout)
+LIB_EXPORT int plc_tag_dump_latency(char *buffer, int buffer_size)
 {
-    int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
+    const char *names[NUM_LATENCY_HISTOGRAMS] = { "queue_wait", "round_trip", "read", "write" };
+    int used = 0;
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    pdebug(DEBUG_INFO, "Starting.");
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
+    if(!buffer) {
+        pdebug(DEBUG_WARN, "Null buffer pointer!");
+        return PLCTAG_ERR_NULL_PTR;
     }
 
-    if(tag->callback) {
-        tag->callback(id, PLCTAG_EVENT_WRITE_STARTED, PLCTAG_STATUS_OK);
+    if(buffer_size < 1) {
+        pdebug(DEBUG_WARN, "Buffer size must be positive!");
+        return PLCTAG_ERR_TOO_SMALL;
     }
 
-    critical_block(tag->api_mutex) {
-        /* the protocol implementation does not do the timeout. */
-        rc = tag->vtable->write(tag);
+    buffer[0] = 0;
+
+    for(int i=0; i < NUM_LATENCY_HISTOGRAMS; i++) {
+        histogram_t *hist = &latency_histograms[i];
+        int64_t count = histogram_count(hist);
+        char line[200];
+        int len = 0;
+
+        /* format into a line that is always big enough, sprintf_s does not truncate. */
+        if(count > 0) {
+            len = snprintf_platform(line, sizeof(line), "%s count=%" PRId64 " p50=%" PRId64 "us p99=%" PRId64 "us p999=%" PRId64 "us\n",
+                                    names[i], count,
+                                    histogram_percentile(hist, 50.0),
+                                    histogram_percentile(hist, 99.0),
+                                    histogram_percentile(hist, 99.9));
+        } else {
+            len = snprintf_platform(line, sizeof(line), "%s count=0\n", names[i]);
+        }
 
-        /* if error, return now */
-        if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Response from write command is not OK!");
-            break;
+        if(len < 0 || len >= buffer_size - used) {
+            pdebug(DEBUG_WARN, "Buffer of %d bytes is too small!", buffer_size);
+            return PLCTAG_ERR_TOO_SMALL;
         }
 
-        /*
-         * if there is a timeout, then loop until we get
-         * an error or we timeout.
-         */
-        if(timeout) {
-            int64_t start_time = time_ms();
-            int64_t timeout_time = timeout + start_time;
+        mem_copy(buffer + used, line, len + 1);
+        used += len;
+    }
 
-            while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
-                /* give some time to the tickler function. */
-                if(tag->vtable->tickler) {
-                    tag->vtable->tickler(tag);
-                }
+    pdebug(DEBUG_INFO, "Done.");
 
-                rc = tag->vtable->status(tag);
+    return used;
+}
 
-                /*
-                 * terminate early and do not wait again if the
-                 * IO is done.
-                 */
-                if(rc != PLCTAG_STATUS_PENDING) {
-                    break;
-                }
 
-                sleep_ms(1); /* MAGIC */
-            }
 
-            /*
-             * if we dropped out of the while loop but the status is
-             * still pending, then we timed out.
-             *
-             * Abort the operation and set the status to show the timeout.
-             */
-            if(rc != PLCTAG_STATUS_OK) {
-                /* abort the request. */
-                if(tag->vtable->abort) {
-                    tag->vtable->abort(tag);
-                }
+/*
+ * plc_tag_reset_latency
+ *
+ * Clear all the library-wide histograms.  The per-connection histograms
+ * are not changed.
+ */
 
-                /* translate error if we are still pending. */
-                if(rc == PLCTAG_STATUS_PENDING) {
-                    pdebug(DEBUG_WARN, "Write operation timed out.");
-                    rc = PLCTAG_ERR_TIMEOUT;
-                }
-            }
+LIB_EXPORT int plc_tag_reset_latency(void)
+{
+    for(int i=0; i < NUM_LATENCY_HISTOGRAMS; i++) {
+        histogram_reset(&latency_histograms[i]);
+    }
 
-            /* don't trigger the callback twice. */
-            if(tag->write_complete) {
-                tag->write_complete = 0;
-            }
+    return PLCTAG_STATUS_OK;
+}
 
-            pdebug(DEBUG_INFO,"elapsed time %lldms",(time_ms()-start_time));
-        }
-    } /* end of api mutex block */
 
-    if(tag->callback) {
-        if(timeout) {
-            tag->callback(id, PLCTAG_EVENT_WRITE_COMPLETED, rc);
-        }
+
+/*
+ * plc_tag_dump_trace
+ *
+ * Write the binary trace records of all threads to the file.
+ */
+
+LIB_EXPORT int plc_tag_dump_trace(const char *file_name)
+{
+    return trace_dump(file_name);
+}
+
+
+
+/*
+ * plc_tag_start_capture
+ *
+ * Start writing the frames sent to and received from PLCs to a pcap file.
+ */
+
+LIB_EXPORT int plc_tag_start_capture(const char *file_name)
+{
+    return capture_start(file_name);
+}
+
+
+
+/*
+ * plc_tag_stop_capture
+ *
+ * Write out the remaining frames and close the capture file.
+ */
+
+LIB_EXPORT int plc_tag_stop_capture(void)
+{
+    return capture_stop();
+}
+
+
+
+/*
+ * plc_tag_record_latency
+ *
+ * Called by the protocol code to add a sample to a library-wide histogram.
+ */
+
+void plc_tag_record_latency(int which, int64_t usec)
+{
+    if(which < 0 || which >= NUM_LATENCY_HISTOGRAMS) {
+        return;
     }
 
-    rc_dec(tag);
+    histogram_record(&latency_histograms[which], usec);
+}
+
+
+
+/*
+ * record_op_latency
+ *
+ * Add the time since the read or write of the tag started to the
+ * histogram if the operation succeeded.  Must be called with the API mutex
+ * held.  Operations the library did not start, like the first read of an
+ * AB tag, have no start time and are not counted.
+ */
 
-    pdebug(DEBUG_INFO, "Done");
+void record_op_latency(plc_tag_p tag, int which, int status)
+{
+    if(tag->op_start_us && status == PLCTAG_STATUS_OK) {
+        plc_tag_record_latency(which, time_us() - tag->op_start_us);
+    }
 
-    return rc;
+    tag->op_start_us = 0;
 }
 
 
@@ -1242,6 +3125,12 @@ LIB_EXPORT int plc_tag_get_int_attribute(int32_t id, const char *attrib_name, in
             res = (int)version_patch;
         } else if(str_cmp_i(attrib_name, "debug_level") == 0) {
             res = (int)get_debug_level();
+        } else if(str_cmp_i(attrib_name, "trace") == 0) {
+            res = trace_enabled;
+        } else if(str_cmp_i(attrib_name, "reactor_threads") == 0) {
+            if(initialize_modules() == PLCTAG_STATUS_OK) {
+                res = reactor_get_num_threads();
+            }
         }
     } else {
         tag = lookup_tag(id);
@@ -1258,6 +3147,12 @@ LIB_EXPORT int plc_tag_get_int_attribute(int32_t id, const char *attrib_name, in
             } else if(str_cmp_i(attrib_name, "read_cache_ms") == 0) {
                 /* FIXME - what happens if this overflows? */
                 res = (int)tag->read_cache_ms;
+            } else if(str_cmp_i(attrib_name, "detect_changes") == 0) {
+                res = tag->detect_changes;
+            } else if(str_cmp_i(attrib_name, "changed_offset") == 0) {
+                res = tag->changed_offset;
+            } else if(str_cmp_i(attrib_name, "changed_size") == 0) {
+                res = tag->changed_size;
             } else  {
                 if(tag->vtable->get_int_attrib) {
                     res = tag->vtable->get_int_attrib(tag, attrib_name, default_value);
@@ -1292,6 +3187,13 @@ LIB_EXPORT int plc_tag_set_int_attribute(int32_t id, const char *attrib_name, in
             } else {
                 res = PLCTAG_ERR_OUT_OF_BOUNDS;
             }
+        } else if(str_cmp_i(attrib_name, "trace") == 0) {
+            res = trace_set_enabled(new_value);
+        } else if(str_cmp_i(attrib_name, "reactor_threads") == 0) {
+            /* the pool is set up with the library. */
+            if((res = initialize_modules()) == PLCTAG_STATUS_OK) {
+                res = reactor_set_num_threads(new_value);
+            }
         }
     } else {
         tag = lookup_tag(id);
@@ -1312,6 +3214,20 @@ LIB_EXPORT int plc_tag_set_int_attribute(int32_t id, const char *attrib_name, in
                 } else {
                     res = PLCTAG_ERR_OUT_OF_BOUNDS;
                 }
+            } else if(str_cmp_i(attrib_name, "detect_changes") == 0) {
+                if(new_value == 0 || new_value == 1) {
+                    /* start over, the next read reports everything as changed. */
+                    if(tag->prev_data) {
+                        mem_free(tag->prev_data);
+                        tag->prev_data = NULL;
+                    }
+
+                    tag->prev_size = 0;
+                    tag->detect_changes = new_value;
+                    res = PLCTAG_STATUS_OK;
+                } else {
+                    res = PLCTAG_ERR_OUT_OF_BOUNDS;
+                }
             } else {
                 if(tag->vtable->set_int_attrib) {
                     res = tag->vtable->set_int_attrib(tag, attrib_name, new_value);
@@ -1818,255 +3734,549 @@ LIB_EXPORT uint8_t plc_tag_get_uint8(int32_t id, int offset)
         res = tag->vtable->get_uint8(tag, offset);
     }
 
-    rc_dec(tag);
+    rc_dec(tag);
+
+    return res;
+}
+
+
+
+
+LIB_EXPORT int plc_tag_set_uint8(int32_t id, int offset, uint8_t val)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* is there a function? */
+        if(!tag->vtable->set_uint8) {
+            pdebug(DEBUG_WARN,"Tag does not support set uint8 operation!");
+            rc = PLCTAG_ERR_UNSUPPORTED;
+            break;
+        }
+
+        rc = tag->vtable->set_uint8(tag, offset, val);
+    }
+
+    rc_dec(tag);
+
+    return rc;
+}
+
+
+
+
+
+LIB_EXPORT int8_t plc_tag_get_int8(int32_t id, int offset)
+{
+    int8_t res = INT8_MIN;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return res;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* is there a function? */
+        if(!tag->vtable->get_int8) {
+            pdebug(DEBUG_WARN,"Tag does not support get int8 operation!");
+            break;
+        }
+
+        res = tag->vtable->get_int8(tag, offset);
+    }
+
+    rc_dec(tag);
+
+    return res;
+}
+
+
+
+
+LIB_EXPORT int plc_tag_set_int8(int32_t id, int offset, int8_t val)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* is there a function? */
+        if(!tag->vtable->set_int8) {
+            pdebug(DEBUG_WARN,"Tag does not support set int8 operation!");
+            rc = PLCTAG_ERR_UNSUPPORTED;
+            break;
+        }
+
+        rc = tag->vtable->set_int8(tag, offset, val);
+    }
+
+    rc_dec(tag);
+
+    return rc;
+}
+
+
+
+
+
+
+LIB_EXPORT double plc_tag_get_float64(int32_t id, int offset)
+{
+    double res = DBL_MAX;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return res;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* is there a function? */
+        if(!tag->vtable->get_float64) {
+            pdebug(DEBUG_WARN,"Tag does not support get float64 operation!");
+            break;
+        }
+
+        res = tag->vtable->get_float64(tag, offset);
+    }
+
+    rc_dec(tag);
+
+    return res;
+}
+
+
+
+
+LIB_EXPORT int plc_tag_set_float64(int32_t id, int offset, double val)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* is there a function? */
+        if(!tag->vtable->set_float64) {
+            pdebug(DEBUG_WARN,"Tag does not support set float64 operation!");
+            rc = PLCTAG_ERR_UNSUPPORTED;
+            break;
+        }
+
+        rc = tag->vtable->set_float64(tag, offset, val);
+    }
+
+    rc_dec(tag);
+
+    return rc;
+}
+
+
+
+LIB_EXPORT float plc_tag_get_float32(int32_t id, int offset)
+{
+    float res = FLT_MAX;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return res;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* is there a function? */
+        if(!tag->vtable->get_float32) {
+            pdebug(DEBUG_WARN,"Tag does not support get float32 operation!");
+            break;
+        }
+
+        res = tag->vtable->get_float32(tag, offset);
+    }
+
+    rc_dec(tag);
+
+    return res;
+}
+
+
+
+
+LIB_EXPORT int plc_tag_set_float32(int32_t id, int offset, float val)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag->api_mutex) {
+        /* is there a function? */
+        if(!tag->vtable->set_float32) {
+            pdebug(DEBUG_WARN,"Tag does not support set float32 operation!");
+            rc = PLCTAG_ERR_UNSUPPORTED;
+            break;
+        }
+
+        rc = tag->vtable->set_float32(tag, offset, val);
+    }
+
+    rc_dec(tag);
+
+    return rc;
+}
+
+
+
+/*
+ * Bulk array accessors.
+ *
+ * These do one lookup and take the API mutex once for the whole array.  When
+ * the tag data is in host byte order, this is a single copy.  Otherwise, the
+ * elements are byte swapped in a simple loop that the compiler can vectorize.
+ */
+
+LIB_EXPORT int plc_tag_get_uint64_array(int32_t id, int offset, uint64_t *buffer, int count)
+{
+    return get_array(id, offset, (uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
+
+
+LIB_EXPORT int plc_tag_set_uint64_array(int32_t id, int offset, const uint64_t *buffer, int count)
+{
+    return set_array(id, offset, (const uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
+
+
+
+LIB_EXPORT int plc_tag_get_int64_array(int32_t id, int offset, int64_t *buffer, int count)
+{
+    return get_array(id, offset, (uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
+
+
+LIB_EXPORT int plc_tag_set_int64_array(int32_t id, int offset, const int64_t *buffer, int count)
+{
+    return set_array(id, offset, (const uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
+
 
-    return res;
+
+LIB_EXPORT int plc_tag_get_uint32_array(int32_t id, int offset, uint32_t *buffer, int count)
+{
+    return get_array(id, offset, (uint8_t *)buffer, (int)sizeof(*buffer), count);
 }
 
 
+LIB_EXPORT int plc_tag_set_uint32_array(int32_t id, int offset, const uint32_t *buffer, int count)
+{
+    return set_array(id, offset, (const uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
 
 
-LIB_EXPORT int plc_tag_set_uint8(int32_t id, int offset, uint8_t val)
-{
-    int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
 
-    pdebug(DEBUG_SPEW, "Starting.");
+LIB_EXPORT int plc_tag_get_int32_array(int32_t id, int offset, int32_t *buffer, int count)
+{
+    return get_array(id, offset, (uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
-    }
 
-    critical_block(tag->api_mutex) {
-        /* is there a function? */
-        if(!tag->vtable->set_uint8) {
-            pdebug(DEBUG_WARN,"Tag does not support set uint8 operation!");
-            rc = PLCTAG_ERR_UNSUPPORTED;
-            break;
-        }
+LIB_EXPORT int plc_tag_set_int32_array(int32_t id, int offset, const int32_t *buffer, int count)
+{
+    return set_array(id, offset, (const uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
 
-        rc = tag->vtable->set_uint8(tag, offset, val);
-    }
 
-    rc_dec(tag);
 
-    return rc;
+LIB_EXPORT int plc_tag_get_uint16_array(int32_t id, int offset, uint16_t *buffer, int count)
+{
+    return get_array(id, offset, (uint8_t *)buffer, (int)sizeof(*buffer), count);
 }
 
 
+LIB_EXPORT int plc_tag_set_uint16_array(int32_t id, int offset, const uint16_t *buffer, int count)
+{
+    return set_array(id, offset, (const uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
 
 
 
-LIB_EXPORT int8_t plc_tag_get_int8(int32_t id, int offset)
+LIB_EXPORT int plc_tag_get_int16_array(int32_t id, int offset, int16_t *buffer, int count)
 {
-    int8_t res = INT8_MIN;
-    plc_tag_p tag = lookup_tag(id);
+    return get_array(id, offset, (uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
 
-    pdebug(DEBUG_SPEW, "Starting.");
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return res;
-    }
+LIB_EXPORT int plc_tag_set_int16_array(int32_t id, int offset, const int16_t *buffer, int count)
+{
+    return set_array(id, offset, (const uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
 
-    critical_block(tag->api_mutex) {
-        /* is there a function? */
-        if(!tag->vtable->get_int8) {
-            pdebug(DEBUG_WARN,"Tag does not support get int8 operation!");
-            break;
-        }
 
-        res = tag->vtable->get_int8(tag, offset);
-    }
 
-    rc_dec(tag);
+LIB_EXPORT int plc_tag_get_uint8_array(int32_t id, int offset, uint8_t *buffer, int count)
+{
+    return get_array(id, offset, (uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
 
-    return res;
+
+LIB_EXPORT int plc_tag_set_uint8_array(int32_t id, int offset, const uint8_t *buffer, int count)
+{
+    return set_array(id, offset, (const uint8_t *)buffer, (int)sizeof(*buffer), count);
 }
 
 
 
+LIB_EXPORT int plc_tag_get_int8_array(int32_t id, int offset, int8_t *buffer, int count)
+{
+    return get_array(id, offset, (uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
+
 
-LIB_EXPORT int plc_tag_set_int8(int32_t id, int offset, int8_t val)
+LIB_EXPORT int plc_tag_set_int8_array(int32_t id, int offset, const int8_t *buffer, int count)
 {
-    int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
+    return set_array(id, offset, (const uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
 
-    pdebug(DEBUG_SPEW, "Starting.");
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
-    }
 
-    critical_block(tag->api_mutex) {
-        /* is there a function? */
-        if(!tag->vtable->set_int8) {
-            pdebug(DEBUG_WARN,"Tag does not support set int8 operation!");
-            rc = PLCTAG_ERR_UNSUPPORTED;
-            break;
-        }
+LIB_EXPORT int plc_tag_get_float64_array(int32_t id, int offset, double *buffer, int count)
+{
+    return get_array(id, offset, (uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
 
-        rc = tag->vtable->set_int8(tag, offset, val);
-    }
 
-    rc_dec(tag);
+LIB_EXPORT int plc_tag_set_float64_array(int32_t id, int offset, const double *buffer, int count)
+{
+    return set_array(id, offset, (const uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
 
-    return rc;
+
+
+LIB_EXPORT int plc_tag_get_float32_array(int32_t id, int offset, float *buffer, int count)
+{
+    return get_array(id, offset, (uint8_t *)buffer, (int)sizeof(*buffer), count);
 }
 
 
+LIB_EXPORT int plc_tag_set_float32_array(int32_t id, int offset, const float *buffer, int count)
+{
+    return set_array(id, offset, (const uint8_t *)buffer, (int)sizeof(*buffer), count);
+}
 
 
 
+/*
+ * get_array/set_array
+ *
+ * Copy elements between the tag data and the caller's buffer, fixing the
+ * byte order if the tag data is not in host order.
+ */
 
-LIB_EXPORT double plc_tag_get_float64(int32_t id, int offset)
+int get_array(int32_t id, int offset, uint8_t *buffer, int elem_size, int count)
 {
-    double res = DBL_MAX;
-    plc_tag_p tag = lookup_tag(id);
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
+    if(!buffer || count < 0) {
+        pdebug(DEBUG_WARN, "Null buffer or negative element count!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    tag = lookup_tag(id);
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
-        return res;
+        return PLCTAG_ERR_NOT_FOUND;
     }
 
     critical_block(tag->api_mutex) {
-        /* is there a function? */
-        if(!tag->vtable->get_float64) {
-            pdebug(DEBUG_WARN,"Tag does not support get float64 operation!");
+        rc = check_array_bounds(tag, offset, elem_size, count);
+        if(rc != PLCTAG_STATUS_OK) {
             break;
         }
 
-        res = tag->vtable->get_float64(tag, offset);
+        copy_elements(buffer, tag->data + offset, elem_size, count, tag->endian);
     }
 
     rc_dec(tag);
 
-    return res;
-}
+    pdebug(DEBUG_SPEW, "Done.");
 
+    return rc;
+}
 
 
 
-LIB_EXPORT int plc_tag_set_float64(int32_t id, int offset, double val)
+int set_array(int32_t id, int offset, const uint8_t *buffer, int elem_size, int count)
 {
     int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
+    plc_tag_p tag = NULL;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
+    if(!buffer || count < 0) {
+        pdebug(DEBUG_WARN, "Null buffer or negative element count!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    tag = lookup_tag(id);
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
         return PLCTAG_ERR_NOT_FOUND;
     }
 
     critical_block(tag->api_mutex) {
-        /* is there a function? */
-        if(!tag->vtable->set_float64) {
-            pdebug(DEBUG_WARN,"Tag does not support set float64 operation!");
-            rc = PLCTAG_ERR_UNSUPPORTED;
+        rc = check_array_bounds(tag, offset, elem_size, count);
+        if(rc != PLCTAG_STATUS_OK) {
             break;
         }
 
-        rc = tag->vtable->set_float64(tag, offset, val);
+        copy_elements(tag->data + offset, buffer, elem_size, count, tag->endian);
     }
 
     rc_dec(tag);
 
+    pdebug(DEBUG_SPEW, "Done.");
+
     return rc;
 }
 
 
 
-LIB_EXPORT float plc_tag_get_float32(int32_t id, int offset)
+int check_array_bounds(plc_tag_p tag, int offset, int elem_size, int count)
 {
-    float res = FLT_MAX;
-    plc_tag_p tag = lookup_tag(id);
-
-    pdebug(DEBUG_SPEW, "Starting.");
-
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return res;
+    if(tag->is_bit) {
+        pdebug(DEBUG_WARN, "Array access is unsupported on a bit tag!");
+        return PLCTAG_ERR_UNSUPPORTED;
     }
 
-    critical_block(tag->api_mutex) {
-        /* is there a function? */
-        if(!tag->vtable->get_float32) {
-            pdebug(DEBUG_WARN,"Tag does not support get float32 operation!");
-            break;
-        }
-
-        res = tag->vtable->get_float32(tag, offset);
+    if(!tag->data) {
+        pdebug(DEBUG_WARN,"Tag has no data!");
+        return PLCTAG_ERR_NO_DATA;
     }
 
-    rc_dec(tag);
+    /* written to avoid overflow with large counts. */
+    if(offset < 0 || offset > tag->size || count > (tag->size - offset) / elem_size) {
+        pdebug(DEBUG_WARN,"Data offset out of bounds.");
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
 
-    return res;
+    return PLCTAG_STATUS_OK;
 }
 
 
 
-
-LIB_EXPORT int plc_tag_set_float32(int32_t id, int offset, float val)
+void copy_elements(uint8_t *dest, const uint8_t *src, int elem_size, int count, int endian)
 {
-    int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
-
-    pdebug(DEBUG_SPEW, "Starting.");
+    const uint16_t endian_check = 1;
+    int host_endian = (*((const uint8_t *)&endian_check) ? PLCTAG_DATA_LITTLE_ENDIAN : PLCTAG_DATA_BIG_ENDIAN);
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
+    if(elem_size == 1 || endian == host_endian) {
+        mem_copy(dest, (void *)src, elem_size * count);
+        return;
     }
 
-    critical_block(tag->api_mutex) {
-        /* is there a function? */
-        if(!tag->vtable->set_float32) {
-            pdebug(DEBUG_WARN,"Tag does not support set float32 operation!");
-            rc = PLCTAG_ERR_UNSUPPORTED;
+    /* fixed element sizes let the compiler unroll and vectorize these. */
+    switch(elem_size) {
+        case 2:
+            for(int i=0; i < count*2; i += 2) {
+                dest[i] = src[i+1];
+                dest[i+1] = src[i];
+            }
             break;
-        }
 
-        rc = tag->vtable->set_float32(tag, offset, val);
-    }
+        case 4:
+            for(int i=0; i < count*4; i += 4) {
+                dest[i] = src[i+3];
+                dest[i+1] = src[i+2];
+                dest[i+2] = src[i+1];
+                dest[i+3] = src[i];
+            }
+            break;
 
-    rc_dec(tag);
+        case 8:
+            for(int i=0; i < count*8; i += 8) {
+                for(int j=0; j < 8; j++) {
+                    dest[i+j] = src[i+7-j];
+                }
+            }
+            break;
 
-    return rc;
+        default:
+            pdebug(DEBUG_ERROR, "Unsupported element size %d!", elem_size);
+            break;
+    }
 }
 
 
 
+
 /*****************************************************************************************************
  *****************************  Support routines for extra indirection *******************************
  ****************************************************************************************************/
 
 
+/*
+ * lookup_tag
+ *
+ * Find the tag and take a strong reference to it.  This does not take any
+ * global lock.  The slot reader count keeps remove_tag_lookup() from
+ * releasing the tag between the ID check and the reference increment.
+ */
+
 plc_tag_p lookup_tag(int32_t tag_id)
 {
+    struct tag_slot_t *slot = get_tag_slot(tag_id);
     plc_tag_p tag = NULL;
 
-    critical_block(tag_lookup_mutex) {
-        tag = hashtable_get(tags, (int64_t)tag_id);
+    if(slot) {
+        atomic_int_add(&slot->readers, 1);
 
-        if(tag) {
-            debug_set_tag_id(tag->tag_id);
-        } else {
-            /* FIXME - remove this. */
-            pdebug(DEBUG_WARN, "Tag with ID %d not found.", tag_id);
+        if(slot->tag_id == tag_id) {
+            tag = rc_inc(slot->tag);
         }
 
-        if(tag && tag->tag_id == tag_id) {
-            pdebug(DEBUG_SPEW, "Found tag %p with id %d.", tag, tag->tag_id);
-            tag = rc_inc(tag);
-        } else {
-            debug_set_tag_id(0);
-            tag = NULL;
-        }
+        atomic_int_add(&slot->readers, -1);
+    }
+
+    if(tag) {
+        debug_set_tag_id(tag->tag_id);
+        pdebug(DEBUG_SPEW, "Found tag %p with id %d.", tag, tag->tag_id);
+    } else {
+        /* IDs of destroyed tags are expected here. */
+        pdebug(DEBUG_DETAIL, "Tag with ID %d not found.", tag_id);
+        debug_set_tag_id(0);
     }
 
     return tag;
@@ -2074,64 +4284,111 @@ plc_tag_p lookup_tag(int32_t tag_id)
 
 
 
-int tag_id_inc(int id)
+/*
+ * tag_wait_event
+ *
+ * Block until the session signals that a response for the tag came in or
+ * the timeout is reached.  The wait is capped so that protocols that do not
+ * signal still make progress.
+ */
+void tag_wait_event(plc_tag_p tag, int64_t timeout_time)
 {
-    if(id <= 0) {
-        pdebug(DEBUG_ERROR, "Incoming ID is not valid! Got %d",id);
-        /* try to correct. */
-        id = (TAG_ID_MASK/2);
+    int64_t wait_ms = timeout_time - time_ms();
+
+    if(wait_ms > TAG_MAX_WAIT_MS) {
+        wait_ms = TAG_MAX_WAIT_MS;
     }
 
-    id = (id + 1) & TAG_ID_MASK;
+    if(wait_ms > 0) {
+        cond_wait(tag->tag_cond_wait, (int)wait_ms);
+    }
+}
 
-    if(id == 0) {
-        id = 1; /* skip zero intentionally! Can't return an ID of zero because it looks like a NULL pointer */
+
+
+/*
+ * get_tag_slot
+ *
+ * Map a tag ID to its slot.  The slot may be empty or hold a different
+ * generation.  Returns NULL if the ID could never have been handed out.
+ */
+
+struct tag_slot_t *get_tag_slot(int32_t id)
+{
+    struct tag_slot_t *chunk = NULL;
+    int index = 0;
+
+    if(id <= 0 || id > TAG_ID_MASK) {
+        return NULL;
     }
 
-    return id;
+    index = (int)(id & TAG_INDEX_MASK);
+
+    chunk = tag_slots[index >> TAG_SLOT_CHUNK_BITS];
+    if(!chunk) {
+        return NULL;
+    }
+
+    return &chunk[index & (TAG_SLOT_CHUNK_SIZE - 1)];
 }
 
 
 
 int add_tag_lookup(plc_tag_p tag)
 {
-    int rc = PLCTAG_ERR_NOT_FOUND;
+    int rc = PLCTAG_STATUS_OK;
     int new_id = 0;
 
     pdebug(DEBUG_DETAIL, "Starting.");
 
     critical_block(tag_lookup_mutex) {
-        int attempts = 0;
-
-        /* only get this when we hold the mutex. */
-        new_id = next_tag_id;
-
-        do {
-            new_id = tag_id_inc(new_id);
-
-            if(new_id <=0) {
-                pdebug(DEBUG_WARN,"ID %d is illegal!", new_id);
-                attempts = MAX_TAG_MAP_ATTEMPTS;
-                break;
+        struct tag_slot_t *chunk = NULL;
+        struct tag_slot_t *slot = NULL;
+        int index = 0;
+
+        /* new slots are used until enough are free, then the one freed longest ago. */
+        if(free_tag_slot >= 0 && (num_free_tag_slots >= TAG_SLOT_MIN_FREE || num_tag_slots > TAG_INDEX_MASK)) {
+            index = free_tag_slot;
+            slot = &(tag_slots[index >> TAG_SLOT_CHUNK_BITS][index & (TAG_SLOT_CHUNK_SIZE - 1)]);
+            free_tag_slot = slot->next_free;
+
+            if(free_tag_slot < 0) {
+                free_tag_slot_last = -1;
             }
 
-            pdebug(DEBUG_SPEW,"Trying new ID %d.", new_id);
+            num_free_tag_slots--;
+        } else if(num_tag_slots <= TAG_INDEX_MASK) {
+            index = num_tag_slots;
 
-            if(!hashtable_get(tags,(int64_t)new_id)) {
-                pdebug(DEBUG_DETAIL,"Found unused ID %d", new_id);
-                break;
-            }
+            /* new chunks are zeroed and published before any ID in them is handed out. */
+            if(!tag_slots[index >> TAG_SLOT_CHUNK_BITS]) {
+                chunk = mem_alloc((int)(sizeof(struct tag_slot_t) * TAG_SLOT_CHUNK_SIZE));
+                if(!chunk) {
+                    pdebug(DEBUG_ERROR, "Unable to allocate tag lookup slots!");
+                    rc = PLCTAG_ERR_NO_MEM;
+                    break;
+                }
 
-            attempts++;
-        } while(attempts < MAX_TAG_MAP_ATTEMPTS);
+                atomic_ptr_cas((void * volatile *)&tag_slots[index >> TAG_SLOT_CHUNK_BITS], NULL, chunk);
+            }
 
-        if(attempts < MAX_TAG_MAP_ATTEMPTS) {
-            rc = hashtable_put(tags, (int64_t)new_id, tag);
+            num_tag_slots++;
+            slot = &(tag_slots[index >> TAG_SLOT_CHUNK_BITS][index & (TAG_SLOT_CHUNK_SIZE - 1)]);
         } else {
+            pdebug(DEBUG_WARN, "No free tag lookup slots!");
             rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
         }
 
-        next_tag_id = new_id;
+        /* never use generation zero so that no ID is zero. */
+        slot->generation = (slot->generation % TAG_GENERATION_MAX) + 1;
+        slot->next_free = -1;
+        slot->tag = tag;
+
+        new_id = (slot->generation << TAG_INDEX_BITS) | index;
+
+        /* publish the ID last, lookups check it before using the tag pointer. */
+        atomic_int_cas(&slot->tag_id, 0, new_id);
     }
 
     if(rc != PLCTAG_STATUS_OK) {
@@ -2142,3 +4399,55 @@ int add_tag_lookup(plc_tag_p tag)
 
     return new_id;
 }
+
+
+
+/*
+ * remove_tag_lookup
+ *
+ * Remove the tag from its slot and return the reference the slot held.
+ * Waits for any lookups of the slot that are in progress.
+ */
+
+plc_tag_p remove_tag_lookup(int32_t id)
+{
+    struct tag_slot_t *slot = get_tag_slot(id);
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!slot) {
+        pdebug(DEBUG_DETAIL, "No slot for ID %d.", id);
+        return NULL;
+    }
+
+    critical_block(tag_lookup_mutex) {
+        /* new lookups fail from here on. */
+        if(!atomic_int_cas(&slot->tag_id, id, 0)) {
+            pdebug(DEBUG_DETAIL, "Slot does not hold ID %d.", id);
+            break;
+        }
+
+        /* lookups are short, spin until any in flight are done with the pointer. */
+        while(atomic_int_add(&slot->readers, 0) != 0) { }
+
+        tag = slot->tag;
+        slot->tag = NULL;
+
+        /* to the end of the free list so that it is reused as late as possible. */
+        slot->next_free = -1;
+
+        if(free_tag_slot_last >= 0) {
+            tag_slots[free_tag_slot_last >> TAG_SLOT_CHUNK_BITS][free_tag_slot_last & (TAG_SLOT_CHUNK_SIZE - 1)].next_free = (int)(id & TAG_INDEX_MASK);
+        } else {
+            free_tag_slot = (int)(id & TAG_INDEX_MASK);
+        }
+
+        free_tag_slot_last = (int)(id & TAG_INDEX_MASK);
+        num_free_tag_slots++;
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return tag;
+}
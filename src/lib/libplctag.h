@@ -258,6 +258,16 @@ LIB_EXPORT void plc_tag_shutdown(void);
 
 #define PLCTAG_EVENT_DESTROYED          (6)
 
+/*
+ * Only sent for tags created with detect_changes=1 (or with that attribute set
+ * later).  After a read completes, the data is compared with the data of the
+ * last read.  If any of it changed, this event follows the READ_COMPLETED
+ * event.  The integer attributes changed_offset and changed_size give the
+ * range of bytes that changed.  The first read reports all of the data as
+ * changed.
+ */
+#define PLCTAG_EVENT_DATA_CHANGED       (7)
+
 LIB_EXPORT int plc_tag_register_callback(int32_t tag_id, void (*tag_callback_func)(int32_t tag_id, int event, int status));
 
 
@@ -289,7 +299,11 @@ LIB_EXPORT int plc_tag_unregister_callback(int32_t tag_id);
  * Once registered, the function will be called with any logging message that is normally printed due 
  * to the current log level setting.
  *
- * WARNING: the callback will usually be called when the internal tag API mutex is held.   You cannot
+ * Once the library is initialized, the callback is called from a background logging thread, a little
+ * after the message was logged.  Messages logged while the logging thread falls behind are dropped and
+ * their number is reported in a later message.
+ *
+ * WARNING: the callback may be called when the internal tag API mutex is held.   You cannot
  * call any tag functions within the callback!
  *
  * Return values:
@@ -349,6 +363,31 @@ LIB_EXPORT int plc_tag_unlock(int32_t tag);
 
 
 
+/*
+ * plc_tag_borrow_data
+ *
+ * Get a pointer to the tag's raw data buffer and its size in bytes.  The tag
+ * is locked until plc_tag_release_data is called from the same thread, so
+ * the data cannot change or move while it is borrowed.  Do not call other
+ * API functions on the tag while it is borrowed.
+ */
+
+LIB_EXPORT int plc_tag_borrow_data(int32_t tag, const uint8_t **data, int *size);
+
+
+
+/*
+ * plc_tag_release_data
+ *
+ * Give back the data buffer borrowed with plc_tag_borrow_data.  The pointer
+ * must not be used after this.
+ */
+
+LIB_EXPORT int plc_tag_release_data(int32_t tag);
+
+
+
+
 
 /*
  * plc_tag_abort
@@ -429,6 +468,139 @@ LIB_EXPORT int plc_tag_write(int32_t tag, int timeout);
 
 
 
+/*
+ * plc_tag_subscribe
+ *
+ * Have the library read the tag every rpi_ms milliseconds.  The reads are
+ * started by the library's helper thread.  Register a callback to get
+ * PLCTAG_EVENT_READ_COMPLETED when each read is done.
+ *
+ * Reads happen on multiples of the RPI, so tags with the same RPI are read
+ * at the same time and their requests are packed together.  If a read is
+ * still running when the next one is due, that period is skipped.
+ *
+ * Subscribing a tag again changes its RPI.  Destroying the tag ends the
+ * subscription.
+ *
+ * Returns PLCTAG_ERR_BAD_PARAM if rpi_ms is not positive.
+ */
+LIB_EXPORT int plc_tag_subscribe(int32_t tag, int rpi_ms);
+
+
+
+/*
+ * plc_tag_unsubscribe
+ *
+ * Stop the periodic reads started with plc_tag_subscribe.  A read already
+ * started is not aborted.  Returns PLCTAG_ERR_NOT_FOUND if the tag is not
+ * subscribed.
+ */
+LIB_EXPORT int plc_tag_unsubscribe(int32_t tag);
+
+
+
+/*
+ * Tag groups.
+ *
+ * A group is read as one unit.  The reads of all the member tags are
+ * queued before any of them is sent, so members that use the same
+ * connection to a PLC go out in as few packed requests as the PLC allows.
+ * This gives a consistent snapshot of the tags for the price of one
+ * round trip where possible.
+ *
+ * plc_tag_group_create returns a group handle, or an error (less than zero).
+ * A tag can be in only one group at a time.  Adding a tag that is in
+ * another group returns PLCTAG_ERR_DUPLICATE.
+ *
+ * plc_tag_group_read starts the reads of all members.  With a timeout, it
+ * waits for all of them and returns the first error of any member, or
+ * PLCTAG_STATUS_OK.  With a zero timeout it returns PLCTAG_STATUS_PENDING
+ * and plc_tag_group_status tells when the group is done.
+ *
+ * The group callback gets PLCTAG_EVENT_READ_STARTED and then, once every
+ * member is done, a single PLCTAG_EVENT_READ_COMPLETED.  Member tag
+ * callbacks are called as for any other read.
+ *
+ * Destroying a group does not destroy its tags.
+ */
+LIB_EXPORT int32_t plc_tag_group_create(void);
+LIB_EXPORT int plc_tag_group_destroy(int32_t group);
+LIB_EXPORT int plc_tag_group_add(int32_t group, int32_t tag);
+LIB_EXPORT int plc_tag_group_read(int32_t group, int timeout);
+LIB_EXPORT int plc_tag_group_status(int32_t group);
+LIB_EXPORT int plc_tag_group_register_callback(int32_t group, void (*group_callback_func)(int32_t group, int event, int status));
+
+
+
+/*
+ * Latency histograms.
+ *
+ * The library keeps histograms, in microseconds, of how long requests
+ * wait in the queue, the round trip of each packet to the PLC, and the
+ * time from the start of a read or write to its successful completion.
+ * Each value is only known to within about 6%.
+ *
+ * plc_tag_get_latency returns the latency at the percentile (0 to 100,
+ * e.g. 99.9), PLCTAG_ERR_NO_DATA if nothing was recorded yet, or another
+ * error (less than zero).
+ *
+ * plc_tag_dump_latency writes a text summary with the count, p50, p99 and
+ * p999 of every histogram into the buffer.  It returns the length of the
+ * text or PLCTAG_ERR_TOO_SMALL.
+ *
+ * Per-connection queue wait and round trip percentiles are in the
+ * session_stats system tag.
+ */
+
+#define PLCTAG_LATENCY_QUEUE_WAIT       (0)
+#define PLCTAG_LATENCY_ROUND_TRIP       (1)
+#define PLCTAG_LATENCY_READ             (2)
+#define PLCTAG_LATENCY_WRITE            (3)
+
+LIB_EXPORT int64_t plc_tag_get_latency(int which, double percentile);
+LIB_EXPORT int plc_tag_dump_latency(char *buffer, int buffer_size);
+LIB_EXPORT int plc_tag_reset_latency(void);
+
+
+
+/*
+ * Binary tracing.
+ *
+ * Setting the library attribute "trace" to 1, with
+ * plc_tag_set_int_attribute(0, "trace", 1), records the start and end of
+ * reads and writes and each request and packet to the PLC into per-thread
+ * buffers.  Recording does no formatting and takes no locks.  Only the
+ * newest records of each thread are kept.
+ *
+ * plc_tag_dump_trace writes the records to a binary file.  Turn tracing
+ * off first for a clean trace.  The trace_decode tool prints the file as
+ * text.
+ */
+
+LIB_EXPORT int plc_tag_dump_trace(const char *file_name);
+
+
+
+/*
+ * Packet capture.
+ *
+ * plc_tag_start_capture writes every EtherNet/IP frame sent to and
+ * received from PLCs into a pcap file that Wireshark can open.  The frames
+ * are wrapped in made-up IPv4 and TCP headers.  The PLC address is used if
+ * the gateway is given as a numeric IP address.  The library's side of
+ * every connection is 10.0.0.1 with a different port for each connection.
+ *
+ * The file is written by a background thread.  Frames are dropped if the
+ * file cannot keep up.  plc_tag_stop_capture writes out the remaining
+ * frames and closes the file.  Only one capture can run at a time.
+ */
+
+LIB_EXPORT int plc_tag_start_capture(const char *file_name);
+LIB_EXPORT int plc_tag_stop_capture(void);
+
+
+
+
 /*
  * Tag data accessors.
  */
@@ -477,6 +649,36 @@ LIB_EXPORT float plc_tag_get_float32(int32_t tag, int offset);
 LIB_EXPORT int plc_tag_set_float32(int32_t tag, int offset, float val);
 
 
+/*
+ * Bulk array accessors.  These copy count elements starting at the byte
+ * offset with one tag lookup and one lock.  They return a status code.
+ */
+LIB_EXPORT int plc_tag_get_uint64_array(int32_t tag, int offset, uint64_t *buffer, int count);
+LIB_EXPORT int plc_tag_set_uint64_array(int32_t tag, int offset, const uint64_t *buffer, int count);
+LIB_EXPORT int plc_tag_get_int64_array(int32_t tag, int offset, int64_t *buffer, int count);
+LIB_EXPORT int plc_tag_set_int64_array(int32_t tag, int offset, const int64_t *buffer, int count);
+
+LIB_EXPORT int plc_tag_get_uint32_array(int32_t tag, int offset, uint32_t *buffer, int count);
+LIB_EXPORT int plc_tag_set_uint32_array(int32_t tag, int offset, const uint32_t *buffer, int count);
+LIB_EXPORT int plc_tag_get_int32_array(int32_t tag, int offset, int32_t *buffer, int count);
+LIB_EXPORT int plc_tag_set_int32_array(int32_t tag, int offset, const int32_t *buffer, int count);
+
+LIB_EXPORT int plc_tag_get_uint16_array(int32_t tag, int offset, uint16_t *buffer, int count);
+LIB_EXPORT int plc_tag_set_uint16_array(int32_t tag, int offset, const uint16_t *buffer, int count);
+LIB_EXPORT int plc_tag_get_int16_array(int32_t tag, int offset, int16_t *buffer, int count);
+LIB_EXPORT int plc_tag_set_int16_array(int32_t tag, int offset, const int16_t *buffer, int count);
+
+LIB_EXPORT int plc_tag_get_uint8_array(int32_t tag, int offset, uint8_t *buffer, int count);
+LIB_EXPORT int plc_tag_set_uint8_array(int32_t tag, int offset, const uint8_t *buffer, int count);
+LIB_EXPORT int plc_tag_get_int8_array(int32_t tag, int offset, int8_t *buffer, int count);
+LIB_EXPORT int plc_tag_set_int8_array(int32_t tag, int offset, const int8_t *buffer, int count);
+
+LIB_EXPORT int plc_tag_get_float64_array(int32_t tag, int offset, double *buffer, int count);
+LIB_EXPORT int plc_tag_set_float64_array(int32_t tag, int offset, const double *buffer, int count);
+LIB_EXPORT int plc_tag_get_float32_array(int32_t tag, int offset, float *buffer, int count);
+LIB_EXPORT int plc_tag_set_float32_array(int32_t tag, int offset, const float *buffer, int count);
+
+
 #ifdef __cplusplus
 }
 #endif
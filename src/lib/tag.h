@@ -114,6 +114,15 @@ struct tag_vtable_t {
 typedef struct tag_vtable_t *tag_vtable_p;
 
 
+/*
+ * While a tag group read queues the reads of its members, their requests
+ * are held back so that the IO threads see all of them at once.  Each
+ * group read has a hold.  The tags point at it while their reads are
+ * queued and the requests keep a reference to it.
+ */
+typedef struct plc_tag_group_hold_t *plc_tag_group_hold_p;
+
+
 /*
  * The base definition of the tag structure.  This is used
  * by the protocol-specific implementations.
@@ -124,13 +133,32 @@ typedef struct tag_vtable_t *tag_vtable_p;
 #define TAG_BASE_STRUCT tag_vtable_p vtable; \
                         mutex_p ext_mutex; \
                         mutex_p api_mutex; \
+                        cond_p tag_cond_wait; \
+                        lock_t ready_lock; \
+                        plc_tag_p ready_next; \
+                        plc_tag_p borrow_next; \
                         int status; \
                         int endian; \
+                        int is_bit; \
                         int tag_id; \
                         int64_t read_cache_expire; \
                         int64_t read_cache_ms; \
                         int read_complete; \
                         int write_complete; \
+                        int64_t op_deadline; \
+                        int64_t op_start_us; \
+                        int subscribe_rpi_ms; \
+                        int subscribe_in_wheel; \
+                        int64_t subscribe_due; \
+                        plc_tag_p subscribe_next; \
+                        int detect_changes; \
+                        uint8_t *prev_data; \
+                        int prev_size; \
+                        int changed_offset; \
+                        int changed_size; \
+                        int32_t group_id; \
+                        plc_tag_group_hold_p group_hold; \
+                        int group_read_pending; \
                         void (*callback)(int32_t tag_id, int event, int status); \
                         int size; \
                         uint8_t *data
@@ -148,11 +176,28 @@ struct plc_tag_t {
 
 /* the following may need to be used where the tag is already mapped or is not yet mapped */
 extern int lib_init(void);
+extern void lib_stop_tickler(void);
 extern void lib_teardown(void);
 extern int plc_tag_abort_mapped(plc_tag_p tag);
 extern int plc_tag_destroy_mapped(plc_tag_p tag);
 extern int plc_tag_status_mapped(plc_tag_p tag);
 
+/* called by protocol code when IO for the tag completes. */
+extern void plc_tag_mark_ready(plc_tag_p tag);
+
+/* true while the reads of the tag group are still being queued.  Takes no locks. */
+extern int plc_tag_group_hold_is_held(plc_tag_group_hold_p hold);
+
+/*
+ * Call wake(arg) when the hold is released.  arg must be reference counted,
+ * the hold keeps a reference until then.  Returns PLCTAG_STATUS_PENDING if
+ * the hold is still held, PLCTAG_STATUS_OK if it was already released.
+ */
+extern int plc_tag_group_hold_add_waiter(plc_tag_group_hold_p hold, void (*wake)(void *arg), void *arg);
+
+/* add a sample, in microseconds, to one of the library-wide latency histograms. */
+extern void plc_tag_record_latency(int which, int64_t usec);
+
 
 
 #endif
@@ -47,9 +47,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <time.h>
 
 #include <lib/libplctag.h>
@@ -562,6 +564,197 @@ int mutex_destroy(mutex_p *m)
 
 
 
+/***************************************************************************
+ ************************* Condition Variables *****************************
+ **************************************************************************/
+
+/*
+ * These work like a latched event.  A signal is remembered until a waiter
+ * sees it, so a signal sent before the wait starts is not lost.
+ */
+
+struct cond_t {
+    pthread_mutex_t p_mutex;
+    pthread_cond_t p_cond;
+    int flag;
+};
+
+
+int cond_create(cond_p *c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition variable pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *c = (struct cond_t *)mem_alloc(sizeof(struct cond_t));
+
+    if(! *c) {
+        pdebug(DEBUG_ERROR, "Unable to allocate condition variable.");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    if(pthread_mutex_init(&((*c)->p_mutex), NULL)) {
+        mem_free(*c);
+        *c = NULL;
+        pdebug(DEBUG_ERROR, "Error initializing condition variable mutex.");
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    if(pthread_cond_init(&((*c)->p_cond), NULL)) {
+        pthread_mutex_destroy(&((*c)->p_mutex));
+        mem_free(*c);
+        *c = NULL;
+        pdebug(DEBUG_ERROR, "Error initializing condition variable.");
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    (*c)->flag = 0;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * cond_wait
+ *
+ * Wait up to timeout_ms for the condition to be signalled.  Returns
+ * PLCTAG_ERR_TIMEOUT if it was not.  The signal is consumed.
+ */
+int cond_wait(cond_p c, int timeout_ms)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int64_t end_time = time_ms() + timeout_ms;
+    struct timespec timeout;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition variable pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+        end_time = time_ms();
+    }
+
+    /* time_ms() is wall clock time, the same as the default condition variable clock. */
+    timeout.tv_sec = (time_t)(end_time / 1000);
+    timeout.tv_nsec = (long)((end_time % 1000) * 1000000);
+
+    if(pthread_mutex_lock(&(c->p_mutex))) {
+        pdebug(DEBUG_WARN, "error locking condition variable mutex.");
+        return PLCTAG_ERR_MUTEX_LOCK;
+    }
+
+    while(!c->flag) {
+        int wait_rc = pthread_cond_timedwait(&(c->p_cond), &(c->p_mutex), &timeout);
+
+        if(wait_rc == ETIMEDOUT) {
+            break;
+        }
+
+        if(wait_rc != 0 && wait_rc != EINTR) {
+            pdebug(DEBUG_WARN, "error %d waiting on condition variable.", wait_rc);
+            rc = PLCTAG_ERR_MUTEX_LOCK;
+            break;
+        }
+    }
+
+    if(rc == PLCTAG_STATUS_OK) {
+        if(c->flag) {
+            c->flag = 0;
+        } else {
+            rc = PLCTAG_ERR_TIMEOUT;
+        }
+    }
+
+    pthread_mutex_unlock(&(c->p_mutex));
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+int cond_signal(cond_p c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition variable pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(pthread_mutex_lock(&(c->p_mutex))) {
+        pdebug(DEBUG_WARN, "error locking condition variable mutex.");
+        return PLCTAG_ERR_MUTEX_LOCK;
+    }
+
+    c->flag = 1;
+
+    pthread_cond_broadcast(&(c->p_cond));
+
+    pthread_mutex_unlock(&(c->p_mutex));
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int cond_clear(cond_p c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition variable pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(pthread_mutex_lock(&(c->p_mutex))) {
+        pdebug(DEBUG_WARN, "error locking condition variable mutex.");
+        return PLCTAG_ERR_MUTEX_LOCK;
+    }
+
+    c->flag = 0;
+
+    pthread_mutex_unlock(&(c->p_mutex));
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int cond_destroy(cond_p *c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c || !*c) {
+        pdebug(DEBUG_WARN, "null condition variable pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pthread_cond_destroy(&((*c)->p_cond));
+    pthread_mutex_destroy(&((*c)->p_mutex));
+
+    mem_free(*c);
+
+    *c = NULL;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
 /***************************************************************************
  ******************************* Threads ***********************************
  **************************************************************************/
@@ -753,21 +946,83 @@ extern void lock_release(lock_t *lock)
 }
 
 
+/*
+ * atomic_ptr_cas
+ *
+ * Replace the pointer with new_val only if it still holds old_val.
+ *
+ * Returns non-zero if the pointer was replaced.
+ */
+
+int atomic_ptr_cas(void * volatile *ptr, void *old_val, void *new_val)
+{
+    return __sync_bool_compare_and_swap(ptr, old_val, new_val) ? 1 : 0;
+}
+
+
+void *atomic_ptr_exchange(void * volatile *ptr, void *new_val)
+{
+    void *old_val = NULL;
+
+    do {
+        old_val = *ptr;
+    } while(!__sync_bool_compare_and_swap(ptr, old_val, new_val));
+
+    return old_val;
+}
+
+
+int atomic_int_add(volatile int *ptr, int val)
+{
+    return __sync_add_and_fetch(ptr, val);
+}
+
+
+int atomic_int_cas(volatile int *ptr, int old_val, int new_val)
+{
+    return __sync_bool_compare_and_swap(ptr, old_val, new_val) ? 1 : 0;
+}
+
+
+int64_t atomic_int64_add(volatile int64_t *ptr, int64_t val)
+{
+    return __sync_add_and_fetch(ptr, val);
+}
+
+
 /***************************************************************************
  ******************************* Sockets ***********************************
  **************************************************************************/
 
+#define MAX_IPS (8)
+
+/* how long a blocking connect may take. */
+#define SOCKET_CONNECT_TIMEOUT (10000)
+
 struct sock_t {
     int fd;
     int port;
     int is_open;
-};
 
+    /* self-pipe used to wake up a thread waiting in socket_wait_event(). */
+    int wake_read_fd;
+    int wake_write_fd;
 
-#define MAX_IPS (8)
+    /* non-blocking connection set up. */
+    int is_connecting;
+    struct in_addr ips[MAX_IPS];
+    int num_ips;
+    int ip_index;
+};
+
+static int set_fd_non_blocking(int fd);
+static int socket_open_fd(int *fd_out);
+static int socket_connect_next_ip(sock_p s);
 
 extern int socket_create(sock_p *s)
 {
+    int wake_fds[2];
+
     pdebug(DEBUG_DETAIL, "Starting.");
 
     if(!s) {
@@ -782,27 +1037,43 @@ extern int socket_create(sock_p *s)
         return PLCTAG_ERR_NO_MEM;
     }
 
+    if(pipe(wake_fds)) {
+        pdebug(DEBUG_ERROR, "Unable to create wake up pipe, errno: %d", errno);
+        mem_free(*s);
+        *s = NULL;
+        return PLCTAG_ERR_CREATE;
+    }
+
+    /* neither end of the pipe may ever block. */
+    if(set_fd_non_blocking(wake_fds[0]) != PLCTAG_STATUS_OK || set_fd_non_blocking(wake_fds[1]) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to set wake up pipe to non-blocking!");
+        close(wake_fds[0]);
+        close(wake_fds[1]);
+        mem_free(*s);
+        *s = NULL;
+        return PLCTAG_ERR_CREATE;
+    }
+
+    (*s)->fd = -1;
+    (*s)->wake_read_fd = wake_fds[0];
+    (*s)->wake_write_fd = wake_fds[1];
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
 }
 
 
-extern int socket_connect_tcp(sock_p s, const char *host, int port)
+/*
+ * Open a new TCP socket and set all the options we need on it.
+ */
+static int socket_open_fd(int *fd_out)
 {
-    struct in_addr ips[MAX_IPS];
-    int num_ips = 0;
-    struct sockaddr_in gw_addr;
-    int sock_opt = 1;
-    int i = 0;
-    int done = 0;
     int fd;
-    int flags;
+    int sock_opt = 1;
     struct timeval timeout; /* used for timing out connections etc. */
     struct linger so_linger; /* used to set up short/no lingering after connections are close()ed. */
 
-    pdebug(DEBUG_DETAIL,"Starting.");
-
     /* Open a socket for communication with the gateway. */
     fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
@@ -821,6 +1092,15 @@ extern int socket_connect_tcp(sock_p s, const char *host, int port)
         return PLCTAG_ERR_OPEN;
     }
 
+    /* requests are small and may be sent back to back, do not let Nagle hold them. */
+    sock_opt = 1;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket no-delay option, errno: %d", errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
 #ifdef BSD_OS_TYPE
     /* The *BSD family has a different way to suppress SIGPIPE on sockets. */
     if(setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (char*)&sock_opt, sizeof(sock_opt))) {
@@ -855,105 +1135,209 @@ extern int socket_connect_tcp(sock_p s, const char *host, int port)
         return PLCTAG_ERR_OPEN;
     }
 
+    /* the connect itself is non-blocking too. */
+    if(set_fd_non_blocking(fd) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Error setting socket to non-blocking, errno: %d", errno);
+        close(fd);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    *fd_out = fd;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * Start a connection attempt to the next address we have not tried yet.
+ */
+static int socket_connect_next_ip(sock_p s)
+{
+    struct sockaddr_in gw_addr;
+
+    memset((void *)&gw_addr,0, sizeof(gw_addr));
+    gw_addr.sin_family = AF_INET ;
+    gw_addr.sin_port = htons((uint16_t)s->port);
+
+    /* try each IP until we run out or get a connection started. */
+    while(s->ip_index < s->num_ips) {
+        int fd = -1;
+        int rc = socket_open_fd(&fd);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            return rc;
+        }
+
+        gw_addr.sin_addr.s_addr = s->ips[s->ip_index].s_addr;
+
+        pdebug(DEBUG_DETAIL, "Attempting to connect to %s",inet_ntoa(*((struct in_addr *)&s->ips[s->ip_index])));
+
+        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+
+        if(rc == 0) {
+            pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&s->ips[s->ip_index])));
+            s->fd = fd;
+            s->is_open = 1;
+            return PLCTAG_STATUS_OK;
+        }
+
+        if(errno == EINPROGRESS) {
+            s->fd = fd;
+            s->is_connecting = 1;
+            return PLCTAG_STATUS_PENDING;
+        }
+
+        pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&s->ips[s->ip_index])),errno);
+        close(fd);
+        s->ip_index++;
+    }
+
+    pdebug(DEBUG_ERROR, "Unable to connect to any gateway host IP address!");
+
+    return PLCTAG_ERR_OPEN;
+}
+
+
+
+/*
+ * socket_connect_tcp_start
+ *
+ * Look up the host and start connecting to it without blocking.  Returns
+ * PLCTAG_STATUS_PENDING if the connection is in progress.  Use
+ * socket_connect_tcp_check() to find out when it is done.
+ */
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port)
+{
+    pdebug(DEBUG_DETAIL,"Starting.");
+
+    if(!s || !host) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(s->is_open || s->is_connecting) {
+        socket_close(s);
+    }
+
+    s->num_ips = 0;
+    s->ip_index = 0;
+    s->port = port;
+
     /* figure out what address we are connecting to. */
 
     /* try a numeric IP address conversion first. */
-    if(inet_pton(AF_INET,host,(struct in_addr *)ips) > 0) {
+    if(inet_pton(AF_INET,host,(struct in_addr *)s->ips) > 0) {
         pdebug(DEBUG_DETAIL, "Found numeric IP address: %s",host);
-        num_ips = 1;
+        s->num_ips = 1;
     } else {
         struct addrinfo hints;
-        struct addrinfo *res=NULL;
+        struct addrinfo *res_head = NULL;
+        struct addrinfo *res = NULL;
         int rc = 0;
 
-        mem_set(&ips, 0, sizeof(ips));
+        mem_set(&s->ips, 0, sizeof(s->ips));
         mem_set(&hints, 0, sizeof(hints));
 
         hints.ai_socktype = SOCK_STREAM; /* TCP */
         hints.ai_family = AF_INET; /* IP V4 only */
 
-        if ((rc = getaddrinfo(host, NULL, &hints, &res)) != 0) {
+        if ((rc = getaddrinfo(host, NULL, &hints, &res_head)) != 0) {
             pdebug(DEBUG_WARN,"Error looking up PLC IP address %s, error = %d\n", host, rc);
 
-            if(res) {
-                freeaddrinfo(res);
+            if(res_head) {
+                freeaddrinfo(res_head);
             }
 
             return PLCTAG_ERR_BAD_GATEWAY;
         }
 
-        for(num_ips = 0; res && num_ips < MAX_IPS; num_ips++) {
-            ips[num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
+        res = res_head;
+        for(s->num_ips = 0; res && s->num_ips < MAX_IPS; s->num_ips++) {
+            s->ips[s->num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
             res = res->ai_next;
         }
 
-        freeaddrinfo(res);
+        freeaddrinfo(res_head);
     }
 
+    pdebug(DEBUG_DETAIL, "Done.");
 
-    /* now try to connect to the remote gateway.  We may need to
-     * try several of the IPs we have.
-     */
+    return socket_connect_next_ip(s);
+}
 
-    i = 0;
-    done = 0;
 
-    memset((void *)&gw_addr,0, sizeof(gw_addr));
-    gw_addr.sin_family = AF_INET ;
-    gw_addr.sin_port = htons((uint16_t)port);
 
-    do {
-        int rc;
-        /* try each IP until we run out or get a connection. */
-        gw_addr.sin_addr.s_addr = ips[i].s_addr;
-
-        pdebug(DEBUG_DETAIL, "Attempting to connect to %s",inet_ntoa(*((struct in_addr *)&ips[i])));
+/*
+ * socket_connect_tcp_check
+ *
+ * Wait up to timeout_ms for a connection started with socket_connect_tcp_start()
+ * to complete.  Returns PLCTAG_STATUS_OK when connected, PLCTAG_STATUS_PENDING
+ * if still in progress or an error.  Failed addresses are skipped automatically.
+ */
+extern int socket_connect_tcp_check(sock_p s, int timeout_ms)
+{
+    int sock_err = 0;
+    socklen_t sock_err_len = (socklen_t)sizeof(sock_err);
+    int rc = 0;
 
-        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+    if(!s) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
 
-        if( rc == 0) {
-            pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&ips[i])));
-            done = 1;
-        } else {
-            pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&ips[i])),errno);
-            i++;
-        }
-    } while(!done && i < num_ips);
+    if(!s->is_connecting) {
+        return (s->is_open ? PLCTAG_STATUS_OK : PLCTAG_ERR_OPEN);
+    }
 
-    if(!done) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Unable to connect to any gateway host IP address!");
-        return PLCTAG_ERR_OPEN;
+    rc = socket_wait_event(s, SOCK_EVENT_WRITE, timeout_ms);
+    if(rc < 0 || !(rc & SOCK_EVENT_WRITE)) {
+        return (rc < 0 && rc != PLCTAG_ERR_TIMEOUT) ? rc : PLCTAG_STATUS_PENDING;
     }
 
+    if(getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &sock_err, &sock_err_len)) {
+        sock_err = errno;
+    }
 
-    /* FIXME
-     * connect() is a little easier to handle in blocking mode, for now
-     * we make the socket non-blocking here, after connect(). */
-    flags=fcntl(fd,F_GETFL,0);
+    s->is_connecting = 0;
 
-    if(flags<0) {
-        pdebug(DEBUG_ERROR, "Error getting socket options, errno: %d", errno);
-        close(fd);
-        return PLCTAG_ERR_OPEN;
+    if(sock_err == 0) {
+        pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&s->ips[s->ip_index])));
+        s->is_open = 1;
+        return PLCTAG_STATUS_OK;
     }
 
-    flags |= O_NONBLOCK;
+    pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&s->ips[s->ip_index])),sock_err);
 
-    if(fcntl(fd,F_SETFL,flags)<0) {
-        pdebug(DEBUG_ERROR, "Error setting socket to non-blocking, errno: %d", errno);
-        close(fd);
-        return PLCTAG_ERR_OPEN;
+    close(s->fd);
+    s->fd = -1;
+    s->ip_index++;
+
+    return socket_connect_next_ip(s);
+}
+
+
+
+extern int socket_connect_tcp(sock_p s, const char *host, int port)
+{
+    int64_t timeout_time = time_ms() + SOCKET_CONNECT_TIMEOUT;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL,"Starting.");
+
+    rc = socket_connect_tcp_start(s, host, port);
+
+    while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
+        rc = socket_connect_tcp_check(s, (int)(timeout_time - time_ms()));
     }
 
-    /* save the values */
-    s->fd = fd;
-    s->port = port;
-    s->is_open = 1;
+    if(rc == PLCTAG_STATUS_PENDING) {
+        pdebug(DEBUG_WARN, "Timed out connecting to %s!", host);
+        socket_close(s);
+        rc = PLCTAG_ERR_TIMEOUT;
+    }
 
     pdebug(DEBUG_DETAIL, "Done.");
 
-    return PLCTAG_STATUS_OK;
+    return rc;
 }
 
 
@@ -975,6 +1359,12 @@ extern int socket_read(sock_p s, uint8_t *buf, int size)
     /* The socket is non-blocking. */
     rc = (int)read(s->fd,buf,(size_t)size);
 
+    /* a zero length read means the other end closed the connection. */
+    if(rc == 0 && size > 0) {
+        pdebug(DEBUG_WARN, "Socket closed by remote end.");
+        return PLCTAG_ERR_READ;
+    }
+
     if(rc < 0) {
         if(errno == EAGAIN || errno == EWOULDBLOCK) {
             return 0;
@@ -1030,16 +1420,20 @@ extern int socket_close(sock_p s)
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    if(!s->is_open) {
+    if(!s->is_open && !s->is_connecting) {
         return PLCTAG_STATUS_OK;
     }
 
-    if(!close(s->fd)) {
+    /* the socket is gone either way. */
+    s->is_open = 0;
+    s->is_connecting = 0;
+
+    if(close(s->fd)) {
+        s->fd = -1;
         return PLCTAG_ERR_CLOSE;
     }
 
-    s->fd = 0;
-    s->is_open = 0;
+    s->fd = -1;
 
     return PLCTAG_STATUS_OK;
 }
@@ -1052,6 +1446,9 @@ extern int socket_destroy(sock_p *s)
 
     socket_close(*s);
 
+    close((*s)->wake_read_fd);
+    close((*s)->wake_write_fd);
+
     mem_free(*s);
 
     *s = 0;
@@ -1061,6 +1458,284 @@ extern int socket_destroy(sock_p *s)
 
 
 
+/*
+ * socket_wait_event
+ *
+ * Block until the socket is ready for one of the requested events, another
+ * thread calls socket_wake() or the timeout expires.  If the socket is not
+ * open, only the wake up event is waited for.
+ *
+ * Returns the mask of the events that happened, PLCTAG_ERR_TIMEOUT if none did
+ * or an error.
+ */
+extern int socket_wait_event(sock_p s, int events, int timeout_ms)
+{
+    struct pollfd fds[2];
+    int num_fds = 0;
+    int result = SOCK_EVENT_NONE;
+    int rc = 0;
+
+    if(!s) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+
+    fds[num_fds].fd = s->wake_read_fd;
+    fds[num_fds].events = POLLIN;
+    fds[num_fds].revents = 0;
+    num_fds++;
+
+    if((s->is_open || s->is_connecting) && (events & (SOCK_EVENT_READ | SOCK_EVENT_WRITE))) {
+        fds[num_fds].fd = s->fd;
+        fds[num_fds].events = (short)(((events & SOCK_EVENT_READ) ? POLLIN : 0) | ((events & SOCK_EVENT_WRITE) ? POLLOUT : 0));
+        fds[num_fds].revents = 0;
+        num_fds++;
+    }
+
+    do {
+        rc = poll(fds, (nfds_t)num_fds, timeout_ms);
+    } while(rc < 0 && errno == EINTR);
+
+    if(rc < 0) {
+        pdebug(DEBUG_WARN, "Error waiting on socket, errno: %d", errno);
+        return PLCTAG_ERR_READ;
+    }
+
+    if(rc == 0) {
+        return PLCTAG_ERR_TIMEOUT;
+    }
+
+    if(fds[0].revents & POLLIN) {
+        uint8_t buf[32];
+
+        /* drain the pipe, all wake ups are the same. */
+        while(read(s->wake_read_fd, buf, sizeof(buf)) > 0) { }
+
+        result |= SOCK_EVENT_WAKE_UP;
+    }
+
+    if(num_fds > 1) {
+        /* errors and hang ups are reported as readable so that the next read sees them. */
+        if(fds[1].revents & (POLLIN | POLLERR | POLLHUP)) {
+            result |= (events & SOCK_EVENT_READ);
+        }
+
+        if(fds[1].revents & (POLLOUT | POLLERR | POLLHUP)) {
+            result |= (events & SOCK_EVENT_WRITE);
+        }
+    }
+
+    return (result ? result : PLCTAG_ERR_TIMEOUT);
+}
+
+
+
+struct sock_wait_set_t {
+    struct pollfd *fds;
+    int *fd_index;
+    int capacity;
+};
+
+
+extern int socket_wait_set_create(sock_wait_set_p *set)
+{
+    if(!set) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *set = mem_alloc((int)sizeof(struct sock_wait_set_t));
+    if(!*set) {
+        pdebug(DEBUG_ERROR, "Unable to allocate wait set!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int socket_wait_set_destroy(sock_wait_set_p *set)
+{
+    if(!set || !*set) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    mem_free((*set)->fds);
+    mem_free((*set)->fd_index);
+    mem_free(*set);
+
+    *set = NULL;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * socket_wait_events
+ *
+ * Like socket_wait_event() but for several sockets at once.  On entry
+ * events[i] holds the events to wait for on socks[i].  On return it holds
+ * the events that happened.  A wake up on any of the sockets ends the wait.
+ *
+ * The poll set is kept in the wait set and only grows when there are more
+ * sockets than ever before.
+ *
+ * Returns the number of sockets with events, PLCTAG_ERR_TIMEOUT if none or
+ * an error.
+ */
+extern int socket_wait_events(sock_wait_set_p set, sock_p *socks, int *events, int num_socks, int timeout_ms)
+{
+    struct pollfd *fds = NULL;
+    int *fd_index = NULL;
+    int num_fds = 0;
+    int num_ready = 0;
+    int rc = 0;
+
+    if(!set || !socks || !events || num_socks <= 0) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(num_socks > SOCKET_WAIT_MAX_SOCKS) {
+        pdebug(DEBUG_WARN, "Cannot wait on %d sockets, the limit is %d!", num_socks, SOCKET_WAIT_MAX_SOCKS);
+        return PLCTAG_ERR_TOO_LARGE;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+
+    if(set->capacity < num_socks) {
+        fds = mem_realloc(set->fds, (int)(sizeof(*fds) * (size_t)num_socks * 2));
+        if(fds) {
+            set->fds = fds;
+        }
+
+        fd_index = mem_realloc(set->fd_index, (int)(sizeof(*fd_index) * (size_t)num_socks));
+        if(fd_index) {
+            set->fd_index = fd_index;
+        }
+
+        if(!fds || !fd_index) {
+            pdebug(DEBUG_ERROR, "Unable to allocate poll set!");
+            return PLCTAG_ERR_NO_MEM;
+        }
+
+        set->capacity = num_socks;
+    }
+
+    fds = set->fds;
+    fd_index = set->fd_index;
+
+    for(int i=0; i < num_socks; i++) {
+        sock_p s = socks[i];
+
+        /* the wake up pipe always comes first, the socket itself only if needed. */
+        fd_index[i] = num_fds;
+
+        fds[num_fds].fd = s->wake_read_fd;
+        fds[num_fds].events = POLLIN;
+        fds[num_fds].revents = 0;
+        num_fds++;
+
+        if((s->is_open || s->is_connecting) && (events[i] & (SOCK_EVENT_READ | SOCK_EVENT_WRITE))) {
+            fds[num_fds].fd = s->fd;
+            fds[num_fds].events = (short)(((events[i] & SOCK_EVENT_READ) ? POLLIN : 0) | ((events[i] & SOCK_EVENT_WRITE) ? POLLOUT : 0));
+            fds[num_fds].revents = 0;
+            num_fds++;
+        }
+    }
+
+    do {
+        rc = poll(fds, (nfds_t)num_fds, timeout_ms);
+    } while(rc < 0 && errno == EINTR);
+
+    if(rc < 0) {
+        pdebug(DEBUG_WARN, "Error waiting on sockets, errno: %d", errno);
+        return PLCTAG_ERR_READ;
+    }
+
+    for(int i=0; i < num_socks; i++) {
+        int index = fd_index[i];
+        int has_sock_fd = ((i + 1 < num_socks ? fd_index[i + 1] : num_fds) - index) > 1;
+        int result = SOCK_EVENT_NONE;
+
+        if(fds[index].revents & POLLIN) {
+            uint8_t buf[32];
+
+            /* drain the pipe, all wake ups are the same. */
+            while(read(socks[i]->wake_read_fd, buf, sizeof(buf)) > 0) { }
+
+            result |= SOCK_EVENT_WAKE_UP;
+        }
+
+        if(has_sock_fd) {
+            if(fds[index + 1].revents & (POLLIN | POLLERR | POLLHUP)) {
+                result |= (events[i] & SOCK_EVENT_READ);
+            }
+
+            if(fds[index + 1].revents & (POLLOUT | POLLERR | POLLHUP)) {
+                result |= (events[i] & SOCK_EVENT_WRITE);
+            }
+        }
+
+        events[i] = result;
+
+        if(result) {
+            num_ready++;
+        }
+    }
+
+    return (num_ready ? num_ready : PLCTAG_ERR_TIMEOUT);
+}
+
+
+
+/*
+ * socket_wake
+ *
+ * Wake up any thread waiting in socket_wait_event().  This is safe to call
+ * from any thread.
+ */
+extern int socket_wake(sock_p s)
+{
+    uint8_t dummy = 1;
+
+    if(!s) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* if the pipe is full, the waiter will wake anyway. */
+    if(write(s->wake_write_fd, &dummy, sizeof(dummy)) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        pdebug(DEBUG_WARN, "Unable to write to wake up pipe, errno: %d", errno);
+        return PLCTAG_ERR_WRITE;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int set_fd_non_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if(flags < 0) {
+        return PLCTAG_ERR_OPEN;
+    }
+
+    if(fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return PLCTAG_ERR_OPEN;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
 
 
 
@@ -1104,3 +1779,32 @@ int64_t time_ms(void)
 
     return  ((int64_t)tv.tv_sec*1000)+ ((int64_t)tv.tv_usec/1000);
 }
+
+
+/*
+ * time_us
+ *
+ * Return a monotonic time in microseconds.  Only differences between
+ * two values are meaningful.
+ */
+int64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((int64_t)ts.tv_sec * 1000000) + ((int64_t)ts.tv_nsec / 1000);
+}
+
+
+/*
+ * cpu_count
+ *
+ * Return the number of processors available, at least one.
+ */
+int cpu_count(void)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (num_cpus > 0 ? (int)num_cpus : 1);
+}
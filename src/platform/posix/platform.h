@@ -109,6 +109,14 @@ extern int mutex_try_lock(mutex_p m);
 extern int mutex_unlock(mutex_p m);
 extern int mutex_destroy(mutex_p *m);
 
+/* condition variable functions/defs.  A signal is latched until a waiter consumes it. */
+typedef struct cond_t *cond_p;
+extern int cond_create(cond_p *c);
+extern int cond_wait(cond_p c, int timeout_ms);
+extern int cond_signal(cond_p c);
+extern int cond_clear(cond_p c);
+extern int cond_destroy(cond_p *c);
+
 
 
 /* macros are evil */
@@ -161,15 +169,46 @@ extern int lock_acquire_try(lock_t *lock);
 extern int lock_acquire(lock_t *lock);
 extern void lock_release(lock_t *lock);
 
+/* atomic pointer swaps.  atomic_ptr_cas returns non-zero if the swap happened. */
+extern int atomic_ptr_cas(void * volatile *ptr, void *old_val, void *new_val);
+extern void *atomic_ptr_exchange(void * volatile *ptr, void *new_val);
+
+/* atomic integer operations.  atomic_int_add returns the new value. */
+extern int atomic_int_add(volatile int *ptr, int val);
+extern int atomic_int_cas(volatile int *ptr, int old_val, int new_val);
+
+/* 64-bit counters.  Adding zero reads the value. */
+extern int64_t atomic_int64_add(volatile int64_t *ptr, int64_t val);
+
 /* socket functions */
 typedef struct sock_t *sock_p;
 extern int socket_create(sock_p *s);
 extern int socket_connect_tcp(sock_p s, const char *host, int port);
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port);
+extern int socket_connect_tcp_check(sock_p s, int timeout_ms);
 extern int socket_read(sock_p s, uint8_t *buf, int size);
 extern int socket_write(sock_p s, uint8_t *buf, int size);
 extern int socket_close(sock_p s);
 extern int socket_destroy(sock_p *s);
 
+#define SOCK_EVENT_NONE         (0)
+#define SOCK_EVENT_READ         (1 << 0)
+#define SOCK_EVENT_WRITE        (1 << 1)
+#define SOCK_EVENT_WAKE_UP      (1 << 2)
+
+extern int socket_wait_event(sock_p s, int events, int timeout_ms);
+extern int socket_wake(sock_p s);
+
+/* scratch space for waiting on several sockets at once, kept by the waiting thread. */
+typedef struct sock_wait_set_t *sock_wait_set_p;
+
+/* poll() has no fixed limit, this only bounds the work of one waiting thread. */
+#define SOCKET_WAIT_MAX_SOCKS   (1024)
+
+extern int socket_wait_set_create(sock_wait_set_p *set);
+extern int socket_wait_set_destroy(sock_wait_set_p *set);
+extern int socket_wait_events(sock_wait_set_p set, sock_p *socks, int *events, int num_socks, int timeout_ms);
+
 /* serial handling */
 typedef struct serial_port_t *serial_port_p;
 #define PLC_SERIAL_PORT_NULL ((plc_serial_port)NULL)
@@ -183,6 +222,8 @@ extern int plc_lib_serial_port_write(serial_port_p serial_port, uint8_t *data, i
 /* misc functions */
 extern int sleep_ms(int ms);
 extern int64_t time_ms(void);
+extern int64_t time_us(void);
+extern int cpu_count(void);
 
 #define snprintf_platform snprintf
 
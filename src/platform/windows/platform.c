@@ -588,6 +588,150 @@ int mutex_destroy(mutex_p *m)
 
 
 
+/***************************************************************************
+ ************************* Condition Variables *****************************
+ **************************************************************************/
+
+/*
+ * These work like a latched event.  A signal is remembered until a waiter
+ * sees it, so a signal sent before the wait starts is not lost.  An
+ * auto-reset event does exactly that.
+ */
+
+struct cond_t {
+    HANDLE h_event;
+};
+
+
+int cond_create(cond_p *c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition variable pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *c = (struct cond_t *)mem_alloc(sizeof(struct cond_t));
+
+    if(! *c) {
+        pdebug(DEBUG_ERROR, "Unable to allocate condition variable.");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    (*c)->h_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(!(*c)->h_event) {
+        mem_free(*c);
+        *c = NULL;
+        pdebug(DEBUG_ERROR, "Error initializing condition variable.");
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * cond_wait
+ *
+ * Wait up to timeout_ms for the condition to be signalled.  Returns
+ * PLCTAG_ERR_TIMEOUT if it was not.  The signal is consumed.
+ */
+int cond_wait(cond_p c, int timeout_ms)
+{
+    DWORD wait_rc = 0;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition variable pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+
+    wait_rc = WaitForSingleObject(c->h_event, (DWORD)timeout_ms);
+
+    if(wait_rc == WAIT_TIMEOUT) {
+        return PLCTAG_ERR_TIMEOUT;
+    }
+
+    if(wait_rc != WAIT_OBJECT_0) {
+        pdebug(DEBUG_WARN, "error waiting on condition variable.");
+        return PLCTAG_ERR_MUTEX_LOCK;
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int cond_signal(cond_p c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition variable pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(!SetEvent(c->h_event)) {
+        pdebug(DEBUG_WARN, "error signalling condition variable.");
+        return PLCTAG_ERR_MUTEX_LOCK;
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int cond_clear(cond_p c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition variable pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    ResetEvent(c->h_event);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int cond_destroy(cond_p *c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c || !*c) {
+        pdebug(DEBUG_WARN, "null condition variable pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    CloseHandle((*c)->h_event);
+
+    mem_free(*c);
+
+    *c = NULL;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
 /***************************************************************************
  ******************************* Threads ***********************************
  **************************************************************************/
@@ -795,6 +939,44 @@ extern void lock_release(lock_t *lock)
 }
 
 
+/*
+ * atomic_ptr_cas
+ *
+ * Replace the pointer with new_val only if it still holds old_val.
+ *
+ * Returns non-zero if the pointer was replaced.
+ */
+
+int atomic_ptr_cas(void * volatile *ptr, void *old_val, void *new_val)
+{
+    return (InterlockedCompareExchangePointer(ptr, new_val, old_val) == old_val) ? 1 : 0;
+}
+
+
+void *atomic_ptr_exchange(void * volatile *ptr, void *new_val)
+{
+    return InterlockedExchangePointer(ptr, new_val);
+}
+
+
+int atomic_int_add(volatile int *ptr, int val)
+{
+    return (int)InterlockedExchangeAdd((volatile LONG *)ptr, (LONG)val) + val;
+}
+
+
+int atomic_int_cas(volatile int *ptr, int old_val, int new_val)
+{
+    return (InterlockedCompareExchange((volatile LONG *)ptr, (LONG)new_val, (LONG)old_val) == (LONG)old_val) ? 1 : 0;
+}
+
+
+int64_t atomic_int64_add(volatile int64_t *ptr, int64_t val)
+{
+    return (int64_t)InterlockedExchangeAdd64((volatile LONGLONG *)ptr, (LONGLONG)val) + val;
+}
+
+
 
 
 
@@ -807,14 +989,29 @@ extern void lock_release(lock_t *lock)
  **************************************************************************/
 
 
+#define MAX_IPS (8)
+
+/* how long a blocking connect may take. */
+#define SOCKET_CONNECT_TIMEOUT (10000)
+
 struct sock_t {
     SOCKET fd;
     int port;
     int is_open;
-};
 
+    /* used to wait for socket readiness and to wake up the waiter. */
+    WSAEVENT sock_event;
+    HANDLE wake_event;
 
-#define MAX_IPS (8)
+    /* non-blocking connection set up. */
+    int is_connecting;
+    IN_ADDR ips[MAX_IPS];
+    int num_ips;
+    int ip_index;
+};
+
+static int socket_open_fd(SOCKET *fd_out);
+static int socket_connect_next_ip(sock_p s);
 
 
 /* windows needs to have the Winsock library initialized
@@ -851,6 +1048,24 @@ extern int socket_create(sock_p *s)
         return PLCTAG_ERR_NO_MEM;
     }
 
+    (*s)->sock_event = WSACreateEvent();
+    if((*s)->sock_event == WSA_INVALID_EVENT) {
+        pdebug(DEBUG_ERROR, "Unable to create socket event!");
+        mem_free(*s);
+        *s = NULL;
+        return PLCTAG_ERR_CREATE;
+    }
+
+    /* manual reset so that a wake up is not lost if nobody is waiting. */
+    (*s)->wake_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if(!(*s)->wake_event) {
+        pdebug(DEBUG_ERROR, "Unable to create wake up event!");
+        WSACloseEvent((*s)->sock_event);
+        mem_free(*s);
+        *s = NULL;
+        return PLCTAG_ERR_CREATE;
+    }
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
@@ -858,26 +1073,22 @@ extern int socket_create(sock_p *s)
 
 
 
-extern int socket_connect_tcp(sock_p s, const char *host, int port)
+/*
+ * Open a new TCP socket and set all the options we need on it.
+ */
+static int socket_open_fd(SOCKET *fd_out)
 {
-    IN_ADDR ips[MAX_IPS];
-    int num_ips = 0;
-    struct sockaddr_in gw_addr;
+    SOCKET fd;
     int sock_opt = 1;
     u_long non_blocking=1;
-    int i = 0;
-    int done = 0;
-    SOCKET fd;
     struct timeval timeout; /* used for timing out connections etc. */
     struct linger so_linger;
 
-    pdebug(DEBUG_DETAIL, "Starting.");
-
     /* Open a socket for communication with the gateway. */
     fd = socket(AF_INET, SOCK_STREAM, 0/*IPPROTO_TCP*/);
 
     /* check for errors */
-    if(fd < 0) {
+    if(fd == INVALID_SOCKET) {
         /*pdebug("Socket creation failed, errno: %d",errno);*/
         return PLCTAG_ERR_OPEN;
     }
@@ -891,6 +1102,15 @@ extern int socket_connect_tcp(sock_p s, const char *host, int port)
         return PLCTAG_ERR_OPEN;
     }
 
+    /* requests are small and may be sent back to back, do not let Nagle hold them. */
+    sock_opt = 1;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&sock_opt, sizeof(sock_opt))) {
+        closesocket(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket no-delay option, errno: %d", errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
     timeout.tv_sec = 10;
     timeout.tv_usec = 0;
 
@@ -916,19 +1136,105 @@ extern int socket_connect_tcp(sock_p s, const char *host, int port)
         return PLCTAG_ERR_OPEN;
     }
 
+    /* the connect itself is non-blocking too. */
+    if(ioctlsocket(fd,FIONBIO,&non_blocking)) {
+        /*pdebug("Error getting socket options, errno: %d", errno);*/
+        closesocket(fd);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    *fd_out = fd;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * Start a connection attempt to the next address we have not tried yet.
+ */
+static int socket_connect_next_ip(sock_p s)
+{
+    struct sockaddr_in gw_addr;
+
+    memset((void *)&gw_addr,0, sizeof(gw_addr));
+    gw_addr.sin_family = AF_INET ;
+    gw_addr.sin_port = htons((u_short)s->port);
+
+    /* try each IP until we run out or get a connection started. */
+    while(s->ip_index < s->num_ips) {
+        SOCKET fd = INVALID_SOCKET;
+        int rc = socket_open_fd(&fd);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            return rc;
+        }
+
+        gw_addr.sin_addr.s_addr = s->ips[s->ip_index].s_addr;
+
+        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+
+        if(rc == 0) {
+            s->fd = fd;
+            s->is_open = 1;
+            return PLCTAG_STATUS_OK;
+        }
+
+        if(WSAGetLastError() == WSAEWOULDBLOCK) {
+            s->fd = fd;
+            s->is_connecting = 1;
+            return PLCTAG_STATUS_PENDING;
+        }
+
+        /* MSVC does not like inet_ntoa(), not safe. */
+        pdebug(DEBUG_DETAIL, "Attempt to connect to address %d failed, error: %d", s->ip_index, WSAGetLastError());
+        closesocket(fd);
+        s->ip_index++;
+    }
+
+    pdebug(DEBUG_WARN,"Unable to connect to any gateway host IP address!");
+
+    return PLCTAG_ERR_OPEN;
+}
+
+
+
+/*
+ * socket_connect_tcp_start
+ *
+ * Look up the host and start connecting to it without blocking.  Returns
+ * PLCTAG_STATUS_PENDING if the connection is in progress.  Use
+ * socket_connect_tcp_check() to find out when it is done.
+ */
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port)
+{
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!s || !host) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(s->is_open || s->is_connecting) {
+        socket_close(s);
+    }
+
+    s->num_ips = 0;
+    s->ip_index = 0;
+    s->port = port;
+
     /* figure out what address we are connecting to. */
 
     /* try a numeric IP address conversion first. */
-    if(inet_pton(AF_INET,host,(struct in_addr *)ips) > 0) {
+    if(inet_pton(AF_INET,host,(struct in_addr *)s->ips) > 0) {
         pdebug(DEBUG_DETAIL, "Found numeric IP address: %s", host);
-        num_ips = 1;
+        s->num_ips = 1;
     } else {
         struct addrinfo hints;
         struct addrinfo* res_head = NULL;
         struct addrinfo *res = NULL;
         int rc = 0;
 
-        mem_set(&ips, 0, sizeof(ips));
+        mem_set(&s->ips, 0, sizeof(s->ips));
         mem_set(&hints, 0, sizeof(hints));
 
         hints.ai_socktype = SOCK_STREAM; /* TCP */
@@ -937,7 +1243,7 @@ extern int socket_connect_tcp(sock_p s, const char *host, int port)
         if ((rc = getaddrinfo(host, NULL, &hints, &res_head)) != 0) {
             pdebug(DEBUG_WARN, "Error looking up PLC IP address %s, error = %d\n", host, rc);
 
-            if (res) {
+            if (res_head) {
                 freeaddrinfo(res_head);
             }
 
@@ -945,82 +1251,107 @@ extern int socket_connect_tcp(sock_p s, const char *host, int port)
         }
 
         res = res_head;
-        for (num_ips = 0; res && num_ips < MAX_IPS; num_ips++) {
-            ips[num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
+        for (s->num_ips = 0; res && s->num_ips < MAX_IPS; s->num_ips++) {
+            s->ips[s->num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
             res = res->ai_next;
         }
 
         freeaddrinfo(res_head);
     }
 
+    pdebug(DEBUG_DETAIL, "Done.");
 
-    /*
-     * now try to connect to the remote gateway.  We may need to
-     * try several of the IPs we have.
-     */
+    return socket_connect_next_ip(s);
+}
 
-    i = 0;
-    done = 0;
 
-    memset((void *)&gw_addr,0, sizeof(gw_addr));
-    gw_addr.sin_family = AF_INET ;
-    gw_addr.sin_port = htons(port);
 
-    do {
-        int rc;
-        /* try each IP until we run out or get a connection. */
-        gw_addr.sin_addr.s_addr = ips[i].s_addr;
+/*
+ * socket_connect_tcp_check
+ *
+ * Wait up to timeout_ms for a connection started with socket_connect_tcp_start()
+ * to complete.  Returns PLCTAG_STATUS_OK when connected, PLCTAG_STATUS_PENDING
+ * if still in progress or an error.  Failed addresses are skipped automatically.
+ */
+extern int socket_connect_tcp_check(sock_p s, int timeout_ms)
+{
+    fd_set write_set;
+    fd_set error_set;
+    struct timeval timeout;
+    int rc = 0;
 
-        /*pdebug(DEBUG_DETAIL,"Attempting to connect to %s",inet_ntoa(*((struct in_addr *)&ips[i])));*/
+    if(!s) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
 
-        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+    if(!s->is_connecting) {
+        return (s->is_open ? PLCTAG_STATUS_OK : PLCTAG_ERR_OPEN);
+    }
 
-        if( rc == 0) {
-            /* Windows MSVC does not like inet_ntoa(), not safe.
-             * pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&ips[i])));
-             */
-            done = 1;
-        } else {
-            /* MSVC does not like inet_ntoa(), not safe.
-             * pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&ips[i])),errno);
-             */
-            i++;
-        }
-    } while(!done && i < num_ips);
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
 
-    if(!done) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Unable to connect to any gateway host IP address!");
+    /* Windows reports a failed connect through the exception set. */
+    FD_ZERO(&write_set);
+    FD_ZERO(&error_set);
+    FD_SET(s->fd, &write_set);
+    FD_SET(s->fd, &error_set);
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+    rc = select(0, NULL, &write_set, &error_set, &timeout);
+    if(rc == SOCKET_ERROR) {
+        pdebug(DEBUG_WARN, "Error waiting for connection, error: %d", WSAGetLastError());
         return PLCTAG_ERR_OPEN;
     }
 
+    if(rc == 0) {
+        return PLCTAG_STATUS_PENDING;
+    }
 
-    /* FIXME
-     * connect() is a little easier to handle in blocking mode, for now
-     * we make the socket non-blocking here, after connect().
-     */
+    s->is_connecting = 0;
 
-    if(ioctlsocket(fd,FIONBIO,&non_blocking)) {
-        /*pdebug("Error getting socket options, errno: %d", errno);*/
-        closesocket(fd);
-        return PLCTAG_ERR_OPEN;
+    if(FD_ISSET(s->fd, &write_set)) {
+        s->is_open = 1;
+        return PLCTAG_STATUS_OK;
     }
 
-    /* save the values */
-    s->fd = fd;
-    s->port = port;
-    s->is_open = 1;
+    pdebug(DEBUG_DETAIL, "Attempt to connect to address %d failed.", s->ip_index);
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    closesocket(s->fd);
+    s->fd = INVALID_SOCKET;
+    s->ip_index++;
 
-    return PLCTAG_STATUS_OK;
+    return socket_connect_next_ip(s);
 }
 
 
 
+extern int socket_connect_tcp(sock_p s, const char *host, int port)
+{
+    int64_t timeout_time = time_ms() + SOCKET_CONNECT_TIMEOUT;
+    int rc = PLCTAG_STATUS_OK;
 
+    pdebug(DEBUG_DETAIL, "Starting.");
 
+    rc = socket_connect_tcp_start(s, host, port);
 
+    while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
+        rc = socket_connect_tcp_check(s, (int)(timeout_time - time_ms()));
+    }
+
+    if(rc == PLCTAG_STATUS_PENDING) {
+        pdebug(DEBUG_WARN, "Timed out connecting to %s!", host);
+        socket_close(s);
+        rc = PLCTAG_ERR_TIMEOUT;
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
 
 
 
@@ -1041,6 +1372,12 @@ extern int socket_read(sock_p s, uint8_t *buf, int size)
     /* The socket is non-blocking. */
     rc = recv(s->fd, (char *)buf, size, 0);
 
+    /* a zero length read means the other end closed the connection. */
+    if(rc == 0 && size > 0) {
+        pdebug(DEBUG_WARN, "Socket closed by remote end.");
+        return PLCTAG_ERR_READ;
+    }
+
     if(rc < 0) {
         int err = WSAGetLastError();
 
@@ -1094,16 +1431,20 @@ extern int socket_close(sock_p s)
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    if(!s->is_open) {
+    if(!s->is_open && !s->is_connecting) {
         return PLCTAG_STATUS_OK;
     }
 
-    if(!closesocket(s->fd)) {
+    /* the socket is gone either way. */
+    s->is_open = 0;
+    s->is_connecting = 0;
+
+    if(closesocket(s->fd)) {
+        s->fd = INVALID_SOCKET;
         return PLCTAG_ERR_CLOSE;
     }
 
-    s->fd = 0;
-    s->is_open = 0;
+    s->fd = INVALID_SOCKET;
 
     return PLCTAG_STATUS_OK;
 }
@@ -1116,6 +1457,9 @@ extern int socket_destroy(sock_p *s)
 
     socket_close(*s);
 
+    WSACloseEvent((*s)->sock_event);
+    CloseHandle((*s)->wake_event);
+
     mem_free(*s);
 
     *s = 0;
@@ -1128,6 +1472,274 @@ extern int socket_destroy(sock_p *s)
 
 
 
+/* check the socket for readiness without blocking. */
+static int socket_check_ready(sock_p s, int events)
+{
+    fd_set read_set;
+    fd_set write_set;
+    struct timeval no_wait = {0, 0};
+    int result = SOCK_EVENT_NONE;
+
+    if((!s->is_open && !s->is_connecting) || !(events & (SOCK_EVENT_READ | SOCK_EVENT_WRITE))) {
+        return SOCK_EVENT_NONE;
+    }
+
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+
+    if(events & SOCK_EVENT_READ) {
+        FD_SET(s->fd, &read_set);
+    }
+
+    if(events & SOCK_EVENT_WRITE) {
+        FD_SET(s->fd, &write_set);
+    }
+
+    if(select(0, &read_set, &write_set, NULL, &no_wait) > 0) {
+        if(FD_ISSET(s->fd, &read_set)) {
+            result |= SOCK_EVENT_READ;
+        }
+
+        if(FD_ISSET(s->fd, &write_set)) {
+            result |= SOCK_EVENT_WRITE;
+        }
+    }
+
+    return result;
+}
+
+
+/*
+ * socket_wait_event
+ *
+ * Block until the socket is ready for one of the requested events, another
+ * thread calls socket_wake() or the timeout expires.  If the socket is not
+ * open, only the wake up event is waited for.
+ *
+ * Returns the mask of the events that happened, PLCTAG_ERR_TIMEOUT if none did
+ * or an error.
+ */
+extern int socket_wait_event(sock_p s, int events, int timeout_ms)
+{
+    HANDLE wait_handles[2];
+    DWORD num_handles = 0;
+    int result = SOCK_EVENT_NONE;
+
+    if(!s) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+
+    /* FD_WRITE is only signalled on transitions, so check the current state first. */
+    result = socket_check_ready(s, events);
+
+    if(result == SOCK_EVENT_NONE) {
+        wait_handles[num_handles++] = s->wake_event;
+
+        if((s->is_open || s->is_connecting) && (events & (SOCK_EVENT_READ | SOCK_EVENT_WRITE))) {
+            long net_events = 0;
+
+            if(events & SOCK_EVENT_READ) {
+                net_events |= FD_READ | FD_CLOSE;
+            }
+
+            if(events & SOCK_EVENT_WRITE) {
+                net_events |= FD_WRITE | FD_CONNECT | FD_CLOSE;
+            }
+
+            WSAResetEvent(s->sock_event);
+
+            if(WSAEventSelect(s->fd, s->sock_event, net_events) == SOCKET_ERROR) {
+                pdebug(DEBUG_WARN, "Error setting up socket event, error: %d", WSAGetLastError());
+                return PLCTAG_ERR_READ;
+            }
+
+            wait_handles[num_handles++] = s->sock_event;
+        }
+
+        if(WaitForMultipleObjects(num_handles, wait_handles, FALSE, (DWORD)timeout_ms) == WAIT_FAILED) {
+            pdebug(DEBUG_WARN, "Error waiting on socket, error: %d", (int)GetLastError());
+            return PLCTAG_ERR_READ;
+        }
+
+        result = socket_check_ready(s, events);
+    }
+
+    if(WaitForSingleObject(s->wake_event, 0) == WAIT_OBJECT_0) {
+        ResetEvent(s->wake_event);
+        result |= SOCK_EVENT_WAKE_UP;
+    }
+
+    return (result ? result : PLCTAG_ERR_TIMEOUT);
+}
+
+
+
+struct sock_wait_set_t {
+    HANDLE wait_handles[MAXIMUM_WAIT_OBJECTS];
+    int results[SOCKET_WAIT_MAX_SOCKS];
+};
+
+
+extern int socket_wait_set_create(sock_wait_set_p *set)
+{
+    if(!set) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *set = mem_alloc((int)sizeof(struct sock_wait_set_t));
+    if(!*set) {
+        pdebug(DEBUG_ERROR, "Unable to allocate wait set!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int socket_wait_set_destroy(sock_wait_set_p *set)
+{
+    if(!set || !*set) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    mem_free(*set);
+
+    *set = NULL;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * socket_wait_events
+ *
+ * Like socket_wait_event() but for several sockets at once.  On entry
+ * events[i] holds the events to wait for on socks[i].  On return it holds
+ * the events that happened.  A wake up on any of the sockets ends the wait.
+ *
+ * Windows can only wait on MAXIMUM_WAIT_OBJECTS handles at once and each
+ * socket can take two, so at most SOCKET_WAIT_MAX_SOCKS sockets can be
+ * waited on.  Callers with more sockets need more waiting threads.
+ *
+ * Returns the number of sockets with events, PLCTAG_ERR_TIMEOUT if none or
+ * an error.
+ */
+extern int socket_wait_events(sock_wait_set_p set, sock_p *socks, int *events, int num_socks, int timeout_ms)
+{
+    HANDLE *wait_handles = NULL;
+    DWORD num_handles = 0;
+    int *results = NULL;
+    int num_ready = 0;
+    int64_t timeout_time = 0;
+
+    if(!set || !socks || !events || num_socks <= 0) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(num_socks > SOCKET_WAIT_MAX_SOCKS) {
+        pdebug(DEBUG_WARN, "Cannot wait on %d sockets, the limit is %d!", num_socks, SOCKET_WAIT_MAX_SOCKS);
+        return PLCTAG_ERR_TOO_LARGE;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+
+    timeout_time = time_ms() + timeout_ms;
+
+    wait_handles = set->wait_handles;
+    results = set->results;
+
+    do {
+        int64_t wait_ms = 0;
+
+        /* check what is ready right now. */
+        for(int i=0; i < num_socks; i++) {
+            results[i] = socket_check_ready(socks[i], events[i]);
+
+            if(WaitForSingleObject(socks[i]->wake_event, 0) == WAIT_OBJECT_0) {
+                ResetEvent(socks[i]->wake_event);
+                results[i] |= SOCK_EVENT_WAKE_UP;
+            }
+
+            if(results[i]) {
+                num_ready++;
+            }
+        }
+
+        if(num_ready || timeout_time <= time_ms()) {
+            break;
+        }
+
+        /* nothing yet, set up the events to wait on. */
+        num_handles = 0;
+
+        for(int i=0; i < num_socks; i++) {
+            sock_p s = socks[i];
+
+            wait_handles[num_handles++] = s->wake_event;
+
+            if((s->is_open || s->is_connecting) && (events[i] & (SOCK_EVENT_READ | SOCK_EVENT_WRITE))) {
+                long net_events = FD_CLOSE;
+
+                if(events[i] & SOCK_EVENT_READ) {
+                    net_events |= FD_READ;
+                }
+
+                if(events[i] & SOCK_EVENT_WRITE) {
+                    net_events |= FD_WRITE | FD_CONNECT;
+                }
+
+                WSAResetEvent(s->sock_event);
+
+                if(WSAEventSelect(s->fd, s->sock_event, net_events) != SOCKET_ERROR) {
+                    wait_handles[num_handles++] = s->sock_event;
+                }
+            }
+        }
+
+        wait_ms = timeout_time - time_ms();
+
+        WaitForMultipleObjects(num_handles, wait_handles, FALSE, (DWORD)(wait_ms > 0 ? wait_ms : 0));
+    } while(1);
+
+    for(int i=0; i < num_socks; i++) {
+        events[i] = results[i];
+    }
+
+    return (num_ready ? num_ready : PLCTAG_ERR_TIMEOUT);
+}
+
+
+
+/*
+ * socket_wake
+ *
+ * Wake up any thread waiting in socket_wait_event().  This is safe to call
+ * from any thread.
+ */
+extern int socket_wake(sock_p s)
+{
+    if(!s) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(!SetEvent(s->wake_event)) {
+        pdebug(DEBUG_WARN, "Unable to signal wake up event!");
+        return PLCTAG_ERR_WRITE;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
 
 
 
@@ -1441,6 +2053,43 @@ int64_t time_ms(void)
 }
 
 
+/*
+ * time_us
+ *
+ * Return a monotonic time in microseconds.  Only differences between
+ * two values are meaningful.
+ */
+int64_t time_us(void)
+{
+    static LARGE_INTEGER freq = {0};
+    LARGE_INTEGER count;
+
+    if(!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+
+    QueryPerformanceCounter(&count);
+
+    /* split the division so that the multiply cannot overflow. */
+    return ((count.QuadPart / freq.QuadPart) * 1000000) + (((count.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart);
+}
+
+
+/*
+ * cpu_count
+ *
+ * Return the number of processors available, at least one.
+ */
+int cpu_count(void)
+{
+    SYSTEM_INFO sys_info;
+
+    GetSystemInfo(&sys_info);
+
+    return (sys_info.dwNumberOfProcessors > 0 ? (int)sys_info.dwNumberOfProcessors : 1);
+}
+
+
 struct tm *localtime_r(const time_t *timep, struct tm *result)
 {
     time_t t = *timep;
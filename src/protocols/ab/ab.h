@@ -37,10 +37,28 @@
 
 #include <lib/libplctag.h>
 #include <util/attr.h>
+#include <util/histogram.h>
 
 void ab_teardown(void);
 int ab_init();
 plc_tag_p ab_tag_create(attr attribs);
 
+/* performance counters of the connections to one PLC. */
+typedef struct ab_session_stats_t {
+    int64_t requests_queued;
+    int64_t requests_sent;
+    int64_t bundles_sent;           /* packets of one or more requests. */
+    int64_t bytes_out;
+    int64_t bytes_in;
+    int64_t reconnects;
+    int64_t forward_open_retries;
+    int64_t timeouts;               /* requests that timed out in the queue or on the wire. */
+    int64_t queue_depth;            /* requests waiting to be sent now. */
+    histogram_t queue_wait;         /* microseconds from queueing a request to sending it. */
+    histogram_t round_trip;         /* microseconds from sending a packet to its response. */
+} ab_session_stats_t;
+
+int ab_get_session_stats(const char *gateway, const char *path, ab_session_stats_t *stats);
+
 
 #endif
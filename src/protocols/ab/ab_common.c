@@ -84,6 +84,7 @@ volatile int ab_protocol_terminating = 0;
 
 /* forward declarations*/
 static int get_tag_data_type(ab_tag_p tag, attr attribs);
+static int get_tag_priority(ab_tag_p tag, attr attribs);
 
 static void ab_tag_destroy(ab_tag_p tag);
 static int default_abort(plc_tag_p tag);
@@ -187,6 +188,24 @@ void ab_teardown(void)
 
 
 
+/*
+ * ab_get_session_stats
+ *
+ * Performance counters of the connections to a gateway, summed.  This is
+ * used by the system session_stats tag.
+ */
+int ab_get_session_stats(const char *gateway, const char *path, ab_session_stats_t *stats)
+{
+    if(!gateway || !stats) {
+        pdebug(DEBUG_WARN, "Called with null gateway or stats pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    return session_get_stats(gateway, path, stats);
+}
+
+
+
 plc_tag_p ab_tag_create(attr attribs)
 {
     ab_tag_p tag = AB_TAG_NULL;
@@ -304,6 +323,14 @@ plc_tag_p ab_tag_create(attr attribs)
     /* pass the connection requirement since it may be overridden above. */
     attr_set_int(attribs, "use_connected_msg", tag->use_connected_msg);
 
+    /* requests from higher priority tags are sent before anything else queued in the session. */
+    rc = get_tag_priority(tag, attribs);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Error getting tag priority %s!", plc_tag_decode_error(rc));
+        tag->status = rc;
+        return (plc_tag_p)tag;
+    }
+
     /* determine the total tag size if this is not a tag list. */
 //    if(!tag->tag_list) {
 //        if(!tag->elem_size) {
@@ -551,6 +578,26 @@ int get_tag_data_type(ab_tag_p tag, attr attribs)
 }
 
 
+int get_tag_priority(ab_tag_p tag, attr attribs)
+{
+    const char *priority = attr_get_str(attribs, "priority", "normal");
+
+    if(str_cmp_i(priority, "high") == 0) {
+        tag->priority = SESSION_PRIORITY_HIGH;
+    } else if(str_cmp_i(priority, "normal") == 0) {
+        tag->priority = SESSION_PRIORITY_NORMAL;
+    } else if(str_cmp_i(priority, "low") == 0) {
+        tag->priority = SESSION_PRIORITY_LOW;
+    } else {
+        pdebug(DEBUG_WARN, "Unknown priority %s, must be high, normal or low!", priority);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
 
 int default_abort(plc_tag_p tag)
 {
@@ -621,10 +668,12 @@ int ab_tag_abort(ab_tag_p tag)
         }
 
         tag->req = rc_dec(tag->req);
-    } else {
+    } else if(!tag->frags) {
         pdebug(DEBUG_DETAIL, "Called without a request in flight.");
     }
 
+    ab_tag_abort_frags(tag);
+
     tag->read_in_progress = 0;
     tag->write_in_progress = 0;
     tag->offset = 0;
@@ -637,6 +686,38 @@ int ab_tag_abort(ab_tag_p tag)
 
 
 
+/*
+ * ab_tag_abort_frags
+ *
+ * Abort and release any fragments of a read or write that are still
+ * queued or in flight.
+ */
+void ab_tag_abort_frags(ab_tag_p tag)
+{
+    if(!tag->frags) {
+        return;
+    }
+
+    for(int i = 0; i < tag->num_frags; i++) {
+        ab_request_p req = tag->frags[i].req;
+
+        if(req) {
+            spin_block(&req->lock) {
+                req->abort_request = 1;
+            }
+
+            tag->frags[i].req = rc_dec(req);
+        }
+    }
+
+    mem_free(tag->frags);
+    tag->frags = NULL;
+    tag->num_frags = 0;
+}
+
+
+
+
 /*
  * ab_tag_status
  *
@@ -712,11 +793,23 @@ void ab_tag_destroy(ab_tag_p tag)
         tag->api_mutex = NULL;
     }
 
+    if(tag->tag_cond_wait) {
+        cond_destroy(&(tag->tag_cond_wait));
+        tag->tag_cond_wait = NULL;
+    }
+
+    ab_tag_abort_frags(tag);
+
     if (tag->data) {
         mem_free(tag->data);
         tag->data = NULL;
     }
 
+    if(tag->prev_data) {
+        mem_free(tag->prev_data);
+        tag->prev_data = NULL;
+    }
+
     pdebug(DEBUG_INFO,"Finished releasing all tag resources.");
 
     pdebug(DEBUG_INFO, "done");
@@ -735,6 +828,25 @@ int ab_get_int_attrib(plc_tag_p raw_tag, const char *attrib_name, int default_va
         res = tag->elem_size;
     } else if(str_cmp_i(attrib_name, "elem_count") == 0) {
         res = tag->elem_count;
+    } else if(str_cmp_i(attrib_name, "priority") == 0) {
+        res = tag->priority;
+    } else if(str_cmp_i(attrib_name, "queue_wait_count") == 0
+              || str_cmp_i(attrib_name, "queue_wait_avg_ms") == 0
+              || str_cmp_i(attrib_name, "queue_wait_max_ms") == 0) {
+        /* queue wait statistics for the tag's priority class on its session. */
+        int64_t count = 0;
+        int64_t total_ms = 0;
+        int64_t max_ms = 0;
+
+        if(tag->session && session_get_queue_wait(tag->session, tag->priority, &count, &total_ms, &max_ms) == PLCTAG_STATUS_OK) {
+            if(str_cmp_i(attrib_name, "queue_wait_count") == 0) {
+                res = (int)count;
+            } else if(str_cmp_i(attrib_name, "queue_wait_avg_ms") == 0) {
+                res = (count > 0 ? (int)(total_ms / count) : 0);
+            } else {
+                res = (int)max_ms;
+            }
+        }
     }
 
     return res;
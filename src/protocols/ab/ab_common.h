@@ -49,6 +49,7 @@ typedef struct ab_request_t *ab_request_p;
 
 
 extern int ab_tag_abort(ab_tag_p tag);
+extern void ab_tag_abort_frags(ab_tag_p tag);
 extern int ab_tag_status(ab_tag_p tag);
 
 
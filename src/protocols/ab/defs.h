@@ -53,6 +53,10 @@
 
 #define DEFAULT_MAX_REQUESTS (10)   /* number of requests and request sizes to allocate by default. */
 
+/* sizes used to estimate how big a CIP reply will be. */
+#define AB_CIP_REPLY_HEADER_SIZE (4)  /* service, reserved, status, extended status word count */
+#define AB_CIP_READ_TYPE_INFO_SIZE (4) /* type in front of read data, at most type plus structure handle */
+
 
 /* AB Constants*/
 #define AB_EIP_OK   (0)
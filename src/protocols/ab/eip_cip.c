@@ -128,17 +128,23 @@ START_PACK typedef struct {
 
 
 
-static int build_read_request_connected(ab_tag_p tag, int byte_offset);
+static int build_read_request_connected(ab_tag_p tag, int byte_offset, ab_request_p *req_out);
+static int build_read_frags_connected(ab_tag_p tag);
 static int build_tag_list_request_connected(ab_tag_p tag);
 static int build_read_request_unconnected(ab_tag_p tag, int byte_offset);
-static int build_write_request_connected(ab_tag_p tag, int byte_offset);
+static int build_write_request_connected(ab_tag_p tag, int byte_offset, ab_request_p *req_out);
+static int build_write_frags_connected(ab_tag_p tag);
 static int build_write_request_unconnected(ab_tag_p tag, int byte_offset);
 static int build_write_bit_request_connected(ab_tag_p tag);
 static int build_write_bit_request_unconnected(ab_tag_p tag);
 static int check_read_status_connected(ab_tag_p tag);
+static int check_read_frags_connected(ab_tag_p tag);
+static int decode_read_response_connected(ab_tag_p tag, ab_request_p req, int offset, int *data_size, int *partial_data);
 static int check_read_tag_list_status_connected(ab_tag_p tag);
 static int check_read_status_unconnected(ab_tag_p tag);
 static int check_write_status_connected(ab_tag_p tag);
+static int check_write_frags_connected(ab_tag_p tag);
+static int decode_write_response_connected(ab_request_p req);
 static int check_write_status_unconnected(ab_tag_p tag);
 static int calculate_write_data_per_packet(ab_tag_p tag);
 
@@ -284,8 +290,15 @@ int tag_read_start(ab_tag_p tag)
     if(tag->use_connected_msg) {
         if(tag->tag_list) {
             rc = build_tag_list_request_connected(tag);
+        } else if(!tag->first_read && !tag->pre_write_read && tag->frag_data_size > 0 && (tag->size - tag->offset) > tag->frag_data_size
+                  && session_get_max_requests_in_flight(tag->session) > 1) {
+            /*
+             * we know how the PLC will split this up, so ask for all of it at once.  With
+             * only one request in flight at a time this would not save any round trips.
+             */
+            rc = build_read_frags_connected(tag);
         } else {
-            rc = build_read_request_connected(tag, tag->offset);
+            rc = build_read_request_connected(tag, tag->offset, &tag->req);
         }
     } else {
         rc = build_read_request_unconnected(tag, tag->offset);
@@ -355,6 +368,7 @@ int tag_write_start(ab_tag_p tag)
         return tag_read_start(tag);
     }
 
+    rc = calculate_write_data_per_packet(tag);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_WARN,"Unable to calculate write sizes!");
         tag->write_in_progress = 0;
@@ -363,7 +377,13 @@ int tag_write_start(ab_tag_p tag)
     }
 
     if(tag->use_connected_msg) {
-        rc = build_write_request_connected(tag, tag->offset);
+        if(!tag->is_bit && (tag->size - tag->offset) > tag->write_data_per_packet
+           && session_get_max_requests_in_flight(tag->session) > 1) {
+            /* queue all the fragments at once and let the session pipeline them. */
+            rc = build_write_frags_connected(tag);
+        } else {
+            rc = build_write_request_connected(tag, tag->offset, &tag->req);
+        }
     } else {
         rc = build_write_request_unconnected(tag, tag->offset);
     }
@@ -383,7 +403,7 @@ int tag_write_start(ab_tag_p tag)
 }
 
 
-int build_read_request_connected(ab_tag_p tag, int byte_offset)
+int build_read_request_connected(ab_tag_p tag, int byte_offset, ab_request_p *req_out)
 {
     eip_cip_co_req* cip = NULL;
     uint8_t* data = NULL;
@@ -393,7 +413,7 @@ int build_read_request_connected(ab_tag_p tag, int byte_offset)
     pdebug(DEBUG_INFO, "Starting.");
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->tag_id, (plc_tag_p)tag, &req);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
         return rc;
@@ -450,28 +470,80 @@ int build_read_request_connected(ab_tag_p tag, int byte_offset)
     /* set the size of the request */
     req->request_size = (int)(data - (req->data));
 
+    /* once the first read has told us the tag size, we know how big the reply will be. */
+    if(tag->elem_size > 0) {
+        req->response_size = AB_CIP_REPLY_HEADER_SIZE + AB_CIP_READ_TYPE_INFO_SIZE + (tag->elem_size * tag->elem_count) - byte_offset;
+    }
+
     /* set the session so that we know what session the request is aiming at */
     //req->session = tag->session;
 
-    req->allow_packing = tag->allow_packing;
+    /* each fragment response fills a whole packet, so there is no point packing those. */
+    req->allow_packing = (tag->frags ? 0 : tag->allow_packing);
 
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to add request to session! rc=%d", rc);
-        tag->req = rc_dec(req);
+        *req_out = rc_dec(req);
         return rc;
     }
 
     /* save the request for later */
-    tag->req = req;
+    *req_out = req;
 
     pdebug(DEBUG_INFO, "Done");
 
     return PLCTAG_STATUS_OK;
 }
 
+
+
+/*
+ * build_read_frags_connected
+ *
+ * Queue a read request for every fragment of the tag from the current
+ * offset on.  The fragments are the size the PLC returned for the last
+ * fragmented read, so each request should come back full.  The session
+ * pipelines them up to its limit of requests in flight.
+ */
+
+int build_read_frags_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int num_frags = 0;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    num_frags = (tag->size - tag->offset + tag->frag_data_size - 1) / tag->frag_data_size;
+
+    tag->frags = (ab_frag_t *)mem_alloc((int)(sizeof(ab_frag_t) * (size_t)num_frags));
+    if(!tag->frags) {
+        pdebug(DEBUG_WARN, "Unable to allocate fragment list!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    tag->num_frags = num_frags;
+
+    for(int i = 0; i < num_frags; i++) {
+        tag->frags[i].offset = tag->offset + (i * tag->frag_data_size);
+
+        rc = build_read_request_connected(tag, tag->frags[i].offset, &tag->frags[i].req);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to build read request for fragment at offset %d!", tag->frags[i].offset);
+            ab_tag_abort_frags(tag);
+            return rc;
+        }
+    }
+
+    pdebug(DEBUG_INFO, "Done. Queued %d fragments.", num_frags);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
 int build_tag_list_request_connected(ab_tag_p tag)
 {
     eip_cip_co_req* cip = NULL;
@@ -485,7 +557,7 @@ int build_tag_list_request_connected(ab_tag_p tag)
     pdebug(DEBUG_INFO, "Starting.");
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->tag_id, (plc_tag_p)tag, &req);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
         return rc;
@@ -620,7 +692,7 @@ int build_read_request_unconnected(ab_tag_p tag, int byte_offset)
     pdebug(DEBUG_INFO, "Starting.");
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->tag_id, (plc_tag_p)tag, &req);
 
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
@@ -748,7 +820,7 @@ int build_write_bit_request_connected(ab_tag_p tag)
     pdebug(DEBUG_INFO, "Starting.");
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->tag_id, (plc_tag_p)tag, &req);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
         return rc;
@@ -965,6 +1037,9 @@ int build_write_bit_request_connected(ab_tag_p tag)
     /* allow packing if the tag allows it. */
     req->allow_packing = tag->allow_packing;
 
+    /* a write reply is just the status. */
+    req->response_size = AB_CIP_REPLY_HEADER_SIZE;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -998,7 +1073,7 @@ int build_write_bit_request_unconnected(ab_tag_p tag)
     pdebug(DEBUG_INFO, "Starting.");
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->tag_id, (plc_tag_p)tag, &req);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
         return rc;
@@ -1271,7 +1346,7 @@ int build_write_bit_request_unconnected(ab_tag_p tag)
 
 
 
-int build_write_request_connected(ab_tag_p tag, int byte_offset)
+int build_write_request_connected(ab_tag_p tag, int byte_offset, ab_request_p *req_out)
 {
     int rc = PLCTAG_STATUS_OK;
     eip_cip_co_req* cip = NULL;
@@ -1287,18 +1362,12 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
     }
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->tag_id, (plc_tag_p)tag, &req);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
         return rc;
     }
 
-    rc = calculate_write_data_per_packet(tag);
-    if (rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_ERROR, "Unable to calculate valid write data per packet!.  rc=%s", plc_tag_decode_error(rc));
-        return rc;
-    }
-
     if(tag->write_data_per_packet < tag->size) {
         multiple_requests = 1;
     }
@@ -1339,6 +1408,7 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
         data += tag->encoded_type_info_size;
     } else {
         pdebug(DEBUG_WARN,"Data type unsupported!");
+        rc_dec(req);
         return PLCTAG_ERR_UNSUPPORTED;
     }
 
@@ -1353,16 +1423,16 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
     }
 
     /* how much data to write? */
-    write_size = tag->size - tag->offset;
+    write_size = tag->size - byte_offset;
 
     if(write_size > tag->write_data_per_packet) {
         write_size = tag->write_data_per_packet;
     }
 
     /* now copy the data to write */
-    mem_copy(data, tag->data + tag->offset, write_size);
+    mem_copy(data, tag->data + byte_offset, write_size);
     data += write_size;
-    tag->offset += write_size;
+    tag->offset = byte_offset + write_size;
 
     /* need to pad data to multiple of 16-bits */
     if (write_size & 0x01) {
@@ -1388,20 +1458,23 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
     /* set the size of the request */
     req->request_size = (int)(data - (req->data));
 
-    /* allow packing if the tag allows it. */
-    req->allow_packing = tag->allow_packing;
+    /* allow packing if the tag allows it.  Fragments fill a packet on their own. */
+    req->allow_packing = (tag->frags ? 0 : tag->allow_packing);
+
+    /* a write reply is just the status. */
+    req->response_size = AB_CIP_REPLY_HEADER_SIZE;
 
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to add request to session! rc=%d", rc);
-        tag->req = rc_dec(req);
+        *req_out = rc_dec(req);
         return rc;
     }
 
     /* save the request for later */
-    tag->req = req;
+    *req_out = req;
 
     pdebug(DEBUG_INFO, "Done");
 
@@ -1410,6 +1483,53 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
 
 
 
+/*
+ * build_write_frags_connected
+ *
+ * Queue a write request for every fragment of the tag data from the
+ * current offset on.  The write is only complete when all of them have
+ * been acknowledged.
+ */
+
+int build_write_frags_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int num_frags = 0;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    num_frags = (tag->size - tag->offset + tag->write_data_per_packet - 1) / tag->write_data_per_packet;
+
+    tag->frags = (ab_frag_t *)mem_alloc((int)(sizeof(ab_frag_t) * (size_t)num_frags));
+    if(!tag->frags) {
+        pdebug(DEBUG_WARN, "Unable to allocate fragment list!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    tag->num_frags = num_frags;
+
+    for(int i = 0; i < num_frags; i++) {
+        tag->frags[i].offset = tag->offset;
+
+        rc = build_write_request_connected(tag, tag->frags[i].offset, &tag->frags[i].req);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to build write request for fragment at offset %d!", tag->frags[i].offset);
+            ab_tag_abort_frags(tag);
+            tag->offset = 0;
+            return rc;
+        }
+
+        /* the request builder moved the offset past the data it took. */
+        tag->frags[i].size = tag->offset - tag->frags[i].offset;
+    }
+
+    pdebug(DEBUG_INFO, "Done. Queued %d fragments.", num_frags);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
 
 int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
 {
@@ -1429,7 +1549,7 @@ int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
     }
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->tag_id, (plc_tag_p)tag, &req);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
         return rc;
@@ -1600,9 +1720,7 @@ int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
 static int check_read_status_connected(ab_tag_p tag)
 {
     int rc = PLCTAG_STATUS_OK;
-    eip_cip_co_resp* cip_resp;
-    uint8_t* data;
-    uint8_t* data_end;
+    int data_size = 0;
     int partial_data = 0;
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1612,6 +1730,10 @@ static int check_read_status_connected(ab_tag_p tag)
         return PLCTAG_ERR_NULL_PTR;
     }
 
+    if(tag->frags) {
+        return check_read_frags_connected(tag);
+    }
+
     if (!tag->req) {
         tag->read_in_progress = 0;
         tag->offset = 0;
@@ -1656,15 +1778,188 @@ static int check_read_status_connected(ab_tag_p tag)
     }
 
     /* the request is ours exclusively. */
+    rc = decode_read_response_connected(tag, tag->req, tag->offset, &data_size, &partial_data);
+
+    /* bump the byte offset */
+    if(rc == PLCTAG_STATUS_OK) {
+        tag->offset += data_size;
+    }
+
+    /* clean up the request */
+    tag->req->abort_request = 1;
+    tag->req = rc_dec(tag->req);
+
+    /* are we actually done? */
+    if (rc == PLCTAG_STATUS_OK) {
+        /* this particular read is done. */
+        tag->read_in_progress = 0;
+
+        /* skip if we are doing a pre-write read. */
+        if (!tag->pre_write_read && partial_data) {
+            /* remember how much the PLC sends at a time so later fragments can go out together. */
+            if(data_size > 0) {
+                tag->frag_data_size = data_size;
+            }
+
+            /* call read start again to get the next piece */
+            pdebug(DEBUG_DETAIL, "calling tag_read_start() to get the next chunk.");
+            rc = tag_read_start(tag);
+        } else {
+            /* done! */
+            tag->first_read = 0;
+            tag->offset = 0;
+
+            /* if this is a pre-read for a write, then pass off to the write routine */
+            if (tag->pre_write_read) {
+                pdebug(DEBUG_DETAIL, "Restarting write call now.");
+                tag->pre_write_read = 0;
+                rc = tag_write_start(tag);
+            }
+        }
+    }
+
+    /* this is not an else clause because the above if could result in bad rc. */
+    if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+        /* error ! */
+        pdebug(DEBUG_WARN, "Error received!");
+
+        /* clean up everything. */
+        ab_tag_abort(tag);
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * check_read_frags_connected
+ *
+ * Collect the responses to a read that was sent as parallel fragments.
+ * The read is done when every fragment is in.  If the PLC returned less
+ * than expected for any fragment, the rest is read from the first gap on.
+ */
+
+static int check_read_frags_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int pending = 0;
+    int gap_offset = -1;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    for(int i = 0; i < tag->num_frags && rc == PLCTAG_STATUS_OK; i++) {
+        ab_frag_t *frag = &(tag->frags[i]);
+        int resp_received = 0;
+        int partial_data = 0;
+
+        /* already processed? */
+        if(!frag->req) {
+            continue;
+        }
+
+        spin_block(&frag->req->lock) {
+            resp_received = frag->req->resp_received;
+
+            if(resp_received && frag->req->status != PLCTAG_STATUS_OK) {
+                rc = frag->req->status;
+                pdebug(DEBUG_WARN,"Session reported failure of fragment request: %s.", plc_tag_decode_error(rc));
+            }
+        }
+
+        if(!resp_received) {
+            pending = 1;
+            continue;
+        }
+
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = decode_read_response_connected(tag, frag->req, frag->offset, &frag->size, &partial_data);
+        }
+
+        frag->req->abort_request = 1;
+        frag->req = rc_dec(frag->req);
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Error received!");
+
+        /* clean up everything, including the fragments still in flight. */
+        ab_tag_abort(tag);
+
+        return rc;
+    }
+
+    if(pending) {
+        pdebug(DEBUG_SPEW, "Done.  Fragments still pending.");
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    /* all in, check that the fragments covered the whole tag. */
+    for(int i = 0; i < tag->num_frags; i++) {
+        int frag_end = tag->frags[i].offset + tag->frags[i].size;
+        int next_offset = (i + 1 < tag->num_frags ? tag->frags[i + 1].offset : tag->size);
+
+        if(frag_end < next_offset) {
+            gap_offset = frag_end;
+            break;
+        }
+    }
+
+    /* releases the now empty fragment list. */
+    ab_tag_abort_frags(tag);
+
+    tag->read_in_progress = 0;
+
+    if(gap_offset >= 0) {
+        pdebug(DEBUG_DETAIL, "PLC returned less data than expected, reading the rest from offset %d.", gap_offset);
+
+        tag->frag_data_size = 0;
+        tag->offset = gap_offset;
+
+        rc = tag_read_start(tag);
+        if(rc != PLCTAG_STATUS_PENDING) {
+            ab_tag_abort(tag);
+        }
+    } else {
+        tag->first_read = 0;
+        tag->offset = 0;
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * decode_read_response_connected
+ *
+ * Check the response to one read request and copy its data into the tag
+ * at the given offset.  The number of data bytes and whether the PLC has
+ * more are passed back.
+ */
+
+static int decode_read_response_connected(ab_tag_p tag, ab_request_p req, int offset, int *data_size, int *partial_data)
+{
+    int rc = PLCTAG_STATUS_OK;
+    eip_cip_co_resp* cip_resp;
+    uint8_t* data;
+    uint8_t* data_end;
+
+    *data_size = 0;
+    *partial_data = 0;
 
     /* point to the data */
-    cip_resp = (eip_cip_co_resp*)(tag->req->data);
+    cip_resp = (eip_cip_co_resp*)(req->data);
 
     /* point to the start of the data */
-    data = (tag->req->data) + sizeof(eip_cip_co_resp);
+    data = (req->data) + sizeof(eip_cip_co_resp);
 
     /* point the end of the data */
-    data_end = (tag->req->data + le2h16(cip_resp->encap_length) + sizeof(eip_encap));
+    data_end = (req->data + le2h16(cip_resp->encap_length) + sizeof(eip_encap));
 
     /* check the status */
     do {
@@ -1706,7 +2001,7 @@ static int check_read_status_connected(ab_tag_p tag)
         }
 
         /* check to see if this is a partial response. */
-        partial_data = (cip_resp->status == AB_CIP_STATUS_FRAG);
+        *partial_data = (cip_resp->status == AB_CIP_STATUS_FRAG);
 
         /*
          * check to see if there is any data to process.  If this is a packed
@@ -1762,8 +2057,8 @@ static int check_read_status_connected(ab_tag_p tag)
             payload_size = (data_end - data);
 
             /* copy the data into the tag and realloc if we need more space. */
-            if(payload_size + tag->offset > tag->size) {
-                tag->size = (int)payload_size + tag->offset;
+            if(payload_size + offset > tag->size) {
+                tag->size = (int)payload_size + offset;
                 tag->elem_size = tag->size / tag->elem_count;
 
                 pdebug(DEBUG_DETAIL, "Increasing tag buffer size to %d bytes.", tag->size);
@@ -1785,11 +2080,10 @@ static int check_read_status_connected(ab_tag_p tag)
              * put into the tag's data buffer.
              */
             if (!tag->pre_write_read) {
-                mem_copy(tag->data + tag->offset, data, (int)(payload_size));
+                mem_copy(tag->data + offset, data, (int)(payload_size));
             }
 
-            /* bump the byte offset */
-            tag->offset += (int)(payload_size);
+            *data_size = (int)payload_size;
         } else {
             pdebug(DEBUG_DETAIL, "Response returned no data and no error.");
         }
@@ -1798,50 +2092,12 @@ static int check_read_status_connected(ab_tag_p tag)
         rc = PLCTAG_STATUS_OK;
     } while(0);
 
-    /* clean up the request */
-    tag->req->abort_request = 1;
-    tag->req = rc_dec(tag->req);
-
-    /* are we actually done? */
-    if (rc == PLCTAG_STATUS_OK) {
-        /* this particular read is done. */
-        tag->read_in_progress = 0;
-
-        /* skip if we are doing a pre-write read. */
-        if (!tag->pre_write_read && partial_data) {
-            /* call read start again to get the next piece */
-            pdebug(DEBUG_DETAIL, "calling tag_read_start() to get the next chunk.");
-            rc = tag_read_start(tag);
-        } else {
-            /* done! */
-            tag->first_read = 0;
-            tag->offset = 0;
-
-            /* if this is a pre-read for a write, then pass off to the write routine */
-            if (tag->pre_write_read) {
-                pdebug(DEBUG_DETAIL, "Restarting write call now.");
-                tag->pre_write_read = 0;
-                rc = tag_write_start(tag);
-            }
-        }
-    }
-
-    /* this is not an else clause because the above if could result in bad rc. */
-    if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
-        /* error ! */
-        pdebug(DEBUG_WARN, "Error received!");
-
-        /* clean up everything. */
-        ab_tag_abort(tag);
-    }
-
-    pdebug(DEBUG_SPEW, "Done.");
-
     return rc;
 }
 
 
 
+
 /*
  * check_read_tag_list_status_connected
  *
@@ -2301,7 +2557,6 @@ static int check_read_status_unconnected(ab_tag_p tag)
 
 static int check_write_status_connected(ab_tag_p tag)
 {
-    eip_cip_co_resp* cip_resp;
     int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -2311,6 +2566,10 @@ static int check_write_status_connected(ab_tag_p tag)
         return PLCTAG_ERR_NULL_PTR;
     }
 
+    if(tag->frags) {
+        return check_write_frags_connected(tag);
+    }
+
     if (!tag->req) {
         tag->write_in_progress = 0;
         tag->offset = 0;
@@ -2351,9 +2610,124 @@ static int check_write_status_connected(ab_tag_p tag)
     }
 
     /* the request is ours exclusively. */
+    rc = decode_write_response_connected(tag->req);
+
+    /* clean up the request. */
+    tag->req->abort_request = 1;
+    tag->req = rc_dec(tag->req);
+
+    /* write is done in one way or another. */
+    tag->write_in_progress = 0;
+
+    if(rc == PLCTAG_STATUS_OK) {
+        if(tag->offset < tag->size) {
+
+            pdebug(DEBUG_DETAIL, "Write not complete, triggering next round.");
+            rc = tag_write_start(tag);
+        } else {
+            /* only clear this if we are done. */
+            tag->offset = 0;
+        }
+    } else {
+        pdebug(DEBUG_WARN,"Write failed!");
+
+        tag->offset = 0;
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+
+
+
+/*
+ * check_write_frags_connected
+ *
+ * Collect the responses to a write that was sent as parallel fragments.
+ * The write is done when every fragment has been answered.  If any of
+ * them failed, the status of the first failed fragment is returned.
+ */
+
+static int check_write_frags_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int pending = 0;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    for(int i = 0; i < tag->num_frags; i++) {
+        ab_frag_t *frag = &(tag->frags[i]);
+        int resp_received = 0;
+
+        /* already processed? */
+        if(!frag->req) {
+            continue;
+        }
+
+        spin_block(&frag->req->lock) {
+            resp_received = frag->req->resp_received;
+
+            if(resp_received && frag->req->status != PLCTAG_STATUS_OK) {
+                frag->status = frag->req->status;
+                pdebug(DEBUG_WARN,"Session reported failure of fragment request: %s.", plc_tag_decode_error(frag->status));
+            }
+        }
+
+        if(!resp_received) {
+            pending = 1;
+            continue;
+        }
+
+        if(frag->status == PLCTAG_STATUS_OK) {
+            frag->status = decode_write_response_connected(frag->req);
+        }
+
+        frag->req->abort_request = 1;
+        frag->req = rc_dec(frag->req);
+    }
+
+    if(pending) {
+        pdebug(DEBUG_SPEW, "Done.  Fragments still pending.");
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    /* all answered, report the first failure if there was one. */
+    for(int i = 0; i < tag->num_frags && rc == PLCTAG_STATUS_OK; i++) {
+        if(tag->frags[i].status != PLCTAG_STATUS_OK) {
+            rc = tag->frags[i].status;
+            pdebug(DEBUG_WARN, "Write of fragment at offset %d failed with %s!", tag->frags[i].offset, plc_tag_decode_error(rc));
+        }
+    }
+
+    /* releases the now empty fragment list. */
+    ab_tag_abort_frags(tag);
+
+    tag->write_in_progress = 0;
+    tag->offset = 0;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * decode_write_response_connected
+ *
+ * Check the PLC's response to one write request.
+ */
+
+static int decode_write_response_connected(ab_request_p req)
+{
+    eip_cip_co_resp* cip_resp;
+    int rc = PLCTAG_STATUS_OK;
 
     /* point to the data */
-    cip_resp = (eip_cip_co_resp*)(tag->req->data);
+    cip_resp = (eip_cip_co_resp*)(req->data);
 
     do {
         if (le2h16(cip_resp->encap_command) != AB_EIP_CONNECTED_SEND) {
@@ -2384,30 +2758,6 @@ static int check_write_status_connected(ab_tag_p tag)
         }
     } while(0);
 
-    /* clean up the request. */
-    tag->req->abort_request = 1;
-    tag->req = rc_dec(tag->req);
-
-    /* write is done in one way or another. */
-    tag->write_in_progress = 0;
-
-    if(rc == PLCTAG_STATUS_OK) {
-        if(tag->offset < tag->size) {
-
-            pdebug(DEBUG_DETAIL, "Write not complete, triggering next round.");
-            rc = tag_write_start(tag);
-        } else {
-            /* only clear this if we are done. */
-            tag->offset = 0;
-        }
-    } else {
-        pdebug(DEBUG_WARN,"Write failed!");
-
-        tag->offset = 0;
-    }
-
-    pdebug(DEBUG_SPEW, "Done.");
-
     return rc;
 }
 
@@ -249,7 +249,7 @@ int tag_read_start(ab_tag_p tag)
     }
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->tag_id, (plc_tag_p)tag, &req);
 
     if(rc != PLCTAG_STATUS_OK) {
         tag->read_in_progress = 0;
@@ -617,7 +617,7 @@ int tag_write_start(ab_tag_p tag)
     }
 
     /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = session_create_request(tag->session, tag->tag_id, (plc_tag_p)tag, &req);
 
     if(rc != PLCTAG_STATUS_OK) {
         tag->write_in_progress = 0;
@@ -37,7 +37,10 @@
 #include <ab/defs.h>
 #include <ab/error_codes.h>
 #include <ab/session.h>
+#include <ab/tag.h>
+#include <util/capture.h>
 #include <util/debug.h>
+#include <util/trace.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -66,6 +69,46 @@
 
 #define SESSION_DISCONNECT_TIMEOUT (5000)
 
+/*
+ * Longest time the session thread waits without checking its state.  New
+ * requests and termination wake the thread up immediately.
+ */
+#define SESSION_IDLE_WAIT_TIME (100)
+
+/* how long to wait for the TCP connection to the gateway. */
+#define SESSION_CONNECT_TIMEOUT (10000)
+
+/*
+ * Most request buffers a session keeps around for reuse.  Each one is
+ * the negotiated payload size plus the EIP/CIP prefix, so this bounds
+ * the idle memory per session to a few hundred KB at worst.
+ */
+#define REQUEST_POOL_MAX_FREE (64)
+
+/* how far down the request queue the packer looks for requests to fill a packet. */
+#define PACK_WINDOW (32)
+
+/* requests older than this are not passed over by the packer. */
+#define PACK_MAX_AGE_MS (50)
+
+
+
+/*
+ * A packet that has been sent to the PLC but for which we have not
+ * seen the response.  The response is matched back to the packet with
+ * the sender context (unconnected) or connection sequence number (connected).
+ */
+typedef struct inflight_bundle_t *inflight_bundle_p;
+struct inflight_bundle_t {
+    int is_connected;
+    uint64_t seq_id;
+    int64_t time_sent;
+    int64_t time_sent_us; /* monotonic, for the round trip histogram. */
+    int num_requests;
+    int num_packets; /* requests after these are duplicate reads sharing a reply. */
+    ab_request_p requests[];
+};
+
 
 
 static ab_session_p session_create_unsafe(const char *host, int gw_port, const char *path, plc_type_t plc_type, int use_connected_msg);
@@ -79,22 +122,40 @@ static int session_add_request_unsafe(ab_session_p sess, ab_request_p req);
 static int session_open_socket(ab_session_p session);
 static void session_destroy(void *session);
 static int session_register(ab_session_p session);
+static int recv_register_session_resp(ab_session_p session);
 static int session_close_socket(ab_session_p session);
 static int session_unregister(ab_session_p session);
+static int session_step(ab_session_p session, int *wait_events, int64_t *wait_until);
 static THREAD_FUNC(session_handler);
+static int session_reactor_step(void *arg, int *wait_events, int64_t *wait_until);
 static int purge_aborted_requests_unsafe(ab_session_p session);
+static int purge_expired_requests_unsafe(ab_session_p session);
+static int request_goes_before(ab_request_p first, ab_request_p second);
 static int process_requests(ab_session_p session);
+static int session_wait_time(int64_t wait_until);
+static int send_next_bundle(ab_session_p session, int *num_sent);
+static int select_bundle_unsafe(ab_session_p session, ab_request_p *bundled_requests, int remaining_space, int *num_packets);
+static int is_same_read(ab_request_p first, ab_request_p second);
+static int request_is_held(ab_request_p request);
+static int request_tag_queued_before(ab_session_p session, int index, plc_tag_p tag);
+static void session_wake_held(void *arg);
+static int recv_next_bundle(ab_session_p session);
+static int find_inflight_bundle(ab_session_p session);
+static void fail_inflight_bundles(ab_session_p session, int status);
+static void fail_bundled_requests(ab_request_p *requests, int num_requests, int status);
 //static int check_packing(ab_session_p session, ab_request_p request);
 static int get_payload_size(ab_request_p request);
+static int get_response_size(ab_request_p request);
 static int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests);
 static int prepare_request(ab_session_p session);
 static int send_eip_request(ab_session_p session, int timeout);
 static int recv_eip_response(ab_session_p session, int timeout);
+static int read_eip_response(ab_session_p session);
 static int unpack_response(ab_session_p session, ab_request_p request, int sub_packet);
-static int perform_forward_open(ab_session_p session);
 static int perform_forward_close(ab_session_p session);
-static int try_forward_open_ex(ab_session_p session, int *max_payload_size_guess);
-static int try_forward_open(ab_session_p session);
+static void start_forward_open(ab_session_p session);
+static int send_forward_open(ab_session_p session);
+static int retry_forward_open(ab_session_p session, int status);
 static int send_forward_open_req(ab_session_p session);
 static int send_forward_open_req_ex(ab_session_p session);
 static int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess);
@@ -104,6 +165,49 @@ static void request_destroy(void *req_arg);
 static int session_request_increase_buffer(ab_request_p request, int new_capacity);
 
 
+/*
+ * Request buffers are all the same size for a given connection, so
+ * instead of going to the heap for every operation they are recycled
+ * through a free list.  The pool is reference counted separately from
+ * the session so that requests outliving their session can still
+ * return their buffers.  Free buffers are linked through their first
+ * bytes.
+ */
+struct request_pool_t {
+    lock_t lock;
+    int capacity;
+    int num_free;
+    uint8_t *free_list;
+};
+
+static request_pool_p request_pool_create(void);
+static void request_pool_destroy(void *pool_arg);
+static uint8_t *request_pool_get(request_pool_p pool, int capacity);
+static void request_pool_put(request_pool_p pool, uint8_t *buffer, int capacity);
+
+/*
+ * With connection_count set above one, tags to the same PLC are spread
+ * over several sessions, each with its own TCP and CIP connection.  The
+ * group only holds weak references to its members; each member holds a
+ * reference to the group.  Tags are handed out to the members in turn
+ * and every request goes to whichever member has the shortest queue.
+ */
+struct session_group_t {
+    lock_t lock;
+    int next_member;
+    int num_members;
+    ab_session_p members[SESSION_MAX_CONNECTION_COUNT];
+};
+
+static ab_session_p find_group_session_unsafe(const char *host, const char *path, int connection_count, ab_session_p *group_leader);
+static int session_group_join_unsafe(ab_session_p leader, ab_session_p session);
+static void session_group_destroy(void *group_arg);
+static void session_group_leave(ab_session_p session);
+static ab_session_p session_group_select(ab_session_p session, ab_request_p req);
+static int session_queue_depth(ab_session_p session);
+static int session_has_group_request(ab_session_p session, int32_t group_id);
+
+
 static volatile mutex_p session_mutex = NULL;
 static volatile vector_p sessions = NULL;
 
@@ -207,6 +311,101 @@ int session_get_max_payload(ab_session_p session)
     return result;
 }
 
+int session_get_max_requests_in_flight(ab_session_p session)
+{
+    int result = SESSION_DEFAULT_REQUESTS_IN_FLIGHT;
+
+    if(!session) {
+        pdebug(DEBUG_WARN, "Called with null session pointer!");
+        return result;
+    }
+
+    critical_block(session->mutex) {
+        result = session->max_requests_in_flight;
+    }
+
+    return result;
+}
+
+
+
+/*
+ * session_get_queue_wait
+ *
+ * How many requests of the priority class have left the queue, and the
+ * total and longest time they spent waiting in it.
+ */
+int session_get_queue_wait(ab_session_p session, int priority, int64_t *count, int64_t *total_ms, int64_t *max_ms)
+{
+    if(!session) {
+        pdebug(DEBUG_WARN, "Called with null session pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(priority < 0 || priority >= SESSION_NUM_PRIORITIES) {
+        pdebug(DEBUG_WARN, "Priority %d is out of bounds!", priority);
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+
+    critical_block(session->mutex) {
+        *count = session->queue_wait_count[priority];
+        *total_ms = session->queue_wait_total_ms[priority];
+        *max_ms = session->queue_wait_max_ms[priority];
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * session_get_stats
+ *
+ * Sum the performance counters of all sessions to the gateway.  If the path
+ * is NULL, sessions with any path count.  Sessions that are closed and gone
+ * no longer count.
+ */
+int session_get_stats(const char *host, const char *path, ab_session_stats_t *stats)
+{
+    int num_sessions = 0;
+
+    mem_set(stats, 0, (int)sizeof(*stats));
+
+    if(!session_mutex) {
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(session_mutex) {
+        for(int i=0; i < vector_length(sessions); i++) {
+            ab_session_p session = vector_get(sessions, i);
+
+            if(str_cmp_i(host, session->host) || (path && str_cmp_i(path, session->path))) {
+                continue;
+            }
+
+            stats->requests_queued += atomic_int64_add(&session->stats.requests_queued, 0);
+            stats->requests_sent += atomic_int64_add(&session->stats.requests_sent, 0);
+            stats->bundles_sent += atomic_int64_add(&session->stats.bundles_sent, 0);
+            stats->bytes_out += atomic_int64_add(&session->stats.bytes_out, 0);
+            stats->bytes_in += atomic_int64_add(&session->stats.bytes_in, 0);
+            stats->reconnects += atomic_int64_add(&session->stats.reconnects, 0);
+            stats->forward_open_retries += atomic_int64_add(&session->stats.forward_open_retries, 0);
+            stats->timeouts += atomic_int64_add(&session->stats.timeouts, 0);
+            histogram_merge(&stats->queue_wait, &session->stats.queue_wait);
+            histogram_merge(&stats->round_trip, &session->stats.round_trip);
+            critical_block(session->mutex) {
+                stats->queue_depth += vector_length(session->requests);
+            }
+
+            num_sessions++;
+        }
+    }
+
+    pdebug(DEBUG_DETAIL, "Found %d sessions to %s.", num_sessions, host);
+
+    return (num_sessions ? PLCTAG_STATUS_OK : PLCTAG_ERR_NOT_FOUND);
+}
+
 int session_find_or_create(ab_session_p *tag_session, attr attribs)
 {
     /*int debug = attr_get_int(attribs,"debug",0);*/
@@ -221,9 +420,31 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
     int rc = PLCTAG_STATUS_OK;
     int auto_disconnect_enabled = 0;
     int auto_disconnect_timeout_ms = INT_MAX;
+    int max_requests_in_flight = attr_get_int(attribs, "max_requests_in_flight", SESSION_DEFAULT_REQUESTS_IN_FLIGHT);
+    int connection_count = attr_get_int(attribs, "connection_count", SESSION_DEFAULT_CONNECTION_COUNT);
+    ab_session_p group_leader = AB_SESSION_NULL;
+    const char *io_engine = attr_get_str(attribs, "io_engine", "thread");
+    int use_reactor = 0;
 
     pdebug(DEBUG_DETAIL, "Starting");
 
+    if(str_cmp_i(io_engine, "reactor") == 0) {
+        use_reactor = 1;
+    } else if(str_cmp_i(io_engine, "thread") != 0) {
+        pdebug(DEBUG_WARN, "Unsupported I/O engine \"%s\", must be \"thread\" or \"reactor\"!", io_engine);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if(max_requests_in_flight < 1 || max_requests_in_flight > SESSION_MAX_REQUESTS_IN_FLIGHT) {
+        pdebug(DEBUG_WARN, "Requests in flight must be between 1 and %d, got %d!", SESSION_MAX_REQUESTS_IN_FLIGHT, max_requests_in_flight);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if(connection_count < 1 || connection_count > SESSION_MAX_CONNECTION_COUNT) {
+        pdebug(DEBUG_WARN, "Connection count must be between 1 and %d, got %d!", SESSION_MAX_CONNECTION_COUNT, connection_count);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
     auto_disconnect_timeout_ms = attr_get_int(attribs, "auto_disconnect_ms", INT_MAX);
     if(auto_disconnect_timeout_ms != INT_MAX) {
         pdebug(DEBUG_DETAIL, "Setting auto-disconnect after %dms.", auto_disconnect_timeout_ms);
@@ -238,7 +459,9 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
 
     critical_block(session_mutex) {
         /* if we are to share sessions, then look for an existing one. */
-        if (shared_session) {
+        if (shared_session && connection_count > 1) {
+            session = find_group_session_unsafe(session_gw, session_path, connection_count, &group_leader);
+        } else if (shared_session) {
             session = find_session_by_host_unsafe(session_gw, session_path);
         } else {
             /* no sharing, create a new one */
@@ -255,8 +478,21 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
             } else {
                 session->auto_disconnect_enabled = auto_disconnect_enabled;
                 session->auto_disconnect_timeout_ms = auto_disconnect_timeout_ms;
+                session->max_requests_in_flight = max_requests_in_flight;
+                session->use_reactor = use_reactor;
 
                 new_session = 1;
+
+                /* add another connection to the PLC's group. */
+                if(group_leader) {
+                    rc = session_group_join_unsafe(group_leader, session);
+                    if(rc != PLCTAG_STATUS_OK) {
+                        pdebug(DEBUG_WARN, "Unable to add session to connection group!");
+                        rc_dec(session);
+                        session = AB_SESSION_NULL;
+                        new_session = 0;
+                    }
+                }
             }
         } else {
             /* turn on auto disconnect if we need to. */
@@ -269,10 +505,23 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
                 session->auto_disconnect_timeout_ms = auto_disconnect_timeout_ms;
             }
 
+            /* pipelining depth only goes up. */
+            if(session->max_requests_in_flight < max_requests_in_flight) {
+                session->max_requests_in_flight = max_requests_in_flight;
+            }
+
+            if(session->use_reactor != use_reactor) {
+                pdebug(DEBUG_DETAIL, "Shared session keeps the I/O engine it was created with.");
+            }
+
             pdebug(DEBUG_DETAIL, "Reusing existing session.");
         }
     }
 
+    if(group_leader) {
+        rc_dec(group_leader);
+    }
+
     /*
      * do this OUTSIDE the mutex in order to let other threads not block if
      * the session creation process blocks.
@@ -490,6 +739,22 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
         return NULL;
     }
 
+    session->inflight = vector_create(SESSION_MAX_REQUESTS_IN_FLIGHT, SESSION_MAX_REQUESTS_IN_FLIGHT);
+    if(!session->inflight) {
+        pdebug(DEBUG_WARN, "Unable to allocate vector for in flight requests!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    session->request_pool = request_pool_create();
+    if(!session->request_pool) {
+        pdebug(DEBUG_WARN, "Unable to allocate request buffer pool!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    session->max_requests_in_flight = SESSION_DEFAULT_REQUESTS_IN_FLIGHT;
+
     session->plc_type = plc_type;
     session->data_capacity = MAX_PACKET_SIZE_EX;
     session->use_connected_msg = use_connected_msg;
@@ -503,6 +768,9 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
 
     session->session_seq_id = (uint64_t)rand();
 
+    session->state = SESSION_OPEN_SOCKET;
+    session->auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
+
     /* guess the max CIP payload size. */
     switch(plc_type) {
     case AB_PROTOCOL_SLC:
@@ -573,13 +841,28 @@ int session_init(ab_session_p session)
         return rc;
     }
 
-    if((rc = thread_create((thread_p *)&(session->handler_thread), session_handler, 32*1024, session)) != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to create session thread!");
+    /* the socket lives as long as the session so that the thread can always be woken up. */
+    if((rc = socket_create(&(session->sock))) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to create socket for session!");
         session->failed = 1;
         return rc;
     }
 
-    pdebug(DEBUG_INFO, "Done.");
+    if(session->use_reactor) {
+        if((rc = reactor_add_client(session->sock, session_reactor_step, session, &(session->reactor_client))) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to add session to reactor!");
+            session->failed = 1;
+            return rc;
+        }
+    } else {
+        if((rc = thread_create((thread_p *)&(session->handler_thread), session_handler, 32*1024, session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to create session thread!");
+            session->failed = 1;
+            return rc;
+        }
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
 
     return rc;
 }
@@ -588,7 +871,8 @@ int session_init(ab_session_p session)
 /*
  * session_open_socket()
  *
- * Connect to the host/port passed via TCP.
+ * Start connecting to the host/port passed via TCP.  Returns
+ * PLCTAG_STATUS_PENDING if the connection is still in progress.
  */
 
 int session_open_socket(ab_session_p session)
@@ -598,20 +882,16 @@ int session_open_socket(ab_session_p session)
     pdebug(DEBUG_INFO, "Starting.");
 
     /* Open a socket for communication with the gateway. */
-    rc = socket_create(&(session->sock));
+    rc = socket_connect_tcp_start(session->sock, session->host, AB_EIP_DEFAULT_PORT);
 
-    if (rc) {
-        pdebug(DEBUG_WARN, "Unable to create socket for session!");
-        return 0;
-    }
-
-    rc = socket_connect_tcp(session->sock, session->host, AB_EIP_DEFAULT_PORT);
-
-    if (rc != PLCTAG_STATUS_OK) {
+    if (rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
         pdebug(DEBUG_WARN, "Unable to connect socket for session!");
         return rc;
     }
 
+    /* each connection is a new stream in the capture. */
+    capture_stream_init(&session->capture, session->host, AB_EIP_DEFAULT_PORT);
+
     pdebug(DEBUG_INFO, "Done.");
 
     return rc;
@@ -619,10 +899,15 @@ int session_open_socket(ab_session_p session)
 
 
 
+/*
+ * session_register
+ *
+ * Send the session registration request.  The session state machine reads
+ * the reply with recv_register_session_resp().
+ */
 int session_register(ab_session_p session)
 {
     eip_session_reg_req *req;
-    eip_encap *resp;
     int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO, "Starting.");
@@ -640,7 +925,7 @@ int session_register(ab_session_p session)
     /* fill in the fields of the request */
     req->encap_command = h2le16(AB_EIP_REGISTER_SESSION);
     req->encap_length = h2le16(sizeof(eip_session_reg_req) - sizeof(eip_encap));
-    req->encap_session_handle = h2le32(session->session_handle);
+    req->encap_session_handle = h2le32(0); /* must be zero, any old handle died with the old socket. */
     req->encap_status = h2le32(0);
     req->encap_sender_context = h2le64((uint64_t)0);
     req->encap_options = h2le32(0);
@@ -665,8 +950,31 @@ int session_register(ab_session_p session)
         return rc;
     }
 
-    /* get the response from the gateway */
-    rc = recv_eip_response(session, SESSION_DEFAULT_TIMEOUT);
+    pdebug(DEBUG_INFO, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * recv_register_session_resp
+ *
+ * Read whatever is available of the registration response.  Returns
+ * PLCTAG_STATUS_PENDING until all of it is in.
+ */
+int recv_register_session_resp(ab_session_p session)
+{
+    eip_encap *resp;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    rc = read_eip_response(session);
+    if(rc == PLCTAG_STATUS_PENDING) {
+        return rc;
+    }
+
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_WARN, "Error receiving session registration response %s!", plc_tag_decode_error(rc));
         return rc;
@@ -719,10 +1027,11 @@ int session_close_socket(ab_session_p session)
 
     if (session->sock) {
         socket_close(session->sock);
-        socket_destroy(&(session->sock));
-        session->sock = NULL;
     }
 
+    /* any partial response is gone with the connection. */
+    session->receiving = 0;
+
     pdebug(DEBUG_INFO, "Done.");
 
     return PLCTAG_STATUS_OK;
@@ -745,11 +1054,23 @@ void session_destroy(void *session_arg)
     /* so remove the session from the list so no one else can reference it. */
     remove_session(session);
 
+    /* and from its group so that no more requests are sent to it. */
+    session_group_leave(session);
+
     pdebug(DEBUG_INFO, "Session sent %" PRId64 " packets.", session->packet_count);
 
     /* terminate the session thread first. */
     session->terminating = 1;
 
+    if(session->sock) {
+        socket_wake(session->sock);
+    }
+
+    /* the reactor will not run the session once this returns. */
+    if(session->reactor_client) {
+        reactor_remove_client(&(session->reactor_client));
+    }
+
     /* get rid of the handler thread. */
     if (session->handler_thread) {
         /* this cannot be guarded by the mutex since the session thread also locks it. */
@@ -795,8 +1116,32 @@ void session_destroy(void *session_arg)
             vector_destroy(session->requests);
             session->requests = NULL;
         }
+
+        /* and all the ones that were sent but never answered. */
+        if(session->inflight) {
+            for(int i = 0; i < vector_length(session->inflight); i++) {
+                inflight_bundle_p bundle = vector_get(session->inflight, i);
+
+                for(int j = 0; j < bundle->num_requests; j++) {
+                    rc_dec(bundle->requests[j]);
+                }
+
+                mem_free(bundle);
+            }
+
+            vector_destroy(session->inflight);
+            session->inflight = NULL;
+        }
+    }
+
+    if(session->sock) {
+        socket_destroy(&(session->sock));
+        session->sock = NULL;
     }
 
+    /* requests still held by tags keep the pool alive until they are gone. */
+    session->request_pool = rc_dec(session->request_pool);
+
     /* we are done with the mutex, finally destroy it. */
     if(session->mutex) {
         mutex_destroy(&(session->mutex));
@@ -834,6 +1179,7 @@ void session_destroy(void *session_arg)
 int session_add_request_unsafe(ab_session_p session, ab_request_p req)
 {
     int rc = PLCTAG_STATUS_OK;
+    int index = 0;
 
     pdebug(DEBUG_INFO, "Starting.");
 
@@ -851,8 +1197,44 @@ int session_add_request_unsafe(ab_session_p session, ab_request_p req)
 
     /* make sure the request points to the session */
 
-    /* insert into the requests vector */
-    vector_put(session->requests, vector_length(session->requests), req);
+    /* used to keep the packer from passing over a request for too long and for the wait statistics. */
+    req->time_queued = time_ms();
+    req->time_queued_us = time_us();
+
+    /*
+     * insert into the requests vector.  The queue is kept in priority order,
+     * earliest deadline first within each class, so the packer always starts
+     * with the most urgent request.
+     */
+    index = vector_length(session->requests);
+    while(index > 0 && request_goes_before(req, vector_get(session->requests, index - 1))) {
+        index--;
+    }
+
+    rc = vector_insert(session->requests, index, req);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to insert request into the queue!");
+        rc_dec(req);
+        return rc;
+    }
+
+    /* the session thread sleeps on held requests, have the group wake it when it is released. */
+    if(req->group_hold) {
+        rc = plc_tag_group_hold_add_waiter(req->group_hold, session_wake_held, session);
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+            pdebug(DEBUG_WARN, "Unable to wait for the group of tag %d, error %s!", req->tag_id, plc_tag_decode_error(rc));
+            vector_remove(session->requests, index);
+            rc_dec(req);
+            return rc;
+        }
+
+        rc = PLCTAG_STATUS_OK;
+    }
+
+    atomic_int64_add(&session->stats.requests_queued, 1);
+
+    req->request_id = ++session->next_request_id;
+    trace_point(TRACE_REQUEST_QUEUED, req->tag_id, req->request_id, req->priority);
 
     pdebug(DEBUG_INFO, "Total requests in the queue: %d", vector_length(session->requests));
 
@@ -869,11 +1251,26 @@ int session_add_request_unsafe(ab_session_p session, ab_request_p req)
 int session_add_request(ab_session_p sess, ab_request_p req)
 {
     int rc = PLCTAG_STATUS_OK;
+    ab_session_p target = sess;
 
     pdebug(DEBUG_DETAIL, "Starting. sess=%p, req=%p", sess, req);
 
-    critical_block(sess->mutex) {
-        rc = session_add_request_unsafe(sess, req);
+    /* spread the load if there are several connections to the PLC. */
+    if(sess->group) {
+        target = session_group_select(sess, req);
+    }
+
+    critical_block(target->mutex) {
+        rc = session_add_request_unsafe(target, req);
+    }
+
+    /* let the session thread know there is work to do. */
+    if(rc == PLCTAG_STATUS_OK) {
+        socket_wake(target->sock);
+    }
+
+    if(target != sess) {
+        rc_dec(target);
     }
 
     pdebug(DEBUG_DETAIL, "Done.");
@@ -920,452 +1317,1180 @@ int session_remove_request_unsafe(ab_session_p session, ab_request_p req)
  ****************************************************************/
 
 
-typedef enum { SESSION_OPEN_SOCKET, SESSION_REGISTER, SESSION_CONNECT,
-               SESSION_IDLE, SESSION_DISCONNECT, SESSION_UNREGISTER,
-               SESSION_CLOSE_SOCKET, SESSION_START_RETRY, SESSION_WAIT_RETRY,
-               SESSION_WAIT_RECONNECT
-             } session_state_t;
-
-
-THREAD_FUNC(session_handler)
+/*
+ * session_step
+ *
+ * Run one pass of the session state machine.  This never waits for the PLC
+ * except during forward close.  Returns non-zero if
+ * the session should be run again right away.  Otherwise the socket events to
+ * wait for and the time by which to run again are filled in.
+ */
+int session_step(ab_session_p session, int *wait_events, int64_t *wait_until)
 {
-    ab_session_p session = arg;
     int rc = PLCTAG_STATUS_OK;
-    session_state_t state = SESSION_OPEN_SOCKET;
-    int64_t timeout_time = 0;
-    int64_t auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
-    int auto_disconnect = 0;
+    int busy = 1;
 
+    *wait_events = SOCK_EVENT_NONE;
+    *wait_until = INT64_MAX;
 
-    pdebug(DEBUG_INFO, "Starting thread for session %p", session);
+    /*
+     * Do this on every cycle.   This keeps the queue clean(ish).
+     *
+     * Make sure we get rid of all the aborted requests queued.
+     * This keeps the overall memory usage lower.
+     */
 
-    while(!session->terminating) {
-        int idle = 0;
+    pdebug(DEBUG_SPEW,"Critical block.");
+    critical_block(session->mutex) {
+        purge_aborted_requests_unsafe(session);
+    }
 
-        /*
-         * Do this on every cycle.   This keeps the queue clean(ish).
-         *
-         * Make sure we get rid of all the aborted requests queued.
-         * This keeps the overall memory usage lower.
-         */
+    switch(session->state) {
+    case SESSION_OPEN_SOCKET:
+        pdebug(DEBUG_DETAIL, "in SESSION_OPEN_SOCKET state.");
 
-        pdebug(DEBUG_SPEW,"Critical block.");
-        critical_block(session->mutex) {
-            purge_aborted_requests_unsafe(session);
+        /* we must connect to the gateway*/
+        rc = session_open_socket(session);
+        if(rc == PLCTAG_STATUS_PENDING) {
+            session->timeout_time = time_ms() + SESSION_CONNECT_TIMEOUT;
+            session->state = SESSION_WAIT_CONNECT;
+        } else if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "session connect failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_CLOSE_SOCKET;
+        } else {
+            session->state = SESSION_REGISTER;
+        }
+        break;
+
+    case SESSION_WAIT_CONNECT:
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_CONNECT state.");
+
+        rc = socket_connect_tcp_check(session->sock, 0);
+        if(rc == PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_DETAIL, "Connected to %s.", session->host);
+            session->state = SESSION_REGISTER;
+        } else if(rc != PLCTAG_STATUS_PENDING) {
+            pdebug(DEBUG_WARN, "session connect failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_CLOSE_SOCKET;
+        } else if(session->timeout_time < time_ms()) {
+            pdebug(DEBUG_WARN, "Timed out connecting to %s!", session->host);
+            session->state = SESSION_CLOSE_SOCKET;
+        } else {
+            busy = 0;
+            *wait_events = SOCK_EVENT_WRITE;
+            *wait_until = session->timeout_time;
         }
+        break;
 
-        switch(state) {
-        case SESSION_OPEN_SOCKET:
-            pdebug(DEBUG_DETAIL, "in SESSION_OPEN_SOCKET state.");
+    case SESSION_REGISTER:
+        pdebug(DEBUG_DETAIL, "in SESSION_REGISTER state.");
 
-            /* we must connect to the gateway*/
-            if ((rc = session_open_socket(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "session connect failed %s!", plc_tag_decode_error(rc));
-                state = SESSION_CLOSE_SOCKET;
-            } else {
-                /* set the timeout for disconnect. */
-                //if(session->auto_disconnect_enabled) {
-                auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
-                //}
+        /* set the timeout for disconnect. */
+        session->auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
 
-                state = SESSION_REGISTER;
-            }
-            break;
+        if ((rc = session_register(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "session registration failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_CLOSE_SOCKET;
+        } else {
+            session->data_offset = 0;
+            session->timeout_time = time_ms() + SESSION_DEFAULT_TIMEOUT;
+            session->state = SESSION_WAIT_REGISTER;
+        }
+        break;
 
-        case SESSION_REGISTER:
-            pdebug(DEBUG_DETAIL, "in SESSION_REGISTER state.");
+    case SESSION_WAIT_REGISTER:
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_REGISTER state.");
 
-            if ((rc = session_register(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "session registration failed %s!", plc_tag_decode_error(rc));
-                state = SESSION_CLOSE_SOCKET;
+        rc = recv_register_session_resp(session);
+        if(rc == PLCTAG_STATUS_PENDING) {
+            if(session->timeout_time < time_ms()) {
+                pdebug(DEBUG_WARN, "Timed out waiting for session registration response!");
+                session->state = SESSION_CLOSE_SOCKET;
             } else {
-                if(session->use_connected_msg) {
-                    state = SESSION_CONNECT;
-                } else {
-                    state = SESSION_IDLE;
-                }
+                busy = 0;
+                *wait_events = SOCK_EVENT_READ;
+                *wait_until = session->timeout_time;
             }
-            break;
+        } else if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "session registration failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_CLOSE_SOCKET;
+        } else if(session->use_connected_msg) {
+            start_forward_open(session);
+            session->state = SESSION_CONNECT;
+        } else {
+            session->state = SESSION_IDLE;
+        }
+        break;
 
-        case SESSION_CONNECT:
-            pdebug(DEBUG_DETAIL, "in SESSION_CONNECT state.");
+    case SESSION_CONNECT:
+        pdebug(DEBUG_DETAIL, "in SESSION_CONNECT state.");
 
-            if((rc = perform_forward_open(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Forward open failed %s!", plc_tag_decode_error(rc));
-                state = SESSION_UNREGISTER;
+        if((rc = send_forward_open(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Forward open failed %s!", plc_tag_decode_error(rc));
+            retry_forward_open(session, rc);
+            session->state = SESSION_UNREGISTER;
+        } else {
+            session->data_offset = 0;
+            session->timeout_time = time_ms() + SESSION_DEFAULT_TIMEOUT;
+            session->state = SESSION_WAIT_FORWARD_OPEN;
+        }
+        break;
+
+    case SESSION_WAIT_FORWARD_OPEN:
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_FORWARD_OPEN state.");
+
+        rc = recv_forward_open_resp(session, (session->forward_open_ex ? &session->forward_open_size : NULL));
+        if(rc == PLCTAG_STATUS_PENDING) {
+            if(session->timeout_time < time_ms()) {
+                pdebug(DEBUG_WARN, "Timed out waiting for Forward Open response!");
+                retry_forward_open(session, PLCTAG_ERR_TIMEOUT);
+                session->state = SESSION_UNREGISTER;
             } else {
-                pdebug(DEBUG_DETAIL, "forward open succeeded, going to idle state.");
-                state = SESSION_IDLE;
+                busy = 0;
+                *wait_events = SOCK_EVENT_READ;
+                *wait_until = session->timeout_time;
             }
-            break;
+        } else if(rc != PLCTAG_STATUS_OK) {
+            if(retry_forward_open(session, rc)) {
+                session->state = SESSION_CONNECT;
+            } else {
+                pdebug(DEBUG_WARN, "Forward open failed %s!", plc_tag_decode_error(rc));
+                session->state = SESSION_UNREGISTER;
+            }
+        } else {
+            pdebug(DEBUG_DETAIL, "ForwardOpen succeeded and maximum CIP packet size is %d.", session->max_payload_size);
+            session->state = SESSION_IDLE;
+        }
+        break;
+
+    case SESSION_IDLE:
+        pdebug(DEBUG_SPEW, "in SESSION_IDLE state.");
+
+        /* if there is work to do, make sure we do not disconnect. */
+        pdebug(DEBUG_SPEW,"Critical block.");
+        critical_block(session->mutex) {
+            if(vector_length(session->requests) > 0) {
+                session->auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
+            }
+        }
 
-        case SESSION_IDLE:
-            pdebug(DEBUG_SPEW, "in SESSION_IDLE state.");
+        /* responses still outstanding count as work too. */
+        if(vector_length(session->inflight) > 0) {
+            session->auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
+        }
 
-            idle = 1;
+        rc = process_requests(session);
+        if(rc == PLCTAG_STATUS_PENDING) {
+            /* waiting for the rest of a response. */
+            busy = 0;
+            *wait_events = SOCK_EVENT_READ;
+            *wait_until = ((inflight_bundle_p)vector_get(session->inflight, 0))->time_sent + SESSION_DEFAULT_TIMEOUT;
+        } else if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Error while processing requests %s!", plc_tag_decode_error(rc));
+            if(session->use_connected_msg) {
+                session->state = SESSION_DISCONNECT;
+            } else {
+                session->state = SESSION_UNREGISTER;
+            }
+        } else {
+            /* only wait if there is nothing left to send or receive. */
+            busy = (vector_length(session->inflight) > 0);
 
-            /* if there is work to do, make sure we do not disconnect. */
-            pdebug(DEBUG_SPEW,"Critical block.");
             critical_block(session->mutex) {
-                if(vector_length(session->requests) > 0) {
-                    auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
+                if(vector_length(session->requests) > 0 && !session->requests_held) {
+                    busy = 1;
                 }
             }
 
-            if((rc = process_requests(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error while processing requests %s!", plc_tag_decode_error(rc));
-                idle = 0;
-                if(session->use_connected_msg) {
-                    state = SESSION_DISCONNECT;
-                } else {
-                    state = SESSION_UNREGISTER;
-                }
+            /* held requests wake us when their group is released. */
+            if(!busy) {
+                *wait_until = session->auto_disconnect_time;
             }
 
             /* check if we should disconnect */
-            //if(session->auto_disconnect_enabled) {
-            if(auto_disconnect_time < time_ms()) {
+            if(session->auto_disconnect_time < time_ms()) {
                 pdebug(DEBUG_DETAIL, "Disconnecting due to inactivity.");
 
-                auto_disconnect = 1;
-                idle = 0;
+                session->auto_disconnect = 1;
+                busy = 1;
 
                 if(session->use_connected_msg) {
-                    state = SESSION_DISCONNECT;
+                    session->state = SESSION_DISCONNECT;
                 } else {
-                    state = SESSION_UNREGISTER;
+                    session->state = SESSION_UNREGISTER;
                 }
             }
-            //}
+        }
 
-            break;
+        break;
 
-        case SESSION_DISCONNECT:
-            pdebug(DEBUG_DETAIL, "in SESSION_DISCONNECT state.");
+    case SESSION_DISCONNECT:
+        pdebug(DEBUG_DETAIL, "in SESSION_DISCONNECT state.");
 
-            if((rc = perform_forward_close(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Forward close failed %s!", plc_tag_decode_error(rc));
-            }
+        if((rc = perform_forward_close(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Forward close failed %s!", plc_tag_decode_error(rc));
+        }
 
-            state = SESSION_UNREGISTER;
-            break;
+        session->state = SESSION_UNREGISTER;
+        break;
+
+    case SESSION_UNREGISTER:
+        pdebug(DEBUG_DETAIL, "in SESSION_UNREGISTER state.");
+
+        if((rc = session_unregister(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unregistering session failed %s!", plc_tag_decode_error(rc));
+        }
+
+        session->state = SESSION_CLOSE_SOCKET;
+        break;
+
+    case SESSION_CLOSE_SOCKET:
+        pdebug(DEBUG_DETAIL, "in SESSION_CLOSE_SOCKET state.");
+
+        if((rc = session_close_socket(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Closing session socket failed %s!", plc_tag_decode_error(rc));
+        }
+
+        if(session->auto_disconnect) {
+            session->state = SESSION_WAIT_RECONNECT;
+        } else {
+            session->state = SESSION_START_RETRY;
+        }
+
+        break;
+
+    case SESSION_START_RETRY:
+        pdebug(DEBUG_DETAIL, "in SESSION_START_RETRY state.");
+
+        /* FIXME - make this a tag attribute. */
+        session->timeout_time = time_ms() + RETRY_WAIT_MS;
+
+        /* start waiting. */
+        session->state = SESSION_WAIT_RETRY;
+
+        break;
+
+    case SESSION_WAIT_RETRY:
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_RETRY state.");
+
+        if(session->timeout_time < time_ms()) {
+            pdebug(DEBUG_DETAIL, "Transitioning to SESSION_OPEN_SOCKET.");
+            atomic_int64_add(&session->stats.reconnects, 1);
+            session->state = SESSION_OPEN_SOCKET;
+        } else {
+            busy = 0;
+            *wait_until = session->timeout_time;
+        }
+
+        break;
+
+    case SESSION_WAIT_RECONNECT:
+        /* wait for at least one request to queue before reconnecting. */
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_RECONNECT state.");
 
-        case SESSION_UNREGISTER:
-            pdebug(DEBUG_DETAIL, "in SESSION_UNREGISTER state.");
+        busy = 0;
+        session->auto_disconnect = 0;
 
-            if((rc = session_unregister(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Unregistering session failed %s!", plc_tag_decode_error(rc));
+        /* if there is work to do, reconnect.. */
+        pdebug(DEBUG_SPEW,"Critical block.");
+        critical_block(session->mutex) {
+            if(vector_length(session->requests) > 0) {
+                pdebug(DEBUG_DETAIL, "There are requests waiting, reopening connection to PLC.");
+
+                atomic_int64_add(&session->stats.reconnects, 1);
+
+                busy = 1;
+                session->state = SESSION_OPEN_SOCKET;
             }
+        }
 
-            state = SESSION_CLOSE_SOCKET;
-            break;
+        break;
+
+
+    default:
+        pdebug(DEBUG_ERROR, "Unknown state %d!", session->state);
+
+        /* FIXME - this logic is not complete.  We might be here without
+         * a connected session or a registered session. */
+        if(session->use_connected_msg) {
+            session->state = SESSION_DISCONNECT;
+        } else {
+            session->state = SESSION_UNREGISTER;
+        }
+
+        break;
+    }
+
+    return busy;
+}
 
-        case SESSION_CLOSE_SOCKET:
-            pdebug(DEBUG_DETAIL, "in SESSION_CLOSE_SOCKET state.");
 
-            if((rc = session_close_socket(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Closing session socket failed %s!", plc_tag_decode_error(rc));
+
+THREAD_FUNC(session_handler)
+{
+    ab_session_p session = arg;
+
+    pdebug(DEBUG_INFO, "Starting thread for session %p", session);
+
+    while(!session->terminating) {
+        int wait_events = SOCK_EVENT_NONE;
+        int64_t wait_until = INT64_MAX;
+
+        /*
+         * give up the CPU until there is something to do.  Queuing a
+         * request or terminating the session wakes us up.
+         */
+        if(!session_step(session, &wait_events, &wait_until) && !session->terminating) {
+            int wait_ms = session_wait_time(wait_until);
+
+            if(wait_ms > 0) {
+                socket_wait_event(session->sock, wait_events | SOCK_EVENT_WAKE_UP, wait_ms);
             }
+        }
+    }
 
-            if(auto_disconnect) {
-                state = SESSION_WAIT_RECONNECT;
-            } else {
-                state = SESSION_START_RETRY;
+    /*
+     * One last time before we exit.
+     */
+    pdebug(DEBUG_DETAIL,"Critical block.");
+    critical_block(session->mutex) {
+        purge_aborted_requests_unsafe(session);
+    }
+
+    THREAD_RETURN(0);
+}
+
+
+
+/*
+ * The reactor version of the session thread.  The reactor always listens
+ * for wake ups on the session socket.
+ */
+int session_reactor_step(void *arg, int *wait_events, int64_t *wait_until)
+{
+    ab_session_p session = arg;
+
+    if(session->terminating) {
+        *wait_events = SOCK_EVENT_NONE;
+        *wait_until = INT64_MAX;
+        return 0;
+    }
+
+    return session_step(session, wait_events, wait_until);
+}
+
+
+
+/*
+ * How long to wait for an event before the given time, capped at
+ * the idle wait time.
+ */
+int session_wait_time(int64_t wait_until)
+{
+    int64_t wait_ms = wait_until - time_ms();
+
+    if(wait_ms > SESSION_IDLE_WAIT_TIME) {
+        wait_ms = SESSION_IDLE_WAIT_TIME;
+    }
+
+    if(wait_ms < 0) {
+        wait_ms = 0;
+    }
+
+    return (int)wait_ms;
+}
+
+
+
+/*
+ * This must be called with the session mutex held!
+ */
+int purge_aborted_requests_unsafe(ab_session_p session)
+{
+    int purge_count = 0;
+    ab_request_p request = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    /* remove the aborted requests. */
+    for(int i=0; i < vector_length(session->requests); i++) {
+        request = vector_get(session->requests, i);
+
+        /* filter out the aborts. */
+        if(request && request->abort_request) {
+            purge_count++;
+
+            /* remove it from the queue. */
+            vector_remove(session->requests, i);
+
+            /* set the debug tag to the owning tag. */
+            debug_set_tag_id(request->tag_id);
+
+            pdebug(DEBUG_DETAIL, "Session thread releasing aborted request %p.", request);
+
+            request->status = PLCTAG_ERR_ABORT;
+            request->request_size = 0;
+            request->resp_received = 1;
+
+            /* release our hold on it. */
+            request = rc_dec(request);
+
+            /* vector size has changed, back up one. */
+            i--;
+        }
+    }
+
+    if(purge_count > 0) {
+        pdebug(DEBUG_DETAIL, "Removed %d aborted requests.", purge_count);
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return purge_count;
+}
+
+
+/*
+ * purge_expired_requests_unsafe
+ *
+ * Drop queued requests whose deadline has passed.  The caller has
+ * stopped waiting for them, so sending them would only take bandwidth
+ * from requests that still matter.  The owning tag sees a timeout.
+ *
+ * Must be called with the session mutex held.
+ */
+int purge_expired_requests_unsafe(ab_session_p session)
+{
+    int purge_count = 0;
+    int64_t now = time_ms();
+    ab_request_p request = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    for(int i=0; i < vector_length(session->requests); i++) {
+        request = vector_get(session->requests, i);
+
+        if(request && request->deadline && request->deadline <= now) {
+            purge_count++;
+
+            vector_remove(session->requests, i);
+
+            debug_set_tag_id(request->tag_id);
+
+            pdebug(DEBUG_DETAIL, "Dropping request %p, its deadline passed %" PRId64 "ms ago.", request, now - request->deadline);
+            trace_point(TRACE_REQUEST_EXPIRED, request->tag_id, request->request_id, 0);
+
+            spin_block(&request->lock) {
+                request->status = PLCTAG_ERR_TIMEOUT;
+                request->request_size = 0;
+                request->resp_received = 1;
+
+                if(!request->abort_request && request->tag) {
+                    plc_tag_mark_ready(request->tag);
+                }
             }
 
-            break;
+            request = rc_dec(request);
 
-        case SESSION_START_RETRY:
-            pdebug(DEBUG_DETAIL, "in SESSION_START_RETRY state.");
+            /* vector size has changed, back up one. */
+            i--;
+        }
+    }
 
-            /* set up timer for retry. */
-            idle = 0;
+    if(purge_count > 0) {
+        pdebug(DEBUG_DETAIL, "Dropped %d expired requests.", purge_count);
+        atomic_int64_add(&session->stats.timeouts, purge_count);
+    }
 
-            /* FIXME - make this a tag attribute. */
-            timeout_time = time_ms() + RETRY_WAIT_MS;
+    pdebug(DEBUG_SPEW, "Done.");
 
-            /* start waiting. */
-            state = SESSION_WAIT_RETRY;
+    return purge_count;
+}
+
+
+
+/*
+ * request_goes_before
+ *
+ * Queue order: higher priority classes first, then earliest deadline
+ * first.  Requests without a deadline are ordered as if it were the
+ * default timeout after they were queued, so they are not starved by
+ * requests with deadlines.
+ */
+int request_goes_before(ab_request_p first, ab_request_p second)
+{
+    int64_t first_deadline = (first->deadline ? first->deadline : first->time_queued + SESSION_DEFAULT_TIMEOUT);
+    int64_t second_deadline = (second->deadline ? second->deadline : second->time_queued + SESSION_DEFAULT_TIMEOUT);
+
+    if(first->priority != second->priority) {
+        return first->priority > second->priority;
+    }
+
+    return first_deadline < second_deadline;
+}
+
+
+
+/*
+ * process_requests
+ *
+ * Send as many request packets as the session allows to be in flight at once,
+ * then read what has arrived of the next response and hand it back to the
+ * requests in it.  Returns PLCTAG_STATUS_PENDING while waiting for the rest
+ * of a response.
+ *
+ * With the default of one request in flight this is the classic
+ * send/wait/receive cycle.
+ */
+int process_requests(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int max_requests_in_flight = SESSION_DEFAULT_REQUESTS_IN_FLIGHT;
+    int num_sent = 0;
+
+    debug_set_tag_id(0);
+
+    pdebug(DEBUG_SPEW, "Starting.");
 
+    if(!session) {
+        pdebug(DEBUG_WARN, "Null session pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pdebug(DEBUG_SPEW, "Checking for requests to process.");
+
+    critical_block(session->mutex) {
+        max_requests_in_flight = session->max_requests_in_flight;
+    }
+
+    /* fill up the pipeline.  The data buffer is busy while part of a response is in it. */
+    while(!session->receiving && vector_length(session->inflight) < max_requests_in_flight) {
+        rc = send_next_bundle(session, &num_sent);
+        if(rc != PLCTAG_STATUS_OK || num_sent == 0) {
             break;
+        }
+    }
+
+    /* read the next response if anything is outstanding. */
+    if(rc == PLCTAG_STATUS_OK && vector_length(session->inflight) > 0) {
+        rc = recv_next_bundle(session);
+    }
 
-        case SESSION_WAIT_RETRY:
-            pdebug(DEBUG_SPEW, "in SESSION_WAIT_RETRY state.");
+    /* problem? the connection is going to be reset, so nothing in flight will be answered. */
+    if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+        session->receiving = 0;
+        fail_inflight_bundles(session, rc);
+    }
 
-            /* make us sleep on each iteration. */
-            idle = 1;
+    debug_set_tag_id(0);
 
-            if(timeout_time < time_ms()) {
-                pdebug(DEBUG_DETAIL, "Transitioning to SESSION_OPEN_SOCKET.");
-                state = SESSION_OPEN_SOCKET;
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * send_next_bundle
+ *
+ * Pull as many requests as will fit out of the front of the queue, pack them into
+ * one packet and send it.  The packet is remembered in the in flight list.
+ */
+int send_next_bundle(ab_session_p session, int *num_sent)
+{
+    int rc = PLCTAG_STATUS_OK;
+    ab_request_p bundled_requests[MAX_REQUESTS] = {NULL};
+    int num_bundled_requests = 0;
+    int num_packets = 0;
+    int remaining_space = 0;
+    inflight_bundle_p bundle = NULL;
+    eip_encap *encap = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    *num_sent = 0;
+
+    session->data_size = 0;
+    session->data_offset = 0;
+
+    /* pick the requests for the next packet out of the front of the list. */
+    critical_block(session->mutex) {
+        session->requests_held = 0;
+
+        /* is there anything to do? */
+        if(vector_length(session->requests)) {
+            /* get rid of all aborted requests and the ones nobody is waiting for any more. */
+            purge_aborted_requests_unsafe(session);
+            purge_expired_requests_unsafe(session);
+
+            /* if there are still requests after purging all the aborted requests, process them. */
+
+            /* how much space do we have to work with. */
+            remaining_space = session->max_payload_size - (int)sizeof(cip_multi_req_header);
+
+            if(vector_length(session->requests)) {
+                num_bundled_requests = select_bundle_unsafe(session, bundled_requests, remaining_space, &num_packets);
+            } else {
+                pdebug(DEBUG_DETAIL, "All requests in queue were aborted, nothing to do.");
             }
+        }
+    }
+
+    /* output debug display as no particular tag. */
+    debug_set_tag_id(0);
+
+    if(num_bundled_requests == 0) {
+        pdebug(DEBUG_SPEW, "Nothing to send.");
+        return PLCTAG_STATUS_OK;
+    }
+
+    pdebug(DEBUG_DETAIL, "%d requests to process in %d packed requests.", num_bundled_requests, num_packets);
+
+    do {
+        bundle = mem_alloc((int)(sizeof(struct inflight_bundle_t) + (sizeof(ab_request_p) * (size_t)num_bundled_requests)));
+        if(!bundle) {
+            pdebug(DEBUG_ERROR, "Unable to allocate in flight bundle!");
+            rc = PLCTAG_ERR_NO_MEM;
+            break;
+        }
 
+        /* copy and pack the requests into the session buffer. */
+        rc = pack_requests(session, bundled_requests, num_packets);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Error while packing requests, %s!", plc_tag_decode_error(rc));
             break;
+        }
 
-        case SESSION_WAIT_RECONNECT:
-            /* wait for at least one request to queue before reconnecting. */
-            pdebug(DEBUG_SPEW, "in SESSION_WAIT_RECONNECT state.");
+        /* fill in all the necessary parts to the request. */
+        if((rc = prepare_request(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to prepare request, %s!", plc_tag_decode_error(rc));
+            break;
+        }
 
-            idle = 1;
-            auto_disconnect = 0;
+        /* send the request */
+        bundle->time_sent_us = time_us();
 
-            /* if there is work to do, reconnect.. */
-            pdebug(DEBUG_DETAIL,"Critical block.");
-            critical_block(session->mutex) {
-                if(vector_length(session->requests) > 0) {
-                    pdebug(DEBUG_DETAIL, "There are requests waiting, reopening connection to PLC.");
+        if((rc = send_eip_request(session, SESSION_DEFAULT_TIMEOUT)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Error sending packet %s!", plc_tag_decode_error(rc));
+            break;
+        }
+
+        /* remember what we sent so that the response can find its way back. */
+        encap = (eip_encap *)(session->data);
+        if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+            bundle->is_connected = 1;
+            bundle->seq_id = session->conn_seq_num;
+        } else {
+            bundle->is_connected = 0;
+            bundle->seq_id = session->session_seq_id;
+        }
+
+        bundle->time_sent = time_ms();
+        bundle->num_requests = num_bundled_requests;
+        bundle->num_packets = num_packets;
+
+        for(int i=0; i < num_bundled_requests; i++) {
+            int64_t queue_wait_us = bundle->time_sent_us - bundled_requests[i]->time_queued_us;
+
+            bundled_requests[i]->time_sent = bundle->time_sent;
+            bundle->requests[i] = bundled_requests[i];
+
+            histogram_record(&session->stats.queue_wait, queue_wait_us);
+            plc_tag_record_latency(PLCTAG_LATENCY_QUEUE_WAIT, queue_wait_us);
+
+            trace_point(TRACE_REQUEST_SENT, bundled_requests[i]->tag_id, bundled_requests[i]->request_id, (int64_t)bundle->seq_id);
+        }
+
+        trace_point(TRACE_PACKET_SENT, 0, bundle->seq_id, num_bundled_requests);
+
+        vector_put(session->inflight, vector_length(session->inflight), bundle);
+        atomic_int_add(&session->num_inflight, 1);
+
+        atomic_int64_add(&session->stats.bundles_sent, 1);
+        atomic_int64_add(&session->stats.requests_sent, num_bundled_requests);
+
+        pdebug(DEBUG_DETAIL, "%d packets in flight.", vector_length(session->inflight));
+
+        *num_sent = num_bundled_requests;
+    } while(0);
+
+    /* problem? clean up the pending requests and dump everything. */
+    if(rc != PLCTAG_STATUS_OK) {
+        fail_bundled_requests(bundled_requests, num_bundled_requests, rc);
+
+        if(bundle) {
+            mem_free(bundle);
+        }
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * select_bundle_unsafe
+ *
+ * Fill a Multiple Service Packet from the first PACK_WINDOW requests in the
+ * queue that are not held.  The first of them always goes first.  After that,
+ * any packable request in the window that still fits is added, even if
+ * something before it did not fit.  This fills the payload much better when
+ * large and small requests are mixed.
+ *
+ * Both the request and the reply must fit in the negotiated payload.  Read
+ * replies carry the data, so a packet of many small reads can have a reply
+ * much bigger than the request.  Requests whose reply size is not known
+ * yet (the first read of a tag) only count their slot in the reply header.
+ *
+ * A read in the window that is identical to one already in the packet is
+ * not sent again.  It is taken off the queue and gets a copy of the same
+ * reply.  These duplicates go after the packed requests in the list, and
+ * each request's packing_num says which reply in the packet is its own.
+ *
+ * Requests from the same tag are never reordered.  A request that has waited
+ * more than PACK_MAX_AGE_MS may not be passed over, so scanning stops there.
+ * Requests of a tag group that is still being queued are stepped over and
+ * do not count against the window, however many there are.  If there is
+ * nothing else in the queue, nothing is sent and requests_held is set.
+ *
+ * Must be called with the session mutex held.  Returns the number of requests
+ * taken off the queue.  num_packets is set to how many of them are packed.
+ */
+int select_bundle_unsafe(ab_session_p session, ab_request_p *bundled_requests, int remaining_space, int *num_packets)
+{
+    ab_request_p duplicates[MAX_REQUESTS] = {NULL};
+    int num_duplicates = 0;
+    plc_tag_p skipped_tags[PACK_WINDOW] = {NULL};
+    int num_skipped = 0;
+    int num_held = 0;
+    int num_bundled_requests = 0;
+    int remaining_response_space = session->max_payload_size - (int)sizeof(cip_multi_resp_header);
+    int can_pack = 0;
+    int64_t now = time_ms();
+    int index = 0;
+    ab_request_p request = NULL;
+
+    /* requests of a tag group that is still being queued wait for the rest of the group. */
+    while(index < vector_length(session->requests)) {
+        request = vector_get(session->requests, index);
+
+        if(!request_is_held(request) && !(num_held && request_tag_queued_before(session, index, request->tag))) {
+            break;
+        }
+
+        num_held++;
+        index++;
+    }
+
+    if(index >= vector_length(session->requests)) {
+        pdebug(DEBUG_SPEW, "Only held requests in the queue.");
+        session->requests_held = 1;
+        *num_packets = 0;
+        return 0;
+    }
+
+    /* the first request that is not held always goes, packable or not. */
+    request = vector_get(session->requests, index);
+    vector_remove(session->requests, index);
+    request->packing_num = 0;
+    bundled_requests[num_bundled_requests++] = request;
+    remaining_space -= get_payload_size(request);
+    remaining_response_space -= get_response_size(request);
 
-                    idle = 0;
-                    state = SESSION_OPEN_SOCKET;
+    /* if the head cannot be packed, the only thing to look for is duplicates of it. */
+    can_pack = request->allow_packing;
+
+    while(index < vector_length(session->requests)
+          && num_skipped < PACK_WINDOW
+          && (num_bundled_requests + num_duplicates) < MAX_REQUESTS) {
+        int tag_skipped = 0;
+
+        request = vector_get(session->requests, index);
+
+        /* held requests are stepped over without using up the window. */
+        if(request_is_held(request) || (num_held && request_tag_queued_before(session, index, request->tag))) {
+            num_held++;
+            index++;
+            continue;
+        }
+
+        /* do not let a request get ahead of an earlier one for the same tag. */
+        for(int i=0; i < num_skipped; i++) {
+            if(skipped_tags[i] == request->tag) {
+                tag_skipped = 1;
+                break;
+            }
+        }
+
+        if(!tag_skipped) {
+            ab_request_p original = NULL;
+            int payload_size = 0;
+            int response_size = 0;
+
+            /* is this a read we are already sending? */
+            for(int i=0; i < num_bundled_requests; i++) {
+                if(is_same_read(bundled_requests[i], request)) {
+                    original = bundled_requests[i];
+                    break;
                 }
             }
 
-            break;
+            if(original) {
+                pdebug(DEBUG_DETAIL, "Read for tag %d is the same as the read for tag %d.", request->tag_id, original->tag_id);
+                vector_remove(session->requests, index);
+                request->packing_num = original->packing_num;
+                duplicates[num_duplicates++] = request;
 
+                /* the next request has moved into this slot. */
+                continue;
+            }
 
-        default:
-            pdebug(DEBUG_ERROR, "Unknown state %d!", state);
+            payload_size = get_payload_size(request);
+            response_size = get_response_size(request);
 
-            /* FIXME - this logic is not complete.  We might be here without
-             * a connected session or a registered session. */
-            if(session->use_connected_msg) {
-                state = SESSION_DISCONNECT;
-            } else {
-                state = SESSION_UNREGISTER;
+            if(can_pack && request->allow_packing && payload_size < remaining_space && response_size <= remaining_response_space) {
+                vector_remove(session->requests, index);
+                request->packing_num = num_bundled_requests;
+                bundled_requests[num_bundled_requests++] = request;
+                remaining_space -= payload_size;
+                remaining_response_space -= response_size;
+
+                continue;
             }
+        }
 
+        /* an old request must not be overtaken any further. */
+        if((now - request->time_queued) > PACK_MAX_AGE_MS) {
+            pdebug(DEBUG_DETAIL, "Request for tag %d has waited too long to be passed over.", request->tag_id);
             break;
         }
 
-        /*
-         * give up the CPU a bit, but only if we are not
-         * doing some linked states.
-         */
-        if(idle && !session->terminating) {
-            sleep_ms(1);
+        skipped_tags[num_skipped++] = request->tag;
+        index++;
+    }
+
+    pdebug(DEBUG_DETAIL, "Packed %d requests with %d bytes of request and %d bytes of reply payload left.", num_bundled_requests, remaining_space, remaining_response_space);
+
+    *num_packets = num_bundled_requests;
+
+    /* the duplicates ride along after the packed requests. */
+    for(int i=0; i < num_duplicates; i++) {
+        bundled_requests[num_bundled_requests++] = duplicates[i];
+    }
+
+    /* keep track of how long each class of request waited. */
+    for(int i=0; i < num_bundled_requests; i++) {
+        int priority = bundled_requests[i]->priority;
+        int64_t wait_ms = now - bundled_requests[i]->time_queued;
+
+        session->queue_wait_count[priority]++;
+        session->queue_wait_total_ms[priority] += wait_ms;
+
+        if(wait_ms > session->queue_wait_max_ms[priority]) {
+            session->queue_wait_max_ms[priority] = wait_ms;
         }
     }
 
-    /*
-     * One last time before we exit.
-     */
-    pdebug(DEBUG_DETAIL,"Critical block.");
-    critical_block(session->mutex) {
-        purge_aborted_requests_unsafe(session);
+    if(num_duplicates) {
+        pdebug(DEBUG_DETAIL, "Coalesced %d duplicate reads.", num_duplicates);
+    }
+
+    return num_bundled_requests;
+}
+
+
+
+/*
+ * request_is_held
+ *
+ * A tag group holds its requests until the reads of all its tags are
+ * queued.  That way they are all in the queue when the packer looks.
+ */
+int request_is_held(ab_request_p request)
+{
+    return plc_tag_group_hold_is_held(request->group_hold);
+}
+
+
+
+/*
+ * request_tag_queued_before
+ *
+ * Check whether the tag already has a request ahead of the given index.  Only
+ * needed when held requests were stepped over, since those are not in the
+ * packer's list of skipped tags.
+ */
+int request_tag_queued_before(ab_session_p session, int index, plc_tag_p tag)
+{
+    for(int i=0; i < index; i++) {
+        ab_request_p request = vector_get(session->requests, i);
+
+        if(request->tag == tag) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * session_wake_held
+ *
+ * Called when the group of a held request is released.  The reference to
+ * the session is kept by the group until this has run.
+ */
+void session_wake_held(void *arg)
+{
+    ab_session_p session = (ab_session_p)arg;
+
+    socket_wake(session->sock);
+}
+
+
+
+/*
+ * is_same_read
+ *
+ * Two connected requests are the same read if their CIP requests are byte
+ * for byte identical and are Read Tag or Read Tag Fragmented.  That covers the
+ * tag name, element count and byte offset.  Writes are never the same.
+ */
+int is_same_read(ab_request_p first, ab_request_p second)
+{
+    eip_cip_co_req *first_req = (eip_cip_co_req *)(first->data);
+    eip_cip_co_req *second_req = (eip_cip_co_req *)(second->data);
+    uint8_t *first_start = NULL;
+    uint8_t *second_start = NULL;
+    int first_len = 0;
+    int second_len = 0;
+
+    if(le2h16(first_req->encap_command) != AB_EIP_CONNECTED_SEND || le2h16(second_req->encap_command) != AB_EIP_CONNECTED_SEND) {
+        return 0;
+    }
+
+    first_start = (uint8_t *)(&first_req->cpf_conn_seq_num) + sizeof(first_req->cpf_conn_seq_num);
+    first_len = (int)le2h16(first_req->cpf_cdi_item_length) - (int)sizeof(first_req->cpf_conn_seq_num);
+
+    second_start = (uint8_t *)(&second_req->cpf_conn_seq_num) + sizeof(second_req->cpf_conn_seq_num);
+    second_len = (int)le2h16(second_req->cpf_cdi_item_length) - (int)sizeof(second_req->cpf_conn_seq_num);
+
+    if(first_len <= 0 || first_len != second_len) {
+        return 0;
+    }
+
+    if(*first_start != AB_EIP_CMD_CIP_READ && *first_start != AB_EIP_CMD_CIP_READ_FRAG) {
+        return 0;
     }
 
-    THREAD_RETURN(0);
+    return (mem_cmp(first_start, first_len, second_start, second_len) == 0);
 }
 
 
-
 /*
- * This must be called with the session mutex held!
+ * recv_next_bundle
+ *
+ * Read whatever is available of the next response packet.  Once it is
+ * complete, find the in flight packet it belongs to and unpack the results
+ * into each of the requests in it.
  */
-int purge_aborted_requests_unsafe(ab_session_p session)
+int recv_next_bundle(ab_session_p session)
 {
-    int purge_count = 0;
-    ab_request_p request = NULL;
+    int rc = PLCTAG_STATUS_OK;
+    int index = 0;
+    int64_t round_trip_us = 0;
+    inflight_bundle_p bundle = NULL;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
-    /* remove the aborted requests. */
-    for(int i=0; i < vector_length(session->requests); i++) {
-        request = vector_get(session->requests, i);
-
-        /* filter out the aborts. */
-        if(request && request->abort_request) {
-            purge_count++;
-
-            /* remove it from the queue. */
-            vector_remove(session->requests, i);
-
-            /* set the debug tag to the owning tag. */
-            debug_set_tag_id(request->tag_id);
+    /* the oldest packet goes first, anything older than the timeout will never be answered. */
+    bundle = vector_get(session->inflight, 0);
+    if(bundle->time_sent + SESSION_DEFAULT_TIMEOUT < time_ms()) {
+        pdebug(DEBUG_WARN, "Timed out waiting for response to packet %" PRIx64 "!", bundle->seq_id);
+        atomic_int64_add(&session->stats.timeouts, bundle->num_requests);
+        return PLCTAG_ERR_TIMEOUT;
+    }
 
-            pdebug(DEBUG_DETAIL, "Session thread releasing aborted request %p.", request);
+    /* start a new response if we are not in the middle of one. */
+    if(!session->receiving) {
+        session->data_offset = 0;
+        session->data_size = 0;
+        session->receiving = 1;
+    }
 
-            request->status = PLCTAG_ERR_ABORT;
-            request->request_size = 0;
-            request->resp_received = 1;
+    rc = read_eip_response(session);
+    if(rc == PLCTAG_STATUS_PENDING) {
+        return rc;
+    }
 
-            /* release our hold on it. */
-            request = rc_dec(request);
+    session->receiving = 0;
 
-            /* vector size has changed, back up one. */
-            i--;
-        }
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Error receiving packet response %s!", plc_tag_decode_error(rc));
+        return rc;
     }
 
-    if(purge_count > 0) {
-        pdebug(DEBUG_DETAIL, "Removed %d aborted requests.", purge_count);
+    index = find_inflight_bundle(session);
+    if(index < 0) {
+        pdebug(DEBUG_WARN, "Dropping response that does not match any packet in flight.");
+        return PLCTAG_STATUS_OK;
     }
 
-    pdebug(DEBUG_SPEW, "Done.");
+    bundle = vector_remove(session->inflight, index);
+    atomic_int_add(&session->num_inflight, -1);
 
-    return purge_count;
-}
+    /* the response is complete, so this is the whole round trip of the packet. */
+    round_trip_us = time_us() - bundle->time_sent_us;
+    histogram_record(&session->stats.round_trip, round_trip_us);
+    plc_tag_record_latency(PLCTAG_LATENCY_ROUND_TRIP, round_trip_us);
+    trace_point(TRACE_PACKET_RECEIVED, 0, bundle->seq_id, round_trip_us);
 
+    do {
+        /*
+         * check the CIP status, but only if this is a bundled
+         * response.   If it is a singleton, then we pass the
+         * status back to the tag.
+         */
+        if(bundle->num_packets > 1) {
+            if(le2h16(((eip_encap *)(session->data))->encap_command) == AB_EIP_UNCONNECTED_SEND) {
+                eip_cip_uc_resp *resp = (eip_cip_uc_resp *)(session->data);
+                pdebug(DEBUG_INFO, "Received unconnected packet with session sequence ID %llx", resp->encap_sender_context);
+
+                /* punt if we got an overall error or it is not a partial/bundled error. */
+                if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
+                    rc = decode_cip_error_code(&(resp->status));
+                    pdebug(DEBUG_WARN, "Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
+                    break;
+                }
+            } else if(le2h16(((eip_encap *)(session->data))->encap_command) == AB_EIP_CONNECTED_SEND) {
+                eip_cip_co_resp *resp = (eip_cip_co_resp *)(session->data);
+                pdebug(DEBUG_INFO, "Received connected packet with connection ID %x and sequence ID %u(%x)", le2h32(resp->cpf_orig_conn_id), le2h16(resp->cpf_conn_seq_num), le2h16(resp->cpf_conn_seq_num));
+
+                /* punt if we got an overall error or it is not a partial/bundled error. */
+                if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
+                    rc = decode_cip_error_code(&(resp->status));
+                    pdebug(DEBUG_WARN, "Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
+                    break;
+                }
+            }
+        }
 
-int process_requests(ab_session_p session)
-{
-    int rc = PLCTAG_STATUS_OK;
-    ab_request_p request = NULL;
-    ab_request_p bundled_requests[MAX_REQUESTS] = {NULL};
-    int num_bundled_requests = 0;
-    int remaining_space = 0;
+        /* copy the results back out. Every request gets a copy. */
+        for(int i=0; i < bundle->num_requests; i++) {
+            debug_set_tag_id(bundle->requests[i]->tag_id);
 
-    debug_set_tag_id(0);
+            rc = unpack_response(session, bundle->requests[i], bundle->requests[i]->packing_num);
+            if(rc != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Unable to unpack response!");
+                break;
+            }
 
-    pdebug(DEBUG_SPEW, "Starting.");
+            /* release our reference */
+            bundle->requests[i] = rc_dec(bundle->requests[i]);
+        }
 
-    if(!session) {
-        pdebug(DEBUG_WARN, "Null session pointer!");
-        return PLCTAG_ERR_NULL_PTR;
-    }
+        debug_set_tag_id(0);
+    } while(0);
 
-    pdebug(DEBUG_SPEW, "Checking for requests to process.");
+    /* problem? clean up the pending requests and dump everything. */
+    if(rc != PLCTAG_STATUS_OK) {
+        fail_bundled_requests(bundle->requests, bundle->num_requests, rc);
+    }
 
-    rc = PLCTAG_STATUS_OK;
-    request = NULL;
-    session->data_size = 0;
-    session->data_offset = 0;
+    mem_free(bundle);
 
-    /* grab a request off the front of the list. */
-    critical_block(session->mutex) {
-        /* is there anything to do? */
-        if(vector_length(session->requests)) {
-            /* get rid of all aborted requests. */
-            purge_aborted_requests_unsafe(session);
+    pdebug(DEBUG_SPEW, "Done.");
 
-            /* if there are still requests after purging all the aborted requests, process them. */
+    return rc;
+}
 
-            /* how much space do we have to work with. */
-            remaining_space = session->max_payload_size - (int)sizeof(cip_multi_req_header);
 
-            if(vector_length(session->requests)) {
-                do {
-                    request = vector_get(session->requests, 0);
 
-                    remaining_space = remaining_space - get_payload_size(request);
+/*
+ * find_inflight_bundle
+ *
+ * Match the response in the session buffer to the packet that was sent
+ * for it.  Returns the index into the in flight list or -1 if no match.
+ */
+int find_inflight_bundle(ab_session_p session)
+{
+    eip_encap *encap = (eip_encap *)(session->data);
+    int is_connected = 0;
+    uint64_t seq_id = 0;
 
-                    /*
-                     * If we have a non-packable request, only queue it if it is the first one.
-                     * If the request is packable, keep queuing as long as there is space.
-                     */
+    if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+        is_connected = 1;
+        seq_id = le2h16(((eip_cip_co_resp *)(session->data))->cpf_conn_seq_num);
+    } else {
+        is_connected = 0;
+        seq_id = session->resp_seq_id;
+    }
 
-                    if(num_bundled_requests == 0 || (request->allow_packing && remaining_space > 0)) {
-                        //pdebug(DEBUG_DETAIL, "packed %d requests with remaining space %d", num_bundled_requests+1, remaining_space);
-                        bundled_requests[num_bundled_requests] = request;
-                        num_bundled_requests++;
+    for(int i=0; i < vector_length(session->inflight); i++) {
+        inflight_bundle_p bundle = vector_get(session->inflight, i);
 
-                        /* remove it from the queue. */
-                        vector_remove(session->requests, 0);
-                    }
-                } while(vector_length(session->requests) && remaining_space > 0 && num_bundled_requests < MAX_REQUESTS && request->allow_packing);
-            } else {
-                pdebug(DEBUG_DETAIL, "All requests in queue were aborted, nothing to do.");
-            }
+        if(bundle->is_connected == is_connected && bundle->seq_id == seq_id) {
+            return i;
         }
     }
 
-    /* output debug display as no particular tag. */
-    debug_set_tag_id(0);
-
-    if(num_bundled_requests > 0) {
+    /*
+     * Not all devices echo the sequence information faithfully.  If there
+     * is only one possible packet, this is the response to it.
+     */
+    if(vector_length(session->inflight) == 1) {
+        pdebug(DEBUG_DETAIL, "Response sequence ID %" PRIx64 " does not match, using only packet in flight.", seq_id);
+        return 0;
+    }
 
-        pdebug(DEBUG_DETAIL, "%d requests to process.", num_bundled_requests);
+    return -1;
+}
 
-        do {
-            /* copy and pack the requests into the session buffer. */
-            rc = pack_requests(session, bundled_requests, num_bundled_requests);
-            if(rc != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error while packing requests, %s!", plc_tag_decode_error(rc));
-                break;
-            }
 
-            /* fill in all the necessary parts to the request. */
-            if((rc = prepare_request(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Unable to prepare request, %s!", plc_tag_decode_error(rc));
-                break;
-            }
 
-            /* send the request */
-            if((rc = send_eip_request(session, SESSION_DEFAULT_TIMEOUT)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error sending packet %s!", plc_tag_decode_error(rc));
-                break;
-            }
+/*
+ * fail_inflight_bundles
+ *
+ * Complete every request in every packet in flight with the passed status.
+ */
+void fail_inflight_bundles(ab_session_p session, int status)
+{
+    while(vector_length(session->inflight) > 0) {
+        inflight_bundle_p bundle = vector_remove(session->inflight, 0);
+        atomic_int_add(&session->num_inflight, -1);
 
-            /* wait for the response */
-            if((rc = recv_eip_response(session, SESSION_DEFAULT_TIMEOUT)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error receiving packet response %s!", plc_tag_decode_error(rc));
-                break;
-            }
+        fail_bundled_requests(bundle->requests, bundle->num_requests, status);
 
-            /*
-             * check the CIP status, but only if this is a bundled
-             * response.   If it is a singleton, then we pass the
-             * status back to the tag.
-             */
-            if(num_bundled_requests > 1) {
-                if(le2h16(((eip_encap *)(session->data))->encap_command) == AB_EIP_UNCONNECTED_SEND) {
-                    eip_cip_uc_resp *resp = (eip_cip_uc_resp *)(session->data);
-                    pdebug(DEBUG_INFO, "Received unconnected packet with session sequence ID %llx", resp->encap_sender_context);
-
-                    /* punt if we got an overall error or it is not a partial/bundled error. */
-                    if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
-                        rc = decode_cip_error_code(&(resp->status));
-                        pdebug(DEBUG_WARN, "Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
-                        break;
-                    }
-                } else if(le2h16(((eip_encap *)(session->data))->encap_command) == AB_EIP_CONNECTED_SEND) {
-                    eip_cip_co_resp *resp = (eip_cip_co_resp *)(session->data);
-                    pdebug(DEBUG_INFO, "Received connected packet with connection ID %x and sequence ID %u(%x)", le2h32(resp->cpf_orig_conn_id), le2h16(resp->cpf_conn_seq_num), le2h16(resp->cpf_conn_seq_num));
-
-                    /* punt if we got an overall error or it is not a partial/bundled error. */
-                    if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
-                        rc = decode_cip_error_code(&(resp->status));
-                        pdebug(DEBUG_WARN, "Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
-                        break;
-                    }
-                }
-            }
+        mem_free(bundle);
+    }
+}
 
-            /* copy the results back out. Every request gets a copy. */
-            for(int i=0; i < num_bundled_requests; i++) {
-                debug_set_tag_id(bundled_requests[i]->tag_id);
 
-                rc = unpack_response(session, bundled_requests[i], i);
-                if(rc != PLCTAG_STATUS_OK) {
-                    pdebug(DEBUG_WARN, "Unable to unpack response!");
-                    break;
-                }
 
-                /* release our reference */
-                bundled_requests[i] = rc_dec(bundled_requests[i]);
-            }
+void fail_bundled_requests(ab_request_p *requests, int num_requests, int status)
+{
+    for(int i=0; i < num_requests; i++) {
+        if(requests[i]) {
+            trace_point(TRACE_REQUEST_DONE, requests[i]->tag_id, requests[i]->request_id, status);
 
-            rc = PLCTAG_STATUS_OK;
-        } while(0);
+            spin_block(&requests[i]->lock) {
+                requests[i]->status = status;
+                requests[i]->request_size = 0;
+                requests[i]->resp_received = 1;
 
-        /* problem? clean up the pending requests and dump everything. */
-        if(rc != PLCTAG_STATUS_OK) {
-            for(int i=0; i < num_bundled_requests; i++) {
-                if(bundled_requests[i]) {
-                    bundled_requests[i]->status = rc;
-                    bundled_requests[i]->request_size = 0;
-                    bundled_requests[i]->resp_received = 1;
-                    bundled_requests[i] = rc_dec(bundled_requests[i]);
+                if(!requests[i]->abort_request && requests[i]->tag) {
+                    plc_tag_mark_ready(requests[i]->tag);
                 }
             }
+
+            requests[i] = rc_dec(requests[i]);
         }
     }
-
-    debug_set_tag_id(0);
-
-    pdebug(DEBUG_SPEW, "Done.");
-
-    return rc;
 }
 
 
@@ -1479,11 +2604,18 @@ int unpack_response(ab_session_p session, ab_request_p request, int sub_packet)
     pdebug(DEBUG_DETAIL, "Unpacked packet:");
     pdebug_dump_bytes(DEBUG_DETAIL, request->data, new_eip_len);
 
+    trace_point(TRACE_REQUEST_DONE, request->tag_id, request->request_id, PLCTAG_STATUS_OK);
+
     /* notify the reading thread that the request is ready */
     spin_block(&request->lock) {
         request->status = PLCTAG_STATUS_OK;
         request->request_size = new_eip_len;
         request->resp_received = 1;
+
+        /* wake up any thread waiting on the tag.  Once the tag aborts, it may be gone. */
+        if(!request->abort_request && request->tag) {
+            plc_tag_mark_ready(request->tag);
+        }
     }
 
     pdebug(DEBUG_DETAIL, "Done.");
@@ -1517,6 +2649,19 @@ int get_payload_size(ab_request_p request)
 
 
 
+/*
+ * get_response_size
+ *
+ * How much of a Multiple Service Packet reply this request will take: its
+ * slot in the reply offset table plus the reply itself, if we know it.
+ */
+int get_response_size(ab_request_p request)
+{
+    return (int)sizeof(uint16_le) + request->response_size;
+}
+
+
+
 int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests)
 {
     eip_cip_co_req *new_req = NULL;
@@ -1717,11 +2862,15 @@ int send_eip_request(ab_session_p session, int timeout)
 
         if(rc >= 0) {
             session->data_offset += (uint32_t)rc;
+            atomic_int64_add(&session->stats.bytes_out, rc);
+        } else if(rc == PLCTAG_ERR_NO_DATA) {
+            /* the socket buffer is full, not an error. */
+            rc = 0;
         }
 
-        /* give up the CPU if we still are looping */
+        /* wait for the socket to drain if we still are looping */
         if(!session->terminating && rc >= 0 && session->data_offset < session->data_size) {
-            sleep_ms(1);
+            socket_wait_event(session->sock, SOCK_EVENT_WRITE, session_wait_time(timeout_time));
         }
     } while(!session->terminating && rc >= 0 && session->data_offset < session->data_size && timeout_time > time_ms());
 
@@ -1740,6 +2889,8 @@ int send_eip_request(ab_session_p session, int timeout)
         return PLCTAG_ERR_TIMEOUT;
     }
 
+    capture_frame(&session->capture, 1, session->data, (int)session->data_size);
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
@@ -1750,13 +2901,10 @@ int send_eip_request(ab_session_p session, int timeout)
 /*
  * recv_eip_response
  *
- * Look at the passed session and read any data we can
- * to fill in a packet.  If we already have a full packet,
- * punt.
+ * Wait for a complete response packet in the session buffer.
  */
 int recv_eip_response(ab_session_p session, int timeout)
 {
-    uint32_t data_needed = 0;
     int rc = PLCTAG_STATUS_OK;
     int64_t timeout_time = 0;
 
@@ -1776,63 +2924,27 @@ int recv_eip_response(ab_session_p session, int timeout)
 
     session->data_offset = 0;
     session->data_size = 0;
-    data_needed = sizeof(eip_encap);
 
     do {
-        rc = socket_read(session->sock, session->data + session->data_offset,
-                         (int)(data_needed - session->data_offset));
-
-        if (rc < 0) {
-            /* error! */
-            pdebug(DEBUG_WARN, "Error reading socket! rc=%d", rc);
-            return rc;
-        } else {
-            session->data_offset += (uint32_t)rc;
-
-            /*pdebug_dump_bytes(session->debug, session->data, session->data_offset);*/
-
-            /* recalculate the amount of data needed if we have just completed the read of an encap header */
-            if(session->data_offset >= sizeof(eip_encap)) {
-                data_needed = (uint32_t)(sizeof(eip_encap) + le2h16(((eip_encap *)(session->data))->encap_length));
-
-                if(data_needed > session->data_capacity) {
-                    pdebug(DEBUG_WARN, "Packet response (%d) is larger than possible buffer size (%d)!", data_needed, session->data_capacity);
-                    return PLCTAG_ERR_TOO_LARGE;
-                }
-            }
-        }
+        rc = read_eip_response(session);
 
         /* did we get all the data? */
-        if(!session->terminating && session->data_offset < data_needed) {
-            /* do not hog the CPU */
-            sleep_ms(1);
+        if(!session->terminating && rc == PLCTAG_STATUS_PENDING) {
+            /* do not hog the CPU, wait for more data to arrive. */
+            socket_wait_event(session->sock, SOCK_EVENT_READ, session_wait_time(timeout_time));
         }
-    } while(!session->terminating && session->data_offset < data_needed && timeout_time > time_ms());
+    } while(!session->terminating && rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms());
 
     if(session->terminating) {
         pdebug(DEBUG_INFO, "Session is terminating, returning...");
         return PLCTAG_ERR_ABORT;
     }
 
-    if(timeout_time <= time_ms()) {
+    if(rc == PLCTAG_STATUS_PENDING) {
         pdebug(DEBUG_WARN, "Timed out waiting for data to read!");
         return PLCTAG_ERR_TIMEOUT;
     }
 
-    session->resp_seq_id = le2h64(((eip_encap *)(session->data))->encap_sender_context);
-    session->data_size = data_needed;
-
-    rc = PLCTAG_STATUS_OK;
-
-    pdebug(DEBUG_DETAIL, "request received all needed data (%d bytes of %d).", session->data_offset, data_needed);
-
-    pdebug_dump_bytes(DEBUG_DETAIL, session->data, (int)(session->data_offset));
-
-    /* check status. */
-    if(le2h32(((eip_encap *)(session->data))->encap_status) != AB_EIP_OK) {
-        rc = PLCTAG_ERR_BAD_STATUS;
-    }
-
     pdebug(DEBUG_DETAIL, "Done.");
 
     return rc;
@@ -1840,62 +2952,78 @@ int recv_eip_response(ab_session_p session, int timeout)
 
 
 
-int perform_forward_open(ab_session_p session)
+/*
+ * read_eip_response
+ *
+ * Read whatever data is available into the session buffer without
+ * waiting.  The caller must zero data_offset before the first call for a
+ * packet.  Returns PLCTAG_STATUS_PENDING until the whole packet is in.
+ */
+int read_eip_response(ab_session_p session)
 {
+    uint32_t data_needed = 0;
     int rc = PLCTAG_STATUS_OK;
-    int max_payload_size = session->max_payload_size;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    pdebug(DEBUG_SPEW, "Starting.");
 
     do {
-        /*
-         * Try with a large packet if this is a Logix-class PLC
-         * and we are doing connected messaging.
-         */
+        /* we need the encap header first to know how big the packet is. */
+        if(session->data_offset >= sizeof(eip_encap)) {
+            data_needed = (uint32_t)(sizeof(eip_encap) + le2h16(((eip_encap *)(session->data))->encap_length));
 
-        if(session->plc_type == AB_PROTOCOL_LGX && session->use_connected_msg) {
-            max_payload_size = MAX_CIP_MSG_SIZE_EX;
+            if(data_needed > session->data_capacity) {
+                pdebug(DEBUG_WARN, "Packet response (%d) is larger than possible buffer size (%d)!", data_needed, session->data_capacity);
+                return PLCTAG_ERR_TOO_LARGE;
+            }
+        } else {
+            data_needed = sizeof(eip_encap);
         }
 
-        rc = try_forward_open_ex(session, &max_payload_size);
-        if(rc == PLCTAG_ERR_TOO_LARGE) {
-            /* we support the Forward Open Extended command, but we need to use a smaller size. */
-            pdebug(DEBUG_DETAIL, "ForwardOpenEx is supported but packet size of %d is not, trying %d.", MAX_CIP_MSG_SIZE_EX, max_payload_size);
+        if(session->data_offset >= data_needed) {
+            break;
+        }
 
-            rc = try_forward_open_ex(session, &max_payload_size);
-            if(rc != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
-            } else {
-                pdebug(DEBUG_DETAIL, "ForwardOpenEx succeeded with packet size %d.", session->max_payload_size);
-            }
-        } else if(rc == PLCTAG_ERR_UNSUPPORTED) {
-            rc = try_forward_open(session);
-            if(rc == PLCTAG_ERR_TOO_LARGE) {
-                /* we support the Forward Open Extended command, but we need to use a smaller size. */
-                pdebug(DEBUG_DETAIL, "ForwardOpen is supported but packet size of %d is not, trying %d.", MAX_CIP_MSG_SIZE, session->max_payload_size);
-
-                rc = try_forward_open(session);
-                if(rc != PLCTAG_STATUS_OK) {
-                    pdebug(DEBUG_WARN, "Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
-                } else {
-                    pdebug(DEBUG_DETAIL, "ForwardOpen succeeded with packet size %d.", session->max_payload_size);
-                }
-            }
-        } /*else {
-            pdebug(DEBUG_WARN, "Unknown error! rc=%d", rc);
-        }*/
-    } while(0);
+        rc = socket_read(session->sock, session->data + session->data_offset,
+                         (int)(data_needed - session->data_offset));
 
-    if(rc == PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_DETAIL, "ForwardOpen succeeded and maximum CIP packet size is %d.", session->max_payload_size);
+        if (rc < 0) {
+            /* error! */
+            pdebug(DEBUG_WARN, "Error reading socket! rc=%d", rc);
+            return rc;
+        }
+
+        session->data_offset += (uint32_t)rc;
+        atomic_int64_add(&session->stats.bytes_in, rc);
+    } while(rc > 0);
+
+    if(session->data_offset < data_needed) {
+        pdebug(DEBUG_SPEW, "Have %d bytes of %d.", session->data_offset, data_needed);
+        return PLCTAG_STATUS_PENDING;
     }
 
-    pdebug(DEBUG_INFO, "Done.");
+    session->resp_seq_id = le2h64(((eip_encap *)(session->data))->encap_sender_context);
+    session->data_size = data_needed;
+
+    capture_frame(&session->capture, 0, session->data, (int)session->data_size);
+
+    rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "request received all needed data (%d bytes of %d).", session->data_offset, data_needed);
+
+    pdebug_dump_bytes(DEBUG_DETAIL, session->data, (int)(session->data_offset));
+
+    /* check status. */
+    if(le2h32(((eip_encap *)(session->data))->encap_status) != AB_EIP_OK) {
+        rc = PLCTAG_ERR_BAD_STATUS;
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
 
     return rc;
 }
 
 
+
 int perform_forward_close(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
@@ -1922,51 +3050,50 @@ int perform_forward_close(ab_session_p session)
 }
 
 
-int try_forward_open_ex(ab_session_p session, int *packet_size_guess)
+/*
+ * start_forward_open
+ *
+ * Set up the first Forward Open attempt of a new connection.  Logix-class
+ * PLCs are asked for a large packet first.
+ */
+void start_forward_open(ab_session_p session)
 {
-    int rc = PLCTAG_STATUS_OK;
-    ab_request_p req=NULL;
-    uint16_t old_max_payload_size = 0;
-
-
-    pdebug(DEBUG_INFO, "Starting.");
+    session->forward_open_ex = 1;
+    session->forward_open_retried = 0;
+    session->forward_open_size = session->max_payload_size;
 
-    critical_block(session->mutex) {
-        old_max_payload_size = session->max_payload_size;
-        session->max_payload_size = (uint16_t)*packet_size_guess;
+    if(session->plc_type == AB_PROTOCOL_LGX && session->use_connected_msg) {
+        session->forward_open_size = MAX_CIP_MSG_SIZE_EX;
     }
+}
 
-    /* get a request buffer */
-    rc = session_create_request(session, 0, &req);
 
-    do {
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to get new request, %s!", plc_tag_decode_error(rc));
-            rc = 0;
-            break;
-        }
 
-        /* send the ForwardOpenEx command to the PLC */
-        if((rc = send_forward_open_req_ex(session)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to send ForwardOpenEx packet!");
-            break;
-        }
+/*
+ * send_forward_open
+ *
+ * Send the current Forward Open attempt.  ForwardOpenEx asks for the guessed
+ * packet size.  The old packet size is kept until the PLC accepts the new one.
+ */
+int send_forward_open(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
 
-        /* check for the ForwardOpen response. */
-        if((rc = recv_forward_open_resp(session, packet_size_guess)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to use ForwardOpen response!");
-            break;
+    if(session->forward_open_ex) {
+        critical_block(session->mutex) {
+            session->forward_open_old_size = session->max_payload_size;
+            session->max_payload_size = (uint16_t)session->forward_open_size;
         }
-    } while(0);
 
-    if(req) {
-        req = rc_dec(req);
+        rc = send_forward_open_req_ex(session);
+    } else {
+        rc = send_forward_open_req(session);
     }
 
     if(rc != PLCTAG_STATUS_OK) {
-        critical_block(session->mutex) {
-            session->max_payload_size = old_max_payload_size;
-        }
+        pdebug(DEBUG_WARN, "Unable to send Forward Open packet!");
     }
 
     pdebug(DEBUG_INFO, "Done.");
@@ -1975,43 +3102,43 @@ int try_forward_open_ex(ab_session_p session, int *packet_size_guess)
 }
 
 
-int try_forward_open(ab_session_p session)
-{
-    int rc = PLCTAG_STATUS_OK;
-    ab_request_p req=NULL;
-
-    pdebug(DEBUG_INFO, "Starting.");
-
-    /* get a request buffer */
-    rc = session_create_request(session, 0, &req);
-
-    do {
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to get new request, %s!", plc_tag_decode_error(rc));
-            rc = 0;
-            break;
-        }
 
-        /* send the ForwardOpen command to the PLC */
-        if((rc = send_forward_open_req(session)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to send ForwardOpenEx packet!");
-            break;
+/*
+ * retry_forward_open
+ *
+ * A Forward Open attempt failed with the passed status.  Put back the
+ * packet size and set up the next attempt if there is one.  If the PLC does
+ * not support ForwardOpenEx, the old ForwardOpen is tried.  If it wants a
+ * smaller packet, ForwardOpenEx is tried again with the size it reported.
+ * Returns non-zero if there is another attempt to make.
+ */
+int retry_forward_open(ab_session_p session, int status)
+{
+    if(session->forward_open_ex) {
+        critical_block(session->mutex) {
+            session->max_payload_size = session->forward_open_old_size;
         }
+    }
 
-        /* check for the ForwardOpen response. */
-        if((rc = recv_forward_open_resp(session, NULL)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to use ForwardOpen response!");
-            break;
-        }
-    } while(0);
+    if(!session->forward_open_ex || session->forward_open_retried) {
+        return 0;
+    }
 
-    if(req) {
-        req = rc_dec(req);
+    if(status == PLCTAG_ERR_TOO_LARGE) {
+        /* we support the Forward Open Extended command, but we need to use a smaller size. */
+        pdebug(DEBUG_DETAIL, "ForwardOpenEx is supported but packet size of %d is not, trying %d.", session->forward_open_old_size, session->forward_open_size);
+    } else if(status == PLCTAG_ERR_UNSUPPORTED) {
+        pdebug(DEBUG_DETAIL, "ForwardOpenEx is not supported, trying ForwardOpen.");
+        session->forward_open_ex = 0;
+    } else {
+        return 0;
     }
 
-    pdebug(DEBUG_INFO, "Done.");
+    atomic_int64_add(&session->stats.forward_open_retries, 1);
 
-    return rc;
+    session->forward_open_retried = 1;
+
+    return 1;
 }
 
 
@@ -2176,14 +3303,24 @@ int send_forward_open_req_ex(ab_session_p session)
 
 
 
+/*
+ * recv_forward_open_resp
+ *
+ * Read whatever is available of the Forward Open response.  Returns
+ * PLCTAG_STATUS_PENDING until all of it is in.
+ */
 int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess)
 {
     eip_forward_open_response_t *fo_resp;
     int rc = PLCTAG_STATUS_OK;
 
-    pdebug(DEBUG_INFO, "Starting");
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    rc = read_eip_response(session);
+    if(rc == PLCTAG_STATUS_PENDING) {
+        return rc;
+    }
 
-    rc = recv_eip_response(session, 0);
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_WARN, "Unable to receive Forward Open response.");
         return rc;
@@ -2246,7 +3383,7 @@ int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess)
         rc = PLCTAG_STATUS_OK;
     } while(0);
 
-    pdebug(DEBUG_INFO, "Done.");
+    pdebug(DEBUG_SPEW, "Done.");
 
     return rc;
 }
@@ -2362,20 +3499,20 @@ int recv_forward_close_resp(ab_session_p session)
 
 
 
-int session_create_request(ab_session_p session, int tag_id, ab_request_p *req)
+int session_create_request(ab_session_p session, int tag_id, plc_tag_p tag, ab_request_p *req)
 {
     int rc = PLCTAG_STATUS_OK;
     ab_request_p res;
-    size_t request_capacity = 0;
+    int request_capacity = 0;
     uint8_t *buffer = NULL;
 
     critical_block(session->mutex) {
-        request_capacity = (size_t)(session->max_payload_size + EIP_CIP_PREFIX_SIZE);
+        request_capacity = (int)(session->max_payload_size + EIP_CIP_PREFIX_SIZE);
     }
 
     pdebug(DEBUG_DETAIL, "Starting.");
 
-    buffer = (uint8_t *)mem_alloc((int)request_capacity);
+    buffer = request_pool_get(session->request_pool, request_capacity);
     if(!buffer) {
         pdebug(DEBUG_WARN, "Unable to allocate request buffer!");
         *req = NULL;
@@ -2384,14 +3521,20 @@ int session_create_request(ab_session_p session, int tag_id, ab_request_p *req)
 
     res = (ab_request_p)rc_alloc((int)sizeof(struct ab_request_t), request_destroy);
     if (!res) {
-        mem_free(buffer);
+        request_pool_put(session->request_pool, buffer, request_capacity);
         *req = NULL;
         rc = PLCTAG_ERR_NO_MEM;
     } else {
         res->data = buffer;
         res->tag_id = tag_id;
-        res->request_capacity = (int)request_capacity;
+        res->tag = tag;
+        res->priority = (tag ? ((ab_tag_p)tag)->priority : SESSION_PRIORITY_NORMAL);
+        res->deadline = (tag ? tag->op_deadline : 0);
+        res->group_id = (tag ? tag->group_id : 0);
+        res->group_hold = (tag ? rc_inc(tag->group_hold) : NULL);
+        res->request_capacity = request_capacity;
         res->lock = LOCK_INIT;
+        res->pool = rc_inc(session->request_pool);
 
         *req = res;
     }
@@ -2420,10 +3563,13 @@ void request_destroy(void *req_arg)
     req->abort_request = 1;
 
     if(req->data) {
-        mem_free(req->data);
+        request_pool_put(req->pool, req->data, req->request_capacity);
         req->data = NULL;
     }
 
+    req->pool = rc_dec(req->pool);
+    req->group_hold = rc_dec(req->group_hold);
+
     pdebug(DEBUG_DETAIL, "Done.");
 }
 
@@ -2433,7 +3579,9 @@ int session_request_increase_buffer(ab_request_p request, int new_capacity)
     uint8_t *old_buffer = NULL;
     uint8_t *new_buffer = NULL;
 
-    new_buffer = (uint8_t *)mem_alloc(new_capacity);
+    int old_capacity = 0;
+
+    new_buffer = request_pool_get(request->pool, new_capacity);
     if(!new_buffer) {
         pdebug(DEBUG_WARN, "Unable to allocate larger request buffer!");
         return PLCTAG_ERR_NO_MEM;
@@ -2441,11 +3589,408 @@ int session_request_increase_buffer(ab_request_p request, int new_capacity)
 
     spin_block(&request->lock) {
         old_buffer = request->data;
+        old_capacity = request->request_capacity;
         request->request_capacity = new_capacity;
         request->data = new_buffer;
     }
 
-    mem_free(old_buffer);
+    request_pool_put(request->pool, old_buffer, old_capacity);
 
     return PLCTAG_STATUS_OK;
 }
+
+
+
+
+request_pool_p request_pool_create(void)
+{
+    request_pool_p pool = NULL;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    pool = (request_pool_p)rc_alloc((int)sizeof(struct request_pool_t), request_pool_destroy);
+    if(!pool) {
+        pdebug(DEBUG_WARN, "Unable to allocate request pool!");
+        return NULL;
+    }
+
+    pool->lock = LOCK_INIT;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return pool;
+}
+
+
+void request_pool_destroy(void *pool_arg)
+{
+    request_pool_p pool = (request_pool_p)pool_arg;
+    uint8_t *buffer = pool->free_list;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    while(buffer) {
+        uint8_t *next = NULL;
+
+        mem_copy(&next, buffer, (int)sizeof(next));
+        mem_free(buffer);
+        buffer = next;
+    }
+
+    pool->free_list = NULL;
+    pool->num_free = 0;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+}
+
+
+/*
+ * Get a zeroed buffer of the given capacity.  The pool only holds
+ * buffers of one size, so if the session renegotiated its payload size
+ * the old buffers are dropped and the pool switches to the new size.
+ */
+uint8_t *request_pool_get(request_pool_p pool, int capacity)
+{
+    uint8_t *buffer = NULL;
+    uint8_t *stale = NULL;
+
+    if(!pool) {
+        return (uint8_t *)mem_alloc(capacity);
+    }
+
+    spin_block(&pool->lock) {
+        if(pool->capacity != capacity) {
+            stale = pool->free_list;
+            pool->free_list = NULL;
+            pool->num_free = 0;
+            pool->capacity = capacity;
+        } else if(pool->free_list) {
+            buffer = pool->free_list;
+            mem_copy(&pool->free_list, buffer, (int)sizeof(pool->free_list));
+            pool->num_free--;
+        }
+    }
+
+    while(stale) {
+        uint8_t *next = NULL;
+
+        mem_copy(&next, stale, (int)sizeof(next));
+        mem_free(stale);
+        stale = next;
+    }
+
+    if(buffer) {
+        mem_set(buffer, 0, capacity);
+    } else {
+        buffer = (uint8_t *)mem_alloc(capacity);
+    }
+
+    return buffer;
+}
+
+
+void request_pool_put(request_pool_p pool, uint8_t *buffer, int capacity)
+{
+    int kept = 0;
+
+    if(!buffer) {
+        return;
+    }
+
+    if(pool) {
+        spin_block(&pool->lock) {
+            if(pool->capacity == capacity && pool->num_free < REQUEST_POOL_MAX_FREE) {
+                mem_copy(buffer, &pool->free_list, (int)sizeof(pool->free_list));
+                pool->free_list = buffer;
+                pool->num_free++;
+                kept = 1;
+            }
+        }
+    }
+
+    if(!kept) {
+        mem_free(buffer);
+    }
+}
+
+
+
+
+/*
+ * find_group_session_unsafe
+ *
+ * Find the session for a tag that wants its PLC traffic spread over
+ * connection_count connections.  If the group to the PLC is not that big
+ * yet, NULL is returned along with the session the new one should be
+ * grouped with.  Otherwise the members take turns.
+ *
+ * Must be called with the session mutex held.
+ */
+
+ab_session_p find_group_session_unsafe(const char *host, const char *path, int connection_count, ab_session_p *group_leader)
+{
+    ab_session_p session = find_session_by_host_unsafe(host, path);
+    session_group_p group = NULL;
+    ab_session_p member = AB_SESSION_NULL;
+    int num_members = 1;
+
+    *group_leader = AB_SESSION_NULL;
+
+    if(!session) {
+        return AB_SESSION_NULL;
+    }
+
+    group = session->group;
+
+    if(group) {
+        spin_block(&group->lock) {
+            num_members = group->num_members;
+
+            if(num_members >= connection_count) {
+                for(int i = 0; i < num_members && !member; i++) {
+                    ab_session_p candidate = group->members[group->next_member % num_members];
+
+                    group->next_member = (group->next_member + 1) % num_members;
+
+                    if(!candidate->failed) {
+                        member = rc_inc(candidate);
+                    }
+                }
+            }
+        }
+    }
+
+    if(num_members < connection_count) {
+        pdebug(DEBUG_DETAIL, "Connection group has %d of %d sessions, adding one.", num_members, connection_count);
+        *group_leader = session;
+        return AB_SESSION_NULL;
+    }
+
+    if(member) {
+        rc_dec(session);
+        session = member;
+    }
+
+    return session;
+}
+
+
+
+/*
+ * session_group_join_unsafe
+ *
+ * Put a new session in the same group as the leader, creating the group if
+ * this is the first time the leader has company.
+ *
+ * Must be called with the session mutex held.
+ */
+
+int session_group_join_unsafe(ab_session_p leader, ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    session_group_p group = leader->group;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!group) {
+        group = (session_group_p)rc_alloc((int)sizeof(struct session_group_t), session_group_destroy);
+        if(!group) {
+            pdebug(DEBUG_WARN, "Unable to allocate session group!");
+            return PLCTAG_ERR_NO_MEM;
+        }
+
+        group->lock = LOCK_INIT;
+        group->members[0] = leader;
+        group->num_members = 1;
+
+        leader->group = group;
+    }
+
+    spin_block(&group->lock) {
+        if(group->num_members < SESSION_MAX_CONNECTION_COUNT) {
+            group->members[group->num_members] = session;
+            group->num_members++;
+        } else {
+            rc = PLCTAG_ERR_TOO_LARGE;
+        }
+    }
+
+    if(rc == PLCTAG_STATUS_OK) {
+        session->group = rc_inc(group);
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+void session_group_destroy(void *group_arg)
+{
+    session_group_p group = (session_group_p)group_arg;
+
+    pdebug(DEBUG_INFO, "Destroying session group with %d members left.", group->num_members);
+}
+
+
+
+/*
+ * session_group_leave
+ *
+ * Take a dying session out of its group.
+ */
+
+void session_group_leave(ab_session_p session)
+{
+    session_group_p group = session->group;
+
+    if(!group) {
+        return;
+    }
+
+    spin_block(&group->lock) {
+        for(int i = 0; i < group->num_members; i++) {
+            if(group->members[i] == session) {
+                group->num_members--;
+                group->members[i] = group->members[group->num_members];
+                group->members[group->num_members] = AB_SESSION_NULL;
+                break;
+            }
+        }
+    }
+
+    session->group = rc_dec(group);
+}
+
+
+
+/*
+ * session_group_select
+ *
+ * Pick the member of the session's group with the fewest queued and in
+ * flight requests.  Members that failed, or that cannot take a request
+ * this big, are skipped.  The session itself wins ties.  A packable request
+ * of a tag group that is being queued goes where the rest of the group is.
+ * A reference is taken on the result if it is not the passed session.
+ *
+ * Each fragment of a large read or write is a request of its own and is
+ * placed on its own, so the fragments of one operation can go out over
+ * different connections at the same time.  That is safe because every
+ * fragment names its byte offset and the tag only completes once all of
+ * them are back.  As with a single connection, fragments are separate
+ * requests to the PLC, so the data is not read or written as one snapshot.
+ */
+
+ab_session_p session_group_select(ab_session_p session, ab_request_p req)
+{
+    session_group_p group = session->group;
+    ab_session_p members[SESSION_MAX_CONNECTION_COUNT];
+    int num_members = 0;
+    ab_session_p best = session;
+    int best_depth = 0;
+    int pinned = 0;
+
+    spin_block(&group->lock) {
+        for(int i = 0; i < group->num_members; i++) {
+            if(group->members[i] != session) {
+                ab_session_p member = rc_inc(group->members[i]);
+
+                if(member) {
+                    members[num_members] = member;
+                    num_members++;
+                }
+            }
+        }
+    }
+
+    best_depth = session_queue_depth(session);
+
+    /* keep the requests of a tag group on one connection so that they are packed together. */
+    if(req->allow_packing && request_is_held(req)) {
+        if(session_has_group_request(session, req->group_id)) {
+            pinned = 1;
+        }
+
+        for(int i = 0; i < num_members && !pinned; i++) {
+            if(session_has_group_request(members[i], req->group_id)) {
+                best = members[i];
+                pinned = 1;
+            }
+        }
+    }
+
+    for(int i = 0; i < num_members && !pinned && best_depth > 0; i++) {
+        ab_session_p member = members[i];
+        int usable = 0;
+        int depth = 0;
+
+        critical_block(member->mutex) {
+            usable = !member->failed && !member->terminating && req->request_size <= member->max_payload_size + EIP_CIP_PREFIX_SIZE;
+        }
+
+        if(usable) {
+            depth = session_queue_depth(member);
+
+            if(depth < best_depth) {
+                best = member;
+                best_depth = depth;
+            }
+        }
+    }
+
+    for(int i = 0; i < num_members; i++) {
+        if(members[i] != best) {
+            rc_dec(members[i]);
+        }
+    }
+
+    return best;
+}
+
+
+
+/*
+ * session_queue_depth
+ *
+ * How many requests a session has waiting or on the wire.  The in flight
+ * list belongs to the session thread, so its length is read from the
+ * atomic counter kept next to it.  The result is only an estimate.
+ */
+
+int session_queue_depth(ab_session_p session)
+{
+    int depth = 0;
+
+    critical_block(session->mutex) {
+        depth = vector_length(session->requests);
+    }
+
+    /* adding zero is an atomic read. */
+    depth += atomic_int_add(&session->num_inflight, 0);
+
+    return depth;
+}
+
+
+
+/*
+ * session_has_group_request
+ *
+ * Is a request of the tag group waiting in the session's queue?
+ */
+
+int session_has_group_request(ab_session_p session, int32_t group_id)
+{
+    int found = 0;
+
+    critical_block(session->mutex) {
+        for(int i = 0; i < vector_length(session->requests) && !found; i++) {
+            ab_request_p request = vector_get(session->requests, i);
+
+            found = (request->group_id == group_id);
+        }
+    }
+
+    return found;
+}
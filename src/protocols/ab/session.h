@@ -34,9 +34,12 @@
 #ifndef __PLCTAG_AB_SESSION_H__
 #define __PLCTAG_AB_SESSION_H__ 1
 
+#include <ab/ab.h>
 #include <ab/ab_common.h>
 #include <ab/defs.h>
+#include <util/capture.h>
 #include <util/rc.h>
+#include <util/reactor.h>
 #include <util/vector.h>
 
 /* #define MAX_SESSION_HOST    (128) */
@@ -48,6 +51,32 @@
 #define SESSION_MIN_REQUESTS    (10)
 #define SESSION_INC_REQUESTS    (10)
 
+#define SESSION_DEFAULT_REQUESTS_IN_FLIGHT (1)
+#define SESSION_MAX_REQUESTS_IN_FLIGHT (16)
+
+#define SESSION_DEFAULT_CONNECTION_COUNT (1)
+#define SESSION_MAX_CONNECTION_COUNT (8)
+
+/* request priority classes.  Requests of a higher class always go out first. */
+#define SESSION_PRIORITY_LOW (0)
+#define SESSION_PRIORITY_NORMAL (1)
+#define SESSION_PRIORITY_HIGH (2)
+#define SESSION_NUM_PRIORITIES (3)
+
+
+typedef enum { SESSION_OPEN_SOCKET, SESSION_WAIT_CONNECT, SESSION_REGISTER, SESSION_WAIT_REGISTER,
+               SESSION_CONNECT, SESSION_WAIT_FORWARD_OPEN,
+               SESSION_IDLE, SESSION_DISCONNECT, SESSION_UNREGISTER,
+               SESSION_CLOSE_SOCKET, SESSION_START_RETRY, SESSION_WAIT_RETRY,
+               SESSION_WAIT_RECONNECT
+             } session_state_t;
+
+
+/* recycled request buffers, shared by a session and its requests. */
+typedef struct request_pool_t *request_pool_p;
+
+/* sessions to the same PLC that share the request load. */
+typedef struct session_group_t *session_group_p;
 
 struct ab_session_t {
 //    int status;
@@ -79,9 +108,27 @@ struct ab_session_t {
     /* Sequence ID for requests. */
     uint64_t session_seq_id;
 
-    /* list of outstanding requests for this session */
+    /* list of outstanding requests for this session, highest priority first, then earliest deadline first. */
     vector_p requests;
 
+    /* how long requests of each priority class waited in the queue before being sent. */
+    int64_t queue_wait_count[SESSION_NUM_PRIORITIES];
+    int64_t queue_wait_total_ms[SESSION_NUM_PRIORITIES];
+    int64_t queue_wait_max_ms[SESSION_NUM_PRIORITIES];
+
+    /* buffers for new requests. */
+    request_pool_p request_pool;
+
+    /* other connections to the same PLC that requests can be spread over. */
+    session_group_p group;
+
+    /* request packets sent but not yet answered.  Only used by the session thread. */
+    int max_requests_in_flight;
+    vector_p inflight;
+
+    /* length of the in flight list, kept atomically so other threads can read it. */
+    volatile int num_inflight;
+
     /* data for receiving messages */
     uint64_t resp_seq_id;
     uint32_t data_offset;
@@ -91,6 +138,12 @@ struct ab_session_t {
 
     uint64_t packet_count;
 
+    /* made-up TCP stream of the connection for packet capture. */
+    capture_stream_t capture;
+
+    /* performance counters, updated with atomics so that any thread can read them. */
+    ab_session_stats_t stats;
+
     thread_p handler_thread;
     volatile int terminating;
     mutex_p mutex;
@@ -98,6 +151,31 @@ struct ab_session_t {
     /* disconnect handling */
     int auto_disconnect_enabled;
     int auto_disconnect_timeout_ms;
+
+    /* connection state machine.  Only used by the thread running the session. */
+    session_state_t state;
+    int64_t timeout_time;
+    int64_t auto_disconnect_time;
+    int auto_disconnect;
+
+    /* the Forward Open attempt in progress. */
+    int forward_open_ex;
+    int forward_open_retried;
+    int forward_open_size;
+    uint16_t forward_open_old_size;
+
+    /* set while a response is partially read into the data buffer. */
+    int receiving;
+
+    /* set when everything queued belongs to tag groups that are still being queued. */
+    int requests_held;
+
+    /* the ID of the next request queued. */
+    uint64_t next_request_id;
+
+    /* run by a shared reactor thread instead of the session's own thread. */
+    int use_reactor;
+    reactor_client_p reactor_client;
 };
 
 struct ab_request_t {
@@ -112,18 +190,42 @@ struct ab_request_t {
 
     /* debugging info */
     int tag_id;
+    uint64_t request_id;    /* unique within the session, for tracing. */
+
+    /* the owning tag, woken when the response is in.  Not valid once the request is aborted. */
+    plc_tag_p tag;
+
+    /* priority class, requests of higher classes are sent first. */
+    int priority;
+
+    /* tag group of the owning tag, zero for none.  Held requests of a group are not sent. */
+    int32_t group_id;
+    plc_tag_group_hold_p group_hold;
 
     /* allow requests to be packed in the session */
     int allow_packing;
-    int packing_num;
+    int packing_num; /* which reply in a packed packet belongs to this request. */
 
-    /* time stamp for debugging output */
+    /* time stamps for debugging output and packing */
+    int64_t time_queued;
     int64_t time_sent;
 
+    /* monotonic queue time in microseconds for the latency histograms. */
+    int64_t time_queued_us;
+
+    /* absolute time after which nobody waits for the response, zero for none. */
+    int64_t deadline;
+
+    /* expected bytes of CIP reply, zero if not known yet.  Used to size packed requests. */
+    int response_size;
+
     /* used by the background thread for incrementally getting data */
     int request_size; /* total bytes, not just data */
     int request_capacity;
     uint8_t *data;
+
+    /* where the data buffer goes back to when the request is destroyed. */
+    request_pool_p pool;
 };
 
 
@@ -136,7 +238,10 @@ extern void session_teardown();
 
 extern int session_find_or_create(ab_session_p *session, attr attribs);
 extern int session_get_max_payload(ab_session_p session);
-extern int session_create_request(ab_session_p session, int tag_id, ab_request_p *request);
+extern int session_get_max_requests_in_flight(ab_session_p session);
+extern int session_get_queue_wait(ab_session_p session, int priority, int64_t *count, int64_t *total_ms, int64_t *max_ms);
+extern int session_get_stats(const char *host, const char *path, ab_session_stats_t *stats);
+extern int session_create_request(ab_session_p session, int tag_id, plc_tag_p tag, ab_request_p *request);
 extern int session_add_request(ab_session_p sess, ab_request_p req);
 
 #endif
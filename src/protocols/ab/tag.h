@@ -64,6 +64,19 @@ typedef enum {
 } elem_type_t;
 
 
+/*
+ * One fragment of a large read or write.  Once the size of the tag and
+ * how much the PLC returns per packet are known, all the fragments are
+ * queued at once instead of one round trip at a time.
+ */
+typedef struct {
+    ab_request_p req;
+    int offset;
+    int size;
+    int status;
+} ab_frag_t;
+
+
 struct ab_tag_t {
     /*struct plc_tag_t p_tag;*/
     TAG_BASE_STRUCT;
@@ -98,7 +111,6 @@ struct ab_tag_t {
     int tag_list;
     uint32_t next_id;
 
-    int is_bit;
     uint8_t bit;
 
     /* requests */
@@ -107,8 +119,16 @@ struct ab_tag_t {
     ab_request_p req;
     int offset;
 
+    /* fragments in flight in parallel, and how much data each one carries. */
+    ab_frag_t *frags;
+    int num_frags;
+    int frag_data_size;
+
     int allow_packing;
 
+    /* priority class of the tag's requests in the session queue. */
+    int priority;
+
     /* flags for operations */
     int read_in_progress;
     int write_in_progress;
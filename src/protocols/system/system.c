@@ -31,6 +31,7 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <float.h>
 #include <platform.h>
 #include <util/debug.h>
 #include <util/attr.h>
@@ -40,6 +41,7 @@
 #include <system/tag.h>
 #include <lib/init.h>
 #include <util/rc.h>
+#include <ab/ab.h>
 
 
 
@@ -50,7 +52,12 @@ static int system_tag_abort(plc_tag_p tag);
 static int system_tag_read(plc_tag_p tag);
 static int system_tag_status(plc_tag_p tag);
 static int system_tag_write(plc_tag_p tag);
+static int read_session_stats(system_tag_p tag);
+static int64_t percentile_or_zero(histogram_t *hist, double percentile);
 
+static uint64_t get_uint64(plc_tag_p ptag, int offset);
+static int64_t get_int64(plc_tag_p ptag, int offset);
+static double get_float64(plc_tag_p ptag, int offset);
 static uint32_t get_uint32(plc_tag_p ptag, int offset);
 static int set_uint32(plc_tag_p ptag, int offset, uint32_t val);
 static uint8_t get_uint8(plc_tag_p ptag, int offset);
@@ -70,10 +77,10 @@ struct tag_vtable_t system_tag_vtable = {
     /* get_bit */ NULL,
     /* set_bit */ NULL,
 
-    /* get_uint64 */ NULL,
+    /* get_uint64 */ get_uint64,
     /* set_uint64 */ NULL,
 
-    /* get_int64 */ NULL,
+    /* get_int64 */ get_int64,
     /* set_int64 */ NULL,
 
     /* get_uint32 */ get_uint32,
@@ -94,7 +101,7 @@ struct tag_vtable_t system_tag_vtable = {
     /* get_int8 */ NULL,
     /* set_int8 */ NULL,
 
-    /* get_float64 */ NULL,
+    /* get_float64 */ get_float64,
     /* set_float64 */ NULL,
 
     /* get_float32 */ NULL,
@@ -140,7 +147,30 @@ plc_tag_p system_tag_create(attr attribs)
 
     /* point data at the backing store. */
     tag->data = &tag->backing_data[0];
-    tag->size = (int)sizeof(tag->backing_data);
+    tag->size = MAX_SYSTEM_TAG_SIZE;
+
+    /* the session counters are for the connections to one gateway. */
+    if(str_cmp_i(name, "session_stats") == 0) {
+        const char *gateway = attr_get_str(attribs, "gateway", NULL);
+        const char *path = attr_get_str(attribs, "path", NULL);
+
+        if(!gateway || str_length(gateway) < 1) {
+            pdebug(DEBUG_ERROR, "The session_stats tag needs a gateway!");
+            rc_dec(tag);
+            return PLC_TAG_P_NULL;
+        }
+
+        tag->gateway = str_dup(gateway);
+        tag->path = (path ? str_dup(path) : NULL);
+
+        if(!tag->gateway || (path && !tag->path)) {
+            pdebug(DEBUG_ERROR, "Unable to copy gateway or path!");
+            rc_dec(tag);
+            return PLC_TAG_P_NULL;
+        }
+
+        tag->size = SESSION_STATS_SIZE;
+    }
 
     /* set the endian-ness */
     tag->endian = PLCTAG_DATA_LITTLE_ENDIAN;
@@ -176,6 +206,22 @@ static void system_tag_destroy(plc_tag_p ptag)
         mutex_destroy(&ptag->api_mutex);
     }
 
+    if(ptag->tag_cond_wait) {
+        cond_destroy(&ptag->tag_cond_wait);
+    }
+
+    if(ptag->prev_data) {
+        mem_free(ptag->prev_data);
+    }
+
+    if(tag->gateway) {
+        mem_free(tag->gateway);
+    }
+
+    if(tag->path) {
+        mem_free(tag->path);
+    }
+
     //mem_free(tag);
 
     return;
@@ -208,11 +254,96 @@ static int system_tag_read(plc_tag_p ptag)
         return PLCTAG_STATUS_OK;
     }
 
+    if(str_cmp_i(&tag->name[0],"session_stats") == 0) {
+        return read_session_stats(tag);
+    }
+
     pdebug(DEBUG_WARN,"Unknown system tag %s", tag->name);
     return PLCTAG_ERR_UNSUPPORTED;
 }
 
 
+
+/*
+ * read_session_stats
+ *
+ * Fill the tag with the counters of the sessions to the gateway.  Each
+ * value is a little-endian 64-bit integer, except the average number of
+ * requests per packet, which is a 64-bit float:
+ *
+ *   0  requests queued
+ *   8  requests sent
+ *  16  packets of requests sent
+ *  24  average requests per packet (float)
+ *  32  bytes sent
+ *  40  bytes received
+ *  48  reconnects
+ *  56  Forward Open retries
+ *  64  requests timed out
+ *  72  requests waiting in the queue now
+ *  80  queue wait p50, p99 and p999 in microseconds
+ * 104  packet round trip p50, p99 and p999 in microseconds
+ *
+ * If there is no session to the gateway, everything is zero.
+ */
+
+int read_session_stats(system_tag_p tag)
+{
+    ab_session_stats_t stats;
+    int64_t values[SESSION_STATS_SIZE / 8];
+    double avg_bundle_size = 0.0;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(ab_get_session_stats(tag->gateway, tag->path, &stats) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_DETAIL, "No sessions to %s.", tag->gateway);
+        mem_set(&stats, 0, (int)sizeof(stats));
+    }
+
+    if(stats.bundles_sent > 0) {
+        avg_bundle_size = (double)stats.requests_sent / (double)stats.bundles_sent;
+    }
+
+    values[0] = stats.requests_queued;
+    values[1] = stats.requests_sent;
+    values[2] = stats.bundles_sent;
+    mem_copy(&values[3], &avg_bundle_size, (int)sizeof(avg_bundle_size));
+    values[4] = stats.bytes_out;
+    values[5] = stats.bytes_in;
+    values[6] = stats.reconnects;
+    values[7] = stats.forward_open_retries;
+    values[8] = stats.timeouts;
+    values[9] = stats.queue_depth;
+    values[10] = percentile_or_zero(&stats.queue_wait, 50.0);
+    values[11] = percentile_or_zero(&stats.queue_wait, 99.0);
+    values[12] = percentile_or_zero(&stats.queue_wait, 99.9);
+    values[13] = percentile_or_zero(&stats.round_trip, 50.0);
+    values[14] = percentile_or_zero(&stats.round_trip, 99.0);
+    values[15] = percentile_or_zero(&stats.round_trip, 99.9);
+
+    for(int i=0; i < SESSION_STATS_SIZE / 8; i++) {
+        uint64_t val = (uint64_t)values[i];
+
+        for(int j=0; j < 8; j++) {
+            tag->data[(i * 8) + j] = (uint8_t)((val >> (8 * j)) & 0xFF);
+        }
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/* an empty histogram reads as zero in the tag. */
+int64_t percentile_or_zero(histogram_t *hist, double percentile)
+{
+    int64_t res = histogram_percentile(hist, percentile);
+
+    return (res < 0 ? 0 : res);
+}
+
+
 static int system_tag_status(plc_tag_p tag)
 {
     tag->status = PLCTAG_STATUS_OK;
@@ -228,8 +359,8 @@ static int system_tag_write(plc_tag_p ptag)
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    /* the version is static */
-    if(str_cmp_i(&tag->name[0],"version") == 0) {
+    /* the version and the counters are read only. */
+    if(str_cmp_i(&tag->name[0],"version") == 0 || str_cmp_i(&tag->name[0],"session_stats") == 0) {
         return PLCTAG_ERR_NOT_IMPLEMENTED;
     }
 
@@ -250,6 +381,60 @@ static int system_tag_write(plc_tag_p ptag)
 
 
 
+uint64_t get_uint64(plc_tag_p raw_tag, int offset)
+{
+    uint64_t res = UINT64_MAX;
+    system_tag_p tag = (system_tag_p)raw_tag;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    /* is there enough data */
+    if((offset < 0) || (offset + ((int)sizeof(uint64_t)) > tag->size)) {
+        pdebug(DEBUG_WARN,"Data offset out of bounds.");
+        return res;
+    }
+
+    res = ((uint64_t)(tag->data[offset])) +
+          ((uint64_t)(tag->data[offset+1]) << 8) +
+          ((uint64_t)(tag->data[offset+2]) << 16) +
+          ((uint64_t)(tag->data[offset+3]) << 24) +
+          ((uint64_t)(tag->data[offset+4]) << 32) +
+          ((uint64_t)(tag->data[offset+5]) << 40) +
+          ((uint64_t)(tag->data[offset+6]) << 48) +
+          ((uint64_t)(tag->data[offset+7]) << 56);
+
+    return res;
+}
+
+
+
+int64_t get_int64(plc_tag_p raw_tag, int offset)
+{
+    return (int64_t)get_uint64(raw_tag, offset);
+}
+
+
+
+double get_float64(plc_tag_p raw_tag, int offset)
+{
+    uint64_t ures = 0;
+    double res = DBL_MAX;
+
+    /* is there enough data */
+    if((offset < 0) || (offset + ((int)sizeof(double)) > raw_tag->size)) {
+        pdebug(DEBUG_WARN,"Data offset out of bounds.");
+        return res;
+    }
+
+    ures = get_uint64(raw_tag, offset);
+
+    mem_copy(&res, &ures, (int)sizeof(res));
+
+    return res;
+}
+
+
+
 uint32_t get_uint32(plc_tag_p raw_tag, int offset)
 {
     uint32_t res = UINT32_MAX;
@@ -41,12 +41,19 @@
 #define MAX_SYSTEM_TAG_NAME (20)
 #define MAX_SYSTEM_TAG_SIZE (30)
 
+/* session_stats is sixteen 64-bit values. */
+#define SESSION_STATS_SIZE (128)
+
 struct system_tag_t {
     /*struct plc_tag_t p_tag;*/
     TAG_BASE_STRUCT;
 
     char name[MAX_SYSTEM_TAG_NAME];
-    uint8_t backing_data[MAX_SYSTEM_TAG_SIZE];
+    uint8_t backing_data[SESSION_STATS_SIZE];
+
+    /* which PLC connections session_stats reports on. */
+    char *gateway;
+    char *path;
 };
 
 typedef struct system_tag_t *system_tag_p;
@@ -0,0 +1,177 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <platform.h>
+#include "../../lib/libplctag.h"
+#include "../check.h"
+#include "../../util/debug.h"
+
+/* the same as DEBUG_RING_SLOTS in debug.c. */
+#define RING_SLOTS (1024)
+
+#define NUM_WRITERS (4)
+#define MESSAGES_PER_WRITER (5 * RING_SLOTS)
+#define BATCH_SIZE (RING_SLOTS / 2)
+
+static pthread_mutex_t counts_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int received[NUM_WRITERS];
+static int last_seen[NUM_WRITERS];
+static int dropped = 0;
+static int out_of_order = 0;
+
+
+/* called by the logger thread with each finished line. */
+static void log_callback(int32_t tag_id, int debug_level, const char *message)
+{
+    const char *text = NULL;
+    int writer = 0;
+    int seq = 0;
+    int count = 0;
+
+    (void)tag_id;
+    (void)debug_level;
+
+    pthread_mutex_lock(&counts_mutex);
+
+    if((text = strstr(message, "ring test ")) && sscanf(text, "ring test %d %d", &writer, &seq) == 2) {
+        CHECK(writer >= 0 && writer < NUM_WRITERS);
+
+        /* messages of one writer come out in order, each at most once. */
+        if(seq <= last_seen[writer]) {
+            out_of_order++;
+        }
+
+        last_seen[writer] = seq;
+        received[writer]++;
+    } else if((text = strstr(message, "Dropped ")) && sscanf(text, "Dropped %d debug", &count) == 1) {
+        dropped += count;
+    }
+
+    pthread_mutex_unlock(&counts_mutex);
+}
+
+
+static int get_received(int writer)
+{
+    int count = 0;
+
+    pthread_mutex_lock(&counts_mutex);
+    count = received[writer];
+    pthread_mutex_unlock(&counts_mutex);
+
+    return count;
+}
+
+
+static void *writer_func(void *arg)
+{
+    int writer = (int)(intptr_t)arg;
+
+    for(int seq=0; seq < MESSAGES_PER_WRITER; seq++) {
+        pdebug(DEBUG_WARN, "ring test %d %d", writer, seq);
+    }
+
+    return NULL;
+}
+
+
+int main(int argc, const char **argv)
+{
+    pthread_t writers[NUM_WRITERS];
+    int total = 0;
+
+    (void)argc;
+    (void)argv;
+
+    printf("Starting debug ring tests.\n");
+
+    for(int i=0; i < NUM_WRITERS; i++) {
+        last_seen[i] = -1;
+    }
+
+    set_debug_level(DEBUG_WARN);
+    CHECK(debug_register_logger(log_callback) == PLCTAG_STATUS_OK);
+    CHECK(debug_start_logger() == PLCTAG_STATUS_OK);
+
+    /* one writer that waits for each batch, so nothing is dropped while the ring wraps several times. */
+    for(int seq=0; seq < MESSAGES_PER_WRITER; seq++) {
+        pdebug(DEBUG_WARN, "ring test %d %d", 0, seq);
+
+        if(((seq + 1) % BATCH_SIZE) == 0) {
+            while(get_received(0) < seq + 1) {
+                sleep_ms(1);
+            }
+        }
+    }
+
+    CHECK(get_received(0) == MESSAGES_PER_WRITER);
+    CHECK(dropped == 0);
+    CHECK(out_of_order == 0);
+
+    printf("One writer sent %d messages through a ring of %d slots.\n", MESSAGES_PER_WRITER, RING_SLOTS);
+
+    /* several writers that do not wait.  Messages may be dropped, but they must all be counted. */
+    for(int i=0; i < NUM_WRITERS; i++) {
+        received[i] = 0;
+        last_seen[i] = -1;
+    }
+
+    for(int i=0; i < NUM_WRITERS; i++) {
+        CHECK(pthread_create(&writers[i], NULL, writer_func, (void *)(intptr_t)i) == 0);
+    }
+
+    for(int i=0; i < NUM_WRITERS; i++) {
+        pthread_join(writers[i], NULL);
+    }
+
+    /* writes out everything that is left, including the drop count. */
+    debug_stop_logger();
+
+    for(int i=0; i < NUM_WRITERS; i++) {
+        total += received[i];
+    }
+
+    printf("%d writers sent %d messages, %d written and %d dropped.\n", NUM_WRITERS, NUM_WRITERS * MESSAGES_PER_WRITER, total, dropped);
+
+    CHECK(out_of_order == 0);
+    CHECK(total + dropped == NUM_WRITERS * MESSAGES_PER_WRITER);
+
+    CHECK(debug_unregister_logger() == PLCTAG_STATUS_OK);
+
+    printf("Done.\n");
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../lib/libplctag.h"
+#include "../check.h"
+#include "../../util/histogram.h"
+
+static histogram_t hist;
+static histogram_t other;
+
+
+/* the value the histogram reports for a single recorded value. */
+static int64_t reported_value(int64_t value)
+{
+    histogram_reset(&hist);
+    histogram_record(&hist, value);
+
+    CHECK(histogram_count(&hist) == 1);
+    CHECK(histogram_percentile(&hist, 0.0) == histogram_percentile(&hist, 100.0));
+
+    return histogram_percentile(&hist, 100.0);
+}
+
+
+int main(int argc, const char **argv)
+{
+    int64_t last_reported = -1;
+
+    (void)argc;
+    (void)argv;
+
+    printf("Starting histogram tests.\n");
+
+    memset(&hist, 0, sizeof(hist));
+    memset(&other, 0, sizeof(other));
+
+    /* nothing recorded. */
+    CHECK(histogram_count(&hist) == 0);
+    CHECK(histogram_percentile(&hist, 50.0) == PLCTAG_ERR_NO_DATA);
+    CHECK(histogram_percentile(NULL, 50.0) == PLCTAG_ERR_NULL_PTR);
+
+    /* small values are exact. */
+    for(int64_t v=0; v < (2 * HISTOGRAM_SUB_BUCKETS); v++) {
+        CHECK(reported_value(v) == v);
+    }
+
+    /* the first bucket that holds two values. */
+    CHECK(reported_value(2 * HISTOGRAM_SUB_BUCKETS) == (2 * HISTOGRAM_SUB_BUCKETS) + 1);
+    CHECK(reported_value((2 * HISTOGRAM_SUB_BUCKETS) + 1) == (2 * HISTOGRAM_SUB_BUCKETS) + 1);
+    CHECK(reported_value((2 * HISTOGRAM_SUB_BUCKETS) + 2) == (2 * HISTOGRAM_SUB_BUCKETS) + 3);
+
+    /* negative values count as zero. */
+    CHECK(reported_value(-5) == 0);
+
+    /* every value is reported as the top of its bucket, within 1/16 of the value. */
+    for(int64_t v=1; v < ((int64_t)1 << HISTOGRAM_MAX_BITS); v += (v / 7) + 1) {
+        int64_t reported = reported_value(v);
+
+        CHECK(reported >= v);
+        CHECK((reported - v) <= (v / HISTOGRAM_SUB_BUCKETS));
+
+        /* the top of a bucket is in the same bucket. */
+        CHECK(reported_value(reported) == reported);
+
+        /* bucket edges only go up. */
+        CHECK(reported >= last_reported);
+        last_reported = reported;
+    }
+
+    /* the edges on both sides of a power of two. */
+    for(int bits = HISTOGRAM_SUB_BITS + 1; bits < HISTOGRAM_MAX_BITS; bits++) {
+        int64_t power = (int64_t)1 << bits;
+
+        CHECK(reported_value(power - 1) == power - 1);
+        CHECK(reported_value(power) == power + (power >> HISTOGRAM_SUB_BITS) - 1);
+    }
+
+    /* huge values all land in the last bucket. */
+    CHECK(reported_value(((int64_t)1 << HISTOGRAM_MAX_BITS) - 1) == ((int64_t)1 << HISTOGRAM_MAX_BITS) - 1);
+    CHECK(reported_value((int64_t)1 << HISTOGRAM_MAX_BITS) == ((int64_t)1 << HISTOGRAM_MAX_BITS) - 1);
+    CHECK(reported_value(INT64_MAX) == ((int64_t)1 << HISTOGRAM_MAX_BITS) - 1);
+
+    /* percentiles of 1 to 100. */
+    histogram_reset(&hist);
+
+    for(int64_t v=1; v <= 100; v++) {
+        histogram_record(&hist, v);
+    }
+
+    CHECK(histogram_count(&hist) == 100);
+    CHECK(histogram_percentile(&hist, 0.0) == 1);          /* the minimum. */
+    CHECK(histogram_percentile(&hist, 10.0) == 10);
+    CHECK(histogram_percentile(&hist, 50.0) == 51);        /* 50 shares a bucket with 51. */
+    CHECK(histogram_percentile(&hist, 99.0) == 99);        /* 96 to 99 share a bucket. */
+    CHECK(histogram_percentile(&hist, 100.0) == 103);      /* the maximum. */
+    CHECK(histogram_percentile(&hist, -1.0) == PLCTAG_ERR_OUT_OF_BOUNDS);
+    CHECK(histogram_percentile(&hist, 100.5) == PLCTAG_ERR_OUT_OF_BOUNDS);
+
+    /* merging adds the counts and keeps the source. */
+    histogram_reset(&other);
+    histogram_record(&other, 1000);
+    histogram_record(&other, 1000);
+    histogram_merge(&hist, &other);
+
+    CHECK(histogram_count(&other) == 2);
+    CHECK(histogram_count(&hist) == 102);
+    CHECK(histogram_percentile(&hist, 100.0) == 1023);
+    CHECK(histogram_percentile(&hist, 50.0) == 51);
+
+    histogram_reset(&hist);
+    CHECK(histogram_count(&hist) == 0);
+    CHECK(histogram_percentile(&hist, 100.0) == PLCTAG_ERR_NO_DATA);
+
+    printf("Done.\n");
+
+    return 0;
+}
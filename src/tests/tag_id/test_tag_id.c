@@ -0,0 +1,150 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../lib/libplctag.h"
+#include "../check.h"
+
+/* enough to go through all the free slots several times. */
+#define NUM_CYCLES (20000)
+#define NUM_LIVE_TAGS (100)
+/* more live tags than fit in a 16-bit slot index. */
+#define NUM_MANY_TAGS (70000)
+#define TAG_ATTRIBS "make=system&family=library&name=version"
+
+static int compare_ids(const void *a, const void *b)
+{
+    int32_t id_a = *(const int32_t *)a;
+    int32_t id_b = *(const int32_t *)b;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+
+int main(int argc, const char **argv)
+{
+    int32_t *old_ids = NULL;
+    int32_t *many_ids = NULL;
+    int32_t live_ids[NUM_LIVE_TAGS];
+    int32_t keeper = 0;
+
+    (void)argc;
+    (void)argv;
+
+    printf("Starting tag ID tests.\n");
+
+    old_ids = calloc(NUM_CYCLES, sizeof(*old_ids));
+    CHECK(old_ids != NULL);
+
+    /* a tag that stays alive the whole time. */
+    keeper = plc_tag_create(TAG_ATTRIBS, 1000);
+    CHECK(keeper > 0);
+
+    /* destroyed tags must not be found, neither right away nor after their slot is reused. */
+    for(int i=0; i < NUM_CYCLES; i++) {
+        int32_t id = plc_tag_create(TAG_ATTRIBS, 1000);
+
+        CHECK(id > 0);
+        CHECK(id != keeper);
+
+        old_ids[i] = id;
+
+        CHECK(plc_tag_status(id) == PLCTAG_STATUS_OK);
+        CHECK(plc_tag_destroy(id) == PLCTAG_STATUS_OK);
+        CHECK(plc_tag_status(id) == PLCTAG_ERR_NOT_FOUND);
+        CHECK(plc_tag_destroy(id) == PLCTAG_ERR_NOT_FOUND);
+    }
+
+    printf("Created and destroyed %d tags.\n", NUM_CYCLES);
+
+    /* no ID was handed out twice. */
+    qsort(old_ids, NUM_CYCLES, sizeof(*old_ids), compare_ids);
+
+    for(int i=1; i < NUM_CYCLES; i++) {
+        CHECK(old_ids[i] != old_ids[i - 1]);
+    }
+
+    /* new tags reuse the slots of the old ones but not their IDs. */
+    for(int i=0; i < NUM_LIVE_TAGS; i++) {
+        live_ids[i] = plc_tag_create(TAG_ATTRIBS, 1000);
+
+        CHECK(live_ids[i] > 0);
+        CHECK(bsearch(&live_ids[i], old_ids, NUM_CYCLES, sizeof(*old_ids), compare_ids) == NULL);
+    }
+
+    for(int i=0; i < NUM_CYCLES; i++) {
+        CHECK(plc_tag_status(old_ids[i]) == PLCTAG_ERR_NOT_FOUND);
+    }
+
+    for(int i=0; i < NUM_LIVE_TAGS; i++) {
+        CHECK(plc_tag_status(live_ids[i]) == PLCTAG_STATUS_OK);
+        CHECK(plc_tag_destroy(live_ids[i]) == PLCTAG_STATUS_OK);
+    }
+
+    /* lots of tags alive at once all get their own IDs. */
+    many_ids = calloc(NUM_MANY_TAGS, sizeof(*many_ids));
+    CHECK(many_ids != NULL);
+
+    for(int i=0; i < NUM_MANY_TAGS; i++) {
+        many_ids[i] = plc_tag_create(TAG_ATTRIBS, 1000);
+        CHECK(many_ids[i] > 0);
+    }
+
+    printf("Created %d live tags.\n", NUM_MANY_TAGS);
+
+    qsort(many_ids, NUM_MANY_TAGS, sizeof(*many_ids), compare_ids);
+
+    for(int i=0; i < NUM_MANY_TAGS; i++) {
+        CHECK(i == 0 || many_ids[i] != many_ids[i - 1]);
+        CHECK(many_ids[i] != keeper);
+        CHECK(plc_tag_status(many_ids[i]) == PLCTAG_STATUS_OK);
+    }
+
+    for(int i=0; i < NUM_MANY_TAGS; i++) {
+        CHECK(plc_tag_destroy(many_ids[i]) == PLCTAG_STATUS_OK);
+    }
+
+    CHECK(plc_tag_status(keeper) == PLCTAG_STATUS_OK);
+    CHECK(plc_tag_destroy(keeper) == PLCTAG_STATUS_OK);
+
+    free(many_ids);
+    free(old_ids);
+
+    plc_tag_shutdown();
+
+    printf("Done.\n");
+
+    return 0;
+}
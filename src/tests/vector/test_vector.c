@@ -0,0 +1,134 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include "../../lib/libplctag.h"
+#include "../check.h"
+#include "../../util/vector.h"
+
+#define NUM_RANDOM_OPS (10000)
+#define MAX_ENTRIES (200)
+
+static int shadow[MAX_ENTRIES];
+static int shadow_len = 0;
+static uint32_t seed = 12345;
+
+static int next_random(int limit)
+{
+    seed = (seed * 1103515245u) + 12345u;
+
+    return (int)((seed >> 16) % (uint32_t)limit);
+}
+
+
+static void check_contents(vector_p vec)
+{
+    CHECK(vector_length(vec) == shadow_len);
+
+    for(int i=0; i < shadow_len; i++) {
+        CHECK((int)(intptr_t)vector_get(vec, i) == shadow[i]);
+    }
+}
+
+
+static void insert_both(vector_p vec, int index, int value)
+{
+    CHECK(vector_insert(vec, index, (void *)(intptr_t)value) == PLCTAG_STATUS_OK);
+
+    for(int i=shadow_len; i > index; i--) {
+        shadow[i] = shadow[i - 1];
+    }
+
+    shadow[index] = value;
+    shadow_len++;
+
+    check_contents(vec);
+}
+
+
+int main(int argc, const char **argv)
+{
+    vector_p vec = NULL;
+    int value = 1;
+
+    (void)argc;
+    (void)argv;
+
+    printf("Starting vector tests.\n");
+
+    /* small capacity and increment so that inserts have to grow the vector. */
+    vec = vector_create(2, 2);
+    CHECK(vec != NULL);
+    CHECK(vector_length(vec) == 0);
+
+    /* into an empty vector, then at the end, the front and the middle. */
+    insert_both(vec, 0, value++);
+    insert_both(vec, 1, value++);
+    insert_both(vec, 0, value++);
+    insert_both(vec, 1, value++);
+    insert_both(vec, shadow_len, value++);
+
+    /* out of bounds inserts change nothing. */
+    CHECK(vector_insert(vec, -1, (void *)(intptr_t)value) == PLCTAG_ERR_OUT_OF_BOUNDS);
+    CHECK(vector_insert(vec, shadow_len + 1, (void *)(intptr_t)value) == PLCTAG_ERR_OUT_OF_BOUNDS);
+    CHECK(vector_insert(NULL, 0, (void *)(intptr_t)value) == PLCTAG_ERR_NULL_PTR);
+    check_contents(vec);
+
+    /* random inserts and removes, as the session queue does. */
+    for(int op=0; op < NUM_RANDOM_OPS; op++) {
+        if(shadow_len < MAX_ENTRIES && (shadow_len == 0 || next_random(3) != 0)) {
+            insert_both(vec, next_random(shadow_len + 1), value++);
+        } else {
+            int index = next_random(shadow_len);
+
+            CHECK((int)(intptr_t)vector_remove(vec, index) == shadow[index]);
+
+            for(int i=index; i < shadow_len - 1; i++) {
+                shadow[i] = shadow[i + 1];
+            }
+
+            shadow_len--;
+
+            check_contents(vec);
+        }
+    }
+
+    printf("Did %d random inserts and removes, %d entries left.\n", NUM_RANDOM_OPS, shadow_len);
+
+    CHECK(vector_destroy(vec) == PLCTAG_STATUS_OK);
+
+    printf("Done.\n");
+
+    return 0;
+}
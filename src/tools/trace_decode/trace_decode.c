@@ -0,0 +1,202 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * trace_decode
+ *
+ * Print a binary trace file written by the library as text, one record per
+ * line, in time order across all threads.  Times are relative to the first
+ * record.
+ *
+ * Usage: trace_decode <trace file>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <util/trace.h>
+
+
+static const char *event_names[TRACE_EVENT_END] = {
+    "UNKNOWN",
+    "READ_START",
+    "READ_DONE",
+    "WRITE_START",
+    "WRITE_DONE",
+    "REQUEST_QUEUED",
+    "REQUEST_SENT",
+    "REQUEST_DONE",
+    "REQUEST_EXPIRED",
+    "PACKET_SENT",
+    "PACKET_RECEIVED"
+};
+
+
+static uint16_t swap16(uint16_t v)
+{
+    return (uint16_t)((v >> 8) | (v << 8));
+}
+
+static uint32_t swap32(uint32_t v)
+{
+    return ((v >> 24) & 0xFF) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | ((v << 24) & 0xFF000000);
+}
+
+static uint64_t swap64(uint64_t v)
+{
+    return ((uint64_t)swap32((uint32_t)v) << 32) | (uint64_t)swap32((uint32_t)(v >> 32));
+}
+
+
+static void swap_record(trace_record_t *record)
+{
+    record->time_us = (int64_t)swap64((uint64_t)record->time_us);
+    record->id = swap64(record->id);
+    record->value = (int64_t)swap64((uint64_t)record->value);
+    record->tag_id = (int32_t)swap32((uint32_t)record->tag_id);
+    record->thread_id = swap16(record->thread_id);
+    record->event = swap16(record->event);
+}
+
+
+static int compare_records(const void *a, const void *b)
+{
+    const trace_record_t *first = (const trace_record_t *)a;
+    const trace_record_t *second = (const trace_record_t *)b;
+
+    if(first->time_us < second->time_us) {
+        return -1;
+    }
+
+    if(first->time_us > second->time_us) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    FILE *in = NULL;
+    trace_file_header_t header;
+    trace_record_t *records = NULL;
+    size_t num_records = 0;
+    size_t capacity = 0;
+    int swapped = 0;
+
+    if(argc != 2) {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    in = fopen(argv[1], "rb");
+    if(!in) {
+        fprintf(stderr, "Unable to open %s!\n", argv[1]);
+        return 1;
+    }
+
+    if(fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s is not a trace file!\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+
+    /* the record size tells us if the file was written with the other byte order. */
+    if(header.record_size != sizeof(trace_record_t)) {
+        if(swap32(header.record_size) == sizeof(trace_record_t)) {
+            swapped = 1;
+            header.version = swap32(header.version);
+        } else {
+            fprintf(stderr, "Unexpected record size %u!\n", header.record_size);
+            fclose(in);
+            return 1;
+        }
+    }
+
+    if(header.version != TRACE_FILE_VERSION) {
+        fprintf(stderr, "Unsupported trace file version %u!\n", header.version);
+        fclose(in);
+        return 1;
+    }
+
+    while(1) {
+        if(num_records == capacity) {
+            trace_record_t *new_records = NULL;
+
+            capacity = (capacity ? capacity * 2 : 4096);
+            new_records = realloc(records, capacity * sizeof(trace_record_t));
+            if(!new_records) {
+                fprintf(stderr, "Out of memory!\n");
+                free(records);
+                fclose(in);
+                return 1;
+            }
+
+            records = new_records;
+        }
+
+        if(fread(&records[num_records], sizeof(trace_record_t), 1, in) != 1) {
+            break;
+        }
+
+        if(swapped) {
+            swap_record(&records[num_records]);
+        }
+
+        num_records++;
+    }
+
+    fclose(in);
+
+    /* each thread's records are in order, but the threads are not merged. */
+    qsort(records, num_records, sizeof(trace_record_t), compare_records);
+
+    for(size_t i=0; i < num_records; i++) {
+        trace_record_t *record = &records[i];
+        const char *name = (record->event < TRACE_EVENT_END ? event_names[record->event] : event_names[0]);
+
+        printf("%12.3fms thread(%u) tag(%d) %-16s id=%" PRIx64 " value=%" PRId64 "\n",
+               (double)(record->time_us - records[0].time_us) / 1000.0,
+               (unsigned)record->thread_id,
+               record->tag_id,
+               name,
+               record->id,
+               record->value);
+    }
+
+    free(records);
+
+    return 0;
+}
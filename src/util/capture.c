@@ -0,0 +1,518 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <lib/libplctag.h>
+#include <platform.h>
+#include <util/capture.h>
+#include <util/debug.h>
+
+
+#define CAPTURE_LINKTYPE_RAW (101)      /* packets start with the IP header. */
+#define CAPTURE_SNAPLEN (65535)
+#define CAPTURE_IP_HEADER_SIZE (20)
+#define CAPTURE_TCP_HEADER_SIZE (20)
+#define CAPTURE_RECORD_HEADER_SIZE (16)
+
+/* frames waiting for the writer beyond this many bytes are dropped. */
+#define CAPTURE_MAX_PENDING_BYTES (4*1024*1024)
+#define CAPTURE_WRITER_WAIT_MS (100)
+
+/* the made-up address of the library's side of every connection. */
+#define CAPTURE_CLIENT_IP (0x0A000001)  /* 10.0.0.1 */
+#define CAPTURE_FIRST_CLIENT_PORT (49152)
+
+/* used for host names that are not dotted quads. */
+#define CAPTURE_UNKNOWN_SERVER_IP (0xC0000201) /* 192.0.2.1 */
+
+
+typedef struct capture_frame_t *capture_frame_p;
+
+struct capture_frame_t {
+    capture_frame_p next;
+    int size;
+    uint8_t data[];
+};
+
+volatile int capture_enabled = 0;
+
+static mutex_p capture_mutex = NULL;
+static cond_p capture_wait = NULL;
+static thread_p capture_thread = NULL;
+static volatile int capture_terminating = 0;
+static FILE *capture_file = NULL;
+
+/* threads inside capture_frame_impl(), capture_stop() waits for them before freeing anything. */
+static volatile int capture_users = 0;
+
+/* protected by the capture mutex. */
+static capture_frame_p pending_first = NULL;
+static capture_frame_p pending_last = NULL;
+static int pending_bytes = 0;
+static int dropped_frames = 0;
+
+static volatile int next_client_port = 0;
+static volatile int next_ip_id = 0;
+static int64_t wall_clock_offset_us = 0;
+
+static lock_t capture_start_lock = LOCK_INIT;
+
+static int write_frames(capture_frame_p frames);
+static void put_be16(uint8_t *dest, uint16_t val);
+static void put_be32(uint8_t *dest, uint32_t val);
+static uint32_t parse_ipv4(const char *host);
+static THREAD_FUNC(capture_writer_func);
+
+
+
+/*
+ * capture_start
+ *
+ * Open the file, write the pcap file header and start the writer thread.
+ */
+
+int capture_start(const char *file_name)
+{
+    int rc = PLCTAG_STATUS_OK;
+    FILE *file = NULL;
+    struct {
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t this_zone;
+        uint32_t sig_figs;
+        uint32_t snap_len;
+        uint32_t link_type;
+    } file_header;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!file_name || str_length(file_name) == 0) {
+        pdebug(DEBUG_WARN, "A file name is required!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if(!lock_acquire_try(&capture_start_lock)) {
+        pdebug(DEBUG_WARN, "Capture is already being started or stopped.");
+        return PLCTAG_ERR_BUSY;
+    }
+
+    do {
+        if(capture_file) {
+            pdebug(DEBUG_WARN, "Capture is already running!");
+            rc = PLCTAG_ERR_DUPLICATE;
+            break;
+        }
+
+        if(!capture_mutex && (rc = mutex_create(&capture_mutex)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create capture mutex!");
+            break;
+        }
+
+        if(!capture_wait && (rc = cond_create(&capture_wait)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create capture condition variable!");
+            break;
+        }
+
+        file = fopen(file_name, "wb");
+        if(!file) {
+            pdebug(DEBUG_WARN, "Unable to open capture file %s!", file_name);
+            rc = PLCTAG_ERR_OPEN;
+            break;
+        }
+
+        /* written in our own byte order, the magic number tells readers which one. */
+        file_header.magic = 0xa1b2c3d4;
+        file_header.version_major = 2;
+        file_header.version_minor = 4;
+        file_header.this_zone = 0;
+        file_header.sig_figs = 0;
+        file_header.snap_len = CAPTURE_SNAPLEN;
+        file_header.link_type = CAPTURE_LINKTYPE_RAW;
+
+        if(fwrite(&file_header, sizeof(file_header), 1, file) != 1) {
+            pdebug(DEBUG_WARN, "Unable to write capture file header!");
+            rc = PLCTAG_ERR_WRITE;
+            break;
+        }
+
+        /* the packet time stamps use the monotonic clock, like the traces, anchored to the wall clock. */
+        wall_clock_offset_us = (time_ms() * 1000) - time_us();
+
+        capture_file = file;
+        capture_terminating = 0;
+
+        rc = thread_create(&capture_thread, capture_writer_func, 32*1024, NULL);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create capture writer thread!");
+            break;
+        }
+
+        capture_enabled = 1;
+    } while(0);
+
+    if(rc != PLCTAG_STATUS_OK && file) {
+        fclose(file);
+        capture_file = NULL;
+    }
+
+    lock_release(&capture_start_lock);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * capture_stop
+ *
+ * Stop capturing, write out everything queued and close the file.  The
+ * mutex and condition variable go too, capture_start() makes new ones.
+ */
+
+int capture_stop(void)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!lock_acquire_try(&capture_start_lock)) {
+        pdebug(DEBUG_WARN, "Capture is already being started or stopped.");
+        return PLCTAG_ERR_BUSY;
+    }
+
+    do {
+        if(!capture_file) {
+            pdebug(DEBUG_DETAIL, "Capture is not running.");
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
+
+        capture_enabled = 0;
+
+        /* a session thread may have seen the flag just before it was cleared. */
+        while(atomic_int_add(&capture_users, 0) > 0) {
+            sleep_ms(1);
+        }
+
+        capture_terminating = 1;
+        cond_signal(capture_wait);
+
+        thread_join(capture_thread);
+        thread_destroy(&capture_thread);
+
+        /* frames queued after the writer stopped. */
+        critical_block(capture_mutex) {
+            rc = write_frames(pending_first);
+
+            pending_first = NULL;
+            pending_last = NULL;
+            pending_bytes = 0;
+
+            if(dropped_frames) {
+                pdebug(DEBUG_WARN, "Dropped %d frames, the capture file could not keep up.", dropped_frames);
+                dropped_frames = 0;
+            }
+        }
+
+        if(fclose(capture_file) != 0 && rc == PLCTAG_STATUS_OK) {
+            rc = PLCTAG_ERR_WRITE;
+        }
+
+        capture_file = NULL;
+    } while(0);
+
+    /* also cleans up after a start that failed. */
+    if(!capture_file) {
+        if(capture_wait) {
+            cond_destroy(&capture_wait);
+        }
+
+        if(capture_mutex) {
+            mutex_destroy(&capture_mutex);
+        }
+    }
+
+    lock_release(&capture_start_lock);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * capture_stream_init
+ *
+ * Set up the addresses of a new connection.  Each connection gets its own
+ * client port so that the streams are kept apart.
+ */
+
+void capture_stream_init(capture_stream_t *stream, const char *server_host, int server_port)
+{
+    int port_offset = atomic_int_add(&next_client_port, 1);
+
+    stream->client_ip = CAPTURE_CLIENT_IP;
+    stream->server_ip = parse_ipv4(server_host);
+    stream->client_port = (uint16_t)(CAPTURE_FIRST_CLIENT_PORT + (port_offset % (65536 - CAPTURE_FIRST_CLIENT_PORT)));
+    stream->server_port = (uint16_t)server_port;
+    stream->client_seq = 1;
+    stream->server_seq = 1;
+}
+
+
+
+/*
+ * capture_frame_impl
+ *
+ * Build the pcap record for the frame and queue it for the writer.  Only
+ * called by the thread that owns the stream.
+ */
+
+void capture_frame_impl(capture_stream_t *stream, int from_client, uint8_t *data, int size)
+{
+    capture_frame_p frame = NULL;
+    uint8_t *ip = NULL;
+    uint8_t *tcp = NULL;
+    int ip_size = CAPTURE_IP_HEADER_SIZE + CAPTURE_TCP_HEADER_SIZE + size;
+    int64_t stamp_us = time_us() + wall_clock_offset_us;
+    uint32_t checksum = 0;
+    uint32_t record_header[4];
+    int dropped = 0;
+
+    if(!stream || !data || size <= 0 || ip_size > CAPTURE_SNAPLEN) {
+        return;
+    }
+
+    /* keep capture_stop() from freeing the mutex under us, then check again. */
+    atomic_int_add(&capture_users, 1);
+
+    if(!capture_enabled) {
+        atomic_int_add(&capture_users, -1);
+        return;
+    }
+
+    frame = mem_alloc((int)sizeof(struct capture_frame_t) + CAPTURE_RECORD_HEADER_SIZE + ip_size);
+    if(!frame) {
+        atomic_int_add(&capture_users, -1);
+        return;
+    }
+
+    frame->size = CAPTURE_RECORD_HEADER_SIZE + ip_size;
+
+    /* the record header is in our own byte order, like the file header. */
+    record_header[0] = (uint32_t)(stamp_us / 1000000);
+    record_header[1] = (uint32_t)(stamp_us % 1000000);
+    record_header[2] = (uint32_t)ip_size;
+    record_header[3] = (uint32_t)ip_size;
+    mem_copy(&frame->data[0], &record_header[0], CAPTURE_RECORD_HEADER_SIZE);
+
+    ip = &frame->data[CAPTURE_RECORD_HEADER_SIZE];
+    tcp = ip + CAPTURE_IP_HEADER_SIZE;
+
+    /* IPv4 header, network byte order. */
+    ip[0] = 0x45;   /* version 4, 5 words of header. */
+    ip[1] = 0;
+    put_be16(&ip[2], (uint16_t)ip_size);
+    put_be16(&ip[4], (uint16_t)atomic_int_add(&next_ip_id, 1));
+    put_be16(&ip[6], 0x4000); /* don't fragment. */
+    ip[8] = 64;     /* TTL */
+    ip[9] = 6;      /* TCP */
+    put_be16(&ip[10], 0);
+    put_be32(&ip[12], (from_client ? stream->client_ip : stream->server_ip));
+    put_be32(&ip[16], (from_client ? stream->server_ip : stream->client_ip));
+
+    for(int i=0; i < CAPTURE_IP_HEADER_SIZE; i += 2) {
+        checksum += (uint32_t)((ip[i] << 8) | ip[i+1]);
+    }
+
+    while(checksum >> 16) {
+        checksum = (checksum & 0xFFFF) + (checksum >> 16);
+    }
+
+    put_be16(&ip[10], (uint16_t)~checksum);
+
+    /* TCP header.  The checksum is left zero, Wireshark does not check it by default. */
+    put_be16(&tcp[0], (from_client ? stream->client_port : stream->server_port));
+    put_be16(&tcp[2], (from_client ? stream->server_port : stream->client_port));
+    put_be32(&tcp[4], (from_client ? stream->client_seq : stream->server_seq));
+    put_be32(&tcp[8], (from_client ? stream->server_seq : stream->client_seq));
+    tcp[12] = 0x50; /* 5 words of header. */
+    tcp[13] = 0x18; /* PSH, ACK */
+    put_be16(&tcp[14], 0xFFFF);
+    put_be16(&tcp[16], 0);
+    put_be16(&tcp[18], 0);
+
+    mem_copy(tcp + CAPTURE_TCP_HEADER_SIZE, data, size);
+
+    if(from_client) {
+        stream->client_seq += (uint32_t)size;
+    } else {
+        stream->server_seq += (uint32_t)size;
+    }
+
+    critical_block(capture_mutex) {
+        if(!capture_enabled || pending_bytes + frame->size > CAPTURE_MAX_PENDING_BYTES) {
+            dropped_frames++;
+            dropped = 1;
+            break;
+        }
+
+        frame->next = NULL;
+
+        if(pending_last) {
+            pending_last->next = frame;
+        } else {
+            pending_first = frame;
+        }
+
+        pending_last = frame;
+        pending_bytes += frame->size;
+    }
+
+    if(dropped) {
+        mem_free(frame);
+    } else {
+        cond_signal(capture_wait);
+    }
+
+    atomic_int_add(&capture_users, -1);
+}
+
+
+
+THREAD_FUNC(capture_writer_func)
+{
+    (void)arg;
+
+    while(!capture_terminating) {
+        capture_frame_p frames = NULL;
+
+        critical_block(capture_mutex) {
+            frames = pending_first;
+
+            pending_first = NULL;
+            pending_last = NULL;
+            pending_bytes = 0;
+        }
+
+        if(frames) {
+            write_frames(frames);
+            fflush(capture_file);
+        } else {
+            cond_wait(capture_wait, CAPTURE_WRITER_WAIT_MS);
+        }
+    }
+
+    THREAD_RETURN(0);
+}
+
+
+
+/* write and free a chain of frames. */
+int write_frames(capture_frame_p frames)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    while(frames) {
+        capture_frame_p next = frames->next;
+
+        if(rc == PLCTAG_STATUS_OK && fwrite(&frames->data[0], (size_t)frames->size, 1, capture_file) != 1) {
+            pdebug(DEBUG_WARN, "Error writing to the capture file!");
+            rc = PLCTAG_ERR_WRITE;
+        }
+
+        mem_free(frames);
+
+        frames = next;
+    }
+
+    return rc;
+}
+
+
+
+void put_be16(uint8_t *dest, uint16_t val)
+{
+    dest[0] = (uint8_t)(val >> 8);
+    dest[1] = (uint8_t)(val & 0xFF);
+}
+
+
+
+void put_be32(uint8_t *dest, uint32_t val)
+{
+    dest[0] = (uint8_t)(val >> 24);
+    dest[1] = (uint8_t)((val >> 16) & 0xFF);
+    dest[2] = (uint8_t)((val >> 8) & 0xFF);
+    dest[3] = (uint8_t)(val & 0xFF);
+}
+
+
+
+/* the address if the host is a dotted quad, otherwise a stand-in. */
+uint32_t parse_ipv4(const char *host)
+{
+    uint32_t addr = 0;
+    int octet = -1;
+    int num_octets = 0;
+
+    if(!host) {
+        return CAPTURE_UNKNOWN_SERVER_IP;
+    }
+
+    for(const char *p = host; ; p++) {
+        if(*p >= '0' && *p <= '9') {
+            octet = (octet < 0 ? 0 : octet * 10) + (*p - '0');
+
+            if(octet > 255) {
+                return CAPTURE_UNKNOWN_SERVER_IP;
+            }
+        } else if((*p == '.' || *p == 0) && octet >= 0 && num_octets < 4) {
+            addr = (addr << 8) | (uint32_t)octet;
+            num_octets++;
+            octet = -1;
+
+            if(*p == 0) {
+                break;
+            }
+        } else {
+            return CAPTURE_UNKNOWN_SERVER_IP;
+        }
+    }
+
+    return (num_octets == 4 ? addr : CAPTURE_UNKNOWN_SERVER_IP);
+}
@@ -0,0 +1,68 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <platform.h>
+
+/*
+ * Packet capture to a pcap file.
+ *
+ * The frames a session sends and receives are wrapped in made-up IPv4 and
+ * TCP headers so that Wireshark follows each connection as a TCP stream
+ * and can decode what is in it.  The session thread only copies the frame
+ * into a queue, a writer thread does the file I/O.  If the writer falls
+ * behind, frames are dropped and counted.
+ */
+
+/* one side of the made-up TCP connection of a session. */
+typedef struct {
+    uint32_t client_ip;
+    uint32_t server_ip;
+    uint16_t client_port;
+    uint16_t server_port;
+    uint32_t client_seq;
+    uint32_t server_seq;
+} capture_stream_t;
+
+extern volatile int capture_enabled;
+
+extern int capture_start(const char *file_name);
+extern int capture_stop(void);
+
+extern void capture_stream_init(capture_stream_t *stream, const char *server_host, int server_port);
+extern void capture_frame_impl(capture_stream_t *stream, int from_client, uint8_t *data, int size);
+
+#define capture_frame(stream, from_client, data, size)                             \
+    do { if(capture_enabled) capture_frame_impl((stream), (from_client), (data), (size)); } while(0)
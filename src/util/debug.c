@@ -56,6 +56,54 @@ static lock_t logger_callback_lock = LOCK_INIT;
 static void (* volatile log_callback_func)(int32_t tag_id, int debug_level, const char *message);
 
 
+/*
+ * Asynchronous output.
+ *
+ * While the logger thread runs, pdebug only formats the message text into
+ * a slot of a bounded ring and returns.  The logger thread adds the time
+ * stamp prefix and writes the line to stderr or the logger callback.  Any
+ * number of threads can add messages without a lock.  When the ring is
+ * full the message is dropped and counted instead of waiting.
+ *
+ * Each slot has a sequence number.  A slot is free for the writer at ring
+ * position pos when its sequence is pos, and holds a message for the
+ * reader when its sequence is pos+1.
+ */
+
+#define DEBUG_RING_SLOTS (1024)   /* must be a power of two. */
+#define DEBUG_MSG_SIZE (256)
+#define DEBUG_LOGGER_WAIT_MS (100)
+
+struct debug_slot_t {
+    volatile int seq;
+    int64_t epoch_ms;
+    uint32_t thread_id;
+    int tag_id;
+    int debug_level;
+    const char *func;
+    int line_num;
+    char message[DEBUG_MSG_SIZE];
+};
+
+static struct debug_slot_t debug_ring[DEBUG_RING_SLOTS];
+static volatile int debug_ring_write_pos = 0;
+static int debug_ring_read_pos = 0;
+static volatile int debug_ring_dropped = 0;
+
+static volatile int logger_running = 0;
+static volatile int logger_terminating = 0;
+static volatile int logger_sleeping = 0;
+static thread_p logger_thread = NULL;
+static cond_p logger_wait = NULL;
+
+static THREAD_LOCAL int is_logger_thread = 0;
+
+static void debug_ring_push(const char *func, int line_num, int debug_level, const char *templ, va_list va);
+static int debug_ring_drain(void);
+static void emit_line(int64_t epoch_ms, uint32_t thread_id, int t_id, int debug_level, const char *func, int line_num, const char *message);
+static THREAD_FUNC(logger_func);
+
+
 /*
  * Keep the thread ID and the tag ID thread local.
  */
@@ -148,69 +196,269 @@ static const char *debug_level_name[DEBUG_END] = {"NONE", "ERROR", "WARN", "INFO
 extern void pdebug_impl(const char *func, int line_num, int debug_level, const char *templ, ...)
 {
     va_list va;
+    char message[DEBUG_MSG_SIZE];
+
+    va_start(va,templ);
+
+    /* the logger thread's own output would only wake it up again. */
+    if(logger_running && !is_logger_thread) {
+        debug_ring_push(func, line_num, debug_level, templ, va);
+    } else {
+        /* not running asynchronously, write it out now. */
+        vsnprintf(message, sizeof(message), templ, va);
+        message[sizeof(message)-1] = 0;
+
+        emit_line(time_ms(), get_thread_id(), tag_id, debug_level, func, line_num, message);
+    }
+
+    va_end(va);
+}
+
+
+
+/*
+ * emit_line
+ *
+ * Add the time stamp prefix and write the line out.
+ */
+
+void emit_line(int64_t epoch_ms, uint32_t thread_id, int t_id, int debug_level, const char *func, int line_num, const char *message)
+{
     struct tm t;
     time_t epoch;
-    int64_t epoch_ms;
     int remainder_ms;
-    char prefix[1000]; /* MAGIC */
-    int prefix_size = 0;
-    char output[1000];
-    int output_size = 0;
-
-    /* build the prefix */
-    // prefix_size = make_prefix(prefix,(int)sizeof(prefix));  /* don't exceed a size that int can express! */
-    // if(prefix_size <= 0) {
-    //     return;
-    // }
+    char output[DEBUG_MSG_SIZE + 200]; /* MAGIC */
 
     /* get the time parts */
-    epoch_ms = time_ms();
     epoch = (time_t)(epoch_ms/1000);
     remainder_ms = (int)(epoch_ms % 1000);
 
     /* FIXME - should capture error return! */
     localtime_r(&epoch,&t);
 
-    /* print only once */
-    /* FIXME - this may not be safe. */
-    // if(!printed_version && debug_level >= DEBUG_INFO) {
-    //     if(lock_acquire_try((lock_t*)&printed_version)) {
-    //         /* create the output string template */
-    //         fprintf(stderr,"%s INFO libplctag version %s, debug level %d.\n",prefix, VERSION, get_debug_level());
-    //     }
-    // }
-
-    /* build the output string template */
-    prefix_size += snprintf(prefix, sizeof(prefix),"%04d-%02d-%02d %02d:%02d:%02d.%03d thread(%u) tag(%d) %s %s:%d %s\n",
-                                                    t.tm_year+1900,
-                                                    t.tm_mon,
-                                                    t.tm_mday,
-                                                    t.tm_hour,
-                                                    t.tm_min,
-                                                    t.tm_sec,
-                                                    remainder_ms, 
-                                                    get_thread_id(), 
-                                                    tag_id, 
-                                                    debug_level_name[debug_level], 
-                                                    func, 
-                                                    line_num, 
-                                                    templ);
+    snprintf(output, sizeof(output),"%04d-%02d-%02d %02d:%02d:%02d.%03d thread(%u) tag(%d) %s %s:%d %s\n",
+                                     t.tm_year+1900,
+                                     t.tm_mon,
+                                     t.tm_mday,
+                                     t.tm_hour,
+                                     t.tm_min,
+                                     t.tm_sec,
+                                     remainder_ms,
+                                     thread_id,
+                                     t_id,
+                                     debug_level_name[debug_level],
+                                     func,
+                                     line_num,
+                                     message);
 
     /* make sure it is zero terminated */
-    prefix[sizeof(prefix)-1] = 0;
-
-    /* print it out. */
-    va_start(va,templ);
+    output[sizeof(output)-1] = 0;
 
-    /* FIXME - check the output size */
-    output_size = vsnprintf(output, sizeof(output), prefix, va);
     if(log_callback_func) {
-        log_callback_func(tag_id, get_debug_level(), output);
+        log_callback_func(t_id, get_debug_level(), output);
     } else {
         fputs(output, stderr);
     }
+}
 
-    va_end(va);
+
+
+/*
+ * debug_ring_push
+ *
+ * Claim the next free slot and fill it in.  If the ring is full, the
+ * message is only counted.
+ */
+
+void debug_ring_push(const char *func, int line_num, int debug_level, const char *templ, va_list va)
+{
+    struct debug_slot_t *slot = NULL;
+    int pos = 0;
+
+    do {
+        int diff = 0;
+
+        pos = debug_ring_write_pos;
+        slot = &debug_ring[(uint32_t)pos & (DEBUG_RING_SLOTS - 1)];
+        diff = (int)((uint32_t)atomic_int_add(&slot->seq, 0) - (uint32_t)pos);
+
+        if(diff < 0) {
+            /* the reader has not emptied this slot yet. */
+            atomic_int_add(&debug_ring_dropped, 1);
+            return;
+        }
+
+        if(diff > 0) {
+            /* another writer claimed it, try again with the new position. */
+            continue;
+        }
+    } while(!atomic_int_cas(&debug_ring_write_pos, pos, (int)((uint32_t)pos + 1)));
+
+    slot->epoch_ms = time_ms();
+    slot->thread_id = get_thread_id();
+    slot->tag_id = tag_id;
+    slot->debug_level = debug_level;
+    slot->func = func;
+    slot->line_num = line_num;
+
+    vsnprintf(slot->message, sizeof(slot->message), templ, va);
+    slot->message[sizeof(slot->message)-1] = 0;
+
+    /* publish the slot to the reader. */
+    atomic_int_add(&slot->seq, 1);
+
+    /* only pay for the wake up if the logger thread is waiting. */
+    if(logger_sleeping && atomic_int_cas(&logger_sleeping, 1, 0)) {
+        cond_signal(logger_wait);
+    }
+}
+
+
+
+/*
+ * debug_ring_drain
+ *
+ * Write out every message in the ring.  Only one thread may drain at a
+ * time.  Returns the number of messages written.
+ */
+
+int debug_ring_drain(void)
+{
+    int count = 0;
+    int dropped = 0;
+
+    while(1) {
+        struct debug_slot_t *slot = &debug_ring[(uint32_t)debug_ring_read_pos & (DEBUG_RING_SLOTS - 1)];
+        int next_pos = (int)((uint32_t)debug_ring_read_pos + 1);
+
+        if(atomic_int_add(&slot->seq, 0) != next_pos) {
+            break;
+        }
+
+        emit_line(slot->epoch_ms, slot->thread_id, slot->tag_id, slot->debug_level, slot->func, slot->line_num, slot->message);
+
+        /* hand the slot back to the writers for the next time around the ring. */
+        atomic_int_add(&slot->seq, DEBUG_RING_SLOTS - 1);
+
+        debug_ring_read_pos = next_pos;
+        count++;
+    }
+
+    dropped = atomic_int_add(&debug_ring_dropped, 0);
+    if(dropped) {
+        char message[DEBUG_MSG_SIZE];
+
+        atomic_int_add(&debug_ring_dropped, -dropped);
+
+        snprintf(message, sizeof(message), "Dropped %d debug messages, the ring was full.", dropped);
+        emit_line(time_ms(), get_thread_id(), 0, DEBUG_WARN, __func__, __LINE__, message);
+    }
+
+    return count;
+}
+
+
+
+THREAD_FUNC(logger_func)
+{
+    (void)arg;
+
+    is_logger_thread = 1;
+
+    while(!logger_terminating) {
+        if(debug_ring_drain() > 0) {
+            continue;
+        }
+
+        /* check again after saying we are asleep so that no wake up is missed. */
+        logger_sleeping = 1;
+
+        if(debug_ring_drain() > 0) {
+            logger_sleeping = 0;
+            continue;
+        }
+
+        cond_wait(logger_wait, DEBUG_LOGGER_WAIT_MS);
+
+        logger_sleeping = 0;
+    }
+
+    debug_ring_drain();
+
+    THREAD_RETURN(0);
+}
+
+
+
+/*
+ * debug_start_logger
+ *
+ * Start the thread that writes out debug messages.  Until it runs, and
+ * after it is stopped, messages are written out directly.
+ */
+
+int debug_start_logger(void)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    if(logger_running) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* the slots start out free for the first pass of writers. */
+    if(!debug_ring_write_pos && !debug_ring_read_pos) {
+        for(int i=0; i < DEBUG_RING_SLOTS; i++) {
+            debug_ring[i].seq = i;
+        }
+    }
+
+    if(!logger_wait) {
+        rc = cond_create(&logger_wait);
+        if(rc != PLCTAG_STATUS_OK) {
+            return rc;
+        }
+    }
+
+    logger_terminating = 0;
+
+    rc = thread_create(&logger_thread, logger_func, 32*1024, NULL);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    logger_running = 1;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * debug_stop_logger
+ *
+ * Write out all waiting messages and stop the logger thread.
+ */
+
+void debug_stop_logger(void)
+{
+    if(!logger_running) {
+        return;
+    }
+
+    /* new messages are written directly from here on. */
+    logger_running = 0;
+
+    logger_terminating = 1;
+    cond_signal(logger_wait);
+
+    thread_join(logger_thread);
+    thread_destroy(&logger_thread);
+
+    /*
+     * pick up anything added while the thread was stopping.  The condition
+     * variable is kept, a late writer may still signal it.
+     */
+    debug_ring_drain();
 }
 
 
@@ -48,6 +48,14 @@
 #define DEBUG_SPEW      (5)
 #define DEBUG_END       (6)
 
+/*
+ * Calls above this level are compiled out, set with the CMake option of
+ * the same name.
+ */
+#ifndef PLCTAG_MAX_DEBUG_LEVEL
+    #define PLCTAG_MAX_DEBUG_LEVEL DEBUG_SPEW
+#endif
+
 extern int set_debug_level(int debug_level);
 extern int get_debug_level(void);
 extern void debug_set_tag_id(int tag_id);
@@ -61,10 +69,14 @@ extern void pdebug_impl(const char *func, int line_num, int debug_level, const c
 
 
 #define pdebug(dbg,...)                                                \
-   do { if((dbg) != DEBUG_NONE && (dbg) <= get_debug_level()) pdebug_impl(__func__, __LINE__, dbg, __VA_ARGS__); } while(0)
+   do { if((dbg) <= PLCTAG_MAX_DEBUG_LEVEL && (dbg) != DEBUG_NONE && (dbg) <= get_debug_level()) pdebug_impl(__func__, __LINE__, dbg, __VA_ARGS__); } while(0)
 
 extern void pdebug_dump_bytes_impl(const char *func, int line_num, int debug_level, uint8_t *data,int count);
-#define pdebug_dump_bytes(dbg, d,c)  do { if((dbg) != DEBUG_NONE && (dbg) <= get_debug_level()) pdebug_dump_bytes_impl(__func__, __LINE__,dbg,d,c); } while(0)
+#define pdebug_dump_bytes(dbg, d,c)  do { if((dbg) <= PLCTAG_MAX_DEBUG_LEVEL && (dbg) != DEBUG_NONE && (dbg) <= get_debug_level()) pdebug_dump_bytes_impl(__func__, __LINE__,dbg,d,c); } while(0)
+
+/* write debug output from a background thread instead of the calling thread. */
+extern int debug_start_logger(void);
+extern void debug_stop_logger(void);
 
 extern int debug_register_logger(void (*log_callback_func)(int32_t tag_id, int debug_level, const char *message));
 extern int debug_unregister_logger(void);
@@ -0,0 +1,195 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <lib/libplctag.h>
+#include <platform.h>
+#include <util/debug.h>
+#include <util/histogram.h>
+
+
+
+/*
+ * Values below 2*HISTOGRAM_SUB_BUCKETS are their own bucket.  Above that,
+ * the top HISTOGRAM_SUB_BITS+1 bits of the value pick the bucket within its
+ * power of two range.
+ */
+
+static int bucket_index(int64_t value)
+{
+    int shift = 0;
+
+    if(value < 0) {
+        value = 0;
+    }
+
+    while((value >> shift) >= (2 * HISTOGRAM_SUB_BUCKETS)) {
+        shift++;
+    }
+
+    if(shift > (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS - 1)) {
+        return HISTOGRAM_NUM_BUCKETS - 1;
+    }
+
+    return (shift * HISTOGRAM_SUB_BUCKETS) + (int)(value >> shift);
+}
+
+
+/* the highest value that lands in the bucket. */
+static int64_t bucket_high_value(int index)
+{
+    int shift = 0;
+    int64_t mantissa = index;
+
+    if(index >= (2 * HISTOGRAM_SUB_BUCKETS)) {
+        shift = (index / HISTOGRAM_SUB_BUCKETS) - 1;
+        mantissa = (index % HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BUCKETS;
+    }
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+
+
+void histogram_record(histogram_t *hist, int64_t value)
+{
+    if(!hist) {
+        return;
+    }
+
+    atomic_int64_add(&hist->buckets[bucket_index(value)], 1);
+}
+
+
+
+int64_t histogram_count(histogram_t *hist)
+{
+    int64_t count = 0;
+
+    if(!hist) {
+        return 0;
+    }
+
+    for(int i=0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        count += atomic_int64_add(&hist->buckets[i], 0);
+    }
+
+    return count;
+}
+
+
+/*
+ * histogram_percentile
+ *
+ * Return the highest value that is in the same bucket as the value at the
+ * percentile (0 to 100).  PLCTAG_ERR_NO_DATA if nothing was recorded.
+ */
+
+int64_t histogram_percentile(histogram_t *hist, double percentile)
+{
+    int64_t counts[HISTOGRAM_NUM_BUCKETS];
+    int64_t total = 0;
+    int64_t target = 0;
+    int64_t seen = 0;
+
+    if(!hist) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(percentile < 0.0 || percentile > 100.0) {
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+
+    /* take one snapshot so that the walk below sees a consistent total. */
+    for(int i=0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        counts[i] = atomic_int64_add(&hist->buckets[i], 0);
+        total += counts[i];
+    }
+
+    if(total == 0) {
+        return PLCTAG_ERR_NO_DATA;
+    }
+
+    target = (int64_t)(((double)total * percentile / 100.0) + 0.5);
+    if(target < 1) {
+        target = 1;
+    }
+
+    for(int i=0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        seen += counts[i];
+
+        if(seen >= target) {
+            return bucket_high_value(i);
+        }
+    }
+
+    return bucket_high_value(HISTOGRAM_NUM_BUCKETS - 1);
+}
+
+
+
+void histogram_merge(histogram_t *dest, histogram_t *src)
+{
+    if(!dest || !src) {
+        return;
+    }
+
+    for(int i=0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        int64_t count = atomic_int64_add(&src->buckets[i], 0);
+
+        if(count) {
+            atomic_int64_add(&dest->buckets[i], count);
+        }
+    }
+}
+
+
+/*
+ * histogram_reset
+ *
+ * Clear the histogram.  Values recorded at the same time might be lost.
+ */
+
+void histogram_reset(histogram_t *hist)
+{
+    if(!hist) {
+        return;
+    }
+
+    for(int i=0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        int64_t count = atomic_int64_add(&hist->buckets[i], 0);
+
+        if(count) {
+            atomic_int64_add(&hist->buckets[i], -count);
+        }
+    }
+}
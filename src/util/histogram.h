@@ -0,0 +1,61 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <platform.h>
+
+/*
+ * Log-bucketed latency histograms in the style of HdrHistogram.  Each power
+ * of two range of values is split into HISTOGRAM_SUB_BUCKETS linear buckets,
+ * so any recorded value is known to within about 6%.  Recording is one atomic
+ * add and never takes a lock.  The values are meant to be microseconds.
+ */
+
+#define HISTOGRAM_SUB_BITS (4)
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/* values at or above 2^36 (about 19 hours in microseconds) go in the last bucket. */
+#define HISTOGRAM_MAX_BITS (36)
+#define HISTOGRAM_NUM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+    volatile int64_t buckets[HISTOGRAM_NUM_BUCKETS];
+} histogram_t;
+
+extern void histogram_record(histogram_t *hist, int64_t value);
+extern int64_t histogram_count(histogram_t *hist);
+extern int64_t histogram_percentile(histogram_t *hist, double percentile);
+extern void histogram_merge(histogram_t *dest, histogram_t *src);
+extern void histogram_reset(histogram_t *hist);
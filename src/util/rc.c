@@ -67,8 +67,7 @@
  */
 
 struct refcount_t {
-    lock_t lock;
-    int count;
+    volatile int count;
     const char *function_name;
     int line_num;
     //cleanup_p cleaners;
@@ -119,7 +118,6 @@ void *rc_alloc_impl(const char *func, int line_num, int data_size, rc_cleanup_fu
     }
 
     rc->count = 1;  /* start with a reference count. */
-    rc->lock = LOCK_INIT;
 
     rc->cleanup_func = cleaner_func;
 
@@ -170,16 +168,14 @@ void *rc_inc_impl(const char *func, int line_num, void *data)
     /* get the refcount structure. */
     rc = ((refcount_p)data) - 1;
 
-    /* spin until we have ownership */
-    spin_block(&rc->lock) {
-        if(rc->count > 0) {
-            rc->count++;
-            count = rc->count;
-            result = data;
-        } else {
-            count = rc->count;
-            result = NULL;
-        }
+    /* only take a reference while the count is still live. */
+    do {
+        count = rc->count;
+    } while(count > 0 && !atomic_int_cas(&rc->count, count, count + 1));
+
+    if(count > 0) {
+        count++;
+        result = data;
     }
 
     if(!result) {
@@ -221,15 +217,15 @@ void *rc_dec_impl(const char *func, int line_num, void *data)
     /* get the refcount structure. */
     rc = ((refcount_p)data) - 1;
 
-    /* do this sorta atomically */
-    spin_block(&rc->lock) {
-        if(rc->count > 0) {
-            rc->count--;
-            count = rc->count;
-        } else {
-            count = rc->count;
-            invalid = 1;
-        }
+    /* never take the count below zero. */
+    do {
+        count = rc->count;
+    } while(count > 0 && !atomic_int_cas(&rc->count, count, count - 1));
+
+    if(count > 0) {
+        count--;
+    } else {
+        invalid = 1;
     }
 
     if(invalid) {
@@ -0,0 +1,672 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <lib/libplctag.h>
+#include <platform.h>
+#include <util/debug.h>
+#include <util/reactor.h>
+#include <util/vector.h>
+
+
+/* longest time a reactor thread waits without looking at its clients. */
+#define REACTOR_MAX_WAIT_MS (100)
+
+/* how many passes a busy client gets before the other clients get a turn. */
+#define REACTOR_MAX_STEPS (10)
+
+#define REACTOR_MIN_CLIENTS (10)
+#define REACTOR_INC_CLIENTS (10)
+
+/* most clients on one reactor thread, the thread's own wake up socket takes one more slot. */
+#define REACTOR_MAX_CLIENTS (SOCKET_WAIT_MAX_SOCKS - 1)
+
+/* how often a thread removing a client checks whether the reactor finished its pass. */
+#define REACTOR_PASS_CHECK_MS (10)
+
+
+typedef struct reactor_t *reactor_p;
+
+struct reactor_client_t {
+    reactor_p reactor;
+    sock_p sock;
+    reactor_step_func step;
+    void *arg;
+
+    int ready;
+    int wait_events;
+    int64_t wait_until;
+};
+
+struct reactor_t {
+    thread_p thread;
+    mutex_p mutex;
+    volatile int terminating;
+
+    /* only used to wake up the thread when the client list changes. */
+    sock_p wake_sock;
+
+    vector_p clients;
+    int clients_changed;
+
+    /*
+     * A pass runs the clients from a copy of the list and then waits on
+     * their sockets without holding the mutex.  A removed client and its
+     * socket must stay valid until the pass that might use them ends.
+     */
+    int in_pass;
+    int pass_count;
+    int num_removing;
+    cond_p pass_done;
+
+    /* the copy of the client list and the wait set, only used by the thread. */
+    sock_wait_set_p wait_set;
+    reactor_client_p *waiting;
+    sock_p *socks;
+    int *events;
+};
+
+
+static int reactor_create(reactor_p *reactor);
+static void reactor_destroy(reactor_p *reactor);
+static int reactor_start_pool_unsafe(void);
+static int reactor_add_thread_unsafe(reactor_p *reactor);
+static void run_client(reactor_client_p client);
+static THREAD_FUNC(reactor_handler);
+
+
+static mutex_p reactor_pool_mutex = NULL;
+static reactor_p *reactors = NULL;
+static int num_reactors = 0;
+
+/* zero means one thread per processor. */
+static int requested_num_threads = 0;
+
+
+
+int reactor_startup(void)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if((rc = mutex_create(&reactor_pool_mutex)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create reactor pool mutex %s!", plc_tag_decode_error(rc));
+        return rc;
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+void reactor_teardown(void)
+{
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(reactor_pool_mutex) {
+        critical_block(reactor_pool_mutex) {
+            for(int i=0; i < num_reactors; i++) {
+                reactor_destroy(&reactors[i]);
+            }
+
+            if(reactors) {
+                mem_free(reactors);
+                reactors = NULL;
+            }
+
+            num_reactors = 0;
+        }
+
+        mutex_destroy(&reactor_pool_mutex);
+        reactor_pool_mutex = NULL;
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+}
+
+
+
+/*
+ * The thread count can only be changed before the pool starts.  Zero means
+ * one thread per processor.  More threads are started later if all of them
+ * already have as many clients as they can wait on.
+ */
+int reactor_set_num_threads(int num_threads)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(num_threads < 0) {
+        pdebug(DEBUG_WARN, "Number of reactor threads must not be negative!");
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+
+    critical_block(reactor_pool_mutex) {
+        if(num_reactors > 0) {
+            pdebug(DEBUG_WARN, "Reactor threads are already running!");
+            rc = PLCTAG_ERR_BUSY;
+            break;
+        }
+
+        requested_num_threads = num_threads;
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+int reactor_get_num_threads(void)
+{
+    int result = 0;
+
+    critical_block(reactor_pool_mutex) {
+        if(num_reactors > 0) {
+            result = num_reactors;
+        } else {
+            result = (requested_num_threads > 0 ? requested_num_threads : cpu_count());
+        }
+    }
+
+    return result;
+}
+
+
+
+/*
+ * reactor_add_client
+ *
+ * Pin the client to the least loaded reactor thread, starting the pool if
+ * this is the first client and another thread if all the threads are full.
+ */
+int reactor_add_client(sock_p sock, reactor_step_func step, void *arg, reactor_client_p *client)
+{
+    int rc = PLCTAG_STATUS_OK;
+    reactor_p reactor = NULL;
+    reactor_client_p new_client = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!sock || !step || !client) {
+        pdebug(DEBUG_WARN, "Called with null pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    new_client = mem_alloc((int)sizeof(struct reactor_client_t));
+    if(!new_client) {
+        pdebug(DEBUG_ERROR, "Unable to allocate reactor client!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    new_client->sock = sock;
+    new_client->step = step;
+    new_client->arg = arg;
+    new_client->ready = 1;
+
+    critical_block(reactor_pool_mutex) {
+        if(num_reactors == 0) {
+            rc = reactor_start_pool_unsafe();
+            if(rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+        }
+
+        /* find the reactor with the fewest clients. */
+        reactor = reactors[0];
+        for(int i=1; i < num_reactors; i++) {
+            if(vector_length(reactors[i]->clients) < vector_length(reactor->clients)) {
+                reactor = reactors[i];
+            }
+        }
+
+        if(vector_length(reactor->clients) >= REACTOR_MAX_CLIENTS) {
+            rc = reactor_add_thread_unsafe(&reactor);
+            if(rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+        }
+
+        new_client->reactor = reactor;
+
+        critical_block(reactor->mutex) {
+            vector_put(reactor->clients, vector_length(reactor->clients), new_client);
+            reactor->clients_changed = 1;
+        }
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to start reactor threads %s!", plc_tag_decode_error(rc));
+        mem_free(new_client);
+        return rc;
+    }
+
+    socket_wake(reactor->wake_sock);
+
+    *client = new_client;
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * reactor_remove_client
+ *
+ * Take the client off its reactor.  The client's step function is not running
+ * and will not be called again once this returns, and the reactor is no
+ * longer waiting on the client's socket.  Must not be called from within a
+ * step function.
+ */
+int reactor_remove_client(reactor_client_p *client)
+{
+    reactor_p reactor = NULL;
+    int in_pass = 0;
+    int pass_count = 0;
+    int pass_done = 0;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!client || !*client) {
+        pdebug(DEBUG_WARN, "Called with null pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    reactor = (*client)->reactor;
+
+    critical_block(reactor->mutex) {
+        for(int i=0; i < vector_length(reactor->clients); i++) {
+            if(vector_get(reactor->clients, i) == *client) {
+                vector_remove(reactor->clients, i);
+                break;
+            }
+        }
+
+        reactor->clients_changed = 1;
+
+        in_pass = reactor->in_pass;
+        pass_count = reactor->pass_count;
+
+        if(in_pass) {
+            reactor->num_removing++;
+        }
+    }
+
+    socket_wake(reactor->wake_sock);
+
+    /* the current pass may still be running the client or waiting on its socket. */
+    while(in_pass && !pass_done) {
+        cond_wait(reactor->pass_done, REACTOR_PASS_CHECK_MS);
+
+        critical_block(reactor->mutex) {
+            if(reactor->pass_count != pass_count) {
+                reactor->num_removing--;
+                pass_done = 1;
+            }
+        }
+    }
+
+    mem_free(*client);
+    *client = NULL;
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/***********************************************************************
+ *************************** Helper Functions **************************
+ **********************************************************************/
+
+
+int reactor_add_thread_unsafe(reactor_p *reactor)
+{
+    int rc = PLCTAG_STATUS_OK;
+    reactor_p *new_reactors = NULL;
+
+    pdebug(DEBUG_INFO, "All %d reactor threads are full, starting another.", num_reactors);
+
+    new_reactors = mem_realloc(reactors, (int)(sizeof(reactor_p) * (size_t)(num_reactors + 1)));
+    if(!new_reactors) {
+        pdebug(DEBUG_ERROR, "Unable to grow reactor pool!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    reactors = new_reactors;
+
+    rc = reactor_create(&reactors[num_reactors]);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to create reactor thread %d!", num_reactors);
+        return rc;
+    }
+
+    *reactor = reactors[num_reactors];
+    num_reactors++;
+
+    return rc;
+}
+
+
+
+int reactor_start_pool_unsafe(void)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int num_threads = (requested_num_threads > 0 ? requested_num_threads : cpu_count());
+
+    pdebug(DEBUG_INFO, "Starting %d reactor threads.", num_threads);
+
+    reactors = mem_alloc((int)(sizeof(reactor_p) * (size_t)num_threads));
+    if(!reactors) {
+        pdebug(DEBUG_ERROR, "Unable to allocate reactor pool!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    for(int i=0; i < num_threads; i++) {
+        rc = reactor_create(&reactors[i]);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to create reactor thread %d!", i);
+            break;
+        }
+
+        num_reactors++;
+    }
+
+    /* punt if we could not get them all. */
+    if(rc != PLCTAG_STATUS_OK) {
+        for(int i=0; i < num_reactors; i++) {
+            reactor_destroy(&reactors[i]);
+        }
+
+        mem_free(reactors);
+        reactors = NULL;
+        num_reactors = 0;
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+int reactor_create(reactor_p *reactor)
+{
+    int rc = PLCTAG_STATUS_OK;
+    reactor_p new_reactor = NULL;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    new_reactor = mem_alloc((int)sizeof(struct reactor_t));
+    if(!new_reactor) {
+        pdebug(DEBUG_ERROR, "Unable to allocate reactor!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    do {
+        if((rc = mutex_create(&new_reactor->mutex)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create reactor mutex!");
+            break;
+        }
+
+        if((rc = cond_create(&new_reactor->pass_done)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create reactor condition variable!");
+            break;
+        }
+
+        if((rc = socket_create(&new_reactor->wake_sock)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create reactor wake up socket!");
+            break;
+        }
+
+        if((rc = socket_wait_set_create(&new_reactor->wait_set)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create reactor wait set!");
+            break;
+        }
+
+        /* room for all the clients and our own wake up socket. */
+        new_reactor->waiting = mem_alloc((int)(sizeof(reactor_client_p) * (REACTOR_MAX_CLIENTS + 1)));
+        new_reactor->socks = mem_alloc((int)(sizeof(sock_p) * (REACTOR_MAX_CLIENTS + 1)));
+        new_reactor->events = mem_alloc((int)(sizeof(int) * (REACTOR_MAX_CLIENTS + 1)));
+
+        if(!new_reactor->waiting || !new_reactor->socks || !new_reactor->events) {
+            pdebug(DEBUG_ERROR, "Unable to allocate reactor wait list!");
+            rc = PLCTAG_ERR_NO_MEM;
+            break;
+        }
+
+        new_reactor->clients = vector_create(REACTOR_MIN_CLIENTS, REACTOR_INC_CLIENTS);
+        if(!new_reactor->clients) {
+            pdebug(DEBUG_ERROR, "Unable to allocate reactor client list!");
+            rc = PLCTAG_ERR_NO_MEM;
+            break;
+        }
+
+        if((rc = thread_create(&new_reactor->thread, reactor_handler, 32*1024, new_reactor)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create reactor thread!");
+            break;
+        }
+    } while(0);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        reactor_destroy(&new_reactor);
+        return rc;
+    }
+
+    *reactor = new_reactor;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+void reactor_destroy(reactor_p *reactor)
+{
+    reactor_p r = NULL;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!reactor || !*reactor) {
+        return;
+    }
+
+    r = *reactor;
+
+    r->terminating = 1;
+
+    if(r->thread) {
+        socket_wake(r->wake_sock);
+        thread_join(r->thread);
+        thread_destroy(&r->thread);
+    }
+
+    if(r->clients) {
+        if(vector_length(r->clients) > 0) {
+            pdebug(DEBUG_WARN, "Reactor still has %d clients!", vector_length(r->clients));
+        }
+
+        vector_destroy(r->clients);
+    }
+
+    if(r->wake_sock) {
+        socket_destroy(&r->wake_sock);
+    }
+
+    if(r->wait_set) {
+        socket_wait_set_destroy(&r->wait_set);
+    }
+
+    mem_free(r->waiting);
+    mem_free(r->socks);
+    mem_free(r->events);
+
+    if(r->pass_done) {
+        cond_destroy(&r->pass_done);
+    }
+
+    if(r->mutex) {
+        mutex_destroy(&r->mutex);
+    }
+
+    mem_free(r);
+
+    *reactor = NULL;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+}
+
+
+
+/*
+ * Run the client until it is idle or has had its share of the thread.
+ */
+void run_client(reactor_client_p client)
+{
+    int steps = 0;
+    int busy = 0;
+
+    client->ready = 0;
+
+    do {
+        client->wait_events = SOCK_EVENT_NONE;
+        client->wait_until = INT64_MAX;
+
+        busy = client->step(client->arg, &client->wait_events, &client->wait_until);
+        steps++;
+    } while(busy && steps < REACTOR_MAX_STEPS);
+
+    /* still busy, come back to this one on the next pass. */
+    if(busy) {
+        client->ready = 1;
+        client->wait_until = 0;
+    }
+}
+
+
+
+THREAD_FUNC(reactor_handler)
+{
+    reactor_p reactor = arg;
+    reactor_client_p *waiting = reactor->waiting;
+    sock_p *socks = reactor->socks;
+    int *events = reactor->events;
+
+    pdebug(DEBUG_INFO, "Starting reactor thread.");
+
+    while(!reactor->terminating) {
+        int num_waiting = 0;
+        int64_t wait_until = time_ms() + REACTOR_MAX_WAIT_MS;
+        int64_t wait_ms = 0;
+        int rc = PLCTAG_STATUS_OK;
+
+        /* removed clients stay valid until the pass ends, so the copy can be used without the mutex. */
+        critical_block(reactor->mutex) {
+            int num_clients = vector_length(reactor->clients);
+
+            reactor->clients_changed = 0;
+            reactor->in_pass = 1;
+
+            waiting[0] = NULL;
+            num_waiting = 1;
+
+            for(int i=0; i < num_clients; i++) {
+                waiting[num_waiting++] = vector_get(reactor->clients, i);
+            }
+        }
+
+        /* the steps can block on a slow PLC, so they must not hold up adding and removing clients. */
+        socks[0] = reactor->wake_sock;
+        events[0] = SOCK_EVENT_NONE;
+
+        for(int i=1; i < num_waiting; i++) {
+            reactor_client_p client = waiting[i];
+
+            if(client->ready || client->wait_until <= time_ms()) {
+                run_client(client);
+            }
+
+            socks[i] = client->sock;
+            events[i] = client->wait_events;
+
+            if(client->wait_until < wait_until) {
+                wait_until = client->wait_until;
+            }
+        }
+
+        wait_ms = wait_until - time_ms();
+        if(wait_ms < 0) {
+            wait_ms = 0;
+        }
+
+        rc = socket_wait_events(reactor->wait_set, socks, events, num_waiting, (int)wait_ms);
+
+        critical_block(reactor->mutex) {
+            /* mark the clients that have something to do. */
+            if(rc > 0) {
+                /* the client list changed while we were waiting, so our copy is stale. */
+                if(reactor->clients_changed) {
+                    for(int i=0; i < vector_length(reactor->clients); i++) {
+                        reactor_client_p client = vector_get(reactor->clients, i);
+                        client->ready = 1;
+                    }
+                } else {
+                    for(int i=1; i < num_waiting; i++) {
+                        if(events[i]) {
+                            waiting[i]->ready = 1;
+                        }
+                    }
+                }
+            }
+
+            reactor->in_pass = 0;
+            reactor->pass_count++;
+
+            if(reactor->num_removing > 0) {
+                cond_signal(reactor->pass_done);
+            }
+        }
+    }
+
+    pdebug(DEBUG_INFO, "Reactor thread done.");
+
+    THREAD_RETURN(0);
+}
@@ -0,0 +1,60 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+#include <platform.h>
+
+/*
+ * A small pool of shared I/O threads.  Each client is pinned to one reactor
+ * thread which waits on the client's socket along with all its other clients
+ * and runs the client's step function when there is something to do.
+ */
+
+typedef struct reactor_client_t *reactor_client_p;
+
+/*
+ * Do one pass of the client's work without blocking for long.  Return non-zero
+ * to be run again right away.  Otherwise set the socket events to wait for and
+ * the latest time at which to be run again.
+ */
+typedef int (*reactor_step_func)(void *arg, int *wait_events, int64_t *wait_until);
+
+extern int reactor_startup(void);
+extern void reactor_teardown(void);
+
+extern int reactor_set_num_threads(int num_threads);
+extern int reactor_get_num_threads(void);
+
+extern int reactor_add_client(sock_p sock, reactor_step_func step, void *arg, reactor_client_p *client);
+extern int reactor_remove_client(reactor_client_p *client);
@@ -0,0 +1,270 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <lib/libplctag.h>
+#include <platform.h>
+#include <util/debug.h>
+#include <util/trace.h>
+
+
+/* buffers of threads that have ended are kept, so the number is limited. */
+#define TRACE_MAX_BUFFERS (64)
+
+typedef struct trace_buffer_t *trace_buffer_p;
+
+struct trace_buffer_t {
+    volatile uint32_t next;     /* total records ever written, only changed by the owning thread. */
+    uint16_t thread_id;
+    trace_record_t records[TRACE_BUFFER_RECORDS];
+};
+
+volatile int trace_enabled = 0;
+
+static lock_t trace_buffers_lock = LOCK_INIT;
+static trace_buffer_p trace_buffers[TRACE_MAX_BUFFERS] = { NULL };
+static int num_trace_buffers = 0;
+static int num_untraced_threads = 0;
+
+/* bumped by trace_teardown() so that threads drop their freed buffers. */
+static volatile int trace_generation = 0;
+
+static THREAD_LOCAL trace_buffer_p this_thread_buffer = NULL;
+static THREAD_LOCAL int this_thread_has_no_buffer = 0;
+static THREAD_LOCAL int this_thread_generation = 0;
+
+static trace_buffer_p get_thread_buffer(void);
+
+
+
+/*
+ * trace_record_impl
+ *
+ * Add a record to the buffer of the calling thread, overwriting the oldest
+ * record if the buffer is full.
+ */
+
+void trace_record_impl(int event, int32_t tag_id, uint64_t id, int64_t value)
+{
+    trace_buffer_p buffer = this_thread_buffer;
+    trace_record_t *record = NULL;
+
+    if(!buffer || this_thread_generation != trace_generation) {
+        buffer = get_thread_buffer();
+
+        if(!buffer) {
+            return;
+        }
+    }
+
+    record = &buffer->records[buffer->next % TRACE_BUFFER_RECORDS];
+
+    record->time_us = time_us();
+    record->id = id;
+    record->value = value;
+    record->tag_id = tag_id;
+    record->thread_id = buffer->thread_id;
+    record->event = (uint16_t)event;
+
+    buffer->next++;
+}
+
+
+
+trace_buffer_p get_thread_buffer(void)
+{
+    trace_buffer_p buffer = NULL;
+    int untraced = 0;
+    int generation = trace_generation;
+
+    /* a buffer from before the last teardown is gone. */
+    if(this_thread_generation != generation) {
+        this_thread_buffer = NULL;
+        this_thread_has_no_buffer = 0;
+        this_thread_generation = generation;
+    }
+
+    /* do not try to allocate on every trace point once it failed. */
+    if(this_thread_has_no_buffer) {
+        return NULL;
+    }
+
+    buffer = mem_alloc((int)sizeof(struct trace_buffer_t));
+    if(!buffer) {
+        this_thread_has_no_buffer = 1;
+        return NULL;
+    }
+
+    spin_block(&trace_buffers_lock) {
+        if(num_trace_buffers < TRACE_MAX_BUFFERS) {
+            buffer->thread_id = (uint16_t)(num_trace_buffers + 1);
+            trace_buffers[num_trace_buffers++] = buffer;
+        } else {
+            mem_free(buffer);
+            buffer = NULL;
+            untraced = ++num_untraced_threads;
+        }
+    }
+
+    /* only say so once, the count is in trace_teardown(). */
+    if(untraced == 1) {
+        pdebug(DEBUG_WARN, "All %d trace buffers are in use, further threads are not traced!", TRACE_MAX_BUFFERS);
+    }
+
+    if(!buffer) {
+        this_thread_has_no_buffer = 1;
+        return NULL;
+    }
+
+    this_thread_buffer = buffer;
+
+    return buffer;
+}
+
+
+
+int trace_set_enabled(int enabled)
+{
+    trace_enabled = (enabled ? 1 : 0);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * trace_dump
+ *
+ * Write the records of all thread buffers to the file, oldest first for
+ * each thread.  Records written while the dump runs may be torn, so turn
+ * tracing off first for a clean trace.
+ */
+
+int trace_dump(const char *file_name)
+{
+    int rc = PLCTAG_STATUS_OK;
+    FILE *out = NULL;
+    trace_file_header_t header;
+    int num_buffers = 0;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!file_name || str_length(file_name) == 0) {
+        pdebug(DEBUG_WARN, "A file name is required!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    out = fopen(file_name, "wb");
+    if(!out) {
+        pdebug(DEBUG_WARN, "Unable to open trace file %s!", file_name);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    mem_set(&header, 0, (int)sizeof(header));
+    mem_copy(&header.magic[0], (void *)TRACE_FILE_MAGIC, (int)sizeof(header.magic));
+    header.version = TRACE_FILE_VERSION;
+    header.record_size = (uint32_t)sizeof(trace_record_t);
+
+    if(fwrite(&header, sizeof(header), 1, out) != 1) {
+        rc = PLCTAG_ERR_WRITE;
+    }
+
+    /* buffers are only freed by trace_teardown() at shutdown, so the ones counted here stay valid. */
+    spin_block(&trace_buffers_lock) {
+        num_buffers = num_trace_buffers;
+    }
+
+    for(int i=0; i < num_buffers && rc == PLCTAG_STATUS_OK; i++) {
+        trace_buffer_p buffer = trace_buffers[i];
+        uint32_t next = buffer->next;
+        uint32_t count = (next < TRACE_BUFFER_RECORDS ? next : TRACE_BUFFER_RECORDS);
+
+        for(uint32_t r = next - count; r != next; r++) {
+            if(fwrite(&buffer->records[r % TRACE_BUFFER_RECORDS], sizeof(trace_record_t), 1, out) != 1) {
+                rc = PLCTAG_ERR_WRITE;
+                break;
+            }
+        }
+    }
+
+    if(fclose(out) != 0 && rc == PLCTAG_STATUS_OK) {
+        rc = PLCTAG_ERR_WRITE;
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Error writing trace file %s!", file_name);
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * trace_teardown
+ *
+ * Free the thread buffers.  Called at library shutdown when the library
+ * threads have stopped.  Threads that trace again later get new buffers.
+ */
+
+void trace_teardown(void)
+{
+    int num_buffers = 0;
+    int untraced = 0;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    spin_block(&trace_buffers_lock) {
+        num_buffers = num_trace_buffers;
+        untraced = num_untraced_threads;
+
+        for(int i=0; i < num_trace_buffers; i++) {
+            mem_free(trace_buffers[i]);
+            trace_buffers[i] = NULL;
+        }
+
+        num_trace_buffers = 0;
+        num_untraced_threads = 0;
+        trace_generation++;
+    }
+
+    if(untraced > 0) {
+        pdebug(DEBUG_WARN, "%d threads were not traced, only %d have trace buffers.", untraced, TRACE_MAX_BUFFERS);
+    }
+
+    pdebug(DEBUG_INFO, "Freed %d trace buffers.", num_buffers);
+
+    pdebug(DEBUG_INFO, "Done.");
+}
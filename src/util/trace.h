@@ -0,0 +1,92 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under either the Mozilla Public License      *
+ * version 2.0 or the GNU LGPL version 2 (or later) license, whichever     *
+ * you choose.                                                             *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ *                                                                         *
+ * LGPL 2:                                                                 *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Binary tracing of the hot paths.
+ *
+ * When tracing is on, each trace point adds one fixed-size record to a
+ * buffer owned by the calling thread.  Nothing is formatted and no lock is
+ * taken.  Each thread buffer keeps only the newest TRACE_BUFFER_RECORDS
+ * records.  trace_dump() writes all the buffers to a file that the
+ * trace_decode tool turns into text.
+ */
+
+/* the trace points. */
+#define TRACE_READ_START        (1)     /* value is the timeout. */
+#define TRACE_READ_DONE         (2)     /* value is the status. */
+#define TRACE_WRITE_START       (3)     /* value is the timeout. */
+#define TRACE_WRITE_DONE        (4)     /* value is the status. */
+#define TRACE_REQUEST_QUEUED    (5)     /* id is the request ID, value the priority. */
+#define TRACE_REQUEST_SENT      (6)     /* id is the request ID, value the packet sequence ID. */
+#define TRACE_REQUEST_DONE      (7)     /* id is the request ID, value the status. */
+#define TRACE_REQUEST_EXPIRED   (8)     /* id is the request ID. */
+#define TRACE_PACKET_SENT       (9)     /* id is the packet sequence ID, value the number of requests. */
+#define TRACE_PACKET_RECEIVED   (10)    /* id is the packet sequence ID, value the round trip in microseconds. */
+#define TRACE_EVENT_END         (11)
+
+#define TRACE_BUFFER_RECORDS (4096)
+
+/* the file is a header followed by records, both in the byte order of the writer. */
+#define TRACE_FILE_MAGIC "PLCTRACE"
+#define TRACE_FILE_VERSION (1)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;   /* also tells the decoder the byte order. */
+} trace_file_header_t;
+
+typedef struct {
+    int64_t time_us;        /* monotonic microseconds. */
+    uint64_t id;
+    int64_t value;
+    int32_t tag_id;
+    uint16_t thread_id;
+    uint16_t event;
+} trace_record_t;
+
+extern volatile int trace_enabled;
+
+extern void trace_record_impl(int event, int32_t tag_id, uint64_t id, int64_t value);
+
+#define trace_point(event, tag_id, id, value)                                \
+    do { if(trace_enabled) trace_record_impl((event), (tag_id), (id), (value)); } while(0)
+
+extern int trace_set_enabled(int enabled);
+extern int trace_dump(const char *file_name);
+extern void trace_teardown(void);
@@ -143,6 +143,47 @@ int vector_put(vector_p vec, int index, void * data)
 }
 
 
+
+/*
+ * vector_insert
+ *
+ * Put the data at index, moving everything from index on up by one.
+ */
+int vector_insert(vector_p vec, int index, void * data)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_SPEW,"Starting");
+
+    /* check to see if the vector ref is valid */
+    if(!vec) {
+       pdebug(DEBUG_WARN,"Null pointer or invalid pointer to vector passed!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(index < 0 || index > vec->len) {
+        pdebug(DEBUG_WARN,"Index is out of bounds!");
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+
+    rc = ensure_capacity(vec, vec->len + 1);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Unable to ensure capacity!");
+        return rc;
+    }
+
+    /* move the rest of the data up to make room. */
+    mem_move(&vec->data[index+1], &vec->data[index], (int)((sizeof(void *) * (size_t)(vec->len - index))));
+
+    vec->data[index] = data;
+
+    vec->len++;
+
+    pdebug(DEBUG_SPEW,"Done");
+
+    return rc;
+}
+
 void * vector_get(vector_p vec, int index)
 {
     pdebug(DEBUG_SPEW,"Starting");